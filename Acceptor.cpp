@@ -0,0 +1,446 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "Acceptor.h"
+#include "Socket.h"
+#include "ProgressEngine.h"
+#include "serialization.h"
+
+#include <map>
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "mpwide-macros.h"
+
+/* Connections that have not sent their handshake within this time are dropped. */
+static const long long int handshake_timeout = 10*1000*1000*1000LL;
+
+void MPW_packHandshake(unsigned char *buf, unsigned long long cookie, int stream, int count)
+{
+  serialize_uint32(buf, MPW_HANDSHAKE_MAGIC);
+  serialize_uint64(buf + 4, cookie);
+  serialize_uint32(buf + 12, (unsigned int) stream);
+  serialize_uint32(buf + 16, (unsigned int) count);
+}
+
+bool MPW_unpackHandshake(const unsigned char *buf, unsigned long long *cookie, int *stream, int *count)
+{
+  if (deserialize_uint32(buf) != MPW_HANDSHAKE_MAGIC) {
+    return false;
+  }
+  *cookie = deserialize_uint64(buf + 4);
+  *stream = (int) deserialize_uint32(buf + 12);
+  *count  = (int) deserialize_uint32(buf + 16);
+  return *count > 0 && *stream >= 0 && *stream < *count;
+}
+
+/* A path waiting for its streams. */
+struct Acceptor::Waiter {
+  int count;
+  int *fds;
+  int filled;
+  bool claimed;
+  unsigned long long cookie;
+};
+
+/* A listening socket and the thread that serves it. */
+struct Acceptor::Listener {
+  Acceptor *acceptor;
+  Socket sock;
+  pthread_t thread;
+};
+
+/* A connection whose handshake has not fully arrived yet. */
+struct PendingStream {
+  int fd;
+  int got;
+  long long int expires; // the connection is dropped if the handshake is not complete by then.
+  bool parked;           // an idle connection of an earlier path.
+  unsigned char buf[MPW_HANDSHAKE_SIZE];
+};
+
+/* An idle connection of a destroyed path, see Acceptor::park(). */
+struct ParkedStream {
+  int port;
+  int fd;
+  long long int expires;
+};
+
+/* All acceptors, by port, and the parked connections. The lock also protects the waiters. */
+static pthread_mutex_t acceptors_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t acceptors_cond = PTHREAD_COND_INITIALIZER;
+static std::map<int, Acceptor*> acceptors;
+static std::vector<ParkedStream> parked_streams;
+
+Acceptor::Acceptor(int port) : port(port), shared(true), stopping(false)
+{
+  if (pipe(wake) < 0) {
+    wake[0] = wake[1] = -1;
+  } else {
+    fcntl(wake[0], F_SETFL, fcntl(wake[0], F_GETFL) | O_NONBLOCK);
+  }
+}
+
+Acceptor::~Acceptor()
+{
+  for (size_t i = 0; i < listeners.size(); i++) {
+    delete listeners[i];
+  }
+  if (wake[0] >= 0) {
+    close(wake[0]);
+  }
+  if (wake[1] >= 0) {
+    close(wake[1]);
+  }
+}
+
+/* Open one more listening socket on the port, with its own thread. Called with the lock held. */
+bool Acceptor::addListener()
+{
+  if (wake[0] < 0 || (!listeners.empty() && !shared)) {
+    return false;
+  }
+  Listener *l = new Listener;
+  l->acceptor = this;
+  if (!l->sock.create()) {
+    delete l;
+    return false;
+  }
+  shared = l->sock.setReusePort();
+  l->sock.setFastOpen(SOMAXCONN);
+  if (!l->sock.bind(port) || !l->sock.listen(SOMAXCONN)) {
+    LOG_WARN("Cannot listen on port " << port << ".");
+    delete l;
+    return false;
+  }
+  l->sock.set_non_blocking(true);
+  if (pthread_create(&l->thread, NULL, loop, l) != 0) {
+    delete l;
+    return false;
+  }
+  listeners.push_back(l);
+  LOG_DEBUG("Port " << port << " now has " << listeners.size() << " listening threads.");
+  return true;
+}
+
+/* Stop the listening threads. Called without the lock held, after the acceptor was unlisted. */
+void Acceptor::stop()
+{
+  pthread_mutex_lock(&acceptors_lock);
+  stopping = true;
+  pthread_mutex_unlock(&acceptors_lock);
+  // A closed pipe stays readable, so every thread sees it.
+  if (wake[1] >= 0) {
+    close(wake[1]);
+    wake[1] = -1;
+  }
+  for (size_t i = 0; i < listeners.size(); i++) {
+    pthread_join(listeners[i]->thread, NULL);
+  }
+}
+
+/* Give a connection to the path it belongs to. Called with the lock held.
+ * Returns false if no waiting path wants it. */
+bool Acceptor::deliver(int fd, unsigned long long cookie, int stream, int count)
+{
+  Waiter *match = NULL;
+  for (std::list<Waiter*>::iterator it = waiters.begin(); it != waiters.end(); ++it) {
+    if ((*it)->claimed && (*it)->cookie == cookie) {
+      match = *it;
+      break;
+    }
+  }
+  if (match == NULL) {
+    for (std::list<Waiter*>::iterator it = waiters.begin(); it != waiters.end(); ++it) {
+      if (!(*it)->claimed && (*it)->count == count) {
+        match = *it;
+        match->claimed = true;
+        match->cookie = cookie;
+        break;
+      }
+    }
+  }
+  if (match == NULL || match->count != count || match->fds[stream] >= 0) {
+    LOG_DEBUG("Port " << port << ": no path is waiting for stream " << stream << " of " << count << ".");
+    return false;
+  }
+
+  const unsigned char ack = MPW_HANDSHAKE_ACK;
+  if (send(fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+    return false;
+  }
+  match->fds[stream] = fd;
+  if (++match->filled == match->count) {
+    pthread_cond_broadcast(&acceptors_cond);
+  }
+  return true;
+}
+
+void *Acceptor::loop(void *args)
+{
+  Listener *l = (Listener *) args;
+  Acceptor *a = l->acceptor;
+  std::vector<PendingStream> pending;
+  std::vector<struct pollfd> fds;
+
+  for (;;) {
+    /* Take over parked connections on our port, to see if they are reused. */
+    pthread_mutex_lock(&acceptors_lock);
+    const bool stopping = a->stopping;
+    for (size_t i = 0; i < parked_streams.size() && !stopping; ) {
+      if (parked_streams[i].port == a->port) {
+        PendingStream p;
+        p.fd = parked_streams[i].fd;
+        p.got = 0;
+        p.expires = parked_streams[i].expires;
+        p.parked = true;
+        pending.push_back(p);
+        parked_streams.erase(parked_streams.begin() + i);
+      } else {
+        i++;
+      }
+    }
+    pthread_mutex_unlock(&acceptors_lock);
+    if (stopping) {
+      break;
+    }
+
+    fds.resize(2 + pending.size());
+    fds[0].fd = a->wake[0];
+    fds[1].fd = l->sock.getSock();
+    for (size_t i = 0; i < pending.size(); i++) {
+      fds[2 + i].fd = pending[i].fd;
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(&fds[0], fds.size(), 1000) < 0 && errno != EINTR) {
+      LOG_ERR("Acceptor poll failed: " << strerror(errno));
+      break;
+    }
+    if (fds[0].revents) {
+      char c;
+      while (read(a->wake[0], &c, 1) > 0) {}
+    }
+
+    /* Read the handshakes that have arrived. */
+    const long long int now = TokenBucket::now();
+    std::vector<PendingStream> waiting;
+    for (size_t i = 0; i < pending.size(); i++) {
+      PendingStream &p = pending[i];
+      if (fds[2 + i].revents) {
+        const ssize_t n = recv(p.fd, p.buf + p.got, MPW_HANDSHAKE_SIZE - p.got, 0);
+        if (n > 0) {
+          p.got += n;
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+          close(p.fd);
+          continue;
+        }
+      }
+      if (p.got == MPW_HANDSHAKE_SIZE) {
+        unsigned long long cookie;
+        int stream, count;
+        bool taken = false;
+        if (MPW_unpackHandshake(p.buf, &cookie, &stream, &count)) {
+          pthread_mutex_lock(&acceptors_lock);
+          taken = a->deliver(p.fd, cookie, stream, count);
+          pthread_mutex_unlock(&acceptors_lock);
+        } else {
+          LOG_WARN("Port " << a->port << ": dropping a connection without a valid handshake.");
+        }
+        if (!taken) {
+          close(p.fd);
+        }
+      } else if (now > p.expires) {
+        close(p.fd);
+      } else {
+        waiting.push_back(p);
+      }
+    }
+    pending.swap(waiting);
+
+    /* Accept new connections. */
+    if (fds[1].revents) {
+      for (;;) {
+        const int fd = l->sock.acceptConnection();
+        if (fd < 0) {
+          break;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        PendingStream p;
+        p.fd = fd;
+        p.got = 0;
+        p.expires = now + handshake_timeout;
+        p.parked = false;
+        pending.push_back(p);
+      }
+    }
+  }
+
+  /* Parked connections that were not reused stay parked. */
+  pthread_mutex_lock(&acceptors_lock);
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (pending[i].parked && pending[i].got == 0) {
+      ParkedStream p;
+      p.port = a->port;
+      p.fd = pending[i].fd;
+      p.expires = pending[i].expires;
+      parked_streams.push_back(p);
+    } else {
+      close(pending[i].fd);
+    }
+  }
+  pthread_mutex_unlock(&acceptors_lock);
+  return NULL;
+}
+
+/* Close parked connections that have been idle for too long. Called with the lock held. */
+void Acceptor::expireParked(long long int now)
+{
+  for (size_t i = 0; i < parked_streams.size(); ) {
+    if (now > parked_streams[i].expires) {
+      close(parked_streams[i].fd);
+      parked_streams.erase(parked_streams.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void Acceptor::park(int port, const int *fds, int n, double idle_timeout)
+{
+  const long long int now = TokenBucket::now();
+  pthread_mutex_lock(&acceptors_lock);
+  expireParked(now);
+  for (int i = 0; i < n; i++) {
+    ParkedStream p;
+    p.port = port;
+    p.fd = fds[i];
+    p.expires = now + (long long int)(idle_timeout*1e9);
+    parked_streams.push_back(p);
+  }
+  /* If paths are waiting on the port, its threads should look at these right away. */
+  std::map<int, Acceptor*>::iterator it = acceptors.find(port);
+  if (it != acceptors.end() && it->second->wake[1] >= 0) {
+    const char c = 0;
+    if (write(it->second->wake[1], &c, 1) < 0) {
+      LOG_DEBUG("Cannot wake the listening threads: " << strerror(errno));
+    }
+  }
+  pthread_mutex_unlock(&acceptors_lock);
+}
+
+int Acceptor::parked()
+{
+  pthread_mutex_lock(&acceptors_lock);
+  expireParked(TokenBucket::now());
+  const int n = parked_streams.size();
+  pthread_mutex_unlock(&acceptors_lock);
+  return n;
+}
+
+void Acceptor::closeParked()
+{
+  pthread_mutex_lock(&acceptors_lock);
+  for (size_t i = 0; i < parked_streams.size(); i++) {
+    close(parked_streams[i].fd);
+  }
+  parked_streams.clear();
+  pthread_mutex_unlock(&acceptors_lock);
+}
+
+int Acceptor::waitForPath(int port, int num_streams, int *fds, double timeout)
+{
+  for (int i = 0; i < num_streams; i++) {
+    fds[i] = -1;
+  }
+  Waiter w;
+  w.count = num_streams;
+  w.fds = fds;
+  w.filled = 0;
+  w.claimed = false;
+  w.cookie = 0;
+
+  pthread_mutex_lock(&acceptors_lock);
+  expireParked(TokenBucket::now());
+  Acceptor *a = acceptors[port];
+  if (a == NULL) {
+    a = new Acceptor(port);
+    if (!a->addListener()) {
+      acceptors.erase(port);
+      pthread_mutex_unlock(&acceptors_lock);
+      delete a;
+      return -EADDRINUSE;
+    }
+    acceptors[port] = a;
+  }
+  a->waiters.push_back(&w);
+  /* Shard the accepting over more threads when several paths are waiting on the port. */
+  const size_t cores = max(1, (int) sysconf(_SC_NPROCESSORS_ONLN));
+  if (a->listeners.size() < min(a->waiters.size(), cores)) {
+    a->addListener();
+  }
+
+  struct timespec deadline;
+  if (timeout > 0) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    const long long int ns = (long long int) tv.tv_usec*1000 + (long long int)(timeout*1e9);
+    deadline.tv_sec = tv.tv_sec + ns / 1000000000LL;
+    deadline.tv_nsec = ns % 1000000000LL;
+  }
+  while (w.filled < w.count) {
+    if (timeout > 0) {
+      if (pthread_cond_timedwait(&acceptors_cond, &acceptors_lock, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    } else {
+      pthread_cond_wait(&acceptors_cond, &acceptors_lock);
+    }
+  }
+  a->waiters.remove(&w);
+  const bool last = a->waiters.empty();
+  if (last) {
+    acceptors.erase(port);
+  }
+  pthread_mutex_unlock(&acceptors_lock);
+
+  if (last) {
+    a->stop();
+    delete a;
+  }
+  if (w.filled < w.count) {
+    for (int i = 0; i < num_streams; i++) {
+      if (fds[i] >= 0) {
+        close(fds[i]);
+        fds[i] = -1;
+      }
+    }
+    return -ETIMEDOUT;
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#ifndef MPW_Acceptor_class
+#define MPW_Acceptor_class
+
+#include <pthread.h>
+#include <vector>
+#include <list>
+
+/* Every stream of a path opens with a handshake on the shared server port:
+ * magic, path cookie (chosen by the connecting side), stream index and stream count,
+ * in network byte order. The server answers with a single MPW_HANDSHAKE_ACK byte
+ * once the stream has been given to a waiting path. */
+#define MPW_HANDSHAKE_MAGIC 0x4d505731 // "MPW1"
+#define MPW_HANDSHAKE_SIZE 20
+#define MPW_HANDSHAKE_ACK 0x06
+
+void MPW_packHandshake(unsigned char *buf, unsigned long long cookie, int stream, int count);
+bool MPW_unpackHandshake(const unsigned char *buf, unsigned long long *cookie, int *stream, int *count);
+
+/** Acceptor
+ * Accepts the streams of any number of paths on one TCP port, and hands each
+ * connection to the path its handshake names. The first stream of an unknown
+ * cookie claims a waiting path with the same number of streams.
+ *
+ * Listening threads are started as paths start waiting, one per waiting path up
+ * to the number of cores. Each has its own listening socket on the port
+ * (SO_REUSEPORT), so the kernel spreads the connections over them. The acceptor
+ * closes its port once no path is waiting any more.
+ *
+ * Idle connections of destroyed paths can be parked here: when the other side
+ * reuses them it sends a new handshake over them, and they are handed out as if
+ * they had just been accepted.
+ */
+class Acceptor
+{
+ public:
+  // Wait until a path of num_streams streams has connected to port, and store its
+  // sockets in fds in stream order. timeout in seconds (<= 0: none).
+  // Returns 0, or a negative errno value.
+  static int waitForPath(int port, int num_streams, int *fds, double timeout);
+
+  // Keep the connected sockets fds, accepted on port, until the other side reuses them
+  // or idle_timeout seconds have passed. The acceptor owns them from now on.
+  static void park(int port, const int *fds, int n, double idle_timeout);
+  // Number of parked connections; close them all.
+  static int parked();
+  static void closeParked();
+
+ private:
+  struct Waiter;
+  struct Listener;
+
+  Acceptor(int port);
+  ~Acceptor();
+  Acceptor(const Acceptor &);
+  Acceptor &operator=(const Acceptor &);
+
+  bool addListener();
+  void stop();
+  bool deliver(int fd, unsigned long long cookie, int stream, int count);
+  static void expireParked(long long int now);
+  static void *loop(void *args);
+
+  int port;
+  bool shared;   // the listening sockets use SO_REUSEPORT.
+  bool stopping;
+  int wake[2];   // pipe that wakes the listening threads; closed to stop them.
+  std::vector<Listener*> listeners;
+  std::list<Waiter*> waiters;
+};
+
+#endif
@@ -0,0 +1,369 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "Checksum.h"
+#include "ProgressEngine.h"
+
+#include <string.h>
+#include <pthread.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define MPW_CRC32C_SSE42 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define MPW_CRC32C_ARM 1
+#endif
+
+#include "serialization.h"
+
+/* Reflected CRC32C polynomial. */
+#define CRC32C_POLY 0x82f63b78U
+
+/* Slicing-by-8 tables for the portable version. */
+static unsigned int crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static bool crc_hw = false;
+
+/* The crc32 instruction of SSE4.2 takes three cycles, but a new one can start every cycle:
+ * three CRCs over adjacent blocks run almost three times as fast as one. Their results are
+ * then combined by moving each one over the blocks after it, which is a multiplication by
+ * x^(8 * block size) modulo the polynomial. As that is linear, it is looked up bytewise. */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+static unsigned int crc_long_shift[4][256], crc_short_shift[4][256];
+
+/* a * b modulo the polynomial, in the reflected bit order of the CRC. */
+static unsigned int multModP(unsigned int a, unsigned int b)
+{
+  unsigned int p = 0;
+  for (unsigned int m = 1U << 31; m != 0; m >>= 1) {
+    if (a & m) {
+      p ^= b;
+    }
+    b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+/* Fill table with what moves a CRC over len bytes of zeros: x^(8 * len) modulo the
+ * polynomial, times each byte of the CRC. */
+static void zerosShift(unsigned int table[4][256], unsigned long long len)
+{
+  unsigned int p = 1U << 31, x = 1U << 30; // 1 and x.
+  for (unsigned long long e = 8 * len; e != 0; e >>= 1) {
+    if (e & 1) {
+      p = multModP(x, p);
+    }
+    x = multModP(x, x);
+  }
+  for (int k = 0; k < 4; k++) {
+    for (unsigned int i = 0; i < 256; i++) {
+      table[k][i] = multModP(p, i << (8 * k));
+    }
+  }
+}
+
+static inline unsigned int shiftCrc(const unsigned int table[4][256], unsigned int c)
+{
+  return table[0][c & 0xff] ^ table[1][(c >> 8) & 0xff] ^ table[2][(c >> 16) & 0xff] ^ table[3][c >> 24];
+}
+
+static void crcInit()
+{
+  for (int i = 0; i < 256; i++) {
+    unsigned int c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+    }
+    crc_table[0][i] = c;
+  }
+  for (int i = 0; i < 256; i++) {
+    for (int t = 1; t < 8; t++) {
+      crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+    }
+  }
+  zerosShift(crc_long_shift, CRC32C_LONG);
+  zerosShift(crc_short_shift, CRC32C_SHORT);
+#if defined(MPW_CRC32C_SSE42)
+  __builtin_cpu_init();
+  crc_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(MPW_CRC32C_ARM)
+  crc_hw = true;
+#endif
+}
+
+static unsigned int crcTable(unsigned int c, const unsigned char *p, size_t len)
+{
+  while (len > 0 && ((size_t) p & 7) != 0) {
+    c = (c >> 8) ^ crc_table[0][(c ^ *p++) & 0xff];
+    len--;
+  }
+  while (len >= 8) {
+    unsigned int lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lo = __builtin_bswap32(lo);
+    hi = __builtin_bswap32(hi);
+#endif
+    lo ^= c;
+    c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+        crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+        crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+        crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    c = (c >> 8) ^ crc_table[0][(c ^ *p++) & 0xff];
+    len--;
+  }
+  return c;
+}
+
+#if defined(MPW_CRC32C_SSE42)
+#if defined(__x86_64__)
+/* Extend c over three adjacent blocks of n bytes at p, shift being the zerosShift() table of n. */
+__attribute__((target("sse4.2")))
+static inline unsigned long long crcThreeBlocks(unsigned long long c, const unsigned char *p, size_t n,
+                                                const unsigned int shift[4][256])
+{
+  unsigned long long c1 = 0, c2 = 0;
+  for (size_t i = 0; i < n; i += 8) {
+    unsigned long long v0, v1, v2;
+    memcpy(&v0, p + i, 8);
+    memcpy(&v1, p + n + i, 8);
+    memcpy(&v2, p + 2 * n + i, 8);
+    c = _mm_crc32_u64(c, v0);
+    c1 = _mm_crc32_u64(c1, v1);
+    c2 = _mm_crc32_u64(c2, v2);
+  }
+  c = shiftCrc(shift, (unsigned int) c) ^ c1;
+  return shiftCrc(shift, (unsigned int) c) ^ c2;
+}
+#endif
+
+__attribute__((target("sse4.2")))
+static unsigned int crcHardware(unsigned int c, const unsigned char *p, size_t len)
+{
+  while (len > 0 && ((size_t) p & 7) != 0) {
+    c = _mm_crc32_u8(c, *p++);
+    len--;
+  }
+#if defined(__x86_64__)
+  unsigned long long c64 = c;
+  for (; len >= 3 * CRC32C_LONG; p += 3 * CRC32C_LONG, len -= 3 * CRC32C_LONG) {
+    c64 = crcThreeBlocks(c64, p, CRC32C_LONG, crc_long_shift);
+  }
+  for (; len >= 3 * CRC32C_SHORT; p += 3 * CRC32C_SHORT, len -= 3 * CRC32C_SHORT) {
+    c64 = crcThreeBlocks(c64, p, CRC32C_SHORT, crc_short_shift);
+  }
+  while (len >= 8) {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    c64 = _mm_crc32_u64(c64, v);
+    p += 8;
+    len -= 8;
+  }
+  c = (unsigned int) c64;
+#endif
+  while (len >= 4) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    c = _mm_crc32_u32(c, v);
+    p += 4;
+    len -= 4;
+  }
+  while (len > 0) {
+    c = _mm_crc32_u8(c, *p++);
+    len--;
+  }
+  return c;
+}
+#elif defined(MPW_CRC32C_ARM)
+static unsigned int crcHardware(unsigned int c, const unsigned char *p, size_t len)
+{
+  while (len >= 8) {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    c = __crc32cd(c, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    c = __crc32cb(c, *p++);
+    len--;
+  }
+  return c;
+}
+#endif
+
+unsigned int Checksum::crc32c(unsigned int crc, const void *buf, size_t len)
+{
+  pthread_once(&crc_once, crcInit);
+  const unsigned char *p = (const unsigned char *) buf;
+#if defined(MPW_CRC32C_SSE42) || defined(MPW_CRC32C_ARM)
+  if (crc_hw) {
+    return ~crcHardware(~crc, p, len);
+  }
+#endif
+  return ~crcTable(~crc, p, len);
+}
+
+unsigned int Checksum::crc32cPortable(unsigned int crc, const void *buf, size_t len)
+{
+  pthread_once(&crc_once, crcInit);
+  return ~crcTable(~crc, (const unsigned char *) buf, len);
+}
+
+bool Checksum::accelerated()
+{
+  pthread_once(&crc_once, crcInit);
+  return crc_hw;
+}
+
+/* Extend crc over the next len bytes of c, and move c past them. */
+static unsigned int crcNext(unsigned int crc, IovCursor &c, long long int len)
+{
+  IovCursor part;
+  part.reset(c, 0, len);
+  struct iovec v[MPW_TASK_MAXIOV];
+  while (part.remaining() > 0) {
+    const int n = part.fill(v, MPW_TASK_MAXIOV);
+    if (n == 0) {
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      crc = Checksum::crc32c(crc, v[i].iov_base, v[i].iov_len);
+      part.advance(v[i].iov_len);
+    }
+  }
+  c.advance(len);
+  return crc;
+}
+
+ChecksumCursor::ChecksumCursor() :
+  offset(0), length(0), chunk(1), tsize(0), total(0), pos(0), dpos(0),
+  sending(false), ready(0), crc(0), bad(-1)
+{}
+
+void ChecksumCursor::reset(const struct iovec *iov, int iovcnt, long long int offset, long long int length,
+                           long long int chunk, bool sending)
+{
+  this->offset = offset;
+  this->length = length;
+  this->sending = sending;
+  // Without checksums the whole range is a single chunk with nothing after it.
+  this->chunk = chunk > 0 ? chunk : std::max(length, 1LL);
+  tsize = chunk > 0 ? MPW_CHECKSUM_SIZE : 0;
+  const long long int nchunks = (length + this->chunk - 1) / this->chunk;
+  total = length + nchunks * tsize;
+  pos = 0;
+  dpos = 0;
+  ready = 0;
+  crc = 0;
+  bad = -1;
+  trailers.assign(nchunks * tsize, 0);
+  data.reset(iov, iovcnt, offset, length);
+  if (sending && tsize > 0) {
+    sum.reset(data, 0, length);
+  }
+}
+
+long long int ChecksumCursor::chunkLength(long long int k) const
+{
+  return std::min(chunk, length - k * chunk);
+}
+
+int ChecksumCursor::fill(struct iovec *out, int maxiov)
+{
+  const long long int stride = chunk + tsize;
+  int n = 0;
+  long long int p = pos;
+  while (n < maxiov && p < total) {
+    const long long int k = p / stride;
+    const long long int within = p % stride;
+    const long long int len = chunkLength(k);
+    if (within < len) {
+      if (sending && tsize > 0) {
+        while (ready <= k) {
+          serialize_uint32(&trailers[ready * tsize], crcNext(0, sum, chunkLength(ready)));
+          ready++;
+        }
+      }
+      IovCursor c;
+      c.reset(data, k * chunk + within - dpos, len - within);
+      const int m = c.fill(out + n, maxiov - n);
+      long long int got = 0;
+      for (int i = n; i < n + m; i++) {
+        got += out[i].iov_len;
+      }
+      n += m;
+      p += got;
+      if (got < len - within) {
+        break;
+      }
+    } else {
+      const long long int t = within - len;
+      out[n].iov_base = &trailers[k * tsize + t];
+      out[n].iov_len = tsize - t;
+      n++;
+      p += tsize - t;
+    }
+  }
+  return n;
+}
+
+long long int ChecksumCursor::advance(long long int n)
+{
+  const long long int stride = chunk + tsize;
+  long long int got_data = 0;
+  while (n > 0 && pos < total) {
+    const long long int k = pos / stride;
+    const long long int within = pos % stride;
+    const long long int len = chunkLength(k);
+    if (within < len) {
+      const long long int got = std::min(n, len - within);
+      if (!sending && tsize > 0) {
+        crc = crcNext(crc, data, got);
+      } else {
+        data.advance(got);
+      }
+      got_data += got;
+      dpos += got;
+      pos += got;
+      n -= got;
+    } else {
+      const long long int got = std::min(n, tsize - (within - len));
+      pos += got;
+      n -= got;
+      if (!sending && within - len + got == tsize) {
+        if (deserialize_uint32(&trailers[k * tsize]) != crc && bad < 0) {
+          bad = offset + k * chunk;
+        }
+        crc = 0;
+      }
+    }
+  }
+  return got_data;
+}
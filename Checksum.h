@@ -0,0 +1,101 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#ifndef MPW_Checksum_class
+#define MPW_Checksum_class
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+
+#include "ProgressEngine.h"
+
+/* Size of the trailer that carries the checksum of a chunk. */
+#define MPW_CHECKSUM_SIZE 4
+
+/** Checksum
+ * CRC32C (Castagnoli), the checksum of iSCSI and SCTP. It runs on the crc32
+ * instruction of SSE4.2 or ARMv8 where the processor has one, which outpaces any
+ * link by far, and falls back to a table-driven version elsewhere.
+ */
+class Checksum
+{
+ public:
+  // Extend crc (0 to start with) over len bytes of buf.
+  static unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+
+  // The table-driven version, whatever the processor has.
+  static unsigned int crc32cPortable(unsigned int crc, const void *buf, size_t len);
+
+  // Whether crc32c() uses a processor instruction.
+  static bool accelerated();
+};
+
+/** ChecksumCursor
+ * Walks a byte range of a scatter/gather list like IovCursor, except that on the
+ * wire every chunk of it is followed by the CRC32C of that chunk. The sending side
+ * computes the checksum of a chunk when it first hands the chunk out, just before
+ * the data is sent; the receiving side extends it over the bytes as they arrive,
+ * while they are still in the cache. With a chunk size <= 0 no checksums are sent.
+ */
+class ChecksumCursor
+{
+ public:
+  ChecksumCursor();
+
+  // Point the cursor at a byte range of a scatter/gather list that is to be sent or received.
+  void reset(const struct iovec *iov, int iovcnt, long long int offset, long long int length,
+             long long int chunk, bool sending);
+
+  // Bytes still to be transferred, checksums included.
+  long long int remaining() const { return total - pos; }
+
+  // Fill out with (at most maxiov entries of) the remaining bytes. Returns the iovec count.
+  int fill(struct iovec *out, int maxiov);
+
+  // Mark n bytes as transferred. Returns how many of them were data rather than checksums.
+  long long int advance(long long int n);
+
+  // Receiving: offset in the scatter/gather list of the first chunk that arrived with
+  // a wrong checksum (-1: none).
+  long long int mismatch() const { return bad; }
+
+ private:
+  ChecksumCursor(const ChecksumCursor &);
+  ChecksumCursor &operator=(const ChecksumCursor &);
+
+  long long int chunkLength(long long int k) const;
+
+  long long int offset, length;
+  long long int chunk;      // data bytes per chunk.
+  long long int tsize;      // bytes of checksum after each chunk (0: none).
+  long long int total, pos; // bytes on the wire, and those transferred.
+  long long int dpos;       // data bytes transferred,
+  IovCursor data;           // ... and where the next one is.
+  bool sending;
+  long long int ready;      // sending: chunks whose checksum has been computed,
+  IovCursor sum;            // ... and where the next one starts.
+  unsigned int crc;         // receiving: checksum of the current chunk so far.
+  long long int bad;
+  std::vector<unsigned char> trailers;
+};
+
+#endif
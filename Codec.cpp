@@ -0,0 +1,339 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "Codec.h"
+
+#include <vector>
+#include <iostream>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mpwide-macros.h"
+
+/* Block format: a sequence is a token byte (literal count in the high nibble, match
+ * length - 4 in the low one; 15 means more follows in bytes of 255 and a final smaller
+ * one), the literals, a 2-byte little-endian offset and the rest of the match length.
+ * The last sequence has literals only. */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_LOG 13
+#define LZ_LAST_LITERALS 5  // the last bytes are always literals...
+#define LZ_MATCH_MARGIN 12  // ... and no match starts in the last bytes.
+#define LZ_SKIP_TRIGGER 6   // after 2^6 misses in a row, the search skips ahead faster.
+
+static inline unsigned int read32(const unsigned char *p)
+{
+  unsigned int v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline unsigned long long read64(const unsigned char *p)
+{
+  unsigned long long v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline unsigned int hash4(unsigned int v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/* Number of bytes from p and ref on that are equal, up to limit. */
+static inline long long int matchLength(const unsigned char *p, const unsigned char *ref, const unsigned char *limit)
+{
+  const unsigned char *start = p;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (p + 8 <= limit) {
+    const unsigned long long diff = read64(p) ^ read64(ref);
+    if (diff) {
+      return p - start + (__builtin_ctzll(diff) >> 3);
+    }
+    p += 8;
+    ref += 8;
+  }
+#endif
+  while (p < limit && *p == *ref) {
+    p++;
+    ref++;
+  }
+  return p - start;
+}
+
+static inline unsigned char *putLength(unsigned char *op, long long int len)
+{
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char) len;
+  return op;
+}
+
+/* Append a sequence; a match length below LZ_MIN_MATCH ends the block. Returns NULL if it does not fit. */
+static unsigned char *putSequence(unsigned char *op, const unsigned char *oend, const unsigned char *lit, long long int nlit,
+                                  int offset, long long int mlen)
+{
+  if (op + 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1 > oend) {
+    return NULL;
+  }
+  unsigned char *token = op++;
+  *token = (unsigned char) (min(nlit, 15LL) << 4);
+  if (nlit >= 15) {
+    op = putLength(op, nlit - 15);
+  }
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen < LZ_MIN_MATCH) {
+    return op;
+  }
+  op[0] = (unsigned char) (offset & 0xff);
+  op[1] = (unsigned char) (offset >> 8);
+  op += 2;
+  mlen -= LZ_MIN_MATCH;
+  *token |= (unsigned char) min(mlen, 15LL);
+  if (mlen >= 15) {
+    op = putLength(op, mlen - 15);
+  }
+  return op;
+}
+
+int Codec::compress(const char *source, int n, char *dest, int cap)
+{
+  const unsigned char *src = (const unsigned char *) source;
+  const unsigned char *end = src + n;
+  unsigned char *op = (unsigned char *) dest;
+  const unsigned char *oend = op + cap;
+
+  // Positions + 1 of the last occurrence of each hash (0: none).
+  unsigned int table[1 << LZ_HASH_LOG];
+  memset(table, 0, sizeof(table));
+
+  const unsigned char *anchor = src;
+  const unsigned char *ip = src;
+  const unsigned char *mflimit = n > LZ_MATCH_MARGIN ? end - LZ_MATCH_MARGIN : src;
+  const unsigned char *matchlimit = end - LZ_LAST_LITERALS;
+  unsigned int misses = 0;
+
+  while (ip < mflimit) {
+    const unsigned int v = read32(ip);
+    const unsigned int h = hash4(v);
+    const unsigned char *ref = table[h] ? src + table[h] - 1 : NULL;
+    table[h] = (unsigned int) (ip - src) + 1;
+    if (ref == NULL || ip - ref > LZ_MAX_OFFSET || read32(ref) != v) {
+      ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+      continue;
+    }
+    misses = 0;
+
+    while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+    const long long int mlen = LZ_MIN_MATCH + matchLength(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, matchlimit);
+    op = putSequence(op, oend, anchor, ip - anchor, (int) (ip - ref), mlen);
+    if (op == NULL) {
+      return 0;
+    }
+    ip += mlen;
+    anchor = ip;
+    if (ip < mflimit) {
+      table[hash4(read32(ip - 2))] = (unsigned int) (ip - 2 - src) + 1;
+    }
+  }
+
+  op = putSequence(op, oend, anchor, end - anchor, 0, 0);
+  if (op == NULL) {
+    return 0;
+  }
+  return (int) (op - (unsigned char *) dest);
+}
+
+/* Read an extended length. Returns false if it runs past iend or grows beyond limit. */
+static inline bool getLength(const unsigned char *&ip, const unsigned char *iend, long long int &len, long long int limit)
+{
+  unsigned char b;
+  do {
+    if (ip >= iend) {
+      return false;
+    }
+    b = *ip++;
+    len += b;
+    if (len > limit) {
+      return false;
+    }
+  } while (b == 255);
+  return true;
+}
+
+int Codec::decompress(const char *source, int n, char *dest, int size)
+{
+  const unsigned char *ip = (const unsigned char *) source;
+  const unsigned char *iend = ip + n;
+  unsigned char *op = (unsigned char *) dest;
+  unsigned char *oend = op + size;
+
+  while (ip < iend) {
+    const unsigned char token = *ip++;
+
+    long long int nlit = token >> 4;
+    if (nlit == 15 && !getLength(ip, iend, nlit, size)) {
+      return -1;
+    }
+    if (nlit > iend - ip || nlit > oend - op) {
+      return -1;
+    }
+    memcpy(op, ip, nlit);
+    op += nlit;
+    ip += nlit;
+    if (ip == iend) {
+      break; // the last sequence.
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    const long long int offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op - (unsigned char *) dest) {
+      return -1;
+    }
+    long long int mlen = token & 15;
+    if (mlen == 15 && !getLength(ip, iend, mlen, size)) {
+      return -1;
+    }
+    mlen += LZ_MIN_MATCH;
+    if (mlen > oend - op) {
+      return -1;
+    }
+    // The match may overlap the bytes it produces: copy whole periods, doubling each time.
+    const unsigned char *ref = op - offset;
+    while (mlen > 0) {
+      const long long int len = min(mlen, (long long int) (op - ref));
+      memcpy(op, ref, len);
+      op += len;
+      mlen -= len;
+    }
+  }
+  return op == oend ? size : -1;
+}
+
+/* The codec threads take the items of the current job in turn. */
+static pthread_mutex_t codec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t codec_work = PTHREAD_COND_INITIALIZER; // a job has been posted, or the threads stop.
+static pthread_cond_t codec_done = PTHREAD_COND_INITIALIZER; // the job is done, or the threads are free.
+static std::vector<pthread_t> codec_threads;
+static bool codec_started = false;
+static bool codec_stopping = false;
+static CodecJob *codec_job = NULL;
+static long long int codec_count = 0;    // items in the job,
+static long long int codec_next = 0;     // ... the next one to take,
+static long long int codec_finished = 0; // ... and the number completed.
+
+void *Codec::loop(void *args)
+{
+  pthread_mutex_lock(&codec_lock);
+  for (;;) {
+    while (!codec_stopping && (codec_job == NULL || codec_next >= codec_count)) {
+      pthread_cond_wait(&codec_work, &codec_lock);
+    }
+    if (codec_stopping) {
+      break;
+    }
+    CodecJob *job = codec_job;
+    const long long int i = codec_next++;
+    pthread_mutex_unlock(&codec_lock);
+    job->run(i);
+    pthread_mutex_lock(&codec_lock);
+    if (++codec_finished == codec_count) {
+      pthread_cond_broadcast(&codec_done);
+    }
+  }
+  pthread_mutex_unlock(&codec_lock);
+  return NULL;
+}
+
+void Codec::run(CodecJob *job, long long int n)
+{
+  pthread_mutex_lock(&codec_lock);
+  if (!codec_started) {
+    codec_started = true;
+    const int cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < cores; i++) {
+      pthread_t t;
+      if (pthread_create(&t, NULL, loop, NULL) != 0) {
+        LOG_WARN("Could not start codec thread " << i << "; compressing with " << i << " threads.");
+        break;
+      }
+      codec_threads.push_back(t);
+    }
+  }
+  if (codec_threads.empty() || n <= 1) {
+    pthread_mutex_unlock(&codec_lock);
+    for (long long int i = 0; i < n; i++) {
+      job->run(i);
+    }
+    return;
+  }
+
+  while (codec_job != NULL) {
+    pthread_cond_wait(&codec_done, &codec_lock); // another path is using the threads.
+  }
+  codec_job = job;
+  codec_count = n;
+  codec_next = 0;
+  codec_finished = 0;
+  pthread_cond_broadcast(&codec_work);
+  while (codec_next < codec_count) {
+    const long long int i = codec_next++;
+    pthread_mutex_unlock(&codec_lock);
+    job->run(i);
+    pthread_mutex_lock(&codec_lock);
+    codec_finished++;
+  }
+  while (codec_finished < codec_count) {
+    pthread_cond_wait(&codec_done, &codec_lock);
+  }
+  codec_job = NULL;
+  pthread_cond_broadcast(&codec_done);
+  pthread_mutex_unlock(&codec_lock);
+}
+
+void Codec::close()
+{
+  pthread_mutex_lock(&codec_lock);
+  codec_stopping = true;
+  pthread_cond_broadcast(&codec_work);
+  std::vector<pthread_t> threads;
+  threads.swap(codec_threads);
+  pthread_mutex_unlock(&codec_lock);
+
+  for (size_t i = 0; i < threads.size(); i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_mutex_lock(&codec_lock);
+  codec_stopping = false;
+  codec_started = false;
+  pthread_mutex_unlock(&codec_lock);
+}
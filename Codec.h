@@ -0,0 +1,67 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#ifndef MPW_Codec_class
+#define MPW_Codec_class
+
+/** CodecJob
+ * A batch of independent pieces of work, e.g. the blocks of a message, that
+ * Codec::run() spreads over its threads.
+ */
+class CodecJob
+{
+ public:
+  virtual ~CodecJob() {}
+  virtual void run(long long int i) = 0;
+};
+
+/** Codec
+ * A fast LZ77 block compressor in the style of LZ4: sequences of literals and
+ * back references of at least 4 bytes within the last 64 kB, found through a hash
+ * of the next 4 bytes. It trades ratio for speed, so that it can keep up with a
+ * wide area link. Blocks are independent of each other.
+ *
+ * The codec threads (one per core besides the caller) are started on first use
+ * and shared by all paths.
+ */
+class Codec
+{
+ public:
+  // Compress n bytes of src into dst. Returns the compressed size, or 0 if it
+  // would exceed cap bytes.
+  static int compress(const char *src, int n, char *dst, int cap);
+
+  // Decompress the n bytes in src into the size bytes of dst. Returns size, or -1
+  // if src is not a compressed block of exactly size bytes.
+  static int decompress(const char *src, int n, char *dst, int size);
+
+  // Call job->run(i) for i = 0 .. n-1 on the codec threads and the calling thread,
+  // and return once all calls have returned.
+  static void run(CodecJob *job, long long int n);
+
+  // Stop the codec threads (they are restarted when needed).
+  static void close();
+
+ private:
+  static void *loop(void *args);
+};
+
+#endif
@@ -0,0 +1,480 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "MPWide.h"
+#include "Communicator.h"
+#include "Reduction.h"
+
+#include <algorithm>
+#include <climits>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "serialization.h"
+
+/* The communicators, by id (NULL: free). */
+static pthread_mutex_t comms_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<Communicator*> comms;
+
+Communicator::Communicator(int rank, const std::vector<int> &paths) :
+  rank(rank), sites(paths.size()), paths(paths)
+{}
+
+/* Keep the handle of a posted request, or the error it could not be posted with. */
+static bool post(std::vector<int> &reqs, int request, int &ret)
+{
+  if (request < 0) {
+    ret = request;
+    return false;
+  }
+  reqs.push_back(request);
+  return true;
+}
+
+/* A chunk of a ring algorithm, received in step. */
+struct RingChunk {
+  int step;
+  long long int start, length;
+};
+
+static int waitAll(std::vector<int> &reqs, int ret)
+{
+  const int r = reqs.empty() ? 0 : MPW_Waitall(reqs.size(), &reqs[0]);
+  reqs.clear();
+  return r < 0 ? r : ret;
+}
+
+int Communicator::relay(char *buf, long long int size, long long int chunk, int parent, const std::vector<int> &children)
+{
+  const long long int n = (size + chunk - 1) / chunk;
+  std::vector<int> recvs, sends;
+  int ret = 0;
+  if (parent >= 0) {
+    for (long long int k = 0; k < n; k++) {
+      post(recvs, MPW_Irecv(buf + k * chunk, std::min(chunk, size - k * chunk), paths[parent]), ret);
+    }
+  }
+  for (long long int k = 0; k < n && ret == 0; k++) {
+    // The chunks from the parent arrive in order, as the requests of a path are served in order.
+    if (parent >= 0) {
+      const int r = MPW_Wait(recvs[k]);
+      recvs[k] = MPW_REQUEST_NULL;
+      if (r < 0) {
+        ret = r;
+        break;
+      }
+    }
+    for (size_t c = 0; c < children.size(); c++) {
+      post(sends, MPW_Isend(buf + k * chunk, std::min(chunk, size - k * chunk), paths[children[c]]), ret);
+    }
+  }
+  for (size_t k = 0; k < recvs.size(); k++) {
+    if (recvs[k] != MPW_REQUEST_NULL) {
+      MPW_Wait(recvs[k]);
+    }
+  }
+  return waitAll(sends, ret);
+}
+
+int Communicator::bcast(char *buf, long long int size, int root)
+{
+  if (root < 0 || root >= sites || size < 0) {
+    return -EINVAL;
+  }
+  // Ranks relative to the root.
+  const int me = (rank - root + sites) % sites;
+  int parent = -1;
+  std::vector<int> children;
+  long long int chunk = MPW_COLL_CHUNK;
+
+  if (size <= MPW_COLL_DIRECT_MAX || sites <= 2) {
+    chunk = std::max(size, 1LL);
+    if (me == 0) {
+      for (int i = 1; i < sites; i++) {
+        children.push_back(i);
+      }
+    } else {
+      parent = 0;
+    }
+  } else if (size >= MPW_COLL_CHAIN_MIN) {
+    if (me > 0) {
+      parent = me - 1;
+    }
+    if (me + 1 < sites) {
+      children.push_back(me + 1);
+    }
+  } else {
+    // Binomial tree: the parent clears the highest bit of our rank, the children add a higher one.
+    int bit = 1;
+    while (bit <= me) {
+      bit <<= 1;
+    }
+    if (me > 0) {
+      parent = me - (bit >> 1);
+    }
+    for (; me + bit < sites; bit <<= 1) {
+      children.push_back(me + bit);
+    }
+  }
+
+  if (parent >= 0) {
+    parent = (parent + root) % sites;
+  }
+  for (size_t c = 0; c < children.size(); c++) {
+    children[c] = (children[c] + root) % sites;
+  }
+  return relay(buf, size, chunk, parent, children);
+}
+
+int Communicator::gather(const char *sendbuf, long long int size, char *recvbuf, int root)
+{
+  if (root < 0 || root >= sites || size < 0) {
+    return -EINVAL;
+  }
+  // The root takes in all the data anyway; forwarding it through other sites would only add hops.
+  std::vector<int> reqs;
+  int ret = 0;
+  if (rank != root) {
+    post(reqs, MPW_Isend((char *) sendbuf, size, paths[root]), ret);
+    return waitAll(reqs, ret);
+  }
+  for (int r = 0; r < sites; r++) {
+    if (r != rank) {
+      post(reqs, MPW_Irecv(recvbuf + r * size, size, paths[r]), ret);
+    }
+  }
+  memmove(recvbuf + rank * size, sendbuf, size);
+  return waitAll(reqs, ret);
+}
+
+int Communicator::ringAllgather(char *buf, const std::vector<long long int> &offset, int first, int unit)
+{
+  const int left = (rank + sites - 1) % sites;
+  const int right = (rank + 1) % sites;
+  const bool swap = unit > 1 && MPW_PathSwapsBytes(paths[left]) > 0;
+  const int mine = (rank + first) % sites;
+  std::vector<RingChunk> in;
+  std::vector<int> recvs, sends;
+  int ret = 0;
+
+  // In step s, block mine - s goes to the right and block mine - s - 1 comes in from the left.
+  for (long long int p = offset[mine]; p < offset[mine + 1]; p += MPW_COLL_CHUNK) {
+    post(sends, MPW_Isend(buf + p, std::min((long long int) MPW_COLL_CHUNK, offset[mine + 1] - p), paths[right]), ret);
+  }
+  for (int s = 0; s < sites - 1; s++) {
+    const int b = (mine - s - 1 + sites) % sites;
+    for (long long int p = offset[b]; p < offset[b + 1]; p += MPW_COLL_CHUNK) {
+      RingChunk c = { s, p, std::min((long long int) MPW_COLL_CHUNK, offset[b + 1] - p) };
+      if (post(recvs, MPW_Irecv(buf + c.start, c.length, paths[left]), ret)) {
+        in.push_back(c);
+      }
+    }
+  }
+  for (size_t i = 0; i < recvs.size(); i++) {
+    const int r = MPW_Wait(recvs[i]);
+    if (r < 0) {
+      ret = r;
+    }
+    if (ret == 0 && swap) {
+      swap_elements(buf + in[i].start, in[i].length / unit, unit);
+    }
+    // Pass each chunk on as soon as it has arrived, unless the right neighbour already has it.
+    if (ret == 0 && in[i].step < sites - 2) {
+      post(sends, MPW_Isend(buf + in[i].start, in[i].length, paths[right]), ret);
+    }
+  }
+  return waitAll(sends, ret);
+}
+
+int Communicator::ringReduceScatter(char *acc, char *tmp, const std::vector<long long int> &offset, int unit,
+                                    int type, int op)
+{
+  const int left = (rank + sites - 1) % sites;
+  const int right = (rank + 1) % sites;
+  const bool swap = unit > 1 && MPW_PathSwapsBytes(paths[left]) > 0;
+  std::vector<RingChunk> in;
+  std::vector<int> recvs, sends;
+  int ret = 0;
+
+  // In step s, our partial result for block rank - s goes to the right, and that of the left
+  // neighbour for block rank - s - 1 comes in and is combined with ours.
+  for (long long int p = offset[rank]; p < offset[rank + 1]; p += MPW_COLL_CHUNK) {
+    post(sends, MPW_Isend(acc + p, std::min((long long int) MPW_COLL_CHUNK, offset[rank + 1] - p), paths[right]), ret);
+  }
+  for (int s = 0; s < sites - 1; s++) {
+    const int b = (rank - s - 1 + sites) % sites;
+    for (long long int p = offset[b]; p < offset[b + 1]; p += MPW_COLL_CHUNK) {
+      RingChunk c = { s, p, std::min((long long int) MPW_COLL_CHUNK, offset[b + 1] - p) };
+      if (post(recvs, MPW_Irecv(tmp + c.start, c.length, paths[left]), ret)) {
+        in.push_back(c);
+      }
+    }
+  }
+  for (size_t i = 0; i < recvs.size(); i++) {
+    const int r = MPW_Wait(recvs[i]);
+    if (r < 0) {
+      ret = r;
+    }
+    if (ret != 0) {
+      continue;
+    }
+    // Combine each chunk while the next ones are still on their way, and pass it on.
+    if (swap) {
+      swap_elements(tmp + in[i].start, in[i].length / unit, unit);
+    }
+    Reduction::apply(acc + in[i].start, tmp + in[i].start, in[i].length / unit, type, op);
+    if (in[i].step < sites - 2) {
+      post(sends, MPW_Isend(acc + in[i].start, in[i].length, paths[right]), ret);
+    }
+  }
+  return waitAll(sends, ret);
+}
+
+int Communicator::allgather(const char *sendbuf, long long int size, char *recvbuf)
+{
+  if (size < 0) {
+    return -EINVAL;
+  }
+  memmove(recvbuf + rank * size, sendbuf, size);
+  if (sites > 2 && size >= MPW_COLL_RING_MIN) {
+    std::vector<long long int> offset(sites + 1);
+    for (int b = 0; b <= sites; b++) {
+      offset[b] = b * size;
+    }
+    return ringAllgather(recvbuf, offset, 0, 1);
+  }
+  std::vector<int> reqs;
+  int ret = 0;
+  for (int r = 0; r < sites; r++) {
+    if (r != rank) {
+      post(reqs, MPW_ISendRecv(recvbuf + rank * size, size, recvbuf + r * size, size, paths[r]), ret);
+    }
+  }
+  return waitAll(reqs, ret);
+}
+
+int Communicator::alltoall(const char *sendbuf, long long int size, char *recvbuf)
+{
+  if (size < 0) {
+    return -EINVAL;
+  }
+  // Every pair of sites has data of its own to exchange, so all of them do so at once.
+  std::vector<int> reqs;
+  int ret = 0;
+  for (int r = 0; r < sites; r++) {
+    if (r != rank) {
+      post(reqs, MPW_ISendRecv((char *) sendbuf + r * size, size, recvbuf + r * size, size, paths[r]), ret);
+    }
+  }
+  memmove(recvbuf + rank * size, sendbuf + rank * size, size);
+  return waitAll(reqs, ret);
+}
+
+int Communicator::combineAll(char *acc, char *tmp, std::vector<int> &reqs, long long int count, int type, int op, int ret)
+{
+  const int unit = MPW_TypeSize(type);
+  const long long int bytes = count * unit;
+  for (int r = 0; r < sites; r++) {
+    if (reqs[r] != MPW_REQUEST_NULL) {
+      const int e = MPW_Wait(reqs[r]);
+      reqs[r] = MPW_REQUEST_NULL;
+      if (e < 0) {
+        ret = e;
+      } else if (MPW_PathSwapsBytes(paths[r]) > 0) {
+        swap_elements(tmp + r * bytes, count, unit);
+      }
+    }
+    if (ret == 0 && r == 0) {
+      memcpy(acc, tmp, bytes);
+    } else if (ret == 0) {
+      Reduction::apply(acc, tmp + r * bytes, count, type, op);
+    }
+  }
+  return ret;
+}
+
+/* Boundaries of the blocks of count elements of unit bytes that the ring algorithms split a vector in. */
+static std::vector<long long int> ringBlocks(long long int count, int unit, int sites)
+{
+  std::vector<long long int> offset(sites + 1);
+  for (int b = 0; b <= sites; b++) {
+    offset[b] = (count / sites * b + std::min((long long int) b, count % sites)) * unit;
+  }
+  return offset;
+}
+
+int Communicator::reduce(const void *sendbuf, void *recvbuf, long long int count, int type, int op, int root)
+{
+  if (root < 0 || root >= sites || count < 0 || !Reduction::valid(type, op)) {
+    return -EINVAL;
+  }
+  const int unit = MPW_TypeSize(type);
+  const long long int bytes = count * unit;
+  std::vector<int> reqs;
+  int ret = 0;
+
+  if (sites > 2 && bytes >= MPW_COLL_RING_MIN) {
+    // Reduce-scatter around the ring, then each site sends the block it holds the result of to the root.
+    const std::vector<long long int> offset = ringBlocks(count, unit, sites);
+    char *tmp = new char[bytes];
+    char *acc = rank == root ? (char *) recvbuf : new char[bytes];
+    memmove(acc, sendbuf, bytes);
+    ret = ringReduceScatter(acc, tmp, offset, unit, type, op);
+    if (rank != root) {
+      const int b = (rank + 1) % sites;
+      if (ret == 0) {
+        post(reqs, MPW_Isend(acc + offset[b], offset[b + 1] - offset[b], paths[root]), ret);
+      }
+      ret = waitAll(reqs, ret);
+      delete [] acc;
+    } else if (ret == 0) {
+      reqs.assign(sites, MPW_REQUEST_NULL);
+      for (int r = 0; r < sites; r++) {
+        const int b = (r + 1) % sites;
+        if (r != rank && ret == 0) {
+          reqs[r] = MPW_Irecv(acc + offset[b], offset[b + 1] - offset[b], paths[r]);
+          ret = std::min(reqs[r], 0);
+        }
+      }
+      for (int r = 0; r < sites; r++) {
+        const int b = (r + 1) % sites;
+        if (reqs[r] < 0) {
+          continue;
+        }
+        const int e = MPW_Wait(reqs[r]);
+        if (e < 0) {
+          ret = e;
+        } else if (MPW_PathSwapsBytes(paths[r]) > 0) {
+          swap_elements(acc + offset[b], (offset[b + 1] - offset[b]) / unit, unit);
+        }
+      }
+    }
+    delete [] tmp;
+    return ret;
+  }
+
+  if (rank != root) {
+    post(reqs, MPW_Isend((char *) sendbuf, bytes, paths[root]), ret);
+    return waitAll(reqs, ret);
+  }
+  char *tmp = new char[sites * bytes];
+  memcpy(tmp + rank * bytes, sendbuf, bytes);
+  reqs.assign(sites, MPW_REQUEST_NULL);
+  for (int r = 0; r < sites; r++) {
+    const int q = r == rank ? MPW_REQUEST_NULL : MPW_Irecv(tmp + r * bytes, bytes, paths[r]);
+    if (q < 0 && r != rank) {
+      ret = q;
+    } else {
+      reqs[r] = q;
+    }
+  }
+  ret = combineAll((char *) recvbuf, tmp, reqs, count, type, op, ret);
+  delete [] tmp;
+  return ret;
+}
+
+int Communicator::allreduce(const void *sendbuf, void *recvbuf, long long int count, int type, int op)
+{
+  if (count < 0 || !Reduction::valid(type, op)) {
+    return -EINVAL;
+  }
+  const int unit = MPW_TypeSize(type);
+  const long long int bytes = count * unit;
+  int ret = 0;
+
+  if (sites > 2 && bytes >= MPW_COLL_RING_MIN) {
+    // Reduce-scatter and allgather around the ring: each link carries about twice the vector.
+    const std::vector<long long int> offset = ringBlocks(count, unit, sites);
+    char *tmp = new char[bytes];
+    memmove(recvbuf, sendbuf, bytes);
+    ret = ringReduceScatter((char *) recvbuf, tmp, offset, unit, type, op);
+    delete [] tmp;
+    return ret < 0 ? ret : ringAllgather((char *) recvbuf, offset, 1, unit);
+  }
+
+  // Every site sends its vector to every other one, and combines them all in the same order.
+  char *tmp = new char[sites * bytes];
+  memcpy(tmp + rank * bytes, sendbuf, bytes);
+  std::vector<int> reqs(sites, MPW_REQUEST_NULL);
+  for (int r = 0; r < sites; r++) {
+    if (r == rank) {
+      continue;
+    }
+    const int q = MPW_ISendRecv(tmp + rank * bytes, bytes, tmp + r * bytes, bytes, paths[r]);
+    if (q < 0) {
+      ret = q;
+    } else {
+      reqs[r] = q;
+    }
+  }
+  ret = combineAll((char *) recvbuf, tmp, reqs, count, type, op, ret);
+  delete [] tmp;
+  return ret;
+}
+
+int Communicator::add(Communicator *comm)
+{
+  pthread_mutex_lock(&comms_lock);
+  size_t i = 0;
+  while (i < comms.size() && comms[i] != NULL) {
+    i++;
+  }
+  if (i >= (size_t) INT_MAX) {
+    pthread_mutex_unlock(&comms_lock);
+    delete comm;
+    return -ENOMEM;
+  }
+  if (i == comms.size()) {
+    comms.push_back(comm);
+  } else {
+    comms[i] = comm;
+  }
+  pthread_mutex_unlock(&comms_lock);
+  return (int) i;
+}
+
+Communicator *Communicator::get(int id)
+{
+  Communicator *c = NULL;
+  pthread_mutex_lock(&comms_lock);
+  if (id >= 0 && id < (int) comms.size()) {
+    c = comms[id];
+  }
+  pthread_mutex_unlock(&comms_lock);
+  return c;
+}
+
+int Communicator::remove(int id)
+{
+  Communicator *c = NULL;
+  pthread_mutex_lock(&comms_lock);
+  if (id >= 0 && id < (int) comms.size()) {
+    c = comms[id];
+    comms[id] = NULL;
+  }
+  pthread_mutex_unlock(&comms_lock);
+  if (c == NULL) {
+    return -EINVAL;
+  }
+  delete c;
+  return 0;
+}
@@ -0,0 +1,86 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#ifndef MPW_Communicator_class
+#define MPW_Communicator_class
+
+#include <vector>
+
+/* Broadcasts of at most this many bytes go straight from the root to every site,
+ * those of at least MPW_COLL_CHAIN_MIN along a chain through all sites, and those in
+ * between along a binomial tree. */
+#define MPW_COLL_DIRECT_MAX (64*1024)
+#define MPW_COLL_CHAIN_MIN (8*1024*1024)
+/* Allgathers of at least this many bytes per site, and reductions of at least this many
+ * bytes, go around a ring of the sites (with more than two of them); smaller ones are
+ * exchanged with every site at once. */
+#define MPW_COLL_RING_MIN (1024*1024)
+/* Messages that pass through other sites are forwarded in chunks of this many bytes, so
+ * that the next link starts carrying them while the previous one still does. */
+#define MPW_COLL_CHUNK (1024*1024)
+
+/** Communicator
+ * A group of sites that perform collective operations together, made of the paths from
+ * this site to each of the others. The operations post requests on all the paths they
+ * use at once, so that every link is busy at the same time. A communicator is used by
+ * one thread at a time.
+ */
+class Communicator
+{
+ public:
+  // paths[r]: the path to the site of rank r (paths[rank] is not used).
+  Communicator(int rank, const std::vector<int> &paths);
+
+  // Each returns 0, or a negative errno value. Sizes are per site.
+  int bcast(char *buf, long long int size, int root);
+  int gather(const char *sendbuf, long long int size, char *recvbuf, int root);
+  int allgather(const char *sendbuf, long long int size, char *recvbuf);
+  int alltoall(const char *sendbuf, long long int size, char *recvbuf);
+  // Reductions of count elements of type with op (see Reduction).
+  int reduce(const void *sendbuf, void *recvbuf, long long int count, int type, int op, int root);
+  int allreduce(const void *sendbuf, void *recvbuf, long long int count, int type, int op);
+
+  int rank, sites;
+  std::vector<int> paths;
+
+  // Register a communicator and return its id (-ENOMEM if none is left).
+  static int add(Communicator *comm);
+  // The communicator with this id, or NULL.
+  static Communicator *get(int id);
+  // Free a communicator. Returns 0, or -EINVAL.
+  static int remove(int id);
+
+ private:
+  // Receive buf from the site of rank parent (-1: none) in chunks, and pass each chunk on
+  // to the children as soon as it has arrived.
+  int relay(char *buf, long long int size, long long int chunk, int parent, const std::vector<int> &children);
+  // Ring algorithms on the blocks of buf, block b spanning offset[b] .. offset[b + 1].
+  // Elements of unit bytes are brought into our byte order as they arrive.
+  // Afterwards, this site holds the reduction of block rank + 1 of all sites.
+  int ringReduceScatter(char *acc, char *tmp, const std::vector<long long int> &offset, int unit, int type, int op);
+  // This site starts with block rank + first, and ends up with all of them.
+  int ringAllgather(char *buf, const std::vector<long long int> &offset, int first, int unit);
+  // Combine the vectors of all sites into acc in rank order, so that all sites that do so get
+  // the same result. That of site r is at tmp + r * count elements, once reqs[r] has completed.
+  int combineAll(char *acc, char *tmp, std::vector<int> &reqs, long long int count, int type, int op, int ret);
+};
+
+#endif
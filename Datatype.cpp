@@ -0,0 +1,236 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "Datatype.h"
+
+#include <algorithm>
+#include <climits>
+#include <errno.h>
+#include <pthread.h>
+
+/* The base types, by id. */
+static const Datatype base_types[] = {
+  Datatype(1), Datatype(2), Datatype(4), Datatype(8), Datatype(sizeof(float)), Datatype(sizeof(double))
+};
+
+/* The derived types, by id - MPW_TYPE_DERIVED (NULL: free). */
+static pthread_mutex_t types_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<Datatype*> derived;
+
+Datatype::Datatype(int unit) : unit(unit), size(unit), lb(0), extent(unit)
+{
+  DatatypeRun r = { 0, unit };
+  runs.push_back(r);
+}
+
+void Datatype::append(long long int offset, long long int length)
+{
+  if (length <= 0)
+    return;
+  if (!runs.empty() && runs.back().offset + runs.back().length == offset) {
+    runs.back().length += length;
+  } else {
+    DatatypeRun r = { offset, length };
+    runs.push_back(r);
+  }
+  size += length;
+}
+
+void Datatype::place(const Datatype &old, long long int offset)
+{
+  for (size_t i = 0; i < old.runs.size(); i++) {
+    append(offset + old.runs[i].offset, old.runs[i].length);
+  }
+}
+
+bool Datatype::contiguous() const
+{
+  return runs.size() == 1 && runs[0].offset == 0 && runs[0].length == extent;
+}
+
+/* A type spans its blocks of old elements: from the first one at first to the end of
+ * the last one at last, both in elements of old (first > last: no blocks). */
+static Datatype *finish(Datatype *t, const Datatype &old, long long int first, long long int last)
+{
+  if (first > last) {
+    t->lb = 0;
+    t->extent = 0;
+  } else {
+    t->lb = old.lb + first * old.extent;
+    t->extent = (last - first) * old.extent;
+  }
+  return t;
+}
+
+Datatype *Datatype::vector(long long int count, long long int blocklength, long long int stride, const Datatype &old)
+{
+  if (count < 0 || blocklength < 0 || stride < 0) {
+    return NULL;
+  }
+  Datatype *t = new Datatype(old.unit);
+  t->runs.clear();
+  t->size = 0;
+  for (long long int i = 0; i < count; i++) {
+    for (long long int j = 0; j < blocklength; j++) {
+      t->place(old, (i * stride + j) * old.extent);
+    }
+  }
+  if (count == 0 || blocklength == 0) {
+    return finish(t, old, 1, 0);
+  }
+  return finish(t, old, 0, (count - 1) * stride + blocklength);
+}
+
+Datatype *Datatype::indexed(int count, const long long int *blocklengths, const long long int *displacements,
+                            const Datatype &old)
+{
+  if (count < 0 || (count > 0 && (blocklengths == NULL || displacements == NULL))) {
+    return NULL;
+  }
+  Datatype *t = new Datatype(old.unit);
+  t->runs.clear();
+  t->size = 0;
+  long long int first = LLONG_MAX, last = LLONG_MIN;
+  for (int i = 0; i < count; i++) {
+    if (blocklengths[i] < 0 || displacements[i] < 0) {
+      delete t;
+      return NULL;
+    }
+    for (long long int j = 0; j < blocklengths[i]; j++) {
+      t->place(old, (displacements[i] + j) * old.extent);
+    }
+    if (blocklengths[i] > 0) {
+      first = std::min(first, displacements[i]);
+      last = std::max(last, displacements[i] + blocklengths[i]);
+    }
+  }
+  return finish(t, old, first, last);
+}
+
+Datatype *Datatype::subarray(int ndims, const long long int *sizes, const long long int *subsizes,
+                             const long long int *starts, const Datatype &old)
+{
+  if (ndims < 1 || sizes == NULL || subsizes == NULL || starts == NULL) {
+    return NULL;
+  }
+  // Elements of old between consecutive indices in each dimension.
+  std::vector<long long int> stride(ndims);
+  long long int elements = 1;
+  for (int d = ndims - 1; d >= 0; d--) {
+    if (sizes[d] < 1 || subsizes[d] < 0 || starts[d] < 0 || starts[d] + subsizes[d] > sizes[d]) {
+      return NULL;
+    }
+    stride[d] = elements;
+    elements *= sizes[d];
+  }
+  Datatype *t = new Datatype(old.unit);
+  t->runs.clear();
+  t->size = 0;
+  std::vector<long long int> index(ndims, 0);
+  bool empty = false;
+  for (int d = 0; d < ndims; d++) {
+    empty = empty || subsizes[d] == 0;
+  }
+  while (!empty) {
+    long long int first = 0;
+    for (int d = 0; d < ndims; d++) {
+      first += (starts[d] + index[d]) * stride[d];
+    }
+    for (long long int j = 0; j < subsizes[ndims - 1]; j++) {
+      t->place(old, (first + j) * old.extent);
+    }
+    // Next line of the last dimension, in C order.
+    int d = ndims - 2;
+    while (d >= 0 && ++index[d] == subsizes[d]) {
+      index[d--] = 0;
+    }
+    empty = d < 0;
+  }
+  // The subarray spans the whole array, so that consecutive ones follow each other.
+  t->extent = elements * old.extent;
+  return t;
+}
+
+void Datatype::layout(char *base, long long int count, std::vector<struct iovec> &iov) const
+{
+  for (long long int i = 0; i < count; i++) {
+    for (size_t j = 0; j < runs.size(); j++) {
+      char *start = base + i * extent + runs[j].offset;
+      if (!iov.empty() && (char *) iov.back().iov_base + iov.back().iov_len == start) {
+        iov.back().iov_len += runs[j].length;
+      } else {
+        struct iovec v = { start, (size_t) runs[j].length };
+        iov.push_back(v);
+      }
+    }
+  }
+}
+
+int Datatype::add(Datatype *type)
+{
+  pthread_mutex_lock(&types_lock);
+  size_t i = 0;
+  while (i < derived.size() && derived[i] != NULL) {
+    i++;
+  }
+  if (i >= (size_t) (INT_MAX - MPW_TYPE_DERIVED)) {
+    pthread_mutex_unlock(&types_lock);
+    delete type;
+    return -ENOMEM;
+  }
+  if (i == derived.size()) {
+    derived.push_back(type);
+  } else {
+    derived[i] = type;
+  }
+  pthread_mutex_unlock(&types_lock);
+  return MPW_TYPE_DERIVED + (int) i;
+}
+
+const Datatype *Datatype::get(int id)
+{
+  if (id >= 0 && id < (int) (sizeof(base_types) / sizeof(base_types[0]))) {
+    return &base_types[id];
+  }
+  const Datatype *t = NULL;
+  pthread_mutex_lock(&types_lock);
+  if (id >= MPW_TYPE_DERIVED && id - MPW_TYPE_DERIVED < (int) derived.size()) {
+    t = derived[id - MPW_TYPE_DERIVED];
+  }
+  pthread_mutex_unlock(&types_lock);
+  return t;
+}
+
+int Datatype::remove(int id)
+{
+  Datatype *t = NULL;
+  pthread_mutex_lock(&types_lock);
+  if (id >= MPW_TYPE_DERIVED && id - MPW_TYPE_DERIVED < (int) derived.size()) {
+    t = derived[id - MPW_TYPE_DERIVED];
+    derived[id - MPW_TYPE_DERIVED] = NULL;
+  }
+  pthread_mutex_unlock(&types_lock);
+  if (t == NULL) {
+    return -EINVAL;
+  }
+  delete t;
+  return 0;
+}
@@ -0,0 +1,83 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#ifndef MPW_Datatype_class
+#define MPW_Datatype_class
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+
+/* Ids of the base types (MPW_BYTE .. MPW_DOUBLE) are below this one, those of derived types from it on. */
+#define MPW_TYPE_DERIVED 16
+
+/* A run of contiguous bytes of an element, at offset from its start. */
+struct DatatypeRun {
+  long long int offset, length;
+};
+
+/** Datatype
+ * The layout of the elements of a type: the runs of contiguous bytes of one element,
+ * the number of data bytes in it and its extent, the distance from one element to the
+ * next. Derived types are built from an old type the way MPI builds its derived
+ * datatypes, and are numbered from MPW_TYPE_DERIVED on; like in MPI, an element spans
+ * its blocks of old elements from lb on, whatever part of those the runs cover. All
+ * elements consist of items of the same base type, whose size is the unit of the type.
+ */
+class Datatype
+{
+ public:
+  // A base type of unit bytes.
+  explicit Datatype(int unit);
+
+  // count blocks of blocklength elements of old, stride elements apart.
+  static Datatype *vector(long long int count, long long int blocklength, long long int stride, const Datatype &old);
+  // count blocks of blocklengths[i] elements of old, at displacements[i] elements.
+  static Datatype *indexed(int count, const long long int *blocklengths, const long long int *displacements,
+                           const Datatype &old);
+  // The block of subsizes elements at starts of an array of sizes elements of old, in C order.
+  static Datatype *subarray(int ndims, const long long int *sizes, const long long int *subsizes,
+                            const long long int *starts, const Datatype &old);
+
+  // Whether an element is one run that fills its extent.
+  bool contiguous() const;
+
+  // Append the runs of count elements at base to iov, merging runs that touch.
+  void layout(char *base, long long int count, std::vector<struct iovec> &iov) const;
+
+  int unit;
+  long long int size, lb, extent;
+  std::vector<DatatypeRun> runs;
+
+  // Register a derived type and return its id (-ENOMEM if none is left).
+  static int add(Datatype *type);
+  // The type with this id, or NULL.
+  static const Datatype *get(int id);
+  // Free a derived type. Returns 0, or -EINVAL.
+  static int remove(int id);
+
+ private:
+  void append(long long int offset, long long int length);
+  // Add the runs of one element of old at offset.
+  void place(const Datatype &old, long long int offset);
+};
+
+#endif
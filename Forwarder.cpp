@@ -25,12 +25,24 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 #include <iostream>
 
 using namespace std;
 
 #include "MPWide.h"
 
+struct PathSetup {
+  int path;
+  int status;
+};
+
+static void *connectPath(void *args) {
+  PathSetup *s = (PathSetup *) args;
+  s->status = MPW_ConnectPath(s->path, true);
+  return NULL;
+}
+
 int main(int argc, char** argv){
 
   string source_host[8];
@@ -39,7 +51,6 @@ int main(int argc, char** argv){
   int dest_baseport[8];
   int streams[8];
   int numcon = 0; //number of topological connections.
-  int size = 0;
 
   for(int i = 0; i<8 ; i++) {
     cout << "Enter source host ip (or 'done' if no other streams need to be defined):" << endl;
@@ -58,43 +69,58 @@ int main(int argc, char** argv){
     cin >> streams[i];
   
     numcon++;
-    size += streams[i];
   }
 
-  string *hosts = new string[size*2];
-  int ports[size*2];
-
-  int offset = 0;
+  /* Each side of a connection is a path: its streams share the base port, like those of the endpoints.
+   * The paths are marked for forwarding, so that the endpoints exchange their byte orders through them. */
+  PathSetup source[8];
+  PathSetup dest[8];
   for(int i=0 ; i<numcon; i++) {
-    for(int j=0 ; j<streams[i]; j++) {
-      hosts[     offset+j] = source_host[i];
-      hosts[size+offset+j] = dest_host[i];
-      ports[     offset+j] = source_baseport[i]+j;
-      ports[size+offset+j] = dest_baseport[i]+j;
-
-      cout << source_host[i] << ":" << source_baseport[i]+j << " " << dest_host[i] << ":" << dest_baseport[i]+j << endl;
+    source[i].path = MPW_CreatePathWithoutConnect(source_host[i], source_baseport[i], streams[i]);
+    dest[i].path = MPW_CreatePathWithoutConnect(dest_host[i], dest_baseport[i], streams[i]);
+    if(source[i].path < 0 || dest[i].path < 0) {
+      cerr << "Could not create the paths of connection " << i << "." << endl;
+      return 1;
     }
-    offset += streams[i];
+    MPW_setPathForwarding(source[i].path, true);
+    MPW_setPathForwarding(dest[i].path, true);
+    cout << source_host[i] << ":" << source_baseport[i] << " " << dest_host[i] << ":" << dest_baseport[i] << " " << streams[i] << " streams" << endl;
   }
 
   cout << "Initializing..." << endl;
 
-  MPW_Init(hosts,ports,size*2);
-  delete [] hosts;
-
-//  MPW_TinyTest();
+  /* Connect all paths at once, as the endpoints may come up in any order. */
+  pthread_t threads[16];
+  for(int i=0 ; i<numcon; i++) {
+    pthread_create(&threads[2*i], NULL, connectPath, &source[i]);
+    pthread_create(&threads[2*i+1], NULL, connectPath, &dest[i]);
+  }
+  bool connected = true;
+  for(int i=0 ; i<numcon; i++) {
+    pthread_join(threads[2*i], NULL);
+    pthread_join(threads[2*i+1], NULL);
+    connected = connected && source[i].status >= 0 && dest[i].status >= 0;
+  }
+  if(!connected) {
+    cerr << "Could not connect all paths." << endl;
+    return 1;
+  }
 
   cerr << "\nStarting Relay Service.\n" << endl;
 
-  int channels[size];
-  int channels2[size];
+  int paths[8];
+  int paths2[8];
 
-  for(int i=0; i<size; i++) {
-    channels[i] = i;
-    channels2[i] = i+size;
+  for(int i=0; i<numcon; i++) {
+    paths[i] = source[i].path;
+    paths2[i] = dest[i].path;
   }
-  MPW_Relay(channels, channels2, size);
+  MPW_RelayPaths(paths, paths2, numcon);
 
+  for(int i=0; i<numcon; i++) {
+    MPW_DestroyPath(paths[i]);
+    MPW_DestroyPath(paths2[i]);
+  }
   MPW_Finalize();
 
 
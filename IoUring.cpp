@@ -0,0 +1,251 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "IoUring.h"
+
+#ifdef MPW_HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <iostream>
+
+#include "mpwide-macros.h"
+
+/* The queue indices are shared with the kernel. */
+#define URING_LOAD(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define URING_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+IoUring::IoUring(unsigned entries, unsigned max_files) :
+  ring_fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sq_size(0), cq_size(0),
+  sqes((struct io_uring_sqe *) MAP_FAILED), sqes_size(0), sqe_tail(0), submitted(0)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  const int fd = uring_setup(entries, &p);
+  if(fd < 0) {
+    LOG_DEBUG("io_uring_setup failed: " << strerror(errno));
+    return;
+  }
+  // The completion wait needs a timeout, which requires IORING_ENTER_EXT_ARG (Linux 5.11).
+  if(!(p.features & IORING_FEAT_EXT_ARG)) {
+    LOG_DEBUG("io_uring lacks IORING_FEAT_EXT_ARG; not using it.");
+    ::close(fd);
+    return;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size = cq_size = max(sq_size, cq_size);
+  }
+  sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(sq_ptr != MAP_FAILED) {
+    cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ptr
+           : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  if(cq_ptr != MAP_FAILED) {
+    sqes = (struct io_uring_sqe *) mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  }
+  if(sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+    LOG_WARN("io_uring: cannot map the queues: " << strerror(errno));
+    ring_fd = fd;
+    release();
+    return;
+  }
+
+  char *sq = (char *) sq_ptr;
+  char *cq = (char *) cq_ptr;
+  sq_head    = (unsigned *)(sq + p.sq_off.head);
+  sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+  sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+  sq_array   = (unsigned *)(sq + p.sq_off.array);
+  cq_head    = (unsigned *)(cq + p.cq_off.head);
+  cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+  cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  sqe_tail = submitted = *sq_tail;
+  ring_fd = fd;
+
+  /* Start with an empty (sparse) table of fixed files; sockets are added as they are used. */
+  if(max_files > 0) {
+    std::vector<int> fds(max_files, -1);
+    if(uring_register(ring_fd, IORING_REGISTER_FILES, &fds[0], max_files) == 0) {
+      for(int i = max_files - 1; i >= 0; i--) {
+        free_slots.push_back(i);
+      }
+    } else {
+      LOG_DEBUG("io_uring: no fixed files: " << strerror(errno));
+    }
+  }
+}
+
+IoUring::~IoUring()
+{
+  release();
+}
+
+void IoUring::release()
+{
+  if(sqes != MAP_FAILED) {
+    munmap(sqes, sqes_size);
+  }
+  if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+    munmap(cq_ptr, cq_size);
+  }
+  if(sq_ptr != MAP_FAILED) {
+    munmap(sq_ptr, sq_size);
+  }
+  sqes = (struct io_uring_sqe *) MAP_FAILED;
+  sq_ptr = cq_ptr = MAP_FAILED;
+  if(ring_fd >= 0) {
+    ::close(ring_fd);
+  }
+  ring_fd = -1;
+}
+
+bool IoUring::available()
+{
+  static int result = -1;
+  if(result < 0) {
+    IoUring probe(4, 0);
+    result = probe.valid() ? 1 : 0;
+  }
+  return result == 1;
+}
+
+struct io_uring_sqe *IoUring::getSqe()
+{
+  if(sqe_tail - URING_LOAD(sq_head) >= *sq_entries) {
+    return NULL;
+  }
+  struct io_uring_sqe *sqe = &sqes[sqe_tail & *sq_mask];
+  sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+unsigned IoUring::freeSqes() const
+{
+  return *sq_entries - (sqe_tail - URING_LOAD(sq_head));
+}
+
+int IoUring::submit(unsigned wait_nr, int timeout_ms)
+{
+  for(unsigned i = submitted; i != sqe_tail; i++) {
+    sq_array[i & *sq_mask] = i & *sq_mask;
+  }
+  URING_STORE(sq_tail, sqe_tail);
+  const unsigned to_submit = sqe_tail - submitted;
+  submitted = sqe_tail;
+
+  if(to_submit == 0 && wait_nr == 0) {
+    return 0;
+  }
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+  if(wait_nr > 0 && timeout_ms >= 0) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (__u64)(unsigned long) &ts;
+    ret = uring_enter(ring_fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  } else {
+    ret = uring_enter(ring_fd, to_submit, wait_nr, flags, NULL, _NSIG / 8);
+  }
+  if(ret < 0) {
+    // A timeout or signal simply ends the wait; the entries have been consumed regardless.
+    if(errno == ETIME || errno == EINTR) {
+      return 0;
+    }
+    LOG_ERR("io_uring_enter failed: " << strerror(errno));
+    return -errno;
+  }
+  return ret;
+}
+
+int IoUring::reap(struct io_uring_cqe *out, int maxcqes)
+{
+  unsigned head = *cq_head;
+  const unsigned tail = URING_LOAD(cq_tail);
+  int n = 0;
+  while(head != tail && n < maxcqes) {
+    out[n++] = cqes[head & *cq_mask];
+    head++;
+  }
+  URING_STORE(cq_head, head);
+  return n;
+}
+
+int IoUring::registerFile(int fd)
+{
+  if(free_slots.empty()) {
+    return -1;
+  }
+  const int slot = free_slots.back();
+  struct io_uring_files_update up;
+  memset(&up, 0, sizeof(up));
+  up.offset = slot;
+  up.fds = (__u64)(unsigned long) &fd;
+  if(uring_register(ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1) {
+    LOG_DEBUG("io_uring: cannot register fd " << fd << ": " << strerror(errno));
+    return -1;
+  }
+  free_slots.pop_back();
+  return slot;
+}
+
+void IoUring::unregisterFile(int slot)
+{
+  if(slot < 0) {
+    return;
+  }
+  int fd = -1;
+  struct io_uring_files_update up;
+  memset(&up, 0, sizeof(up));
+  up.offset = slot;
+  up.fds = (__u64)(unsigned long) &fd;
+  uring_register(ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+  free_slots.push_back(slot);
+}
+
+#endif // MPW_HAVE_IO_URING
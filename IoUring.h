@@ -0,0 +1,96 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#ifndef MPW_IoUring_class
+#define MPW_IoUring_class
+
+/* io_uring is used through the raw system calls, so only the kernel headers are needed. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG)
+#define MPW_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef MPW_HAVE_IO_URING
+
+#include <sys/types.h>
+#include <vector>
+
+/** IoUring
+ * A minimal io_uring instance: a submission and completion queue shared with
+ * the kernel, plus a table of registered (fixed) files. Not thread-safe; each
+ * ProgressEngine owns one.
+ */
+class IoUring
+{
+ public:
+  IoUring(unsigned entries, unsigned max_files);
+  ~IoUring();
+
+  // False if the kernel does not support io_uring (or a feature we need).
+  bool valid() const { return ring_fd >= 0; }
+
+  // Check once whether io_uring can be used in this process.
+  static bool available();
+
+  // A cleared submission entry, or NULL if the submission queue is full.
+  struct io_uring_sqe *getSqe();
+  unsigned freeSqes() const;
+
+  // Submit all prepared entries and wait for at least wait_nr completions or
+  // timeout_ms (-1: no timeout). Returns the number submitted, or a negative errno.
+  int submit(unsigned wait_nr, int timeout_ms);
+
+  // Move up to maxcqes completions to out. Returns the number moved.
+  int reap(struct io_uring_cqe *out, int maxcqes);
+
+  // Register fd as a fixed file. Returns its slot, or -1 if the plain fd must be used.
+  int registerFile(int fd);
+  void unregisterFile(int slot);
+
+ private:
+  IoUring(const IoUring &);
+  IoUring &operator=(const IoUring &);
+  void release();
+
+  int ring_fd;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  unsigned sqe_tail;  // entries handed out by getSqe().
+  unsigned submitted; // entries published to the kernel.
+
+  std::vector<int> free_slots;
+};
+
+#endif // MPW_HAVE_IO_URING
+
+#endif
@@ -20,6 +20,14 @@
  * **************************************************************/
 #include "MPWide.h"
 #include "Socket.h"
+#include "ProgressEngine.h"
+#include "Acceptor.h"
+#include "Resolver.h"
+#include "Codec.h"
+#include "Checksum.h"
+#include "Datatype.h"
+#include "Communicator.h"
+#include "Relay.h"
 
 #include <iostream>
 #include <fstream>
@@ -28,8 +36,14 @@
 #include <sys/time.h>
 #include <pthread.h>
 #include <cstdlib>
+#include <climits>
 #include <vector>
+#include <list>
+#include <set>
+#include <map>
 #include <unistd.h>
+#include <poll.h>
+#include <sched.h>
 
 #include "serialization.h"
 #include "mpwide-macros.h"
@@ -37,6 +51,10 @@
 // forward declarations
 class MPWPath;
 struct thread_tmp;
+class TagMux;
+static void deleteTagMux(TagMux *mux);
+static void closeRequests();
+void EraseStream(int stream);
 
 bool MPWideAutoTune = true;
 
@@ -47,8 +65,11 @@ static int *isclient = NULL;
 static Socket **client = NULL;
 static std::string *remote_url = NULL;
 
-/* global thread memory */
-static thread_tmp** ta = NULL;
+/* path id of each stream (-1 if the stream is not part of a path) */
+static int *stream_path = NULL;
+
+/* rate limit for the data sent on each stream */
+static TokenBucket **stream_pacer = NULL;
 
 // length of all the above vectors:
 static int num_streams = 0;
@@ -57,27 +78,219 @@ static int num_streams = 0;
 static MPWPath **paths = NULL;
 static int num_paths = 0;
 
-/* Send and Recv occurs in chunks of size tcpbuf_ssize/rsize.
- * Setting this to 1MB or higher gave problems with Amsterdam-Drexel test. */
-static int tcpbuf_ssize = 8*1024;
-static int tcpbuf_rsize = 8*1024;
+/* Guards the stream and path tables above. Slots are taken and given back with the write
+ * lock held; exchanges only look their path up, under the read lock, so that threads using
+ * different paths do not wait for each other. Each stream slot is only written by the path
+ * (or MPW_Init call) that holds it. */
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Returns the path with this id, or NULL if there is none. */
+static MPWPath *getPath(int path)
+{
+  pthread_rwlock_rdlock(&table_lock);
+  MPWPath *p = (path >= 0 && path < num_paths) ? paths[path] : NULL;
+  pthread_rwlock_unlock(&table_lock);
+  return p;
+}
+
+/* Send and Recv occurs in chunks of at most tcpbuf_ssize/rsize. Each stream picks its
+ * own chunk size within that, following the free space in its socket buffers: fixed
+ * chunks of 1MB or higher gave problems with Amsterdam-Drexel test. */
+static int tcpbuf_ssize = 4*1024*1024;
+static int tcpbuf_rsize = 4*1024*1024;
 static int relay_ssize = 8*1024;
 static int relay_rsize = 8*1024;
 
+/* Maximum number of worker threads per path. -1 means one per processor core. */
+static int max_path_workers = -1;
+
+/* Drive the streams through io_uring instead of epoll (MPW_BACKEND_IO_URING). */
+static bool use_io_uring = false;
+
+/* Idle streams of destroyed client paths, kept for reuse by a later path to the same
+ * host and port (see MPW_setPathPool). Server-side streams are parked in the Acceptor. */
+struct PooledPath {
+  std::string host;
+  int port;
+  std::vector<int> fds;
+  long long int expires;
+};
+static std::list<PooledPath> path_pool;
+static pthread_mutex_t path_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int path_pool_max = 0;         // maximum number of idle streams (0: no pool).
+static double path_pool_idle = 60.0;  // seconds an idle stream is kept.
+
+/* Chunk size of paths that stripe their messages dynamically. Chunk headers
+ * carry the length in 32 bits, which the largest chunk size leaves room for. */
+static const long long int default_stripe_chunk = 256*1024;
+static const long long int max_stripe_chunk = 1024*1024*1024;
+
+/* Paths with checksums send a CRC32C after every chunk of this many bytes. */
+#define MPW_CHECKSUM_CHUNK (64*1024)
+
+/* Time allowed for connecting the streams of a path, in seconds (<= 0: no limit). */
+static const double default_connect_timeout = 10.0;
+
+/* Connect retries start after 10 ms and back off to at most 500 ms. */
+static const long long int connect_backoff_min = 10*1000*1000LL;
+static const long long int connect_backoff_max = 500*1000*1000LL;
+
+/* Sample the TCP state of a stream. */
+static int sampleTcp(const Socket *s, int stream, MPW_TcpInfo *out)
+{
+  TcpStats st;
+  const int ret = s->tcpStats(st);
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  out->time          = tv.tv_sec + 1.0e-6*tv.tv_usec;
+  out->stream        = stream;
+  out->rtt_us        = st.rtt_us;
+  out->rttvar_us     = st.rttvar_us;
+  out->min_rtt_us    = st.min_rtt_us;
+  out->cwnd          = st.cwnd;
+  out->ssthresh      = st.ssthresh;
+  out->mss           = st.mss;
+  out->retransmits   = st.retransmits;
+  out->lost          = st.lost;
+  out->unacked_bytes = st.unacked_bytes;
+  out->notsent_bytes = st.notsent_bytes;
+  out->delivery_rate = st.delivery_rate;
+  out->pacing_rate   = st.pacing_rate;
+  return ret;
+}
+
+/* Records the TCP state of the streams of a path into a ring, from its own thread. */
+class TcpRecorder {
+public:
+  TcpRecorder(Socket **socks, int n, double interval, int capacity)
+  : socks(socks, socks + n), interval(interval), ring(capacity), next(0), count(0), stopping(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    running = pthread_create(&thread, NULL, loop, this) == 0;
+  }
+  ~TcpRecorder() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    if (running) {
+      pthread_join(thread, NULL);
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+  bool started() const { return running; }
+
+  int copy(MPW_TcpInfo *out, int max) {
+    pthread_mutex_lock(&lock);
+    const int n = min(max, count);
+    const int cap = ring.size();
+    for (int i = 0; i < n; i++) {
+      out[i] = ring[(next - count + i + cap) % cap];
+    }
+    pthread_mutex_unlock(&lock);
+    return n;
+  }
+
+private:
+  static void *loop(void *args) {
+    TcpRecorder *r = (TcpRecorder *) args;
+    const int cap = r->ring.size();
+    MPW_TcpInfo sample;
+    pthread_mutex_lock(&r->lock);
+    while (!r->stopping) {
+      for (size_t i = 0; i < r->socks.size(); i++) {
+        if (sampleTcp(r->socks[i], i, &sample) == 0) {
+          r->ring[r->next] = sample;
+          r->next = (r->next + 1) % cap;
+          r->count = min(r->count + 1, cap);
+        }
+      }
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      const long long int ns = until.tv_nsec + (long long int) (r->interval * 1e9);
+      until.tv_sec += ns / 1000000000LL;
+      until.tv_nsec = ns % 1000000000LL;
+      while (!r->stopping && pthread_cond_timedwait(&r->cond, &r->lock, &until) == 0) {}
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+  }
+
+  std::vector<Socket*> socks;
+  double interval;
+  std::vector<MPW_TcpInfo> ring;
+  int next, count;
+  bool stopping, running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* The compression stage of a path: its mode, and what it has measured of its own speed
+ * and of the link (exponential averages, 0 until measured). */
+struct CompressionState {
+  CompressionState()
+  : mode(MPW_COMPRESS_OFF), messages(0), compressed(0), raw_bytes(0), wire_bytes(0),
+    ratio(0), compress_rate(0), decompress_rate(0), link_rate(0), since_probe(0), active(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+  }
+  ~CompressionState() { pthread_mutex_destroy(&lock); }
+
+  int getMode();
+  // Whether to compress an outgoing message of size bytes.
+  bool choose(long long int size);
+  // Account for an exchange: size bytes sent as wire bytes, link_bytes moved in link_ns, and
+  // decompressed bytes received compressed. Times in ns.
+  void sample(long long int size, long long int wire, bool was_compressed, long long int compress_ns,
+              long long int link_bytes, long long int link_ns, long long int decompressed, long long int decompress_ns);
+
+  int mode;
+  long long int messages, compressed, raw_bytes, wire_bytes;
+  double ratio, compress_rate, decompress_rate, link_rate;
+  int since_probe; // messages sent uncompressed since the last compressed one.
+  bool active;
+  pthread_mutex_t lock;
+
+ private:
+  CompressionState(const CompressionState &);
+  CompressionState &operator=(const CompressionState &);
+};
+
 /* PATH-specific definitions */
 class MPWPath {
 public:
   std::string remote_url; // end-point of the path
   int *streams; // id numbers of the streams used
   int num_streams; // number of streams
+  WorkerPool *pool; // worker threads that drive the streams, created when the path connects.
+  long long int zerocopy_threshold; // sends of at least this size use MSG_ZEROCOPY (0: disabled).
+  TokenBucket pacer; // rate limit for the sum of the streams.
+  double stream_rate; // rate limit per stream (0: the global pacing rate, -1: none).
+  bool kernel_pacing; // stream rates are enforced by the kernel (SO_MAX_PACING_RATE).
+  double connect_timeout; // deadline for connecting the streams, in seconds (<= 0: none).
+  double setup_time; // seconds the last MPW_ConnectPath took.
+  TcpRecorder *recorder; // samples the TCP state of the streams (NULL: not recording).
+  std::string congestion; // TCP congestion control of the streams ("": the system default).
+  long long int stripe_chunk; // messages are striped in chunks of this size (0: in one slice per stream).
+  TagMux *mux; // receives the tagged messages of the path (NULL: none used yet).
+  long long int checksum_chunk; // every chunk of this many bytes is followed by its CRC32C (0: no checksums).
+  bool forwarding; // the path is relayed (MPW_setPathForwarding), and leaves the byte order to the endpoints.
+  bool peer_big_endian; // byte order of the other end, as it announced it after connecting.
+  CompressionState compression;
   
   MPWPath(std::string remote_url, int* str, int numstr)
-  : remote_url(remote_url), num_streams(numstr)
+  : remote_url(remote_url), num_streams(numstr), pool(NULL), zerocopy_threshold(0),
+    pacer(-1), stream_rate(0), kernel_pacing(false),
+    connect_timeout(default_connect_timeout), setup_time(0), recorder(NULL), stripe_chunk(0), mux(NULL),
+    checksum_chunk(0), forwarding(false), peer_big_endian(host_big_endian())
   {
     streams = new int[numstr];
     memcpy(streams, str, num_streams*sizeof(int));
   }
-  ~MPWPath() { delete [] streams; }
+  ~MPWPath() { deleteTagMux(mux); delete recorder; delete pool; delete [] streams; }
 };
 
 /* thread information */
@@ -93,24 +306,48 @@ struct thread_tmp {
 };
 
 /* socket startup information */
+enum { INIT_CONNECTING, INIT_HANDSHAKE, INIT_AWAIT_ACK, INIT_RETRY, INIT_LISTENING, INIT_CONNECTED, INIT_FAILED };
 struct init_tmp {
   int stream;
   Socket *sock;
   int port;
   int cport;
-  bool server_wait;
-  bool connected;
+  int state;               // INIT_*
+  long long int retry_at;  // time of the next connect attempt (INIT_RETRY).
+  long long int backoff;   // delay before the next connect attempt.
+  bool handshake;          // the stream shares the server port with others and must name itself.
+  bool reused;             // the connection comes from the path pool.
+  int hs_sent;             // bytes of hs sent so far.
+  unsigned char hs[MPW_HANDSHAKE_SIZE];
 };
 
+
 /** MPW_PacingMode
-  * MPWide is able to have PacingMode either enabled or disabled. By default, the PacingMode is enabled, and MPWide will insert very 
-  * short usleep messages between communication calls. These usleep statements often help reduce the chance of overflowing the transfer 
-  * buffers of local network interfaces, which in turn result in worse and less stable performance.
+  * MPWide is able to have PacingMode either enabled or disabled. By default, the PacingMode is enabled, and MPWide will limit 
+  * the rate at which each stream sends with a token bucket: a stream only waits when it has used up its budget. Pacing 
+  * often helps reduce the chance of overflowing the transfer buffers of local network interfaces, which in turn result 
+  * in worse and less stable performance. Paths can also limit the sum of their streams, or leave the per-stream pacing to the kernel.
   */
 #if MPW_PacingMode == 1
   static double pacing_rate = 100*1024*1024; //Pacing rate per stream. This is the maximum throughput in bytes/sec possible for each stream.
-  static useconds_t pacing_sleeptime = useconds_t(1000000/(pacing_rate/(1.0*tcpbuf_ssize))); //Sleep time for SendRecvs in microseconds.
 
+  /* Configure the pacer of a stream from the global and path settings. Called by the
+   * owner of the stream, or with table_lock held.
+   * Returns true if the kernel paces the stream. */
+  static bool applyPacing(int stream)
+  {
+    const int path = stream_path[stream];
+    double rate = pacing_rate;
+    if (path >= 0 && paths[path]->stream_rate != 0)
+      rate = paths[path]->stream_rate;
+
+    if (path >= 0 && paths[path]->kernel_pacing && client[stream]->is_valid() && client[stream]->setMaxPacingRate(rate)) {
+      stream_pacer[stream]->setRate(-1);
+      return true;
+    }
+    stream_pacer[stream]->setRate(rate);
+    return false;
+  }
 
 extern "C" {
   double MPW_getPacingRate() {
@@ -118,15 +355,16 @@ extern "C" {
   }
 
   void MPW_setPacingRate(double rate) {
-    if(rate == -1) {
-      pacing_rate = -1;
-      pacing_sleeptime = 0;
+    pacing_rate = rate > 0 ? rate : -1;
+    if(rate > 0) {
+      LOG_INFO("Pacing enabled, rate = " << pacing_rate << " bytes/s per stream.");
     }
-    else {
-      pacing_rate = rate;
-      pacing_sleeptime = useconds_t(1000000/(pacing_rate/(1.0*tcpbuf_ssize)));
-      LOG_INFO("Pacing enabled, rate = " << pacing_rate << " => delay = " << pacing_sleeptime << " us.");
+    pthread_rwlock_rdlock(&table_lock);
+    for(int i = 0; i < num_streams; i++) {
+      if(client[i])
+        applyPacing(i);
     }
+    pthread_rwlock_unlock(&table_lock);
   }
 }
 
@@ -134,11 +372,13 @@ extern "C" {
   static void autotunePacingRate()
   {
     int max_streams = 0;
+    pthread_rwlock_rdlock(&table_lock);
     for(int i = 0; i < num_paths; i++)
     {
       if (paths[i] && paths[i]->num_streams > max_streams)
         max_streams = paths[i]->num_streams;
     }
+    pthread_rwlock_unlock(&table_lock);
     
     if (max_streams < 3)
       MPW_setPacingRate(1200*1024*1024);
@@ -186,36 +426,58 @@ static void showSettings()
   double UnpackingTime = 0.0;
 #endif
 
+void MPW_setWorkerThreads(int max_workers) {
+  max_path_workers = max_workers;
+}
+
+int MPW_setTransportBackend(int backend) {
+  use_io_uring = backend == MPW_BACKEND_IO_URING;
+  if (use_io_uring && !ProgressEngine::ioUringAvailable()) {
+    LOG_WARN("io_uring is not available on this system, using the epoll backend instead.");
+    use_io_uring = false;
+  }
+  LOG_DEBUG("Transport backend set to " << (use_io_uring ? "io_uring" : "epoll") << ".");
+  return MPW_getTransportBackend();
+}
+
+int MPW_getTransportBackend() {
+  return use_io_uring ? MPW_BACKEND_IO_URING : MPW_BACKEND_EPOLL;
+}
+
 void MPW_setChunkSize(int sending, int receiving) {
   tcpbuf_ssize = sending;
   tcpbuf_rsize = receiving;
   LOG_DEBUG("Chunk Size  modified to: " << sending << "/" << receiving << ".");
 }
 
-/* MPW_DNSResolve converts a host name to an ip address. */
-char *MPW_DNSResolve(char *host){
-  if(isdigit(host[0])) {
-    return host;
-  }
-  const hostent* host_info = 0 ;
+/* The returned addresses are kept for the lifetime of the library, so callers
+ * in different threads never see each other's results. */
+static pthread_mutex_t resolved_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::set<std::string> *resolved_addrs = NULL;
 
-  for( int i=0; (host_info==0) && (i<4); i++) {
-    host_info = gethostbyname(host);
+/* MPW_DNSResolve converts a host name to an ip address. Returns NULL if the name does not resolve. */
+char *MPW_DNSResolve(char *host){
+  std::string addr;
+  if(Resolver::resolve(host, addr) < 0) {
+    return NULL;
   }
-  if(host_info) {
-    const in_addr* address = (in_addr*)host_info->h_addr_list[0] ;
-    host = (char*) (inet_ntoa(*address));
-    LOG_DEBUG(" address found: " << host);
-    return host;
+  pthread_mutex_lock(&resolved_lock);
+  if(!resolved_addrs) {
+    resolved_addrs = new std::set<std::string>();
   }
-  LOG_ERR("Error: Unable to resolve host name");
-  return NULL;
+  const char *ret = resolved_addrs->insert(addr).first->c_str();
+  pthread_mutex_unlock(&resolved_lock);
+  return (char *) ret;
 }
 
 char *MPW_DNSResolve(std::string host) {
   return MPW_DNSResolve((char *)host.c_str());
 }
 
+void MPW_setDNSCacheTTL(double seconds) {
+  Resolver::setTTL(seconds);
+}
+
 inline int selectSockets(int wchannel, int rchannel, int mask)
 /* Returns:
  0 if no access.
@@ -231,6 +493,7 @@ int MPW_NumChannels(){
 }
 
 #if MONITORING == 1
+/* Bytes moved by all streams; updated by the worker threads of every path. */
 long long int bytes_sent;
 bool stop_monitor = false;
 
@@ -246,7 +509,7 @@ void *MPW_TBandwidth_Monitor(void *args)
   
   while(!stop_monitor) {
     if(old_time != int(GetTime())) {
-      cur_bytes_sent = bytes_sent;
+      cur_bytes_sent = __sync_add_and_fetch(&bytes_sent, 0);
       myfile << "time: " << int(GetTime()) << " bandwidth: " << cur_bytes_sent - old_bytes_sent << std::endl;
       old_bytes_sent = cur_bytes_sent;
       old_time = int(GetTime());
@@ -259,71 +522,6 @@ void *MPW_TBandwidth_Monitor(void *args)
 #endif // ifdef PERF_TIMING
 #endif // MONITORING == 1
 
-/* Initialize a single MPWide TCP stream (used within a pthread). */
-void* MPW_InitStream(void* args) 
-{
-  init_tmp &t = *((init_tmp *) args);
-
-  Socket *sock = t.sock;
-  const int stream = t.stream;
-  const int port = t.port;
-  const int cport = t.cport;
-  const bool server_wait = t.server_wait;
-
-  if(isclient[stream]) {
-    sock->create();
-    /* Patch to bypass firewall problems. */
-    if(cport>0) {
-      LOG_DEBUG("[" << stream << "] Trying to bind as client at " << (cport));
-      int bound = sock->bind(cport);
-    }
-
-    /* End of patch*/
-    t.connected = sock->connect(remote_url[stream],port);
-    LOG_WARN("Server wait & connected " << server_wait << "," << t.connected);
-
-    #if InitStreamTimeOut == 0
-    if (!server_wait) {
-      while(!t.connected) {
-        usleep(50000);
-        t.connected = client[stream].connect(remote_url[stream],port);
-      }
-    }
-    #endif
-    
-    LOG_DEBUG("[" << stream << "] Attempt to connect as client to " << remote_url[stream]
-              <<" at port " << port <<  ": " << t.connected);
-  }
- 
-  if(!t.connected) {
-    sock->close();
-    if (server_wait) {
-      sock->create();
-
-      bool bound = sock->bind(port);
-      LOG_DEBUG("[" << stream << "] Trying to bind as server at " << port << ". Result = " << bound);
-      
-      if (!bound) {
-        LOG_WARN("Bind on ch #"<< stream <<" failed.");
-        sock->close();
-        return NULL;
-      }
-
-      if (sock->listen()) {
-          t.connected = sock->accept();
-          LOG_DEBUG("[" << stream << "] Attempt to act as server: " << t.connected);
-          if (t.connected) { isclient[stream] = 0; }
-      }
-      else {
-        LOG_WARN("Listen on ch #"<< stream <<" failed.");
-        sock->close();
-        return NULL;
-      }
-    }
-  }
-  return NULL;
-}
-
 /* Close down individual streams. */
 void MPW_CloseChannels(int* channel, int numchannels) 
 {
@@ -333,15 +531,17 @@ void MPW_CloseChannels(int* channel, int numchannels)
   }
 }
 
-/* Add new MPWide streams that are associated to a single MPWide Path. */
-void MPW_AddStreams(std::string* url, int* ports, int* cports, const int *stream_indices, const int numstreams) {
+/* Allocate the stream and path tables. Called with table_lock held for writing. */
+static void allocateTables()
+{
   if (client == NULL) {
     client     = new Socket*[MAX_NUM_STREAMS];
     port       = new int[MAX_NUM_STREAMS];
     cport      = new int[MAX_NUM_STREAMS];
     isclient   = new int[MAX_NUM_STREAMS];
     remote_url = new std::string[MAX_NUM_STREAMS];
-    ta         = new thread_tmp*[MAX_NUM_STREAMS];
+    stream_path = new int[MAX_NUM_STREAMS];
+    stream_pacer = new TokenBucket*[MAX_NUM_STREAMS];
     paths      = new MPWPath*[MAX_NUM_PATHS];
 #ifdef PERF_TIMING
 #if MONITORING == 1
@@ -350,18 +550,27 @@ void MPW_AddStreams(std::string* url, int* ports, int* cports, const int *stream
 #endif
 #endif
   }
+}
+
+/* Set up new MPWide streams in slots that have been reserved for them. */
+void MPW_AddStreams(std::string* url, int* ports, int* cports, const int *stream_indices, const int numstreams) {
+  /* Each distinct host is looked up once, all of them at the same time. */
+  std::vector<std::string> addrs(numstreams);
+  if(Resolver::resolveAll(url, &addrs[0], numstreams) < 0) {
+    LOG_ERR("Error: Unable to resolve host name");
+  }
   
   for(int i = 0; i < numstreams; i++) {
     const int stream = stream_indices[i];
 
-    client[stream]     = new Socket();
     port[stream]       = ports[i];
-    ta[stream]         = new thread_tmp;
-    ta[stream]->channel = stream;
+#if MPW_PacingMode == 1
+    applyPacing(stream);
+#endif
 	  LOG_INFO("Stream number " << stream);
-    remote_url[stream] = MPW_DNSResolve(url[i]);
+    remote_url[stream] = addrs[i];
     LOG_DEBUG("MPW_DNSResolve resolves " << url[i] << " to address " << remote_url[stream] << ".");
-    
+
     if(url[i].compare("0") == 0 || url[i].compare("0.0.0.0") == 0) {
       isclient[stream] = 0;
       cport[stream]    = -1;
@@ -375,69 +584,338 @@ void MPW_AddStreams(std::string* url, int* ports, int* cports, const int *stream
   }
 }
 
-int MPW_InitStreams(int *stream_indices, int numstreams, bool server_wait) {
-  pthread_t streams[numstreams];
-  init_tmp t[numstreams];
+/* Start listening for the remote end of a stream. */
+static void InitListen(init_tmp &t)
+{
+  Socket *sock = t.sock;
+  sock->close();
+  sock->create();
+  sock->setFastOpen(MAXCONNECTIONS);
+
+  bool bound = sock->bind(t.port);
+  LOG_DEBUG("[" << t.stream << "] Trying to bind as server at " << t.port << ". Result = " << bound);
+  if (!bound) {
+    LOG_WARN("Bind on ch #"<< t.stream <<" failed.");
+    sock->close();
+    t.state = INIT_FAILED;
+    return;
+  }
+  if (!sock->listen()) {
+    LOG_WARN("Listen on ch #"<< t.stream <<" failed.");
+    sock->close();
+    t.state = INIT_FAILED;
+    return;
+  }
+  sock->set_non_blocking(true);
+  t.state = INIT_LISTENING;
+}
+
+/* The TCP connection of a stream is up; streams on a shared port still have to introduce themselves. */
+static void InitConnected(init_tmp &t)
+{
+  if (t.handshake) {
+    t.hs_sent = 0;
+    t.state = INIT_HANDSHAKE;
+  } else {
+    t.state = INIT_CONNECTED;
+  }
+}
+
+static void InitConnect(init_tmp &t, bool server_wait, long long int now);
+
+/* A connect attempt failed: act as server instead, or try again later. */
+static void InitConnectFailed(init_tmp &t, int error, bool server_wait, long long int now)
+{
+  LOG_DEBUG("[" << t.stream << "] Attempt to connect as client to " << remote_url[t.stream]
+            << " at port " << t.port << " failed: " << strerror(-error));
+  t.sock->close();
+  if (t.reused) {
+    // The pooled connection has gone stale; make a new one.
+    t.reused = false;
+    InitConnect(t, server_wait, now);
+    return;
+  }
+  if (server_wait) {
+    // Streams on a shared port wait for the other side together, see MPW_InitStreams.
+    if (t.handshake) {
+      t.state = INIT_FAILED;
+    } else {
+      InitListen(t);
+    }
+    return;
+  }
+  t.state = INIT_RETRY;
+  t.retry_at = now + t.backoff;
+  t.backoff = min(2*t.backoff, connect_backoff_max);
+}
+
+/* Issue a non-blocking connect for a stream. */
+static void InitConnect(init_tmp &t, bool server_wait, long long int now)
+{
+  Socket *sock = t.sock;
+  sock->close();
+  sock->create();
+  /* Patch to bypass firewall problems. */
+  if(t.cport>0) {
+    LOG_DEBUG("[" << t.stream << "] Trying to bind as client at " << (t.cport));
+    sock->bind(t.cport);
+  }
+  /* End of patch*/
+  if (t.handshake) {
+    sock->setFastOpenConnect();
+  }
+
+  const int ret = sock->startConnect(remote_url[t.stream], t.port);
+  if (ret == 0) {
+    InitConnected(t);
+  } else if (ret == -EINPROGRESS) {
+    t.state = INIT_CONNECTING;
+  } else {
+    InitConnectFailed(t, ret, server_wait, now);
+  }
+}
+
+/* Advance a connecting stream whose socket has become ready. */
+static void InitProgress(init_tmp &t, bool server_wait, long long int now)
+{
+  int ret = 0;
+  if (t.state == INIT_CONNECTING) {
+    ret = t.sock->finishConnect();
+    if (ret == 0) {
+      InitConnected(t);
+    }
+  } else if (t.state == INIT_HANDSHAKE) {
+    ret = t.sock->setupSend((const char *) t.hs + t.hs_sent, MPW_HANDSHAKE_SIZE - t.hs_sent);
+    if (ret > 0) {
+      t.hs_sent += ret;
+      if (t.hs_sent == MPW_HANDSHAKE_SIZE) {
+        t.state = INIT_AWAIT_ACK;
+      }
+    }
+  } else if (t.state == INIT_AWAIT_ACK) {
+    char ack = 0;
+    ret = t.sock->setupRecv(&ack, 1);
+    if (ret == 1) {
+      ret = ack == MPW_HANDSHAKE_ACK ? 0 : -EPROTO;
+      if (ret == 0) {
+        t.state = INIT_CONNECTED;
+      }
+    }
+  }
+  if (ret < 0 && ret != -EAGAIN) {
+    InitConnectFailed(t, ret, server_wait, now);
+  }
+}
+
+/* States in which a stream is actively connecting (and subject to the deadline). */
+static bool InitActive(int state)
+{
+  return state == INIT_CONNECTING || state == INIT_HANDSHAKE || state == INIT_AWAIT_ACK || state == INIT_RETRY;
+}
+
+/* A random identifier for a path, sent in the handshakes of its streams. */
+static unsigned long long newPathCookie()
+{
+  static unsigned long long counter = 0;
+  unsigned long long x = (unsigned long long) TokenBucket::now() ^ ((unsigned long long) getpid() << 32)
+                       ^ (__sync_add_and_fetch(&counter, 1) * 0x9e3779b97f4a7c15ULL);
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/* Set up the given streams. All connects are issued at once and completed from a single
+ * poll() loop, so a path is ready in about one round trip however many streams it has.
+ * Streams of a client connect to the server, retrying with backoff until timeout seconds
+ * have passed. With server_wait, a stream whose connect fails (and any stream without a
+ * remote host) listens instead, and waits for the other side as long as it takes.
+ *
+ * With shared_port, the streams form one path whose server accepts all of them on the
+ * same port: each connection starts with a handshake naming the path and the stream,
+ * and the server side waits for them through the Acceptor. The streams then either all
+ * connect or all wait for the other side. Connections in reuse_fds (-1: none) come from
+ * the path pool; they only repeat the handshake.
+ * Returns 0 if all streams are connected, -1 otherwise. */
+int MPW_InitStreams(int *stream_indices, int numstreams, bool server_wait, double timeout, bool shared_port,
+                    const int *reuse_fds) {
+  std::vector<init_tmp> t(numstreams);
+  const unsigned long long cookie = shared_port ? newPathCookie() : 0;
+  const long long int start = TokenBucket::now();
+  long long int deadline = timeout > 0 ? start + (long long int)(timeout*1e9) : 0;
+  #if InitStreamTimeOut == 0
+  if (!server_wait) {
+    deadline = 0;
+  }
+  #endif
 
   for(int i = 0; i < numstreams; i++) {
-    int stream = stream_indices[i];
-    t[i].stream      = stream;
-    t[i].sock        = client[stream];
-    t[i].port        = port[stream];
-    t[i].cport       = cport[stream];
-    t[i].server_wait = server_wait;
-    t[i].connected   = false;
-    if(i>0) {
-      int code = pthread_create(&streams[i], NULL, MPW_InitStream, &t[i]);
+    const int stream = stream_indices[i];
+    t[i].stream   = stream;
+    t[i].sock     = client[stream];
+    t[i].port     = port[stream];
+    t[i].cport    = cport[stream];
+    t[i].state    = INIT_FAILED;
+    t[i].retry_at = 0;
+    t[i].backoff  = connect_backoff_min;
+    t[i].handshake = shared_port;
+    t[i].reused   = false;
+    t[i].hs_sent  = 0;
+    MPW_packHandshake(t[i].hs, cookie, i, numstreams);
+    if (shared_port && reuse_fds && reuse_fds[i] >= 0) {
+      t[i].sock->attach(reuse_fds[i]);
+      t[i].reused = true;
+      InitConnected(t[i]);
+    } else if (isclient[stream]) {
+      InitConnect(t[i], server_wait, start);
+    } else if (server_wait && !shared_port) {
+      InitListen(t[i]);
     }
   }
-  if(numstreams > 0) {
-    MPW_InitStream(&t[0]);
+
+  std::vector<struct pollfd> fds;
+  std::vector<int> fd_task;
+  for(;;) {
+    const long long int now = TokenBucket::now();
+    long long int wake = 0; // next retry or the deadline, whichever comes first.
+    fds.clear();
+    fd_task.clear();
+    for(int i = 0; i < numstreams; i++) {
+      if (t[i].state == INIT_RETRY && t[i].retry_at <= now) {
+        InitConnect(t[i], server_wait, now);
+      }
+      if (deadline > 0 && now >= deadline && InitActive(t[i].state)) {
+        LOG_WARN("Connecting ch #" << t[i].stream << " timed out.");
+        t[i].sock->close();
+        t[i].state = INIT_FAILED;
+      }
+      if (t[i].state == INIT_RETRY) {
+        wake = wake > 0 ? min(wake, t[i].retry_at) : t[i].retry_at;
+      }
+      if (deadline > 0 && InitActive(t[i].state)) {
+        wake = wake > 0 ? min(wake, deadline) : deadline;
+      }
+      if ((InitActive(t[i].state) && t[i].state != INIT_RETRY) || t[i].state == INIT_LISTENING) {
+        struct pollfd p;
+        p.fd = t[i].sock->getSock();
+        p.events = t[i].state == INIT_CONNECTING || t[i].state == INIT_HANDSHAKE ? POLLOUT : POLLIN;
+        p.revents = 0;
+        fds.push_back(p);
+        fd_task.push_back(i);
+      }
+    }
+    if (fds.empty() && wake == 0) {
+      break;
+    }
+    int timeout_ms = -1;
+    if (wake > 0) {
+      timeout_ms = (int) max(0LL, (wake - now + 999999) / 1000000);
+    }
+    if (fds.empty()) {
+      usleep(timeout_ms*1000);
+      continue;
+    }
+    if (::poll(&fds[0], fds.size(), timeout_ms) < 0 && errno != EINTR) {
+      LOG_ERR("poll failed during connection setup: " << strerror(errno));
+      break;
+    }
+
+    const long long int done = TokenBucket::now();
+    for(size_t j = 0; j < fds.size(); j++) {
+      if (fds[j].revents == 0) {
+        continue;
+      }
+      init_tmp &ti = t[fd_task[j]];
+      if (ti.state != INIT_LISTENING) {
+        InitProgress(ti, server_wait, done);
+      } else {
+        const int ret = ti.sock->tryAccept();
+        if (ret == 0) {
+          ti.state = INIT_CONNECTED;
+          isclient[ti.stream] = 0;
+        } else if (ret != -EAGAIN) {
+          ti.sock->close();
+          ti.state = INIT_FAILED;
+        }
+      }
+    }
   }
-  for(int i = 1; i < numstreams; i++) {
-    pthread_join(streams[i], NULL);
+
+  /* A path that could not connect as a whole acts as server: the other side connects to us. */
+  if (shared_port && server_wait && numstreams > 0) {
+    bool all_connected = true;
+    for(int i = 0; i < numstreams; i++) {
+      all_connected = all_connected && t[i].state == INIT_CONNECTED;
+    }
+    if (!all_connected) {
+      std::vector<int> fds(numstreams);
+      for(int i = 0; i < numstreams; i++) {
+        t[i].sock->close();
+        t[i].state = INIT_FAILED;
+      }
+      LOG_DEBUG("Waiting for " << numstreams << " streams on port " << t[0].port << ".");
+      if (Acceptor::waitForPath(t[0].port, numstreams, &fds[0], 0) == 0) {
+        for(int i = 0; i < numstreams; i++) {
+          t[i].sock->attach(fds[i]);
+          t[i].state = INIT_CONNECTED;
+          isclient[t[i].stream] = 0;
+        }
+      }
+    }
   }
-  
-  /* Error handling code (in case MPW_InitStream times out for one or more */
+
+  /* Error handling code (in case a stream timed out or failed) */
   // closing itself is done by caller
   bool all_connected = true;
   for(int i = 0; i < numstreams; i++) {
-    if(t[i].connected == false) {
+    if(t[i].state != INIT_CONNECTED) {
       LOG_WARN("One connection has failed: #" << stream_indices[i]);
       all_connected = false;
     }
   }
+  LOG_INFO("Set up " << numstreams << " streams in " << (TokenBucket::now() - start)*1e-9 << " s.");
   if (all_connected)
     return 0;
   else
     return -1;
 }
 
+/* Take total_streams contiguous stream slots and give each its socket and pacer.
+ * Called with table_lock held for writing. Returns the first slot, or -1. */
 static int reserveAvailableStreamNumber(int total_streams)
 {
   int streak = 0;
-  
+  int stream_number = -1;
+
+  allocateTables();
   /* Get next available contiguous streams */
-  for (int i = 0; i < num_streams; i++) {
+  for (int i = 0; i < num_streams && stream_number < 0; i++) {
     if (client[i] == NULL) {
       if (++streak == total_streams)
         // Don't modify num_streams
-        return i + 1 - total_streams;
+        stream_number = i + 1 - total_streams;
     } else if (streak) {
       streak = 0;
     }
   }
   // fall through
-  if (num_streams + total_streams <= MAX_NUM_STREAMS) {
-    const int stream_number = num_streams;
-    num_streams += total_streams;
-    return stream_number;
-  } else {
-    LOG_ERR("ERROR: trying to create more than " << MAX_NUM_STREAMS << " streams");
-    return -1;
+  if (stream_number < 0) {
+    if (num_streams + total_streams <= MAX_NUM_STREAMS) {
+      stream_number = num_streams;
+      num_streams += total_streams;
+    } else {
+      LOG_ERR("ERROR: trying to create more than " << MAX_NUM_STREAMS << " streams");
+      return -1;
+    }
   }
+  for (int i = stream_number; i < stream_number + total_streams; i++) {
+    client[i] = new Socket();
+    stream_path[i] = -1;
+    stream_pacer[i] = new TokenBucket();
+  }
+  return stream_number;
 }
 
+/* Called with table_lock held for writing. */
 static int reserveAvailablePathNumber()
 {
   /* Get next available path */
@@ -459,7 +937,9 @@ int MPW_Init(std::string* url, int* ports, int* cports, int numstreams)
 {
   LOG_INFO("Initialising...");
 
+  pthread_rwlock_wrlock(&table_lock);
   const int start_stream = reserveAvailableStreamNumber(numstreams);
+  pthread_rwlock_unlock(&table_lock);
   if (start_stream == -1) return -1;
   
   int stream_indices[numstreams];
@@ -468,35 +948,53 @@ int MPW_Init(std::string* url, int* ports, int* cports, int numstreams)
   }
 
   MPW_AddStreams(url, ports, cports, stream_indices, numstreams);
-  int ret = MPW_InitStreams(stream_indices, numstreams, true);
+  int ret = MPW_InitStreams(stream_indices, numstreams, true, default_connect_timeout, false, NULL);
   showSettings();
   return ret;
 }
 
 /* Constructs a path. Return path id or negative error value. */
 int MPW_CreatePathWithoutConnect(std::string host, int server_side_base_port, const int streams_in_path) {
+  if (streams_in_path < 1) return -1;
+
+  int stream_indices[streams_in_path];
+
+  /* Take the slots and make the path known in one go, so that concurrent calls cannot get the same ones. */
+  pthread_rwlock_wrlock(&table_lock);
   const int start_stream = reserveAvailableStreamNumber(streams_in_path);
-  const int path_id = reserveAvailablePathNumber();
-  
-  if (start_stream == -1 || path_id == -1) return -1;
+  const int path_id = start_stream == -1 ? -1 : reserveAvailablePathNumber();
+  if (path_id >= 0) {
+    for(int i = 0; i < streams_in_path; i++) {
+      stream_indices[i] = start_stream + i;
+    }
+    paths[path_id] = new MPWPath(host, stream_indices, streams_in_path);
+  } else {
+    for(int i = 0; start_stream >= 0 && i < streams_in_path; i++) {
+      EraseStream(start_stream + i);
+    }
+  }
+  pthread_rwlock_unlock(&table_lock);
+
+  if (path_id == -1) return -1;
 
   int path_ports[streams_in_path];
   int path_cports[streams_in_path];
 
   std::string *hosts = new std::string[streams_in_path];
-  int stream_indices[streams_in_path];
   
+  /* All streams of a path connect to the same server port, and tell it which stream they are. */
   for(int i = 0; i < streams_in_path; i++) {
-    path_ports[i] = server_side_base_port + i;
+    path_ports[i] = server_side_base_port;
     path_cports[i] = -2;
     hosts[i] = host;
-    stream_indices[i] = start_stream + i;
   }
   
   MPW_AddStreams(hosts, path_ports, path_cports, stream_indices, streams_in_path);
   delete [] hosts;
 
-  paths[path_id] = new MPWPath(host, stream_indices, streams_in_path);
+  for(int i = 0; i < streams_in_path; i++) {
+    stream_path[stream_indices[i]] = path_id;
+  }
   
 #if MPW_PacingMode == 1
   if(MPWideAutoTune) {
@@ -508,25 +1006,267 @@ int MPW_CreatePathWithoutConnect(std::string host, int server_side_base_port, co
   LOG_INFO(host << " " <<  server_side_base_port << " " << streams_in_path << " streams.");
   
   for(int i=0; i<streams_in_path; i++) {
-    LOG_DEBUG("Stream[" << i << "]: " << paths[path_id]->streams[i]);
+    LOG_DEBUG("Stream[" << i << "]: " << stream_indices[i]);
   } 
 
   /* Return the identifier for the MPWPath we just created. */
   return path_id;
 }
 
+/* Close pooled streams that have been idle for too long. Called with path_pool_lock held. */
+static void expirePathPool(long long int now)
+{
+  for (std::list<PooledPath>::iterator it = path_pool.begin(); it != path_pool.end(); ) {
+    if (now > it->expires || path_pool_max <= 0) {
+      for (size_t i = 0; i < it->fds.size(); i++) {
+        ::close(it->fds[i]);
+      }
+      it = path_pool.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+/* Number of pooled client streams. Called with path_pool_lock held. */
+static int pooledClientStreams()
+{
+  int n = 0;
+  for (std::list<PooledPath>::iterator it = path_pool.begin(); it != path_pool.end(); ++it) {
+    n += it->fds.size();
+  }
+  return n;
+}
+
+/* Take idle connections to host:port for a path of n streams out of the pool. The smallest
+ * pooled path with at least n streams is used; its extra streams are closed.
+ * Returns true if fds has been filled. */
+static bool takePooledStreams(const std::string &host, int port, int n, int *fds)
+{
+  pthread_mutex_lock(&path_pool_lock);
+  expirePathPool(TokenBucket::now());
+  std::list<PooledPath>::iterator best = path_pool.end();
+  for (std::list<PooledPath>::iterator it = path_pool.begin(); it != path_pool.end(); ++it) {
+    if (it->host == host && it->port == port && (int) it->fds.size() >= n &&
+        (best == path_pool.end() || it->fds.size() < best->fds.size())) {
+      best = it;
+    }
+  }
+  const bool found = best != path_pool.end();
+  if (found) {
+    for (size_t i = 0; i < best->fds.size(); i++) {
+      if ((int) i < n) {
+        fds[i] = best->fds[i];
+      } else {
+        ::close(best->fds[i]);
+      }
+    }
+    path_pool.erase(best);
+  }
+  pthread_mutex_unlock(&path_pool_lock);
+  return found;
+}
+
+/* The congestion control new connections get. */
+static std::string defaultCongestionControl()
+{
+  Socket s;
+  s.create();
+  return s.congestionControl();
+}
+
+/* Keep the streams of a path that is being destroyed, if they are healthy and there is room.
+ * Returns true if they have been parked; the path's sockets no longer own them then. */
+static bool parkPathStreams(int path)
+{
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return false;
+  }
+  if (path_pool_max <= 0 || p->num_streams < 1 || p->zerocopy_threshold > 0) {
+    return false;
+  }
+  const bool client_side = isclient[p->streams[0]];
+  for (int i = 0; i < p->num_streams; i++) {
+    const int stream = p->streams[i];
+    // A server may find the handshake of the next path waiting already.
+    if (isclient[stream] != client_side || !client[stream]->isIdle(!client_side)) {
+      return false;
+    }
+  }
+
+  pthread_mutex_lock(&path_pool_lock);
+  const long long int now = TokenBucket::now();
+  expirePathPool(now);
+  /* Make room by dropping the oldest client paths. */
+  while (!path_pool.empty() && pooledClientStreams() + Acceptor::parked() + p->num_streams > path_pool_max) {
+    for (size_t i = 0; i < path_pool.front().fds.size(); i++) {
+      ::close(path_pool.front().fds[i]);
+    }
+    path_pool.pop_front();
+  }
+  const bool room = pooledClientStreams() + Acceptor::parked() + p->num_streams <= path_pool_max;
+  if (room) {
+    std::vector<int> fds(p->num_streams);
+    const std::string default_cc = p->congestion.empty() ? "" : defaultCongestionControl();
+    for (int i = 0; i < p->num_streams; i++) {
+      client[p->streams[i]]->setMaxPacingRate(-1);
+      if (!default_cc.empty()) {
+        client[p->streams[i]]->setCongestionControl(default_cc);
+      }
+      fds[i] = client[p->streams[i]]->detach();
+    }
+    if (client_side) {
+      PooledPath pooled;
+      pooled.host = remote_url[p->streams[0]];
+      pooled.port = port[p->streams[0]];
+      pooled.fds = fds;
+      pooled.expires = now + (long long int)(path_pool_idle*1e9);
+      path_pool.push_back(pooled);
+    } else {
+      Acceptor::park(port[p->streams[0]], &fds[0], p->num_streams, path_pool_idle);
+    }
+    LOG_DEBUG("Path " << path << ": " << p->num_streams << " streams parked in the pool.");
+  }
+  pthread_mutex_unlock(&path_pool_lock);
+  return room;
+}
+
+/* Close all pooled streams. */
+static void closePathPool()
+{
+  pthread_mutex_lock(&path_pool_lock);
+  const int max_streams = path_pool_max;
+  path_pool_max = 0;
+  expirePathPool(0);
+  path_pool_max = max_streams;
+  pthread_mutex_unlock(&path_pool_lock);
+  Acceptor::closeParked();
+}
+
+void MPW_setPathPool(int max_streams, double idle_timeout) {
+  pthread_mutex_lock(&path_pool_lock);
+  path_pool_max = max(0, max_streams);
+  path_pool_idle = idle_timeout;
+  pthread_mutex_unlock(&path_pool_lock);
+  if (max_streams <= 0) {
+    closePathPool();
+  }
+}
+
+int MPW_PooledStreams() {
+  pthread_mutex_lock(&path_pool_lock);
+  expirePathPool(TokenBucket::now());
+  const int n = pooledClientStreams();
+  pthread_mutex_unlock(&path_pool_lock);
+  return n + Acceptor::parked();
+}
+
+/* The byte that announces the byte order of a host to the other end of a path. */
+#define MPW_ORDER_LITTLE 'l'
+#define MPW_ORDER_BIG    'B'
+
+/* Send our byte order on the first stream of a freshly connected path, and read that of the
+ * other end. Forwarders relay the byte like any other data, so it always comes from the endpoint
+ * itself. Returns 0, or a negative errno value. */
+static int exchangeByteOrder(MPWPath *p)
+{
+  const Socket *s = client[p->streams[0]];
+  const char mine = host_big_endian() ? MPW_ORDER_BIG : MPW_ORDER_LITTLE;
+  char theirs = 0;
+  bool sent = false, received = false;
+  const long long int deadline = p->connect_timeout > 0 ? TokenBucket::now() + (long long int) (p->connect_timeout*1e9) : -1;
+  while (!sent || !received) {
+    int ret = sent ? 0 : s->setupSend(&mine, 1);
+    if (ret < 0 && ret != -EAGAIN) {
+      return ret;
+    }
+    sent = sent || ret == 1;
+    ret = received ? 0 : s->setupRecv(&theirs, 1);
+    if (ret < 0 && ret != -EAGAIN) {
+      return ret;
+    }
+    received = received || ret == 1;
+    if (sent && received) {
+      break;
+    }
+    int timeout_ms = -1;
+    if (deadline >= 0) {
+      const long long int left = deadline - TokenBucket::now();
+      if (left <= 0) {
+        return -ETIMEDOUT;
+      }
+      timeout_ms = (int) (left/1000000 + 1);
+    }
+    struct pollfd pfd;
+    pfd.fd = s->getSock();
+    pfd.events = (sent ? 0 : POLLOUT) | (received ? 0 : POLLIN);
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+      return -errno;
+    }
+  }
+  if (theirs != MPW_ORDER_LITTLE && theirs != MPW_ORDER_BIG) {
+    LOG_ERR("The other end of the path announced an unknown byte order (" << (int) theirs << ").");
+    return -EPROTO;
+  }
+  p->peer_big_endian = theirs == MPW_ORDER_BIG;
+  return 0;
+}
+
 /** Connect a path that has been created and provided with streams, to a remote endpoint,
  * or have it act as a server. 
  */
 int MPW_ConnectPath(int path_id, bool server_wait) {
-  int ret = MPW_InitStreams(paths[path_id]->streams, paths[path_id]->num_streams, server_wait);
+  MPWPath *p = getPath(path_id);
+  if (p == NULL) {
+    return -1;
+  }
+  const long long int start = TokenBucket::now();
+  const int n = p->num_streams;
+  /* Reuse idle streams to the same server, if the pool has them. */
+  std::vector<int> reuse(n, -1);
+  const bool reusing = n > 0 && isclient[p->streams[0]] &&
+                       takePooledStreams(remote_url[p->streams[0]], port[p->streams[0]], n, &reuse[0]);
+  if (reusing) {
+    LOG_DEBUG("Path " << path_id << " reuses " << n << " pooled streams.");
+  }
+  int ret = MPW_InitStreams(p->streams, n, server_wait,
+                            p->connect_timeout, true, reusing ? &reuse[0] : NULL);
+  if (ret >= 0 && n > 0 && !p->forwarding) {
+    ret = exchangeByteOrder(p);
+  }
+  p->setup_time = (TokenBucket::now() - start)*1e-9;
   
   if (MPWideAutoTune && ret >= 0)
   {
-    const int default_window = 32*1024*1024/paths[path_id]->num_streams;
-    for(int j = 0; j < paths[path_id]->num_streams; j++)
-      MPW_setWin(paths[path_id]->streams[j], default_window);
+    const int default_window = 32*1024*1024/p->num_streams;
+    for(int j = 0; j < p->num_streams; j++)
+      MPW_setWin(p->streams[j], default_window);
+  }
+
+  /* Start the worker threads that will drive this path's streams until it is destroyed. */
+  if (ret >= 0 && p->pool == NULL) {
+    int workers = max_path_workers;
+    if (workers < 0)
+      workers = max(1, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    workers = min(workers, p->num_streams);
+    if (workers > 0) {
+      p->pool = new WorkerPool(workers, use_io_uring);
+      LOG_INFO("Path " << path_id << " is driven by " << p->pool->size() << " worker threads.");
+    }
+  }
+  if (ret >= 0 && p->zerocopy_threshold > 0) {
+    MPW_setPathZeroCopy(path_id, true, p->zerocopy_threshold);
+  }
+  if (ret >= 0 && !p->congestion.empty()) {
+    MPW_setPathCongestionControl(path_id, p->congestion);
+  }
+#if MPW_PacingMode == 1
+  if (ret >= 0 && p->kernel_pacing) {
+    MPW_setPathKernelPacing(path_id, true);
   }
+#endif
   showSettings();
 
   return ret;
@@ -552,11 +1292,12 @@ int MPW_CreatePath_c (char* host, int server_side_base_port, int streams_in_path
 
 
 
-/* Remove a stream from a path. */
+/* Remove a stream from a path. Called with table_lock held for writing. */
 void EraseStream(int stream) {
   delete client[stream];
   client[stream] = NULL;
-  delete ta[stream];
+  stream_path[stream] = -1;
+  delete stream_pacer[stream];
   
   // Deleted last stream, move the stream counter back
   if (stream + 1 == num_streams) {
@@ -578,34 +1319,338 @@ void MPW_setWin(int stream, int size) {
 
 /* Attempt to change the TCP window size for a single path. */
 void MPW_setPathWin(int path, int size) {
-  for(int i=0; i < paths[path]->num_streams; i++) {
-    client[paths[path]->streams[i]]->setWin(size);
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return;
+  }
+  for(int i=0; i < p->num_streams; i++) {
+    client[p->streams[i]]->setWin(size);
   }
 }
 
-/** Destroy an MPWide path (disconnect, then delete).
+void MPW_setPathConnectTimeout(int path, double seconds) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return;
+  }
+  p->connect_timeout = seconds;
+}
+
+void MPW_setPathForwarding(int path, bool enable) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return;
+  }
+  p->forwarding = enable;
+}
+
+double MPW_getPathSetupTime(int path) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return -1;
+  }
+  return p->setup_time;
+}
+
+/** Enable or disable MSG_ZEROCOPY transmission for the streams of a path.
+ * Only sends of at least threshold bytes are worth pinning pages for; smaller ones are copied.
+ * May be called before the path connects, in which case it takes effect on connection.
+ * Returns the number of streams for which the kernel accepted zero-copy.
+ */
+int MPW_setPathZeroCopy(int path, bool enable, long long int threshold) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return -EINVAL;
+  }
+  if (threshold <= 0)
+    threshold = 32*1024;
+  p->zerocopy_threshold = enable ? threshold : 0;
+
+  int enabled = 0;
+  for(int i=0; i < p->num_streams; i++) {
+    Socket *s = client[p->streams[i]];
+    if (s == NULL || !s->is_valid())
+      continue;
+    if (s->setZeroCopy(p->zerocopy_threshold) && enable)
+      enabled++;
+  }
+  if (enable && enabled < p->num_streams && enabled > 0) {
+    LOG_WARN("Zero-copy enabled on only " << enabled << " of " << p->num_streams << " streams of path " << path << ".");
+  }
+  return enabled;
+}
+
+/** Stripe the messages of a path dynamically: MPW_SendRecv and friends cut them into
+ * chunks of chunk_size bytes (<= 0: 256 kB) that each stream takes in turn as soon as it
+ * has sent its previous one, so a stalled stream carries less of the message.
+ */
+void MPW_setPathStriping(int path, bool enable, long long int chunk_size) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return;
+  }
+  p->stripe_chunk = enable ? (chunk_size > 0 ? min(chunk_size, max_stripe_chunk) : default_stripe_chunk) : 0;
+}
+
+/** Send a CRC32C after every 64 kB of data on the streams of a path, and verify them on arrival.
+ */
+int MPW_setPathChecksums(int path, bool enable) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return -EINVAL;
+  }
+  p->checksum_chunk = enable ? MPW_CHECKSUM_CHUNK : 0;
+  return 0;
+}
+
+/** Compress the messages of a path (MPW_COMPRESS_ON), or only while that makes the path
+ * faster (MPW_COMPRESS_AUTO). The sender of a message decides, so the receiver only needs to
+ * expect the frames.
+ */
+int MPW_setPathCompression(int path, int mode) {
+  MPWPath *p = getPath(path);
+  if (p == NULL || mode < MPW_COMPRESS_OFF || mode > MPW_COMPRESS_AUTO) {
+    return -EINVAL;
+  }
+  pthread_mutex_lock(&p->compression.lock);
+  p->compression.mode = mode;
+  p->compression.since_probe = 0;
+  pthread_mutex_unlock(&p->compression.lock);
+  return 0;
+}
+
+int MPW_GetCompressionInfo(int path, MPW_CompressionInfo* info) {
+  MPWPath *p = getPath(path);
+  if (p == NULL || info == NULL) {
+    return -EINVAL;
+  }
+  CompressionState &z = p->compression;
+  pthread_mutex_lock(&z.lock);
+  info->mode = z.mode;
+  info->active = z.active;
+  info->messages = z.messages;
+  info->compressed = z.compressed;
+  info->raw_bytes = z.raw_bytes;
+  info->wire_bytes = z.wire_bytes;
+  info->ratio = z.ratio;
+  info->compress_rate = z.compress_rate;
+  info->decompress_rate = z.decompress_rate;
+  info->link_rate = z.link_rate;
+  pthread_mutex_unlock(&z.lock);
+  return 0;
+}
+
+/** Select the TCP congestion control algorithm ("cubic", "bbr", ...) for the streams of a
+ * path, on either side. May be called before the path connects, in which case it takes
+ * effect on connection. Returns the number of connected streams that use it, or a negative
+ * errno value if the kernel does not offer the algorithm (-ENOENT) or does not allow it (-EPERM).
+ */
+int MPW_setPathCongestionControl(int path, std::string name) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return -EINVAL;
+  }
+  Socket probe;
+  probe.create();
+  const int ret = probe.setCongestionControl(name);
+  if (ret < 0) {
+    LOG_WARN("Congestion control " << name << " is not available: " << strerror(-ret));
+    return ret;
+  }
+  p->congestion = name;
+
+  int applied = 0;
+  for(int i=0; i < p->num_streams; i++) {
+    Socket *s = client[p->streams[i]];
+    if (s == NULL || !s->is_valid())
+      continue;
+    if (s->setCongestionControl(name) == 0)
+      applied++;
+  }
+  LOG_INFO("Path " << path << " uses congestion control " << name << " on " << applied << " streams.");
+  return applied;
+}
+
+#if MPW_PacingMode == 1
+/** Pace a path: path_rate limits the sum of all its streams, stream_rate each of them
+ * (bytes/s; -1 means unlimited and a stream_rate of 0 follows MPW_setPacingRate).
+ */
+void MPW_setPathPacingRate(int path, double path_rate, double stream_rate) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return;
+  }
+  p->pacer.setRate(path_rate);
+  p->stream_rate = stream_rate > 0 ? stream_rate : (stream_rate == 0 ? 0 : -1);
+  for(int i=0; i < p->num_streams; i++) {
+    applyPacing(p->streams[i]);
+  }
+  LOG_INFO("Path " << path << " paced at " << path_rate << " bytes/s, " << stream_rate << " bytes/s per stream.");
+}
+
+double MPW_getPathPacingRate(int path) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return -1;
+  }
+  return p->pacer.getRate();
+}
+
+/** Leave the per-stream pacing of a path to the kernel (SO_MAX_PACING_RATE), which
+ * spaces out the packets themselves. The path-wide rate is still enforced by MPWide.
+ * Returns the number of streams paced by the kernel.
+ */
+int MPW_setPathKernelPacing(int path, bool enable) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return -EINVAL;
+  }
+  p->kernel_pacing = enable;
+  int delegated = 0;
+  for(int i=0; i < p->num_streams; i++) {
+    const int stream = p->streams[i];
+    if (!enable && client[stream]->is_valid())
+      client[stream]->setMaxPacingRate(-1);
+    if (applyPacing(stream))
+      delegated++;
+  }
+  return delegated;
+}
+#endif
+
+/* Report the transmission counters of one stream of a path. */
+int MPW_GetStreamInfo(int path, int stream, MPW_StreamInfo* info) {
+  MPWPath *p = getPath(path);
+  if (p == NULL ||
+      stream < 0 || stream >= p->num_streams || info == NULL) {
+    return -EINVAL;
+  }
+  const Socket *s = client[p->streams[stream]];
+  info->zerocopy_threshold = s->zeroCopyThreshold();
+  info->zerocopy_sends = s->zeroCopyIssued();
+  info->zerocopy_completed = s->zeroCopyCompleted();
+  info->zerocopy_copied = s->zeroCopyCopied();
+  info->copy_sends = s->copySends();
+  info->send_chunk = s->lastSendChunk();
+  info->recv_chunk = s->lastRecvChunk();
+  info->blocked_sends = s->blockedSends();
+  info->blocked_recvs = s->blockedRecvs();
+  info->bytes_sent = s->bytesSent();
+  info->bytes_received = s->bytesReceived();
+  info->checksum_errors = s->checksumErrors();
+  info->checksum_error_offset = s->checksumErrorOffset();
+  sampleTcp(s, stream, &info->tcp);
+  memset(info->congestion, 0, sizeof(info->congestion));
+  strncpy(info->congestion, s->congestionControl().c_str(), sizeof(info->congestion) - 1);
+  return 0;
+}
+
+int MPW_GetPathInfo(int path, MPW_PathInfo* info) {
+  MPWPath *p = getPath(path);
+  if (p == NULL || info == NULL) {
+    return -EINVAL;
+  }
+  memset(info, 0, sizeof(*info));
+  info->streams = p->num_streams;
+  info->stripe_chunk = p->stripe_chunk;
+  info->min_rtt_us = -1;
+  long long int rtt_sum = 0;
+  int sampled = 0;
+  for (int i = 0; i < p->num_streams; i++) {
+    const Socket *s = client[p->streams[i]];
+    info->bytes_sent += s->bytesSent();
+    info->bytes_received += s->bytesReceived();
+    info->checksum_errors += s->checksumErrors();
+    MPW_TcpInfo t;
+    if (sampleTcp(s, i, &t) < 0) {
+      continue;
+    }
+    sampled++;
+    rtt_sum += t.rtt_us;
+    info->min_rtt_us = info->min_rtt_us < 0 ? t.rtt_us : min(info->min_rtt_us, t.rtt_us);
+    info->max_rtt_us = max(info->max_rtt_us, t.rtt_us);
+    info->cwnd += t.cwnd;
+    info->retransmits += t.retransmits;
+    info->lost += t.lost;
+    info->unacked_bytes += t.unacked_bytes;
+    info->delivery_rate += t.delivery_rate;
+    info->pacing_rate += t.pacing_rate;
+  }
+  info->avg_rtt_us = sampled > 0 ? rtt_sum / sampled : 0;
+  info->min_rtt_us = max(info->min_rtt_us, 0LL);
+  return 0;
+}
+
+int MPW_StartTcpRecording(int path, double interval, int capacity) {
+  MPWPath *p = getPath(path);
+  if (p == NULL || interval <= 0 || capacity <= 0) {
+    return -EINVAL;
+  }
+  delete p->recorder;
+  std::vector<Socket*> socks(p->num_streams);
+  for (int i = 0; i < p->num_streams; i++) {
+    socks[i] = client[p->streams[i]];
+  }
+  p->recorder = new TcpRecorder(&socks[0], p->num_streams, interval, capacity);
+  if (!p->recorder->started()) {
+    delete p->recorder;
+    p->recorder = NULL;
+    return -EAGAIN;
+  }
+  return 0;
+}
+
+int MPW_StopTcpRecording(int path) {
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return -EINVAL;
+  }
+  delete p->recorder;
+  p->recorder = NULL;
+  return 0;
+}
+
+int MPW_GetTcpRecording(int path, MPW_TcpInfo* samples, int max) {
+  MPWPath *p = getPath(path);
+  if (p == NULL || samples == NULL || max < 0) {
+    return -EINVAL;
+  }
+  if (p->recorder == NULL) {
+    return 0;
+  }
+  return p->recorder->copy(samples, max);
+}
+
+/** Destroy an MPWide path (disconnect, then delete).
  * Return 0 on success (negative on failure).
  */
 int MPW_DestroyPath(int path) {
-  for (int j = 0; j < paths[path]->num_streams; j++) {
-    EraseStream(paths[path]->streams[j]);
+  MPWPath *p = getPath(path);
+  if (p == NULL) {
+    return -EINVAL;
+  }
+  MPW_StopTcpRecording(path);
+  if (p->mux) {
+    // A fragment may have been cut short: the streams cannot be reused.
+    deleteTagMux(p->mux);
+    p->mux = NULL;
+  } else {
+    parkPathStreams(path);
   }
 
-  delete paths[path];
+  pthread_rwlock_wrlock(&table_lock);
   paths[path] = NULL;
-
   // Reset num_paths, if this was the last path
-  if (path == num_paths - 1) {
-    for (int i = path - 1; i >= 0; --i) {
-      if (paths[i] != NULL) {
-        num_paths = i + 1;
-        return 0;
-      }
-    }
-    // If no paths are found, num_streams is 0
-    num_paths = 0;
+  while (num_paths > 0 && paths[num_paths - 1] == NULL) {
+    num_paths--;
   }
-  
+  for (int j = 0; j < p->num_streams; j++) {
+    EraseStream(p->streams[j]);
+  }
+  pthread_rwlock_unlock(&table_lock);
+
+  // The worker threads are joined outside the lock, as they may still look paths up.
+  delete p;
   return 0;
 }
 
@@ -613,19 +1658,31 @@ extern "C" {
 
   /* Path-based Send and Recv operations*/
   int MPW_DSendRecv(char* sendbuf, long long int sendsize, char* recvbuf, long long int maxrecvsize, int path) {
-    return MPW_DSendRecv(sendbuf, sendsize, recvbuf, maxrecvsize, paths[path]->streams, paths[path]->num_streams);
+    MPWPath *p = getPath(path);
+    if (p == NULL)
+      return -EINVAL;
+    return MPW_DSendRecv(sendbuf, sendsize, recvbuf, maxrecvsize, p->streams, p->num_streams);
   }
 
   int MPW_SendRecv(char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize, int path) {
-    return MPW_SendRecv(sendbuf, sendsize, recvbuf, recvsize,  paths[path]->streams, paths[path]->num_streams);
+    MPWPath *p = getPath(path);
+    if (p == NULL)
+      return -EINVAL;
+    return MPW_SendRecv(sendbuf, sendsize, recvbuf, recvsize,  p->streams, p->num_streams);
   }
 
   int MPW_Send(char* sendbuf, long long int sendsize, int path) {
-    return MPW_SendRecv(sendbuf, sendsize, NULL, 0, paths[path]->streams, paths[path]->num_streams);
+    MPWPath *p = getPath(path);
+    if (p == NULL)
+      return -EINVAL;
+    return MPW_SendRecv(sendbuf, sendsize, NULL, 0, p->streams, p->num_streams);
   }
 
   int MPW_Recv(char* recvbuf, long long int recvsize, int path) {
-    return MPW_SendRecv(NULL, 0, recvbuf, recvsize,  paths[path]->streams, paths[path]->num_streams);
+    MPWPath *p = getPath(path);
+    if (p == NULL)
+      return -EINVAL;
+    return MPW_SendRecv(NULL, 0, recvbuf, recvsize,  p->streams, p->num_streams);
   }
 
 }
@@ -674,30 +1731,57 @@ int MPW_Finalize()
 #if MONITORING == 1
   stop_monitor = true;
 #endif
+  pthread_rwlock_wrlock(&table_lock);
+  std::vector<MPWPath*> old_paths;
   for (int i = 0; i < num_paths; i++) {
     if (paths[i])
-      delete paths[i];
+      old_paths.push_back(paths[i]);
   }
-  delete [] paths;
   num_paths = 0;
-  
+  pthread_rwlock_unlock(&table_lock);
+  for (size_t i = 0; i < old_paths.size(); i++) {
+    delete old_paths[i];
+  }
+  closeRequests();
+  closePathPool();
+  Codec::close();
+
+  /* Give data still in flight up to a second to reach the other side before closing. */
+  const long long int flush_deadline = TokenBucket::now() + 1000*1000*1000LL;
+  for (int i = 0; i < num_streams; i++) {
+    while (client[i] && client[i]->is_valid() && client[i]->sendQueued() > 0 &&
+           TokenBucket::now() < flush_deadline) {
+      usleep(1000);
+    }
+  }
+
+  pthread_rwlock_wrlock(&table_lock);
   for (int i = 0; i < num_streams; i++) {
     if (client[i]) {
       delete client[i];
-      delete ta[i];
+      delete stream_pacer[i];
     }
   }
   delete [] client;
-  delete [] ta;
+  delete [] stream_path;
+  delete [] stream_pacer;
   delete [] port;
   delete [] cport;
   delete [] remote_url;
   delete [] isclient;
+  delete [] paths;
+  client = NULL;
+  stream_path = NULL;
+  stream_pacer = NULL;
+  port = NULL;
+  cport = NULL;
+  remote_url = NULL;
+  isclient = NULL;
+  paths = NULL;
   num_streams = 0;
+  pthread_rwlock_unlock(&table_lock);
 
   LOG_INFO("MPWide sockets are closed.");
-  // Wait on any closing sockets
-  sleep(1);
   return 1;
 }
 
@@ -715,163 +1799,1401 @@ void MPW_Recv(char* buf, long long int size, int* channels, int num_channels)
   MPW_SendRecv(NULL,0,buf,size,channels,num_channels);
 }
 
-/* Send/Recv (part of) the data between two processes using a single TCP stream and a single thread. */
-int *InThreadSendRecv(char* const sendbuf, const long long int sendsize, char* const recvbuf, const long long int recvsize, const int base_channel)
+/* Returns the progress engine of the calling thread, configured with the current chunk sizes and pacing. */
+static pthread_key_t engine_key;
+static pthread_once_t engine_key_once = PTHREAD_ONCE_INIT;
+
+static void deleteEngine(void *engine) { delete (ProgressEngine *)engine; }
+static void makeEngineKey() { pthread_key_create(&engine_key, deleteEngine); }
+
+static ProgressEngine *localEngine(int ssize, int rsize)
 {
-  int * const ret = new int(0);
+  pthread_once(&engine_key_once, makeEngineKey);
+  ProgressEngine *engine = (ProgressEngine *)pthread_getspecific(engine_key);
+  if(engine != NULL && engine->requestedIoUring() != use_io_uring && engine->active() == 0) {
+    delete engine; // the backend has been changed since.
+    engine = NULL;
+  }
+  if(engine == NULL) {
+    engine = new ProgressEngine(use_io_uring);
+    pthread_setspecific(engine_key, engine);
+  }
+  engine->send_chunk = ssize;
+  engine->recv_chunk = rsize;
+  return engine;
+}
 
-#ifdef PERF_TIMING
-  double t = GetTime();
+/* Returns the worker pool of the path that owns all the given streams, or NULL. */
+static WorkerPool *poolOf(const int *channel, int nc)
+{
+  if (nc < 1 || stream_path[channel[0]] < 0)
+    return NULL;
+  const int path = stream_path[channel[0]];
+  for (int i = 1; i < nc; i++) {
+    if (stream_path[channel[i]] != path)
+      return NULL;
+  }
+  MPWPath *p = getPath(path);
+  return p ? p->pool : NULL;
+}
+
+/* Drive a set of tasks to completion and free them. Tasks run on the worker
+ * threads of their path if it has any, or else on the calling thread. */
+static void setPacers(std::vector<StreamTask*> &tasks)
+{
+#if MPW_PacingMode == 1
+  /* Tasks send on the stream they are numbered after: charge that stream and its path. */
+  for(size_t i = 0; i < tasks.size(); i++) {
+    const int stream = tasks[i]->stream;
+    if (stream < 0)
+      continue;
+    if (stream_pacer[stream]->limited())
+      tasks[i]->pacer[0] = stream_pacer[stream];
+    MPWPath *p = getPath(stream_path[stream]);
+    if (p && p->pacer.limited())
+      tasks[i]->pacer[1] = &p->pacer;
+  }
 #endif
+}
 
-  long long int a = 0;
-  long long int b = 0;
-  
-  const Socket *wsock = client[base_channel % 65536];
-  const Socket *rsock = base_channel < 65536 ? wsock : client[(base_channel/65536) - 1];
-  
-  int mask = (recvsize == 0 ? MPWIDE_SOCKET_RDMASK : 0)
-           | (sendsize == 0 ? MPWIDE_SOCKET_WRMASK : 0);
-  
-  while (mask != (MPWIDE_SOCKET_RDMASK|MPWIDE_SOCKET_WRMASK)) {
-    const int mode = Socket_select(rsock->getSock(), wsock->getSock(), mask, 10, 0);
+static int runTasks(std::vector<StreamTask*> &tasks, WorkerPool *pool, int ssize = tcpbuf_ssize, int rsize = tcpbuf_rsize)
+{
+  int ret = 0;
+  setPacers(tasks);
+  if (tasks.empty()) {
+    ret = 0;
+  } else if (pool) {
+    ret = pool->run(&tasks[0], tasks.size(), ssize, rsize);
+  } else {
+    ret = localEngine(ssize, rsize)->run(&tasks[0], tasks.size());
+  }
+  for(size_t i = 0; i < tasks.size(); i++) {
+    delete tasks[i];
+  }
+  return ret;
+}
 
-    if (mode == -1) {
-      // Continue after interrupt, but fail on other messages
-      if (errno == EINTR)
-        continue;
-      else {
-        *ret = -max(1, errno);
-        break;
-      }
+/* The chunk size in which the data of a stream is checksummed (0: none). */
+static long long int checksumChunk(int stream)
+{
+  MPWPath *p = getPath(stream_path[stream]);
+  return p ? p->checksum_chunk : 0;
+}
+
+/* Whether any of the streams belongs to a path with checksums, which the dynamically
+ * sized exchanges do not send. */
+static bool anyChecksums(const int *streams, int n)
+{
+  for (int i = 0; i < n; i++) {
+    if (checksumChunk(streams[i]) > 0) {
+      return true;
     }
-    if(FLAG_CHECK(mode,MPWIDE_SOCKET_RDMASK)) {
-      const int n = rsock->irecv(recvbuf + b, min(tcpbuf_rsize,recvsize - b));
-      if (n <= 0) {
-        if (n == 0) // socket disconnected on other side, choose default -1 errno.
-          *ret = -1;
-        else
-          *ret = -max(1, errno);
-        break;
+  }
+  return false;
+}
+
+/* Report a chunk that arrived with a wrong checksum. Returns the error for the task. */
+static int checksumMismatch(StreamTask *t, long long int offset, const char *where)
+{
+  t->rsock->noteChecksumError(offset);
+  LOG_ERR("Checksum mismatch on stream " << t->stream << " (path " << (t->stream >= 0 ? stream_path[t->stream] : -1)
+          << ") in the chunk at offset " << offset << " of " << where << ".");
+  return -EBADMSG;
+}
+
+/* Bytes in share i of a message of size bytes that is split over nc streams, in whole
+ * elements of unit bytes (the last share takes any bytes left over). */
+static long long int shareSize(long long int size, int nc, int i, int unit)
+{
+  const long long int elements = size / unit;
+  long long int share = (elements / nc + (i < elements % nc ? 1 : 0)) * unit;
+  if (i == nc - 1)
+    share += size % unit;
+  return share;
+}
+
+/* Reverse the bytes of each element of size bytes in the next len bytes of an iovec list,
+ * and move the cursor past them. */
+static void swapNext(IovCursor &at, long long int len, int size)
+{
+  IovCursor c;
+  c.reset(at, 0, len);
+  at.advance(len);
+  struct iovec part[MPW_TASK_MAXIOV];
+  unsigned char *split[8]; // the bytes of an element that spans two iovecs.
+  int have = 0;
+  while (c.remaining() > 0) {
+    const int n = c.fill(part, MPW_TASK_MAXIOV);
+    if (n == 0)
+      break;
+    for (int i = 0; i < n; i++) {
+      unsigned char *b = (unsigned char *) part[i].iov_base;
+      long long int l = part[i].iov_len;
+      c.advance(l);
+      for (; have > 0 && l > 0; l--) {
+        split[have++] = b++;
+        if (have == size) {
+          for (int k = 0; k < size / 2; k++) {
+            const unsigned char t = *split[k];
+            *split[k] = *split[size - 1 - k];
+            *split[size - 1 - k] = t;
+          }
+          have = 0;
+        }
       }
-      b += n;
-      #if MONITORING == 1
-      bytes_sent += n;
-      #endif
+      const long long int whole = l / size;
+      swap_elements(b, whole, size);
+      for (b += whole * size, l -= whole * size; l > 0; l--)
+        split[have++] = b++;
+    }
+  }
+}
 
-      if(b == recvsize)
-        mask |= MPWIDE_SOCKET_RDMASK; //don't check for read anymore
+/* Typed exchanges with a host of the other byte order: puts the elements of a byte range
+ * that arrives in order into our byte order as the bytes come in, while they are in cache. */
+class ElementSwap
+{
+ public:
+  ElementSwap() : size(0), got(0), done(0) {}
+
+  // size: bytes per element (0 or 1: nothing to do). offset must start an element.
+  void reset(const struct iovec *iov, int iovcnt, long long int offset, int size) {
+    this->size = size;
+    got = done = 0;
+    if (size > 1)
+      next.reset(iov, iovcnt, offset, LLONG_MAX);
+  }
+
+  // The next n bytes of the range have arrived.
+  void arrived(long long int n) {
+    if (size < 2)
+      return;
+    got += n;
+    const long long int end = got - got % size;
+    if (end > done) {
+      swapNext(next, end - done, size);
+      done = end;
     }
+  }
 
-    if(FLAG_CHECK(mode,MPWIDE_SOCKET_WRMASK)) {
-      const int n = wsock->isend(sendbuf + a, min(tcpbuf_ssize, sendsize - a));
+ private:
+  ElementSwap(const ElementSwap &);
+  ElementSwap &operator=(const ElementSwap &);
 
-      if (n < 0) {
-        *ret = -errno;
-        break;
-      }
-      
-      a += n;
-      #if MONITORING == 1
-      bytes_sent += n;
-      #endif
+  int size;
+  long long int got, done; // bytes that have arrived, and those swapped,
+  IovCursor next;          // ... and where the next one to swap is.
+};
+
+/* Send/Recv (part of) the data between two processes over a single TCP stream.
+ * This is the state machine that used to run in its own thread (InThreadSendRecv).
+ * Either side may be a byte range of a scatter/gather list. With checksum_chunk > 0
+ * each chunk of that size is followed by its checksum. */
+class SendRecvTask : public StreamTask
+{
+ public:
+  SendRecvTask(Socket *rsock, Socket *wsock, char *sendbuf, long long int sendsize, char *recvbuf, long long int recvsize,
+               long long int checksum_chunk = 0)
+  : StreamTask(rsock, wsock), where("its receive buffer")
+  {
+    siov.iov_base = sendbuf;
+    siov.iov_len = sendsize;
+    riov.iov_base = recvbuf;
+    riov.iov_len = recvsize;
+    scur.reset(&siov, 1, 0, sendsize, checksum_chunk, true);
+    rcur.reset(&riov, 1, 0, recvsize, checksum_chunk, false);
+  }
+
+  SendRecvTask(Socket *rsock, Socket *wsock, const struct iovec *sendiov, int sendcnt, long long int sendoffset, long long int sendsize,
+               const struct iovec *recviov, int recvcnt, long long int recvoffset, long long int recvsize, long long int checksum_chunk = 0,
+               int swap = 0)
+  : StreamTask(rsock, wsock), where("the message")
+  {
+    scur.reset(sendiov, sendcnt, sendoffset, sendsize, checksum_chunk, true);
+    rcur.reset(recviov, recvcnt, recvoffset, recvsize, checksum_chunk, false);
+    rswap.reset(recviov, recvcnt, recvoffset, swap);
+  }
 
-      if(a == sendsize)
-        mask |= MPWIDE_SOCKET_WRMASK; //don't check for write anymore
+  bool wantRecv() const { return rcur.remaining() > 0; }
+  bool wantSend() const { return scur.remaining() > 0; }
+
+  int nextRecv(struct iovec *iov, int maxiov) { return rcur.fill(iov, maxiov); }
+  int nextSend(struct iovec *iov, int maxiov) { return scur.fill(iov, maxiov); }
+
+  void recvDone(long long int n) {
+    rswap.arrived(rcur.advance(n));
+    if (rcur.mismatch() >= 0 && error == 0) {
+      error = checksumMismatch(this, rcur.mismatch(), where);
     }
+    #if MONITORING == 1
+    __sync_fetch_and_add(&bytes_sent, n);
+    #endif
+  }
+  void sendDone(long long int n) {
+    scur.advance(n);
+    #if MONITORING == 1
+    __sync_fetch_and_add(&bytes_sent, n);
+    #endif
+  }
+
+ private:
+  struct iovec siov, riov;
+  ChecksumCursor scur, rcur;
+  ElementSwap rswap;
+  const char *where; // what the offsets of the receiving side refer to.
+};
 
-    #if MPW_PacingMode == 1
-    usleep(pacing_sleeptime);
+/* Dynamic striping: a message is cut into chunks that the streams of a path take in
+ * turn as they become free. Each chunk is preceded by a header of sequence number,
+ * length and offset; a stream ends its share with a header of sequence number
+ * MPW_STRIPE_END. On a path with checksums, the data of a chunk is followed by the
+ * checksums of its pieces of checksum_chunk bytes. */
+#define MPW_STRIPE_HEADER 16
+#define MPW_STRIPE_END 0xffffffffU
+
+/* The chunks of an outgoing message. The headers stay in place until the exchange
+ * is over, as zero-copy sends may still refer to them. */
+struct StripeSchedule {
+  StripeSchedule(const struct iovec *iov, int iovcnt, long long int size, long long int chunk, int nstreams,
+                 long long int checksum_chunk)
+  : iov(iov), iovcnt(iovcnt), size(size), chunk(chunk), nchunks((size + chunk - 1) / chunk), checksum_chunk(checksum_chunk),
+    next(0), received(0), headers((nchunks + nstreams) * MPW_STRIPE_HEADER)
+  {
+    for (long long int i = 0; i < nchunks + nstreams; i++) {
+      unsigned char *h = &headers[i * MPW_STRIPE_HEADER];
+      const bool end = i >= nchunks;
+      serialize_uint32(h, end ? MPW_STRIPE_END : (unsigned int) i);
+      serialize_uint32(h + 4, end ? 0 : (unsigned int) min(chunk, size - i * chunk));
+      serialize_uint64(h + 8, end ? 0 : i * chunk);
+    }
+  }
+
+  const struct iovec *iov;
+  int iovcnt;
+  long long int size, chunk, nchunks;
+  long long int checksum_chunk;
+  long long int next;     // the next chunk to hand out, taken with an atomic increment.
+  long long int received; // payload bytes received by all streams.
+  std::vector<unsigned char> headers; // one per chunk, then an end marker per stream.
+};
+
+/* One stream's part of a striped exchange: it sends the chunks it manages to take from
+ * the schedule, and places the chunks it receives at the offsets their headers name. */
+class StripeTask : public StreamTask
+{
+ public:
+  StripeTask(Socket *sock, StripeSchedule *sched, int index, const struct iovec *recviov, int recvcnt, long long int recvsize,
+             int swap = 0)
+  : StreamTask(sock, sock), sched(sched), index(index), hdr(NULL), hdr_left(0), last(false), send_done(false),
+    recviov(recviov), recvcnt(recvcnt), recvsize(recvsize), rhdr_got(0), recv_done(false), swap(swap)
+  {}
+
+  bool wantSend() const { return !send_done; }
+  bool wantRecv() const { return !recv_done; }
+
+  int nextSend(struct iovec *iov, int maxiov) {
+    if (hdr == NULL) {
+      take();
+    }
+    int n = 0;
+    if (hdr_left > 0) {
+      iov[n].iov_base = hdr + MPW_STRIPE_HEADER - hdr_left;
+      iov[n].iov_len = hdr_left;
+      n++;
+    }
+    return n + scur.fill(iov + n, maxiov - n);
+  }
+
+  void sendDone(long long int n) {
+    const long long int h = min(n, hdr_left);
+    hdr_left -= h;
+    scur.advance(n - h);
+    #if MONITORING == 1
+    __sync_fetch_and_add(&bytes_sent, n - h);
     #endif
+    if (hdr_left == 0 && scur.remaining() == 0) {
+      send_done = last;
+      hdr = NULL;
+    }
   }
 
-  #ifdef PERF_TIMING
-  t = GetTime() - t;
-  LOG_DEBUG("This Send/Recv took: " << t << "s. Rate: " << (sendsize+recvsize)/(t*1024*1024)
-            << "MB/s. ch=" << (base_channel % 65536) << "/" << ((base_channel/65536) - 1));
-  SendRecvTime += t;
-  #endif
+  int nextRecv(struct iovec *iov, int maxiov) {
+    if (rhdr_got < MPW_STRIPE_HEADER) {
+      iov[0].iov_base = rhdr + rhdr_got;
+      iov[0].iov_len = MPW_STRIPE_HEADER - rhdr_got;
+      return 1;
+    }
+    return rcur.fill(iov, maxiov);
+  }
+
+  void recvDone(long long int n) {
+    if (rhdr_got < MPW_STRIPE_HEADER) {
+      rhdr_got += n;
+      if (rhdr_got == MPW_STRIPE_HEADER) {
+        header();
+      }
+      return;
+    }
+    const long long int data = rcur.advance(n);
+    rswap.arrived(data);
+    __sync_fetch_and_add(&sched->received, data);
+    if (rcur.mismatch() >= 0 && error == 0) {
+      error = checksumMismatch(this, rcur.mismatch(), "the message");
+    }
+    #if MONITORING == 1
+    __sync_fetch_and_add(&bytes_sent, n);
+    #endif
+    if (rcur.remaining() == 0) {
+      rhdr_got = 0;
+    }
+  }
+
+ private:
+  /* Take the next chunk, or the end marker once there are none left. */
+  void take() {
+    const long long int i = __sync_fetch_and_add(&sched->next, 1);
+    if (i < sched->nchunks) {
+      hdr = &sched->headers[i * MPW_STRIPE_HEADER];
+      scur.reset(sched->iov, sched->iovcnt, i * sched->chunk, min(sched->chunk, sched->size - i * sched->chunk),
+                 sched->checksum_chunk, true);
+    } else {
+      hdr = &sched->headers[(sched->nchunks + index) * MPW_STRIPE_HEADER];
+      scur.reset(NULL, 0, 0, 0, 0, true);
+      last = true;
+    }
+    hdr_left = MPW_STRIPE_HEADER;
+  }
+
+  void header() {
+    const unsigned int seq = deserialize_uint32(rhdr);
+    const long long int len = deserialize_uint32(rhdr + 4);
+    const long long int off = deserialize_uint64(rhdr + 8);
+    if (seq == MPW_STRIPE_END && len == 0) {
+      recv_done = true;
+      return;
+    }
+    if (len <= 0 || off < 0 || off + len > recvsize) {
+      LOG_ERR("Striped chunk " << seq << " (" << len << " bytes at " << off << ") does not fit in the "
+              << recvsize << " byte receive buffer.");
+      error = -EPROTO;
+      return;
+    }
+    rcur.reset(recviov, recvcnt, off, len, sched->checksum_chunk, false);
+    rswap.reset(recviov, recvcnt, off, swap);
+  }
+
+  StripeSchedule *sched;
+  int index;
+  unsigned char *hdr;      // header of the chunk being sent (NULL: none taken yet).
+  long long int hdr_left;  // ... and the part of it still to be sent.
+  bool last, send_done;
+  ChecksumCursor scur;
+
+  const struct iovec *recviov;
+  int recvcnt;
+  long long int recvsize;
+  unsigned char rhdr[MPW_STRIPE_HEADER];
+  long long int rhdr_got;
+  bool recv_done;
+  ChecksumCursor rcur;
+  int swap;
+  ElementSwap rswap;
+};
+
+/* Exchange a message over all streams of a path with dynamic striping. Typed messages
+ * are cut into chunks of whole elements of unit bytes, and swap (if > 1) is the size of
+ * the elements whose bytes are reversed as they arrive. */
+static int StripedSendRecv(const struct iovec* sendiov, int sendcnt, long long int sendsize,
+                           const struct iovec* recviov, int recvcnt, long long int recvsize, int path,
+                           int unit = 1, int swap = 0)
+{
+  MPWPath *p = getPath(path);
+  const long long int chunk = max((long long int) unit, p->stripe_chunk - p->stripe_chunk % unit);
+  StripeSchedule sched(sendiov, sendcnt, sendsize, chunk, p->num_streams, p->checksum_chunk);
+  std::vector<StreamTask*> tasks;
+  for (int i = 0; i < p->num_streams; i++) {
+    tasks.push_back(new StripeTask(client[p->streams[i]], &sched, i, recviov, recvcnt, recvsize, swap));
+    tasks.back()->stream = p->streams[i];
+  }
+  int ret = runTasks(tasks, p->pool);
+  if (ret >= 0 && sched.received != recvsize) {
+    LOG_ERR("Striped exchange received " << sched.received << " of " << recvsize << " bytes.");
+    ret = -EPROTO;
+  }
   return ret;
 }
 
-/* Data type intended to contain information for MPW_Relay (which relies on threads) */
-typedef struct relay_struct{
-  int channel;
-  int channel2;
-  int bufsize;
-}relay_struct;
+/* The path whose streams are exactly the given ones (-1 if there is none). */
+static int exactPath(const int *channel, int nc)
+{
+  if (nc < 1 || stream_path[channel[0]] < 0)
+    return -1;
+  const int path = stream_path[channel[0]];
+  MPWPath *p = getPath(path);
+  if (p == NULL || nc != p->num_streams)
+    return -1;
+  for (int i = 0; i < nc; i++) {
+    if (channel[i] != p->streams[i])
+      return -1;
+  }
+  return path;
+}
+
+/* The path whose streams are exactly the given ones, if it stripes its messages dynamically (-1 otherwise). */
+static int stripedPath(const int *channel, int nc)
+{
+  const int path = exactPath(channel, nc);
+  if (path < 0 || getPath(path)->stripe_chunk <= 0)
+    return -1;
+  return path;
+}
 
-/* MPWide Relay function: Provides two-way relay over one channel. */
-void* MPW_Relay(void* args) 
+/* Compression: each stream's share of a message is preceded by a frame header of magic,
+ * flags, share size and the number of bytes that follow on the wire. A compressed share is
+ * a sequence of blocks of MPW_COMPRESS_BLOCK bytes (the last one may be shorter), each
+ * preceded by its compressed size; a block that does not shrink is sent as it is, with its
+ * own size. Shares of 0 bytes are not sent at all. */
+#define MPW_ZFRAME_MAGIC 0x4d50575a // "MPWZ"
+#define MPW_ZFRAME_HEADER 24
+#define MPW_ZFRAME_COMPRESSED 1
+#define MPW_ZFRAME_CHECKSUMS 2 // the bytes after the header carry checksums (as on a path with checksums).
+#define MPW_COMPRESS_BLOCK (128*1024)
+/* Messages below this size are never compressed. */
+#define MPW_COMPRESS_MIN (16*1024)
+/* A path in MPW_COMPRESS_AUTO that does not compress still compresses one message in this many, to measure again. */
+#define MPW_COMPRESS_PROBE 16
+
+/* The path whose streams are exactly the given ones, if it compresses its messages (-1 otherwise). */
+static int compressedPath(const int *channel, int nc)
 {
-  relay_struct *r = (relay_struct *)args;
+  const int path = exactPath(channel, nc);
+  if (path < 0 || getPath(path)->compression.getMode() == MPW_COMPRESS_OFF)
+    return -1;
+  return path;
+}
 
-  int mode  = 0;
-  int mode2 = 0;
-  long long int n     = 0;
-  long long int ns    = 0;
-  long long int n2    = 0;
-  long long int ns2   = 0;
+static void average(double &avg, double sample)
+{
+  avg = avg > 0 ? 0.75 * avg + 0.25 * sample : sample;
+}
 
-  int   channel  = r->channel;
-  int   channel2 = r->channel2;
-  int   bufsize  = r->bufsize;
-  
-  char* buf      = (char *) malloc(bufsize);
-  char* buf2     = (char *) malloc(bufsize);
-  
-  LOG_DEBUG("Starting Relay Channel #" << channel);
-  int tmp = 0;
-
-  while(1) {
-
-    mode  = client[channel]->select_me(0);
-    mode2 = client[channel2]->select_me(0);
-    //std::cout << "mode/mode2 = " << mode << "/" << mode2 << "--" << n << "/" << n2 << "/" << ns << "/" << ns2 <<std::endl;
-
-    /* Recv from channel 1 */
-    if(mode%2 == 1) {
-      if(n == ns) {
-        n = 0; ns = 0;
-      }  
-      tmp = client[channel]->irecv(buf+n,min(bufsize-n,relay_rsize));
-      n += tmp; 
-      LOG_TRACE("Retrieved from 1: " << n);
-    }
-    /* ...forward to channel 2. */
-    if(mode2/2 == 1 && n > 0) {
-      tmp = client[channel2]->isend(buf+ns,min(n-ns,relay_ssize));
-      ns += tmp;
-      LOG_TRACE("Sent to 2: " << ns);
+int CompressionState::getMode()
+{
+  pthread_mutex_lock(&lock);
+  const int m = mode;
+  pthread_mutex_unlock(&lock);
+  return m;
+}
+
+bool CompressionState::choose(long long int size)
+{
+  if (size < MPW_COMPRESS_MIN)
+    return false;
+  pthread_mutex_lock(&lock);
+  bool yes = true;
+  if (mode == MPW_COMPRESS_AUTO && ratio > 0 && compress_rate > 0 && link_rate > 0) {
+    /* Seconds per byte for compressing, sending the compressed bytes and decompressing them
+     * on the other side (assumed to be as fast as here, or as compressing until measured),
+     * against those for sending the bytes as they are. */
+    const double decompress = decompress_rate > 0 ? decompress_rate : compress_rate;
+    yes = 1.0 / compress_rate + ratio / link_rate + 1.0 / decompress < 1.0 / link_rate;
+    if (!yes && ++since_probe >= MPW_COMPRESS_PROBE)
+      yes = true;
+  }
+  if (yes)
+    since_probe = 0;
+  pthread_mutex_unlock(&lock);
+  return yes;
+}
+
+void CompressionState::sample(long long int size, long long int wire, bool was_compressed, long long int compress_ns,
+                              long long int link_bytes, long long int link_ns, long long int decompressed, long long int decompress_ns)
+{
+  pthread_mutex_lock(&lock);
+  if (size > 0) {
+    messages++;
+    raw_bytes += size;
+    wire_bytes += wire;
+    active = was_compressed;
+    if (was_compressed) {
+      compressed++;
+      average(ratio, (double) wire / size);
+      if (compress_ns > 0)
+        average(compress_rate, size * 1e9 / compress_ns);
     }
-    
-    // Recv from channel 2 
-    if(mode2%2 == 1) {  
-      if(n2 == ns2) {
-        n2 = 0; ns2 = 0;
+  }
+  if (link_bytes >= MPW_COMPRESS_MIN && link_ns > 0)
+    average(link_rate, link_bytes * 1e9 / link_ns);
+  if (decompressed > 0 && decompress_ns > 0)
+    average(decompress_rate, decompressed * 1e9 / decompress_ns);
+  pthread_mutex_unlock(&lock);
+}
+
+/* The bytes [offset, offset+len) of an iovec list if they are contiguous, or NULL. */
+static char *iovSpan(const struct iovec *iov, int iovcnt, long long int offset, long long int len)
+{
+  IovCursor c(iov, iovcnt, offset, len);
+  struct iovec part;
+  if (c.fill(&part, 1) == 1 && (long long int) part.iov_len == len)
+    return (char *) part.iov_base;
+  return NULL;
+}
+
+/* Copy the bytes [offset, offset+len) of an iovec list to buf, or (to_iov) from buf. */
+static void iovCopy(const struct iovec *iov, int iovcnt, long long int offset, long long int len, char *buf, bool to_iov)
+{
+  IovCursor c(iov, iovcnt, offset, len);
+  struct iovec part[MPW_TASK_MAXIOV];
+  while (c.remaining() > 0) {
+    const int n = c.fill(part, MPW_TASK_MAXIOV);
+    for (int i = 0; i < n; i++) {
+      if (to_iov)
+        memcpy(part[i].iov_base, buf, part[i].iov_len);
+      else
+        memcpy(buf, part[i].iov_base, part[i].iov_len);
+      buf += part[i].iov_len;
+      c.advance(part[i].iov_len);
+    }
+  }
+}
+
+/* One stream's share of a message in a compressing exchange. */
+struct ZShare {
+  ZShare() : offset(0), size(0), wire(0), compressed(false) {}
+  long long int offset, size; // the part of the message.
+  long long int wire;         // bytes that follow the frame header.
+  bool compressed;
+  unsigned char hdr[MPW_ZFRAME_HEADER];
+  std::vector<struct iovec> blocks; // sending compressed: the blocks with their sizes.
+  std::vector<char> buf;            // receiving compressed: the share as it arrived.
+};
+
+/* A block of a message and where it goes to or comes from. */
+struct ZBlock {
+  ZShare *share;
+  long long int offset, size; // the part of the message.
+  char *data;                 // the compressed block (behind its size, when sending).
+  long long int coded;        // its compressed size.
+};
+
+/* Compress the blocks of an outgoing message, each into its own slot. */
+class CompressJob : public CodecJob
+{
+ public:
+  CompressJob(const struct iovec *iov, int iovcnt) : iov(iov), iovcnt(iovcnt) {}
+
+  void run(long long int i) {
+    ZBlock &b = blocks[i];
+    std::vector<char> tmp;
+    const char *src = iovSpan(iov, iovcnt, b.offset, b.size);
+    if (src == NULL) {
+      tmp.resize(b.size);
+      iovCopy(iov, iovcnt, b.offset, b.size, &tmp[0], false);
+      src = &tmp[0];
+    }
+    int n = Codec::compress(src, (int) b.size, b.data + 4, (int) b.size - 1);
+    if (n <= 0) {
+      memcpy(b.data + 4, src, b.size);
+      n = (int) b.size;
+    }
+    serialize_uint32((unsigned char *) b.data, n);
+    b.coded = n;
+  }
+
+  const struct iovec *iov;
+  int iovcnt;
+  std::vector<ZBlock> blocks;
+};
+
+/* Decompress the blocks of an incoming message into place. */
+class DecompressJob : public CodecJob
+{
+ public:
+  DecompressJob(const struct iovec *iov, int iovcnt, int swap) : iov(iov), iovcnt(iovcnt), swap(swap), failed(0) {}
+
+  void run(long long int i) {
+    ZBlock &b = blocks[i];
+    std::vector<char> tmp;
+    char *dst = iovSpan(iov, iovcnt, b.offset, b.size);
+    if (dst == NULL) {
+      tmp.resize(b.size);
+      dst = &tmp[0];
+    }
+    if (b.coded == b.size) {
+      memcpy(dst, b.data, b.size);
+    } else if (Codec::decompress(b.data, (int) b.coded, dst, (int) b.size) != b.size) {
+      __sync_fetch_and_add(&failed, 1);
+      return;
+    }
+    if (swap > 1)
+      swap_elements(dst, b.size / swap, swap);
+    if (!tmp.empty())
+      iovCopy(iov, iovcnt, b.offset, b.size, dst, true);
+  }
+
+  const struct iovec *iov;
+  int iovcnt;
+  int swap;   // the size of the elements whose bytes are reversed (if > 1).
+  int failed; // blocks that did not decompress.
+  std::vector<ZBlock> blocks;
+};
+
+/* One stream's part of a compressing exchange: it sends its share behind a frame header,
+ * and receives the share of the other side, straight into place if it is not compressed. */
+class FrameTask : public StreamTask
+{
+ public:
+  FrameTask(Socket *sock, ZShare *out, const struct iovec *sendiov, int sendcnt,
+            ZShare *in, const struct iovec *recviov, int recvcnt, long long int checksum_chunk, int swap)
+  : StreamTask(sock, sock), out(out), hdr_left(out ? MPW_ZFRAME_HEADER : 0),
+    in(in), recviov(recviov), recvcnt(recvcnt), rhdr_got(0), recv_done(in == NULL), swap(swap)
+  {
+    if (out && out->compressed) {
+      scur.reset(&out->blocks[0], out->blocks.size(), 0, out->wire, checksum_chunk, true);
+    } else if (out) {
+      scur.reset(sendiov, sendcnt, out->offset, out->size, checksum_chunk, true);
+    }
+  }
+
+  bool wantSend() const { return hdr_left > 0 || scur.remaining() > 0; }
+  bool wantRecv() const { return !recv_done; }
+
+  int nextSend(struct iovec *iov, int maxiov) {
+    int n = 0;
+    if (hdr_left > 0) {
+      iov[n].iov_base = out->hdr + MPW_ZFRAME_HEADER - hdr_left;
+      iov[n].iov_len = hdr_left;
+      n++;
+    }
+    return n + scur.fill(iov + n, maxiov - n);
+  }
+
+  void sendDone(long long int n) {
+    const long long int h = min(n, hdr_left);
+    hdr_left -= h;
+    scur.advance(n - h);
+    #if MONITORING == 1
+    __sync_fetch_and_add(&bytes_sent, n - h);
+    #endif
+  }
+
+  int nextRecv(struct iovec *iov, int maxiov) {
+    if (rhdr_got < MPW_ZFRAME_HEADER) {
+      iov[0].iov_base = rhdr + rhdr_got;
+      iov[0].iov_len = MPW_ZFRAME_HEADER - rhdr_got;
+      return 1;
+    }
+    return rcur.fill(iov, maxiov);
+  }
+
+  void recvDone(long long int n) {
+    if (rhdr_got < MPW_ZFRAME_HEADER) {
+      rhdr_got += n;
+      if (rhdr_got == MPW_ZFRAME_HEADER) {
+        header();
       }
-      tmp = client[channel2]->irecv(buf2+n2,min(bufsize-n2,relay_rsize));
-      n2 += tmp;
-      LOG_TRACE("Retrieved from 2: " << n2);
+      return;
     }
-    // ...forward to channel 1. 
-    if(mode/2 == 1 && n2 > 0) {
-      tmp = client[channel]->isend(buf2+ns2,min(n2-ns2,relay_ssize));
-      ns2 += tmp;
-      LOG_TRACE("Sent to 1: " << ns2);
+    rswap.arrived(rcur.advance(n));
+    if (rcur.mismatch() >= 0 && error == 0) {
+      error = checksumMismatch(this, rcur.mismatch(), in->compressed ? "its compressed share" : "the message");
     }
-    
-    #if MPW_PacingMode == 1
-    usleep(pacing_sleeptime);
+    #if MONITORING == 1
+    __sync_fetch_and_add(&bytes_sent, n);
     #endif
+    recv_done = rcur.remaining() == 0;
   }
-  
-  free(buf);
-  free(buf2);
 
+ private:
+  void header() {
+    const unsigned int magic = deserialize_uint32(rhdr);
+    const unsigned int flags = deserialize_uint32(rhdr + 4);
+    const long long int size = deserialize_uint64(rhdr + 8);
+    const long long int wire = deserialize_uint64(rhdr + 16);
+    const bool compressed = (flags & MPW_ZFRAME_COMPRESSED) != 0;
+    const long long int checksum_chunk = (flags & MPW_ZFRAME_CHECKSUMS) ? MPW_CHECKSUM_CHUNK : 0;
+    const long long int blocks = (in->size + MPW_COMPRESS_BLOCK - 1) / MPW_COMPRESS_BLOCK;
+    if (magic != MPW_ZFRAME_MAGIC || size != in->size ||
+        (compressed ? wire < 4 * blocks || wire > size + 4 * blocks : wire != size)) {
+      LOG_ERR("Compressed frame of " << size << " (" << wire << " on the wire) bytes does not match the "
+              << in->size << " bytes expected on this stream.");
+      error = -EPROTO;
+      return;
+    }
+    in->compressed = compressed;
+    in->wire = wire;
+    if (compressed) {
+      in->buf.resize(wire);
+      biov.iov_base = &in->buf[0];
+      biov.iov_len = wire;
+      rcur.reset(&biov, 1, 0, wire, checksum_chunk, false);
+    } else {
+      rcur.reset(recviov, recvcnt, in->offset, size, checksum_chunk, false);
+      rswap.reset(recviov, recvcnt, in->offset, swap);
+    }
+    recv_done = wire == 0;
+  }
+
+  ZShare *out;
+  long long int hdr_left;
+  ChecksumCursor scur;
+
+  ZShare *in;
+  const struct iovec *recviov;
+  int recvcnt;
+  unsigned char rhdr[MPW_ZFRAME_HEADER];
+  long long int rhdr_got;
+  struct iovec biov;
+  bool recv_done;
+  ChecksumCursor rcur;
+  int swap;
+  ElementSwap rswap; // shares that arrive as they are; compressed ones are swapped as they are decompressed.
+};
+
+/* Find the blocks of the compressed shares that arrived. Returns false if one is malformed. */
+static bool receivedBlocks(std::vector<ZShare> &in, DecompressJob &job, long long int &decompressed)
+{
+  for (size_t i = 0; i < in.size(); i++) {
+    ZShare &s = in[i];
+    if (!s.compressed)
+      continue;
+    long long int pos = 0;
+    for (long long int off = 0; off < s.size; off += MPW_COMPRESS_BLOCK) {
+      ZBlock b;
+      b.share = &s;
+      b.offset = s.offset + off;
+      b.size = min((long long int) MPW_COMPRESS_BLOCK, s.size - off);
+      if (pos + 4 > s.wire)
+        return false;
+      b.coded = deserialize_uint32((unsigned char *) &s.buf[pos]);
+      b.data = &s.buf[pos + 4];
+      pos += 4 + b.coded;
+      if (b.coded < 1 || b.coded > b.size || pos > s.wire)
+        return false;
+      job.blocks.push_back(b);
+    }
+    if (pos != s.wire)
+      return false;
+    decompressed += s.size;
+  }
+  return true;
+}
+
+/* Exchange a message over all streams of a path through its compression stage. unit and
+ * swap are as for StripedSendRecv. */
+static int CompressedSendRecv(const struct iovec* sendiov, int sendcnt, long long int sendsize,
+                              const struct iovec* recviov, int recvcnt, long long int recvsize, int path,
+                              int unit = 1, int swap = 0)
+{
+  MPWPath *p = getPath(path);
+  int nc = p->num_streams;
+#if OptimizeStreamCount == 1
+  nc = max(1, min(nc, max(sendsize, recvsize)/BytesPerStream) );
+#endif
+  std::vector<ZShare> out(nc), in(nc);
+  long long int soffset = 0, roffset = 0;
+  for (int i = 0; i < nc; i++) {
+    out[i].offset = soffset;
+    out[i].size = shareSize(sendsize, nc, i, unit);
+    in[i].offset = roffset;
+    in[i].size = shareSize(recvsize, nc, i, unit);
+    soffset += out[i].size;
+    roffset += in[i].size;
+  }
+
+  /* Compress the blocks of all shares at once, each into a slot that leaves room for it to
+   * be sent as it is. */
+  const bool compress = p->compression.choose(sendsize);
+  const long long int t0 = TokenBucket::now();
+  CompressJob cjob(sendiov, sendcnt);
+  std::vector<char> slots;
+  if (compress) {
+    for (int i = 0; i < nc; i++) {
+      for (long long int off = 0; off < out[i].size; off += MPW_COMPRESS_BLOCK) {
+        ZBlock b;
+        b.share = &out[i];
+        b.offset = out[i].offset + off;
+        b.size = min((long long int) MPW_COMPRESS_BLOCK, out[i].size - off);
+        b.data = NULL;
+        b.coded = 0;
+        cjob.blocks.push_back(b);
+      }
+    }
+    slots.resize(cjob.blocks.size() * (4 + MPW_COMPRESS_BLOCK));
+    for (size_t j = 0; j < cjob.blocks.size(); j++) {
+      cjob.blocks[j].data = &slots[j * (4 + MPW_COMPRESS_BLOCK)];
+    }
+    Codec::run(&cjob, cjob.blocks.size());
+    for (size_t j = 0; j < cjob.blocks.size(); j++) {
+      const ZBlock &b = cjob.blocks[j];
+      struct iovec v = { b.data, (size_t) (4 + b.coded) };
+      b.share->blocks.push_back(v);
+      b.share->wire += v.iov_len;
+    }
+  }
+  long long int swire = 0;
+  for (int i = 0; i < nc; i++) {
+    out[i].compressed = compress;
+    if (!compress)
+      out[i].wire = out[i].size;
+    swire += out[i].wire;
+    serialize_uint32(out[i].hdr, MPW_ZFRAME_MAGIC);
+    serialize_uint32(out[i].hdr + 4, (compress ? MPW_ZFRAME_COMPRESSED : 0) | (p->checksum_chunk > 0 ? MPW_ZFRAME_CHECKSUMS : 0));
+    serialize_uint64(out[i].hdr + 8, out[i].size);
+    serialize_uint64(out[i].hdr + 16, out[i].wire);
+  }
+  const long long int t1 = TokenBucket::now();
+
+  std::vector<StreamTask*> tasks;
+  for (int i = 0; i < nc; i++) {
+    tasks.push_back(new FrameTask(client[p->streams[i]], out[i].size > 0 ? &out[i] : NULL, sendiov, sendcnt,
+                                  in[i].size > 0 ? &in[i] : NULL, recviov, recvcnt, p->checksum_chunk, swap));
+    tasks.back()->stream = p->streams[i];
+  }
+  int ret = runTasks(tasks, p->pool);
+  const long long int t2 = TokenBucket::now();
+  if (ret < 0)
+    return ret;
+
+  long long int rwire = 0, decompressed = 0;
+  for (int i = 0; i < nc; i++) {
+    rwire += in[i].wire;
+  }
+  DecompressJob djob(recviov, recvcnt, swap);
+  if (!receivedBlocks(in, djob, decompressed)) {
+    LOG_ERR("Received a malformed compressed message.");
+    return -EPROTO;
+  }
+  Codec::run(&djob, djob.blocks.size());
+  if (djob.failed > 0) {
+    LOG_ERR(djob.failed << " blocks of a compressed message did not decompress.");
+    return -EPROTO;
+  }
+  const long long int t3 = TokenBucket::now();
+
+  p->compression.sample(sendsize, swire, compress, t1 - t0, max(swire, rwire), t2 - t1, decompressed, t3 - t2);
+  return ret;
+}
+
+/* Tagged messages: a path that carries them is read by a thread of its own, which
+ * files every incoming message under its channel until a MPW_RecvTagged takes it.
+ * A message is sent as one or more fragments, each on whichever stream is free,
+ * preceded by a header of magic, channel, tag, fragment length, per-channel sequence
+ * number, message size and fragment offset. */
+#define MPW_TAG_MAGIC 0x4d505754 // "MPWT"
+#define MPW_TAG_HEADER 40
+/* A header on this channel ends the stream: the other side stops reading it. */
+#define MPW_TAG_CLOSE 0xffffffffU
+
+/* A message being received, or waiting to be taken. */
+struct TaggedMessage {
+  int tag;
+  long long int size;
+  long long int got;  // bytes received so far.
+  bool claimed;       // a MPW_RecvTagged waits for the rest of it.
+  char *data;
+};
+
+/* The messages of one channel, by sequence number. */
+struct TagChannel {
+  TagChannel() : send_seq(0), frontier(0) {}
+  unsigned long long send_seq;  // sequence number of the next message sent.
+  unsigned long long frontier;  // lowest sequence number none of whose fragments has arrived.
+  std::set<unsigned long long> ahead; // sequence numbers beyond the frontier that have arrived.
+  std::map<unsigned long long, TaggedMessage*> messages;
+};
+
+class TagMux;
+
+/* Reads the fragments arriving on one stream of a tagged path. It never finishes. */
+class DemuxTask : public StreamTask
+{
+ public:
+  DemuxTask(Socket *sock, TagMux *mux) : StreamTask(sock, sock), mux(mux), got(0), msg(NULL), left(0), closed(false) {}
+
+  bool wantRecv() const { return !closed; }
+  int nextRecv(struct iovec *iov, int maxiov) {
+    if (got < MPW_TAG_HEADER) {
+      iov[0].iov_base = hdr + got;
+      iov[0].iov_len = MPW_TAG_HEADER - got;
+    } else {
+      iov[0].iov_base = dst;
+      iov[0].iov_len = left;
+    }
+    return 1;
+  }
+  void recvDone(long long int n);
+  void complete();
+
+ private:
+  TagMux *mux;
+  unsigned char hdr[MPW_TAG_HEADER];
+  long long int got;
+  TaggedMessage *msg; // message the fragment belongs to.
+  char *dst;          // where the rest of the fragment goes.
+  long long int left; // ... and how much of it is still to come.
+  bool closed;        // the other side has closed the stream.
+};
+
+class TagMux
+{
+ public:
+  TagMux(MPWPath *p) : path(p), error(0), stopping(false), rr(0), closed(0), locks(p->num_streams)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    for (int i = 0; i < p->num_streams; i++) {
+      pthread_mutex_init(&locks[i], NULL);
+    }
+    engine = new ProgressEngine(use_io_uring);
+    engine->recv_chunk = tcpbuf_rsize;
+    if (pipe(wake) == 0) {
+      engine->setWakeFd(wake[0]);
+    }
+    for (int i = 0; i < p->num_streams; i++) {
+      tasks.push_back(new DemuxTask(client[p->streams[i]], this));
+      engine->add(tasks.back());
+    }
+    running = pthread_create(&thread, NULL, loop, this) == 0;
+  }
+
+  ~TagMux()
+  {
+    stop();
+    delete engine;
+    ::close(wake[0]);
+    ::close(wake[1]);
+    for (size_t i = 0; i < tasks.size(); i++) {
+      delete tasks[i];
+    }
+    for (std::map<int, TagChannel>::iterator c = channels.begin(); c != channels.end(); ++c) {
+      for (std::map<unsigned long long, TaggedMessage*>::iterator m = c->second.messages.begin(); m != c->second.messages.end(); ++m) {
+        delete [] m->second->data;
+        delete m->second;
+      }
+    }
+    for (size_t i = 0; i < locks.size(); i++) {
+      pthread_mutex_destroy(&locks[i]);
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&lock);
+  }
+
+  int send(const char *buf, long long int size, int channel, int tag);
+  // Stop reading the streams.
+  void stop()
+  {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_mutex_unlock(&lock);
+    if (write(wake[1], "x", 1) < 0) {}
+    if (running) {
+      pthread_join(thread, NULL);
+      running = false;
+    }
+  }
+  // Tell the other side that no more messages will come.
+  void close();
+  long long int recv(char *buf, long long int maxsize, int channel, int tag, int *recv_tag, bool wait);
+
+  /* Called by the DemuxTasks, on the mux thread. */
+  TaggedMessage *fragment(const unsigned char *hdr, char **dst, long long int *len);
+  void received(TaggedMessage *msg, long long int n);
+  void failed(int err);
+  void closedStream();
+
+ private:
+  static void *loop(void *args)
+  {
+    TagMux *mux = (TagMux *) args;
+    for (;;) {
+      pthread_mutex_lock(&mux->lock);
+      const bool stop = mux->stopping || mux->error < 0;
+      pthread_mutex_unlock(&mux->lock);
+      if (stop) {
+        return NULL;
+      }
+      mux->engine->poll(1000);
+    }
+  }
+
+  // The first message of the channel at or after the frontier's prefix that matches tag (NULL: none yet).
+  TaggedMessage *match(TagChannel &c, int tag, unsigned long long *seq);
+
+  MPWPath *path;
+  int error;
+  bool stopping, running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // signalled when a message arrives or completes.
+  int wake[2];
+  long long int rr;    // stream the next search for a free one starts at.
+  int closed;          // streams closed by the other side.
+  std::vector<pthread_mutex_t> locks; // held while a fragment is sent on the stream.
+  ProgressEngine *engine;
+  std::vector<DemuxTask*> tasks;
+  std::map<int, TagChannel> channels;
+};
+
+void DemuxTask::recvDone(long long int n)
+{
+  if (got < MPW_TAG_HEADER) {
+    got += n;
+    if (got == MPW_TAG_HEADER && deserialize_uint32(hdr + 4) == MPW_TAG_CLOSE) {
+      closed = true;
+    } else if (got == MPW_TAG_HEADER) {
+      msg = mux->fragment(hdr, &dst, &left);
+      if (msg == NULL) {
+        error = -EPROTO;
+      } else if (left == 0) {
+        got = 0;
+      }
+    }
+    return;
+  }
+  dst += n;
+  left -= n;
+  mux->received(msg, n);
+  if (left == 0) {
+    got = 0;
+  }
+}
+
+void DemuxTask::complete()
+{
+  if (error < 0) {
+    mux->failed(error);
+  } else {
+    mux->closedStream();
+  }
+}
+
+TaggedMessage *TagMux::fragment(const unsigned char *hdr, char **dst, long long int *len)
+{
+  const int channel = (int) deserialize_uint32(hdr + 4);
+  const int tag = (int) deserialize_uint32(hdr + 8);
+  const long long int flen = deserialize_uint32(hdr + 12);
+  const unsigned long long seq = deserialize_uint64(hdr + 16);
+  const long long int size = (long long int) deserialize_uint64(hdr + 24);
+  const long long int offset = (long long int) deserialize_uint64(hdr + 32);
+  if (deserialize_uint32(hdr) != MPW_TAG_MAGIC || size < 0 || offset < 0 || offset + flen > size) {
+    LOG_ERR("Invalid tagged message fragment on channel " << channel << ".");
+    return NULL;
+  }
+
+  pthread_mutex_lock(&lock);
+  TagChannel &c = channels[channel];
+  TaggedMessage *msg = NULL;
+  std::map<unsigned long long, TaggedMessage*>::iterator it = c.messages.find(seq);
+  if (it != c.messages.end()) {
+    msg = it->second;
+  } else if (seq >= c.frontier && c.ahead.count(seq) == 0) {
+    msg = new TaggedMessage();
+    msg->tag = tag;
+    msg->size = size;
+    msg->got = 0;
+    msg->claimed = false;
+    msg->data = new char[max(size, 1LL)];
+    c.messages[seq] = msg;
+    c.ahead.insert(seq);
+    while (!c.ahead.empty() && *c.ahead.begin() == c.frontier) {
+      c.ahead.erase(c.ahead.begin());
+      c.frontier++;
+    }
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+  if (msg == NULL || msg->size != size) {
+    LOG_ERR("Fragment of tagged message " << seq << " on channel " << channel << " does not fit it.");
+    return NULL;
+  }
+  *dst = msg->data + offset;
+  *len = flen;
+  if (flen == 0) {
+    received(msg, 0); // an empty message is complete once its header is in.
+  }
+  return msg;
+}
+
+void TagMux::received(TaggedMessage *msg, long long int n)
+{
+  pthread_mutex_lock(&lock);
+  msg->got += n;
+  if (msg->got == msg->size) {
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void TagMux::failed(int err)
+{
+  pthread_mutex_lock(&lock);
+  if (!stopping && error == 0) {
+    LOG_ERR("Tagged message stream failed: " << strerror(err < 0 ? -err : EIO));
+  }
+  error = err < 0 ? err : -EIO;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+void TagMux::closedStream()
+{
+  pthread_mutex_lock(&lock);
+  if (++closed == path->num_streams && error == 0) {
+    error = -ECONNRESET; // whatever is still queued can be received, nothing more will come.
+  }
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+void TagMux::close()
+{
+  pthread_mutex_lock(&lock);
+  const int err = error;
+  pthread_mutex_unlock(&lock);
+  if (err < 0) {
+    return;
+  }
+  unsigned char hdr[MPW_TAG_HEADER];
+  memset(hdr, 0, sizeof(hdr));
+  serialize_uint32(hdr, MPW_TAG_MAGIC);
+  serialize_uint32(hdr + 4, MPW_TAG_CLOSE);
+  std::vector<StreamTask*> tasks;
+  for (int i = 0; i < path->num_streams; i++) {
+    pthread_mutex_lock(&locks[i]);
+    const int stream = path->streams[i];
+    tasks.push_back(new SendRecvTask(client[stream], client[stream], (char *) hdr, MPW_TAG_HEADER, NULL, 0));
+    tasks.back()->stream = stream;
+  }
+  runTasks(tasks, path->pool);
+  for (int i = 0; i < path->num_streams; i++) {
+    pthread_mutex_unlock(&locks[i]);
+  }
+}
+
+TaggedMessage *TagMux::match(TagChannel &c, int tag, unsigned long long *seq)
+{
+  for (std::map<unsigned long long, TaggedMessage*>::iterator it = c.messages.begin();
+       it != c.messages.end() && it->first < c.frontier; ++it) {
+    if (!it->second->claimed && (tag == MPW_ANY_TAG || it->second->tag == tag)) {
+      *seq = it->first;
+      return it->second;
+    }
+  }
   return NULL;
 }
 
+long long int TagMux::recv(char *buf, long long int maxsize, int channel, int tag, int *recv_tag, bool wait)
+{
+  pthread_mutex_lock(&lock);
+  TagChannel &c = channels[channel];
+  unsigned long long seq = 0;
+  TaggedMessage *msg = match(c, tag, &seq);
+  while (msg == NULL && wait && error == 0) {
+    pthread_cond_wait(&cond, &lock);
+    msg = match(c, tag, &seq);
+  }
+  if (msg == NULL) {
+    const int ret = error < 0 ? error : -EAGAIN;
+    pthread_mutex_unlock(&lock);
+    return ret;
+  }
+  if (recv_tag) {
+    *recv_tag = msg->tag;
+  }
+  const long long int size = msg->size;
+  if (buf == NULL) {
+    pthread_mutex_unlock(&lock); // probe only.
+    return size;
+  }
+  if (size > maxsize) {
+    pthread_mutex_unlock(&lock);
+    LOG_ERR("Tagged message of " << size << " bytes does not fit in " << maxsize << " bytes.");
+    return -EMSGSIZE;
+  }
+  msg->claimed = true;
+  while (msg->got < msg->size && error == 0) {
+    pthread_cond_wait(&cond, &lock);
+  }
+  if (msg->got < msg->size) {
+    msg->claimed = false;
+    const int ret = error;
+    pthread_mutex_unlock(&lock);
+    return ret;
+  }
+  c.messages.erase(seq);
+  pthread_mutex_unlock(&lock);
+
+  memcpy(buf, msg->data, size);
+  delete [] msg->data;
+  delete msg;
+  return size;
+}
+
+int TagMux::send(const char *buf, long long int size, int channel, int tag)
+{
+  pthread_mutex_lock(&lock);
+  const unsigned long long seq = channels[channel].send_seq++;
+  const int err = error;
+  pthread_mutex_unlock(&lock);
+  if (err < 0) {
+    return err;
+  }
+
+  const int n = path->num_streams;
+  const long long int chunk = path->stripe_chunk > 0 ? path->stripe_chunk : default_stripe_chunk;
+  const long long int nfrags = max(1LL, (size + chunk - 1) / chunk);
+  std::vector<unsigned char> headers(nfrags * MPW_TAG_HEADER);
+  for (long long int f = 0; f < nfrags; f++) {
+    unsigned char *h = &headers[f * MPW_TAG_HEADER];
+    serialize_uint32(h, MPW_TAG_MAGIC);
+    serialize_uint32(h + 4, (unsigned int) channel);
+    serialize_uint32(h + 8, (unsigned int) tag);
+    serialize_uint32(h + 12, (unsigned int) min(chunk, size - f * chunk));
+    serialize_uint64(h + 16, seq);
+    serialize_uint64(h + 24, size);
+    serialize_uint64(h + 32, f * chunk);
+  }
+
+  /* Send the fragments in rounds over the streams that are free, so that messages of
+   * other channels can go in between. */
+  int ret = 0;
+  for (long long int f = 0; f < nfrags && ret >= 0; ) {
+    std::vector<int> taken;
+    const long long int start = __sync_fetch_and_add(&rr, 1);
+    for (int i = 0; i < n && (long long int) taken.size() < nfrags - f; i++) {
+      const int s = (start + i) % n;
+      if (pthread_mutex_trylock(&locks[s]) == 0) {
+        taken.push_back(s);
+      }
+    }
+    if (taken.empty()) {
+      const int s = start % n;
+      pthread_mutex_lock(&locks[s]);
+      taken.push_back(s);
+    }
+
+    std::vector<struct iovec> iov(2 * taken.size());
+    std::vector<StreamTask*> tasks;
+    for (size_t i = 0; i < taken.size(); i++, f++) {
+      iov[2*i].iov_base = &headers[f * MPW_TAG_HEADER];
+      iov[2*i].iov_len = MPW_TAG_HEADER;
+      iov[2*i+1].iov_base = (char *) buf + f * chunk;
+      iov[2*i+1].iov_len = min(chunk, size - f * chunk);
+      const int stream = path->streams[taken[i]];
+      tasks.push_back(new SendRecvTask(client[stream], client[stream], &iov[2*i], 2, 0, MPW_TAG_HEADER + iov[2*i+1].iov_len,
+                                       NULL, 0, 0, 0));
+      tasks.back()->stream = stream;
+    }
+    ret = runTasks(tasks, path->pool);
+    for (size_t i = 0; i < taken.size(); i++) {
+      pthread_mutex_unlock(&locks[taken[i]]);
+    }
+  }
+  return ret;
+}
+
+static pthread_mutex_t tag_mux_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The tagged message state of a path, started on first use. */
+static TagMux *tagMux(MPWPath *path)
+{
+  pthread_mutex_lock(&tag_mux_lock);
+  if (path->mux == NULL) {
+    path->mux = new TagMux(path);
+  }
+  TagMux *mux = path->mux;
+  pthread_mutex_unlock(&tag_mux_lock);
+  return mux;
+}
+
+static void deleteTagMux(TagMux *mux)
+{
+  if (mux) {
+    /* Stop reading first: once the other side has our close headers, it may close the
+     * streams without sending its own, and a read would then find them closed. */
+    mux->stop();
+    mux->close();
+    delete mux;
+  }
+}
+
+int MPW_SendTagged(const char* buf, long long int size, int channel, int tag, int path) {
+  MPWPath *p = getPath(path);
+  if (p == NULL || size < 0 || channel < 0 || tag < 0) {
+    return -EINVAL;
+  }
+  if (p->checksum_chunk > 0) {
+    return -ENOTSUP; // tagged messages carry no checksums.
+  }
+  return tagMux(p)->send(buf, size, channel, tag);
+}
+
+long long int MPW_RecvTagged(char* buf, long long int maxsize, int channel, int tag, int path, int* recv_tag) {
+  MPWPath *p = getPath(path);
+  if (p == NULL || buf == NULL || channel < 0 || tag < MPW_ANY_TAG) {
+    return -EINVAL;
+  }
+  if (p->checksum_chunk > 0) {
+    return -ENOTSUP; // tagged messages carry no checksums.
+  }
+  return tagMux(p)->recv(buf, maxsize, channel, tag, recv_tag, true);
+}
+
+long long int MPW_ProbeTagged(int channel, int tag, int path, int* recv_tag) {
+  MPWPath *p = getPath(path);
+  if (p == NULL || channel < 0 || tag < MPW_ANY_TAG) {
+    return -EINVAL;
+  }
+  if (p->checksum_chunk > 0) {
+    return -ENOTSUP; // tagged messages carry no checksums.
+  }
+  return tagMux(p)->recv(NULL, 0, channel, tag, recv_tag, false);
+}
+
+/* One direction of MPW_Relay: everything read from rsock is forwarded to wsock. */
+class ForwardTask : public StreamTask
+{
+ public:
+  ForwardTask(Socket *from, Socket *to, int bufsize)
+  : StreamTask(from, to), bufsize(bufsize), n(0), ns(0)
+  {
+    buf = (char *) malloc(bufsize);
+  }
+  ~ForwardTask() { free(buf); }
+
+  bool wantRecv() const { return n < bufsize; }
+  bool wantSend() const { return ns < n; }
+
+  int nextRecv(struct iovec *iov, int maxiov) {
+    iov[0].iov_base = buf + n;
+    iov[0].iov_len = bufsize - n;
+    return 1;
+  }
+  int nextSend(struct iovec *iov, int maxiov) {
+    iov[0].iov_base = buf + ns;
+    iov[0].iov_len = n - ns;
+    return 1;
+  }
+
+  void recvDone(long long int bytes) {
+    n += bytes;
+    LOG_TRACE("Retrieved: " << n);
+  }
+  void sendDone(long long int bytes) {
+    ns += bytes;
+    LOG_TRACE("Sent: " << ns);
+    if(ns == n) {
+      n = 0; ns = 0;
+    }
+  }
+
+ private:
+  char *buf;
+  long long int bufsize;
+  long long int n, ns; // bytes buffered / bytes forwarded.
+};
+
 /* Unused function that can allow automatic termination when a file named 'stop' is present. */
 void* CheckStop(void* args) {
   while(true) {
@@ -886,166 +3208,177 @@ void* CheckStop(void* args) {
 
 /* MPW_Relay: 
  * redirects [num_channels] streams in [channels] to the respective 
- * streams in [channels2] and vice versa. */
+ * streams in [channels2] and vice versa. On Linux the data is spliced
+ * from socket to socket by one event loop per core (see Relay), until
+ * both sides of every pair have closed. Elsewhere both directions of
+ * every channel pair are driven by a single progress engine. */
 void MPW_Relay(int* channels, int* channels2, int num_channels) {
+  if (Relay::available()) {
+    std::vector<int> a, b;
+    for(int i = 0; i < num_channels; i++) {
+      LOG_DEBUG("Starting Relay Channel #" << channels[i]);
+      a.push_back(client[channels[i]]->getSock());
+      b.push_back(client[channels2[i]]->getSock());
+    }
+    const int ret = Relay::run(a, b, 0);
+    if (ret < 0) {
+      LOG_WARN("Relay ended with an error: " << strerror(-ret));
+    }
+    return;
+  }
+
   int bufsize = max(relay_ssize,relay_rsize);
 
-  pthread_t streams[num_channels*2];
-  relay_struct rstruct[num_channels*2];
-  
+  std::vector<StreamTask*> tasks;
   for(int i = 0; i < num_channels; i++) {
-    rstruct[i].channel  = channels[i];
-    rstruct[i].channel2 = channels2[i];
-    rstruct[i].bufsize  = bufsize;
-    int code = pthread_create(&streams[i], NULL, MPW_Relay, &rstruct[i]); 
+    LOG_DEBUG("Starting Relay Channel #" << channels[i]);
+    tasks.push_back(new ForwardTask(client[channels[i]], client[channels2[i]], bufsize));
+    tasks.back()->stream = channels2[i];
+    tasks.push_back(new ForwardTask(client[channels2[i]], client[channels[i]], bufsize));
+    tasks.back()->stream = channels[i];
   }
-  
-  for(int i = 0; i < num_channels*2; i++) {
-    pthread_join(streams[i], NULL);
-  }  
+
+  runTasks(tasks, NULL, relay_ssize, relay_rsize);
   return;
 }
 
-/* Dynamically sized Send/Recv between two processes. */
-void *MPW_TDynEx(void *args)
-{
-  bool cycling = false;
-  thread_tmp *ta = (thread_tmp *)args;
-
-  if (ta->channel > 65535) { cycling = true; }
+int MPW_RelayPaths(int* paths, int* paths2, int num_paths) {
+  std::vector<int> a, b;
+  for(int i = 0; i < num_paths; i++) {
+    MPWPath *p = getPath(paths[i]);
+    MPWPath *q = getPath(paths2[i]);
+    if(p == NULL || q == NULL || p->num_streams != q->num_streams) {
+      return -EINVAL;
+    }
+    /* Paths that exchanged byte orders as they connected told their endpoints ours, which is only
+     * right if it is also the order of the other endpoint. Half a forwarding pair would pass the
+     * byte of one endpoint on to an endpoint that has had its byte already. */
+    if(p->forwarding != q->forwarding ||
+       (!p->forwarding && (p->peer_big_endian != host_big_endian() || q->peer_big_endian != host_big_endian()))) {
+      LOG_ERR("Paths " << paths[i] << " and " << paths2[i] << " have told their endpoints the byte order of this host; "
+              "mark them with MPW_setPathForwarding before connecting them.");
+      return -EPROTO;
+    }
+    for(int j = 0; j < p->num_streams; j++) {
+      a.push_back(p->streams[j]);
+      b.push_back(q->streams[j]);
+    }
+  }
+  if(a.empty()) {
+    return -EINVAL;
+  }
+  MPW_Relay(&a[0], &b[0], a.size());
+  return 0;
+}
 
-  char * sendbuf = ta->sendbuf;
-  long long int totalsendsize = ta->sendsize;
-  long long int recvsize = ta->recvsize;
-  // Maximum size permitted for message.
-  long long int maxrecvsize = recvsize;
-  char* recvbuf = ta->recvbuf;
-  int channel = ta->channel % 65536; //send channel
+/* Dynamically sized Send/Recv between two processes (formerly the MPW_TDynEx thread).
+ * The 8-byte message size is sent ahead of the data, and the recv side
+ * only learns its share of the buffer once that size has arrived. */
+class DynExTask : public StreamTask
+{
+ public:
+  DynExTask(thread_tmp *ta, Socket *rsock, Socket *wsock)
+  : StreamTask(rsock, wsock), ta(ta), sendbuf(ta->sendbuf), recvbuf(ta->recvbuf),
+    totalsendsize(ta->sendsize), recvsize(ta->recvsize), maxrecvsize(ta->recvsize),
+    id(ta->thread_id), numschannels(ta->numchannels), numrchannels(ta->numrchannels),
+    a(0), b(0), c(0), d(0), recv_settings_known(false)
+  {
+    sendsize = totalsendsize / numschannels;
+    if(id < (totalsendsize % numschannels)) {
+      sendsize++;
+    }
+    ::serialize_size_t(net_send_size, (const size_t)totalsendsize);
 
-  int channel2 = cycling ? (ta->channel / 65536) - 1 : channel; //recv channel
+    #if SendRecvInputReport == 2
+    std::cout << "TDynEx(sendsize="<<sendsize<<",maxrecvsize="<<maxrecvsize<<",nc="<<numschannels<<"/"<<numrchannels<<std::endl;
+    #endif
+  }
 
-  int id = ta->thread_id;
-  long long int numschannels = ta->numchannels;
-  long long int numrchannels = ta->numrchannels;
+  // The exchange runs as long as either direction has data left, like the old thread loop.
+  bool wantRecv() const { return recvsize > d; }
+  bool wantSend() const { return (recvsize > d || sendsize > c) && (a < 8 || sendsize > c); }
 
-  long long int sendsize = totalsendsize / numschannels;
-  if(id < (totalsendsize % numschannels)) {
-    sendsize++;
+  int nextRecv(struct iovec *iov, int maxiov) {
+    if(!recv_settings_known) {
+      iov[0].iov_base = net_size_found + b;
+      iov[0].iov_len = 8 - b;
+    } else {
+      iov[0].iov_base = recvbuf + d;
+      iov[0].iov_len = recvsize - d;
+    }
+    return 1;
   }
 
-  #if SendRecvInputReport == 2
-  std::cout << "TDynEx(sendsize="<<sendsize<<",maxrecvsize="<<maxrecvsize<<",ch_send="<<channel<<",ch_recv="<<channel2<<",nc="<<numschannels<<"/"<<numrchannels<<std::endl;
-  #endif
+  int nextSend(struct iovec *iov, int maxiov) {
+    if(a < 8) { //send size first.
+      iov[0].iov_base = net_send_size + a;
+      iov[0].iov_len = 8 - a;
+    } else {
+      iov[0].iov_base = sendbuf + c;
+      iov[0].iov_len = sendsize - c;
+    }
+    return 1;
+  }
 
-  unsigned char net_size_found[8], net_send_size[8];
-  long long int recvsizeall = -1;
-  size_t a, b;
-  long long int c,d;
-  a = b = 0;
-  c = d = 0;
-
-  // recvsize is initially set to the size of the long long int which holds the message size.
-  bool recv_settings_known = false;   //this thread knows how much data may be received.
-  int mask = 0;
-  long long int offset_r = 0; //stores correct recv buffer offset for this thread.
-
-  /* Second: await the recvsize */
-
-  while(recvsize > d || sendsize > c) {
-    int mode = selectSockets(channel,channel2,mask);
-
-    /* (1.) Receiving is possible, but only done by thread 0 until we know more. */
-    if(mode%2 == 1) {
-      if(!recv_settings_known) {
-        int n = client[channel2]->irecv((char *)net_size_found+b,8-b);
-        b += n;
-
-        if(b == 8) { //recvsize data is now available.
-          size_t size_found = ::deserialize_size_t(net_size_found);
-
-          if (size_found > maxrecvsize) { //Would we want to do reallocs here???
-            std::cerr << "ERROR: DynEx recv size is greater than given constraint." << std::endl;
-            std::cerr << "(Size found = " << size_found << " bytes. Maxrecvsize = " << maxrecvsize << " bytes.)" << std::endl;
-            std::cerr << "(Channel: " << channel <<", Totalsendsize = "<< totalsendsize <<")" << std::endl;
-            std::cerr << "Going to sleep, so trace can be done. Press Ctrl-c to exit." << std::endl;
-            while(1) { sleep(1); }
-          }
-          recvsizeall = size_found;
-          if(id == 0) {
-            *(ta->dyn_recvsize) = size_found;
-          }
+  void recvDone(long long int n) {
+    if(recv_settings_known) {
+      d += n;
+      #if MONITORING == 1
+      __sync_fetch_and_add(&bytes_sent, n);
+      #endif
+      return;
+    }
 
-          recvsize = recvsizeall / numrchannels;
-          if(id < (recvsizeall % numrchannels)) {
-            recvsize++;
-          }
+    b += n;
+    if(b < 8) {
+      return;
+    }
+    //recvsize data is now available.
+    size_t size_found = ::deserialize_size_t(net_size_found);
+
+    if ((long long int)size_found > maxrecvsize) {
+      LOG_ERR("ERROR: DynEx recv size is greater than given constraint.");
+      LOG_ERR("(Size found = " << size_found << " bytes. Maxrecvsize = " << maxrecvsize << " bytes.)");
+      LOG_ERR("(Totalsendsize = "<< totalsendsize <<")");
+      error = -EMSGSIZE;
+      return;
+    }
+    if(id == 0) {
+      *(ta->dyn_recvsize) = size_found;
+    }
 
-          if(id < numrchannels) {
-            offset_r = ((size_found / numrchannels) * id) + min(id,size_found % numrchannels);
-            recvbuf = &(ta->recvbuf[offset_r]);
-          } 
- 
-          recv_settings_known = true;
-        }
-      } 
-      else {
-        int n = client[channel2]->irecv(recvbuf+d,min(tcpbuf_rsize,recvsize-d));
-        d += n;
-        #if MONITORING == 1
-        bytes_sent += n;
-        #endif
-        if(recvsize == d) { mask++; }
-      }
+    recvsize = size_found / numrchannels;
+    if(id < (long long int)(size_found % numrchannels)) {
+      recvsize++;
+    }
+    if(id < numrchannels) {
+      long long int offset_r = ((size_found / numrchannels) * id) + min(id, (long long int)(size_found % numrchannels));
+      recvbuf = &(ta->recvbuf[offset_r]);
     }
+    recv_settings_known = true;
+  }
 
-    /* SENDING POSSIBLE */
-    if(mode/2==1) {
-      if(a<8) { //send size first.
-        ::serialize_size_t(net_send_size, (const size_t)totalsendsize);
-        int n = client[channel]->isend((char*)net_send_size + a,8-a);
-        a += n;
-      }
-      else { //send data after that, leave 16byte margin to prevent SendRecv from crashing.
-        int n = client[channel]->isend(sendbuf+c,min(tcpbuf_ssize,sendsize-c)); 
-        c += n;
-        #if MONITORING == 1
-        bytes_sent += n;
-        #endif
-
-        if(sendsize == c) {
-          mask += 2; //don't check for write anymore
-        }
-      }
+  void sendDone(long long int n) {
+    if(a < 8) {
+      a += n;
+      return;
     }
-    #if MPW_PacingMode == 1
-    usleep(pacing_sleeptime);
+    c += n;
+    #if MONITORING == 1
+    __sync_fetch_and_add(&bytes_sent, n);
     #endif
   }
 
-  return NULL;
-}
-
-/* Better version of TSendRecv */
-void *MPW_TSendRecv(void *args)
-{
-  thread_tmp *t = (thread_tmp *)args;
-  return InThreadSendRecv(t->sendbuf, t->sendsize, t->recvbuf, t->recvsize, t->channel);
-}
-
-/* Better version of TSendRecv */
-void *MPW_TSend(void *args)
-{
-  thread_tmp *t = (thread_tmp *)args;
-  return InThreadSendRecv(t->sendbuf, t->sendsize, (char *)0, 0, t->channel);
-}
-
-/* Better version of TSendRecv */
-void *MPW_TRecv(void *args)
-{
-  thread_tmp *t = (thread_tmp *)args;
-  return InThreadSendRecv((char *)0, 0, t->recvbuf, t->recvsize, t->channel);
-}
-
+ private:
+  thread_tmp *ta;
+  char *sendbuf, *recvbuf;
+  long long int totalsendsize, sendsize;
+  long long int recvsize, maxrecvsize; // recvsize is this stream's share once the header is in.
+  long long int id, numschannels, numrchannels;
+  unsigned char net_size_found[8], net_send_size[8];
+  long long int a, b, c, d; // header sent, header received, data sent, data received.
+  bool recv_settings_known; // this stream knows how much data may be received.
+};
 /* DSendRecv: MPWide Low-level dynamic exchange. 
  * In this exchange, the message size is automatically appended to the data. 
  * The size is first read by the receiving process, which then reads in the
@@ -1064,32 +3397,25 @@ long long int DSendRecv(char** sendbuf, long long int totalsendsize, char* recvb
 #endif
   //std::cout << sendbuf[0] << " / " << recvbuf[0] << " / " << num_channels << " / " << sendsize[0] << " / " << recvsize[0] << " / " << channel[0] << std::endl;
 
-  pthread_t streams[num_channels];
+  std::vector<StreamTask*> tasks;
+  std::vector<thread_tmp> ta(num_channels); // the tasks refer to these until they are done.
   long long int dyn_recvsize = 0;
 
   for(int i=0; i<num_channels; i++){
-      ta[channel[i]]->sendsize = totalsendsize;
-      ta[channel[i]]->recvsize = maxrecvsize;
-    
-      // NOTE: after this function ends, this will be a dangling pointer
-      ta[channel[i]]->dyn_recvsize = &dyn_recvsize; //one recvsize stored centrally. Read in by thread 0.
-    
-      ta[channel[i]]->channel = channel[i];
-      ta[channel[i]]->sendbuf = sendbuf[i];
-      ta[channel[i]]->recvbuf = recvbuf;
-      ta[channel[i]]->thread_id = i;
-      ta[channel[i]]->numchannels = num_channels;
-      ta[channel[i]]->numrchannels = num_channels;
-      if(i>0) {
-        int code = pthread_create(&streams[i], NULL, MPW_TDynEx, ta[channel[i]]);
-      }
+      ta[i].sendsize = totalsendsize;
+      ta[i].recvsize = maxrecvsize;
+      ta[i].dyn_recvsize = &dyn_recvsize; //one recvsize stored centrally. Read in by thread 0.
+      ta[i].channel = channel[i];
+      ta[i].sendbuf = sendbuf[i];
+      ta[i].recvbuf = recvbuf;
+      ta[i].thread_id = i;
+      ta[i].numchannels = num_channels;
+      ta[i].numrchannels = num_channels;
+      tasks.push_back(new DynExTask(&ta[i], client[channel[i]], client[channel[i]]));
+      tasks.back()->stream = channel[i];
   }
 
-  MPW_TDynEx(ta[channel[0]]);
-
-  for(int i=1; i<num_channels; i++) {
-    pthread_join(streams[i], NULL);
-  }
+  int ret = runTasks(tasks, poolOf(channel, num_channels));
 
 #ifdef PERF_TIMING
   t = GetTime() - t;
@@ -1103,8 +3429,10 @@ long long int DSendRecv(char** sendbuf, long long int totalsendsize, char* recvb
   SendRecvTime += t;
 #endif
 
-  return ta[channel[0]]->dyn_recvsize[0];
-
+  if(ret < 0) {
+    return ret;
+  }
+  return dyn_recvsize;
 }
 
 /* buf,bsize and num_chunks contain parameters.
@@ -1135,6 +3463,10 @@ long long int MPW_DSendRecv( char *sendbuf, long long int sendsize,
                 char *recvbuf, long long int maxrecvsize,
                 int *channel, int nc){
 
+  if (anyChecksums(channel, nc)) {
+    LOG_ERR("MPW_DSendRecv does not send checksums; use MPW_SendRecv on paths with checksums.");
+    return -ENOTSUP;
+  }
   char **sendbuf2 = new char*[nc];
   long long int *sendsize2 = new long long int[nc];
 
@@ -1148,12 +3480,17 @@ long long int MPW_DSendRecv( char *sendbuf, long long int sendsize,
 
 /* The core function implementing MPW_Cycle. */
 long long int Cycle(char** sendbuf2, long long int sendsize2, char* recvbuf2, long long int maxrecvsize2, int* ch_send, int nc_send, int* ch_recv, int nc_recv, bool dynamic) {
+  if (anyChecksums(ch_send, nc_send) || anyChecksums(ch_recv, nc_recv)) {
+    LOG_ERR("MPW_Cycle does not send checksums; use MPW_SendRecv on paths with checksums.");
+    return -ENOTSUP;
+  }
   #ifdef PERF_TIMING
   double t = GetTime();
   #endif
-  pthread_t streams[nc_send];
+  std::vector<StreamTask*> tasks;
+  std::vector<thread_tmp> ta(max(nc_send,nc_recv)); // the tasks refer to these until they are done.
   char dummy_recv[nc_recv];
-  char dummy_send[nc_send][1];
+  std::vector<char> dummy_send(nc_send, 0);
 
   long long int totalsendsize = sendsize2;
   long long int dyn_recvsize_sendchannel = 0; 
@@ -1162,7 +3499,7 @@ long long int Cycle(char** sendbuf2, long long int sendsize2, char* recvbuf2, lo
   //TODO: Add support for different number of send/recv streams.
   for (int i = 0; i < max(nc_send,nc_recv); i++)
   {
-    thread_tmp &props = *ta[i];
+    thread_tmp &props = ta[i];
     
     if(totalsendsize>0 && i<nc_send) {
       if(dynamic) { //overall sendsize given to all threads.
@@ -1177,7 +3514,7 @@ long long int Cycle(char** sendbuf2, long long int sendsize2, char* recvbuf2, lo
     }
     else {
       props.sendsize = 1*nc_send;
-      props.sendbuf = dummy_send[i];
+      props.sendbuf = &dummy_send[0];
     }
 
     if(maxrecvsize2>0 && i<nc_recv) {
@@ -1214,49 +3551,40 @@ long long int Cycle(char** sendbuf2, long long int sendsize2, char* recvbuf2, lo
     props.numchannels  = nc_send;
     props.numrchannels = nc_recv;
     //printThreadTmp(ta[i]);
-    if(i>0) {
-      if(dynamic) {
-        int code = pthread_create(&streams[i], NULL, MPW_TDynEx, ta[i]);
-      } else {
-        int code = pthread_create(&streams[i], NULL, MPW_TSendRecv, ta[i]);
-      }
-    }
-  }
 
-  if(dynamic) {
-    MPW_TDynEx(ta[0]);
-    if(max(nc_send,nc_recv)>1) {
-      for(int i=1; i<max(nc_send,nc_recv); i++) {
-        pthread_join(streams[i], NULL);
-      }
-    }
-  } else {
-    int* res = (int *)MPW_TSendRecv(ta[0]);
-    // TODO: error checking on MPW_TSendRecv
-    delete res;
-
-    if(max(nc_send,nc_recv)>1) {
-      for(int i=1; i<max(nc_send,nc_recv); i++) {
-        pthread_join(streams[i], (void **)&res);
-        // TODO: error checking on MPW_TSendRecv
-        delete res;
-      }
+    /* Send over the send channel, recv over the recv channel (both are the same if only one is given). */
+    Socket *wsock = client[props.channel % 65536];
+    Socket *rsock = props.channel < 65536 ? wsock : client[(props.channel / 65536) - 1];
+    if(dynamic) {
+      tasks.push_back(new DynExTask(&ta[i], rsock, wsock));
+    } else {
+      tasks.push_back(new SendRecvTask(rsock, wsock, props.sendbuf, props.sendsize, props.recvbuf, props.recvsize));
     }
+    tasks.back()->stream = props.channel % 65536;
   }
 
+  /* Use the worker threads if the send and recv streams belong to the same path. */
+  WorkerPool *pool = poolOf(ch_send, nc_send);
+  if (pool != poolOf(ch_recv, nc_recv))
+    pool = NULL;
+
+  int ret = runTasks(tasks, pool);
+
 
   #ifdef PERF_TIMING
     t = GetTime() - t;
 
     #if LOG_LVL >= LOG_INFO
-      long long int total_size = sendsize2 + (ta[0]->dyn_recvsize)[0];
+      long long int total_size = sendsize2 + dyn_recvsize_sendchannel;
       std::cout << "Cycle: " << t << "s. Size: " << (total_size/(1024*1024)) << "MB. Rate: " << total_size/(t*1024*1024) << "MB/s." << std::endl;
     #endif
     SendRecvTime += t;
   #endif
 
-//  return dyn_recvsize_recvchannel;
-  return (ta[0]->dyn_recvsize)[0];
+  if(ret < 0) {
+    return ret;
+  }
+  return dyn_recvsize_sendchannel;
 }
 
 /** CycleWrapper
@@ -1333,48 +3661,16 @@ int MPW_PSendRecv(char** sendbuf, long long int* sendsize, char** recvbuf, long
 #endif
 
   //std::cout << sendbuf[0] << " / " << recvbuf[0] << " / " << num_channels << " / " << sendsize[0] << " / " << recvsize[0] << " / " << channel[0] << std::endl;
-  pthread_t streams[num_channels];
+  std::vector<StreamTask*> tasks;
 
-  void *(*sendrecvFunc)(void *);
-  
   for(int i = 0; i < num_channels; i++){
     const int stream = channel[i];
-
-    if (recvsize[i]) {
-      ta[stream]->recvbuf = recvbuf[i];
-      ta[stream]->recvsize = recvsize[i];
-    }
-    if (sendsize[i]) {
-      ta[stream]->sendsize = sendsize[i];
-      ta[stream]->sendbuf = sendbuf[i];
-    }
-    
-    if (sendsize[i] && recvsize[i])
-      sendrecvFunc = &MPW_TSendRecv;
-    else if (sendsize[i])
-      sendrecvFunc = &MPW_TSend;
-    else
-      sendrecvFunc = &MPW_TRecv;
-    
-    if(i>0) {
-      int code = pthread_create(&streams[i], NULL, sendrecvFunc, ta[stream]);
-    }
+    tasks.push_back(new SendRecvTask(client[stream], client[stream], sendbuf[i], sendsize[i], recvbuf[i], recvsize[i],
+                                     checksumChunk(stream)));
+    tasks.back()->stream = stream;
   }
-  
-  int return_value = 0;
-  int *res = (int *)sendrecvFunc(ta[channel[0]]);
-  if (*res < 0)
-    return_value = *res;
-  delete res;
 
-  if(num_channels > 1) {
-    for(int i = 1; i < num_channels; i++) {
-      pthread_join(streams[i], (void **)&res);
-      if (*res < 0)
-        return_value = *res;
-      delete res;
-    }
-  }
+  int return_value = runTasks(tasks, poolOf(channel, num_channels));
 
   #ifdef PERF_TIMING
     t = GetTime() - t;
@@ -1403,6 +3699,19 @@ int MPW_SendRecv( char* sendbuf, long long int sendsize, char* recvbuf, long lon
   }
 #endif
 
+  const int compressed = compressedPath(channel, nc);
+  const int striped = compressed < 0 ? stripedPath(channel, nc) : -1;
+  if (compressed >= 0 || striped >= 0 || checksumChunk(channel[0]) > 0) {
+    struct iovec siov = { sendbuf, (size_t) sendsize };
+    struct iovec riov = { recvbuf, (size_t) recvsize };
+    if (compressed >= 0)
+      return CompressedSendRecv(&siov, 1, sendsize, &riov, 1, recvsize, compressed);
+    if (striped >= 0)
+      return StripedSendRecv(&siov, 1, sendsize, &riov, 1, recvsize, striped);
+    // Checksummed slices report mismatches at their offset in the message.
+    return MPW_SendRecvV(&siov, 1, &riov, 1, channel, nc);
+  }
+
 #if OptimizeStreamCount == 1
   nc = max(1, min(nc, max(sendsize, recvsize)/BytesPerStream) );
 #endif
@@ -1446,6 +3755,178 @@ int MPW_SendRecv( char* sendbuf, long long int sendsize, char* recvbuf, long lon
   return ret;
 }
 
+static long long int iovSize(const struct iovec* iov, int iovcnt)
+{
+  long long int size = 0;
+  for(int i = 0; i < iovcnt; i++) {
+    size += iov[i].iov_len;
+  }
+  return size;
+}
+
+/* MPW_SendRecvV, for messages of elements of unit bytes; swap (if > 1) is the size of the
+ * elements whose bytes are reversed as they arrive. */
+static int SendRecvV(const struct iovec* sendiov, int sendcnt, struct iovec* recviov, int recvcnt, int* channel, int nc,
+                     int unit, int swap)
+{
+#ifdef PERF_TIMING
+  double t = GetTime();
+#endif
+  const long long int sendsize = iovSize(sendiov, sendcnt);
+  const long long int recvsize = iovSize(recviov, recvcnt);
+
+  const int compressed = compressedPath(channel, nc);
+  const int striped = compressed < 0 ? stripedPath(channel, nc) : -1;
+  if (compressed >= 0 || striped >= 0) {
+    int ret = compressed >= 0 ? CompressedSendRecv(sendiov, sendcnt, sendsize, recviov, recvcnt, recvsize, compressed, unit, swap)
+                              : StripedSendRecv(sendiov, sendcnt, sendsize, recviov, recvcnt, recvsize, striped, unit, swap);
+#ifdef PERF_TIMING
+    SendRecvTime += GetTime() - t;
+#endif
+    return ret;
+  }
+
+#if OptimizeStreamCount == 1
+  nc = max(1, min(nc, max(sendsize, recvsize)/BytesPerStream) );
+#endif
+
+  std::vector<StreamTask*> tasks;
+  long long int soffset = 0, roffset = 0;
+
+  for(int i = 0; i < nc; i++) {
+    const long long int ssize = shareSize(sendsize, nc, i, unit);
+    const long long int rsize = shareSize(recvsize, nc, i, unit);
+    tasks.push_back(new SendRecvTask(client[channel[i]], client[channel[i]], sendiov, sendcnt, soffset, ssize,
+                                     recviov, recvcnt, roffset, rsize, checksumChunk(channel[i]), swap));
+    tasks.back()->stream = channel[i];
+    soffset += ssize;
+    roffset += rsize;
+  }
+
+  int ret = runTasks(tasks, poolOf(channel, nc));
+
+#ifdef PERF_TIMING
+  SendRecvTime += GetTime() - t;
+#endif
+  return ret;
+}
+
+/** MPW_SendRecvV
+ * Scatter/gather version of MPW_SendRecv. The iovec lists are treated as one logical byte stream
+ * per direction, which is striped over the streams exactly like a contiguous buffer would be.
+ * The data is sent and received in place with sendmsg/recvmsg, so no packing copy is needed.
+ */
+int MPW_SendRecvV(const struct iovec* sendiov, int sendcnt, struct iovec* recviov, int recvcnt, int* channel, int nc)
+{
+  return SendRecvV(sendiov, sendcnt, recviov, recvcnt, channel, nc, 1, 0);
+}
+
+extern "C" {
+  int MPW_SendRecvV(const struct iovec* sendiov, int sendcnt, struct iovec* recviov, int recvcnt, int path) {
+    MPWPath *p = getPath(path);
+    if (p == NULL)
+      return -EINVAL;
+    return MPW_SendRecvV(sendiov, sendcnt, recviov, recvcnt, p->streams, p->num_streams);
+  }
+
+  int MPW_SendV(const struct iovec* sendiov, int sendcnt, int path) {
+    MPWPath *p = getPath(path);
+    if (p == NULL)
+      return -EINVAL;
+    return MPW_SendRecvV(sendiov, sendcnt, NULL, 0, p->streams, p->num_streams);
+  }
+
+  int MPW_RecvV(struct iovec* recviov, int recvcnt, int path) {
+    MPWPath *p = getPath(path);
+    if (p == NULL)
+      return -EINVAL;
+    return MPW_SendRecvV(NULL, 0, recviov, recvcnt, p->streams, p->num_streams);
+  }
+
+  long long int MPW_TypeSize(int type) {
+    const Datatype *t = Datatype::get(type);
+    return t ? t->size : -EINVAL;
+  }
+
+  long long int MPW_TypeExtent(int type) {
+    const Datatype *t = Datatype::get(type);
+    return t ? t->extent : -EINVAL;
+  }
+
+  int MPW_TypeVector(long long int count, long long int blocklength, long long int stride, int oldtype) {
+    const Datatype *old = Datatype::get(oldtype);
+    Datatype *t = old ? Datatype::vector(count, blocklength, stride, *old) : NULL;
+    return t ? Datatype::add(t) : -EINVAL;
+  }
+
+  int MPW_TypeIndexed(int count, const long long int* blocklengths, const long long int* displacements, int oldtype) {
+    const Datatype *old = Datatype::get(oldtype);
+    Datatype *t = old ? Datatype::indexed(count, blocklengths, displacements, *old) : NULL;
+    return t ? Datatype::add(t) : -EINVAL;
+  }
+
+  int MPW_TypeSubarray(int ndims, const long long int* sizes, const long long int* subsizes, const long long int* starts,
+                       int oldtype) {
+    const Datatype *old = Datatype::get(oldtype);
+    Datatype *t = old ? Datatype::subarray(ndims, sizes, subsizes, starts, *old) : NULL;
+    return t ? Datatype::add(t) : -EINVAL;
+  }
+
+  int MPW_TypeFree(int type) {
+    return Datatype::remove(type);
+  }
+
+  int MPW_PathSwapsBytes(int path) {
+    MPWPath *p = getPath(path);
+    if (p == NULL || p->num_streams < 1)
+      return -EINVAL;
+    return p->peer_big_endian != host_big_endian() ? 1 : 0;
+  }
+
+  /* The sender sends its elements as they are; the receiver puts them in its own byte order.
+   * Elements of derived types are sent from and received into place: the runs of their
+   * layout become the iovec lists of the exchange. */
+  int MPW_SendRecvTyped(int path, int type, const void* sendbuf, long long int sendcount, void* recvbuf, long long int recvcount) {
+    const Datatype *t = Datatype::get(type);
+    const int swaps = MPW_PathSwapsBytes(path);
+    if (t == NULL || swaps < 0 || sendcount < 0 || recvcount < 0)
+      return -EINVAL;
+    MPWPath *p = getPath(path);
+    const int swap = swaps ? t->unit : 0;
+    if (t->contiguous()) {
+      struct iovec siov = { (void *) sendbuf, (size_t) (sendcount * t->size) };
+      struct iovec riov = { recvbuf, (size_t) (recvcount * t->size) };
+      return SendRecvV(&siov, 1, &riov, 1, p->streams, p->num_streams, t->unit, swap);
+    }
+
+#ifdef PERF_TIMING
+    const double t0 = GetTime();
+#endif
+    std::vector<struct iovec> siov, riov;
+    t->layout((char *) sendbuf, sendcount, siov);
+#ifdef PERF_TIMING
+    const double t1 = GetTime();
+    PackingTime += t1 - t0;
+#endif
+    t->layout((char *) recvbuf, recvcount, riov);
+#ifdef PERF_TIMING
+    UnpackingTime += GetTime() - t1;
+#endif
+    if (siov.size() > INT_MAX || riov.size() > INT_MAX)
+      return -EINVAL;
+    return SendRecvV(siov.empty() ? NULL : &siov[0], siov.size(), riov.empty() ? NULL : &riov[0], riov.size(),
+                     p->streams, p->num_streams, t->unit, swap);
+  }
+
+  int MPW_SendTyped(int path, int type, const void* sendbuf, long long int sendcount) {
+    return MPW_SendRecvTyped(path, type, sendbuf, sendcount, NULL, 0);
+  }
+
+  int MPW_RecvTyped(int path, int type, void* recvbuf, long long int recvcount) {
+    return MPW_SendRecvTyped(path, type, NULL, 0, recvbuf, recvcount);
+  }
+}
+
 /* Synchronization functions: try to minimize the use of this function. */
 void MPW_Barrier(int channel)
 {
@@ -1490,6 +3971,187 @@ void MPW_Barrier() {
   }
 }
 
+/* Collective operations: the algorithms live in Communicator. */
+int MPW_CommCreate(int rank, int size, const int* paths)
+{
+  if (size < 1 || rank < 0 || rank >= size || paths == NULL) {
+    return -EINVAL;
+  }
+  std::vector<int> ids(paths, paths + size);
+  for (int r = 0; r < size; r++) {
+    if (r == rank) {
+      ids[r] = -1;
+    } else if (getPath(paths[r]) == NULL) {
+      return -EINVAL;
+    }
+  }
+  return Communicator::add(new Communicator(rank, ids));
+}
+
+int MPW_CommFree(int comm)
+{
+  return Communicator::remove(comm);
+}
+
+int MPW_Bcast(char* buf, long long int size, int root, int comm)
+{
+  Communicator *c = Communicator::get(comm);
+  return c ? c->bcast(buf, size, root) : -EINVAL;
+}
+
+int MPW_Gather(const char* sendbuf, long long int size, char* recvbuf, int root, int comm)
+{
+  Communicator *c = Communicator::get(comm);
+  return c ? c->gather(sendbuf, size, recvbuf, root) : -EINVAL;
+}
+
+int MPW_Allgather(const char* sendbuf, long long int size, char* recvbuf, int comm)
+{
+  Communicator *c = Communicator::get(comm);
+  return c ? c->allgather(sendbuf, size, recvbuf) : -EINVAL;
+}
+
+int MPW_Alltoall(const char* sendbuf, long long int size, char* recvbuf, int comm)
+{
+  Communicator *c = Communicator::get(comm);
+  return c ? c->alltoall(sendbuf, size, recvbuf) : -EINVAL;
+}
+
+int MPW_Reduce(const void* sendbuf, void* recvbuf, long long int count, int type, int op, int root, int comm)
+{
+  Communicator *c = Communicator::get(comm);
+  return c ? c->reduce(sendbuf, recvbuf, count, type, op, root) : -EINVAL;
+}
+
+int MPW_Allreduce(const void* sendbuf, void* recvbuf, long long int count, int type, int op, int comm)
+{
+  Communicator *c = Communicator::get(comm);
+  return c ? c->allreduce(sendbuf, recvbuf, count, type, op) : -EINVAL;
+}
+
+/* A barrier token is spun for this long (ns) before the wait falls back to poll(): on a
+ * fast link it arrives within the spin, and waking up from poll() would add to its latency. */
+#define MPW_BARRIER_SPIN 50000LL
+
+/* A flushing barrier gives up when the data on the path has not been acknowledged after this long (ns). */
+#define MPW_BARRIER_FLUSH_TIMEOUT (10*1000*1000*1000LL)
+
+/* On a single core, spinning would only keep the other side from running. */
+static bool barrierSpins()
+{
+  static const bool spin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  return spin;
+}
+
+/* Wait until the socket is ready for events. Returns 0, or a negative errno value. */
+static int waitSocket(const Socket *s, short events)
+{
+  struct pollfd pfd;
+  pfd.fd = s->getSock();
+  pfd.events = events;
+  for (;;) {
+    pfd.revents = 0;
+    const int n = ::poll(&pfd, 1, -1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -errno;
+    }
+    if (pfd.revents & (POLLERR | POLLNVAL)) {
+      return -ECONNRESET;
+    }
+    return 0; // on POLLHUP the recv() reports the end of the connection.
+  }
+}
+
+/* Wait until the other side has acknowledged all data sent on the socket, or until deadline.
+ * Returns 0, or a negative errno value. */
+static int waitAcknowledged(const Socket *s, long long int deadline)
+{
+  const long long int spin_end = TokenBucket::now() + (barrierSpins() ? MPW_BARRIER_SPIN : 0);
+  struct pollfd pfd;
+  pfd.fd = s->getSock();
+  pfd.events = 0; // errors and hangups only.
+  while (s->is_valid() && s->sendQueued() > 0) {
+    const long long int now = TokenBucket::now();
+    if (now >= deadline) {
+      return -ETIMEDOUT;
+    }
+    if (now < spin_end) {
+      sched_yield();
+      continue;
+    }
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, 1) > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+      return -ECONNRESET;
+    }
+  }
+  return 0;
+}
+
+int MPW_PathBarrier(int path, bool flush)
+{
+  MPWPath *p = getPath(path);
+  if (p == NULL || p->num_streams < 1) {
+    return -EINVAL;
+  }
+  #ifdef PERF_TIMING
+    double t = GetTime();
+  #endif
+
+  int ret = 0;
+  if (flush) {
+    /* The token follows the data of its own stream; on the others, wait until the
+     * other side has acknowledged everything that was sent. */
+    const long long int deadline = TokenBucket::now() + MPW_BARRIER_FLUSH_TIMEOUT;
+    for (int i = 1; i < p->num_streams && ret == 0; i++) {
+      ret = waitAcknowledged(client[p->streams[i]], deadline);
+    }
+  }
+
+  /* Both sides send a token on the first stream and wait for the one of the other: once it
+   * has arrived, the other side has entered the barrier as well. Streams have TCP_NODELAY
+   * set, so the token does not wait for the acknowledgement of earlier data. */
+  Socket *s = client[p->streams[0]];
+  char token = 'B';
+  while (ret == 0) {
+    const int n = s->isend(&token, 1);
+    if (n == 1) {
+      break;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      ret = -errno;
+      break;
+    }
+    if ((ret = waitSocket(s, POLLOUT)) < 0) {
+      break;
+    }
+  }
+
+  const long long int spin_end = TokenBucket::now() + (barrierSpins() ? MPW_BARRIER_SPIN : 0);
+  while (ret == 0) {
+    const int n = s->irecv(&token, 1);
+    if (n == 1) {
+      break;
+    }
+    if (n == 0) {
+      ret = -ECONNRESET;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ret = -errno;
+    } else if (TokenBucket::now() >= spin_end) {
+      ret = waitSocket(s, POLLIN);
+    }
+  }
+  if (ret < 0) {
+    LOG_ERR("Barrier on path " << path << " failed: " << strerror(-ret));
+  }
+  #ifdef PERF_TIMING
+    BarrierTime += GetTime() - t;
+  #endif
+  return ret;
+}
+
 /* C interface */
 extern "C" { 
   void MPW_SendRecv1_c (char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize, int base_channel) {
@@ -1522,77 +4184,278 @@ void MPW_Print() { //print MPWide stream specific information.
 }
 
 
-/* Non-blocking extension */
+/* Non-blocking extension: each request is an exchange handed to the worker threads of its
+ * path (or, for paths without workers, to a shared one) that completes in the background. */
+
+struct Request : public TaskGroup {
+  Request(int path) : TaskGroup(0), id(-1), path(path), left(0), result(0), finished(false),
+                      callback(NULL), arg(NULL), sched(NULL), recvsize(0) {}
+  ~Request() {
+    for (size_t i = 0; i < tasks.size(); i++) {
+      delete tasks[i];
+    }
+    delete sched;
+  }
+
+  void done(int error);
 
-typedef struct MPW_NBE {
-  pthread_t pthr_id;
   int id;
-  thread_tmp NBE_args;
-}MPW_NBE;
+  int path;
+  int left;      // tasks that have not completed yet.
+  int result;    // 0, or the last task error.
+  bool finished;
+  MPW_Callback callback;
+  void *arg;
+  std::vector<StreamTask*> tasks;
+  struct iovec siov, riov;
+  StripeSchedule *sched; // for paths that stripe dynamically.
+  long long int recvsize;
+};
 
-static std::vector<MPW_NBE> MPW_nonBlockingExchanges;
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+static std::map<int, Request*> requests;
+static int next_request = 0;
+static WorkerPool *request_pool = NULL;
 
-/* A TSendRecv that encapsulates a full MPW_SendRecv. */
-void *MPW_TSendRecv_Full(void *args)
+/* Called by the worker threads as the tasks of the request complete. */
+void Request::done(int error)
 {
-  thread_tmp *t = (thread_tmp *)args;
-  
-  MPW_SendRecv(t->sendbuf, t->sendsize, t->recvbuf, t->recvsize, t->channel); 
-  //NOTE: the channel variable in the thread_tmp structure is repurposed as a path variable here (both are of 'int' datatype). 
-  //It also gets changed to a negative number whenever the SendRecv is completed.
-  
-  t->channel = (t->channel+1)*-1; //turn channel into a negative number to indicate completion.
-  return NULL;
+  pthread_mutex_lock(&request_lock);
+  if (error < 0) {
+    result = error;
+  }
+  if (--left > 0) {
+    pthread_mutex_unlock(&request_lock);
+    return;
+  }
+  if (result >= 0 && sched && sched->received != recvsize) {
+    LOG_ERR("Striped exchange received " << sched->received << " of " << recvsize << " bytes.");
+    result = -EPROTO;
+  }
+  finished = true;
+  pthread_cond_broadcast(&request_cond);
+  const MPW_Callback cb = callback;
+  if (cb) {
+    requests.erase(id);
+  }
+  pthread_mutex_unlock(&request_lock);
+
+  if (cb) {
+    cb(id, result, arg);
+    // Nothing touches the tasks after they have completed, so they can go now.
+    delete this;
+  }
 }
 
-/* Non-Blocking Exchange style MPWide receive. */
-int MPW_ISendRecv( char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize, int path) {
-  MPW_NBE new_nonblocking_exchange = MPW_NBE();
-  new_nonblocking_exchange.NBE_args = thread_tmp();
-  new_nonblocking_exchange.NBE_args.sendbuf = sendbuf;
-  new_nonblocking_exchange.NBE_args.sendsize = sendsize;
-  new_nonblocking_exchange.NBE_args.recvbuf = recvbuf;
-  new_nonblocking_exchange.NBE_args.recvsize = recvsize;
-  new_nonblocking_exchange.NBE_args.channel = path;
-   
-  if(MPW_nonBlockingExchanges.size() == 0) { //no other non-blocking comms? Use id 0.
-    new_nonblocking_exchange.id = 0;
+/* Post an exchange on a path. Returns the request handle, or a negative errno value. */
+static int postExchange(char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize, int path)
+{
+  MPWPath *p = getPath(path);
+  if (p == NULL || sendsize < 0 || recvsize < 0) {
+    return -EINVAL;
   }
-  else { //generate a new unique incremented id.
-    new_nonblocking_exchange.id = MPW_nonBlockingExchanges[MPW_nonBlockingExchanges.size()-1].id + 1;
+  if (p->compression.getMode() != MPW_COMPRESS_OFF) {
+    return -ENOTSUP;
   }
-  
-  MPW_nonBlockingExchanges.push_back(new_nonblocking_exchange);
-  MPW_nonBlockingExchanges[MPW_nonBlockingExchanges.size()-1].NBE_args = new_nonblocking_exchange.NBE_args;
-  
-  int code = pthread_create(&(MPW_nonBlockingExchanges[MPW_nonBlockingExchanges.size()-1].pthr_id), 
-                            NULL, MPW_TSendRecv_Full, &(MPW_nonBlockingExchanges[MPW_nonBlockingExchanges.size()-1].NBE_args));
-                            
-  return new_nonblocking_exchange.id;
+  Request *r = new Request(path);
+  r->siov.iov_base = sendbuf;
+  r->siov.iov_len = sendsize;
+  r->riov.iov_base = recvbuf;
+  r->riov.iov_len = recvsize;
+  r->recvsize = recvsize;
+
+  if (p->stripe_chunk > 0) {
+    r->sched = new StripeSchedule(&r->siov, 1, sendsize, p->stripe_chunk, p->num_streams, p->checksum_chunk);
+    for (int i = 0; i < p->num_streams; i++) {
+      r->tasks.push_back(new StripeTask(client[p->streams[i]], r->sched, i, &r->riov, 1, recvsize));
+      r->tasks.back()->stream = p->streams[i];
+    }
+  } else {
+    int nc = p->num_streams;
+#if OptimizeStreamCount == 1
+    nc = max(1, min(nc, max(sendsize, recvsize)/BytesPerStream) );
+#endif
+    long long int soffset = 0, roffset = 0;
+    for (int i = 0; i < nc; i++) {
+      const int stream = p->streams[i];
+      const long long int ssize = shareSize(sendsize, nc, i, 1);
+      const long long int rsize = shareSize(recvsize, nc, i, 1);
+      r->tasks.push_back(new SendRecvTask(client[stream], client[stream], &r->siov, 1, soffset, ssize,
+                                          &r->riov, 1, roffset, rsize, p->checksum_chunk));
+      r->tasks.back()->stream = stream;
+      soffset += ssize;
+      roffset += rsize;
+    }
+  }
+  setPacers(r->tasks);
+  r->left = r->tasks.size();
+
+  pthread_mutex_lock(&request_lock);
+  r->id = next_request;
+  next_request = next_request == INT_MAX ? 0 : next_request + 1;
+  requests[r->id] = r;
+  WorkerPool *pool = p->pool;
+  if (pool == NULL) {
+    if (request_pool == NULL) {
+      request_pool = new WorkerPool(1, use_io_uring);
+    }
+    pool = request_pool;
+  }
+  const int id = r->id;
+  pthread_mutex_unlock(&request_lock);
+
+  pool->submit(&r->tasks[0], r->tasks.size(), tcpbuf_ssize, tcpbuf_rsize, r);
+  return id;
+}
+
+/* Stop the shared worker and free the requests that were never released. */
+static void closeRequests()
+{
+  pthread_mutex_lock(&request_lock);
+  WorkerPool *pool = request_pool;
+  request_pool = NULL;
+  pthread_mutex_unlock(&request_lock);
+  delete pool;
+
+  pthread_mutex_lock(&request_lock);
+  std::map<int, Request*> left;
+  left.swap(requests);
+  pthread_mutex_unlock(&request_lock);
+  for (std::map<int, Request*>::iterator it = left.begin(); it != left.end(); ++it) {
+    delete it->second;
+  }
+}
+
+int MPW_Isend(char* sendbuf, long long int sendsize, int path) {
+  return postExchange(sendbuf, sendsize, NULL, 0, path);
+}
+
+int MPW_Irecv(char* recvbuf, long long int recvsize, int path) {
+  return postExchange(NULL, 0, recvbuf, recvsize, path);
 }
 
-int Find_NBE_By_ID(int NBE_id) {
-  int element_number = -1;
-  for(int i=0; i<MPW_nonBlockingExchanges.size(); i++) {
-    if(MPW_nonBlockingExchanges[i].id == NBE_id) {
-      element_number = i;
+int MPW_ISendRecv(char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize, int path) {
+  return postExchange(sendbuf, sendsize, recvbuf, recvsize, path);
+}
+
+int MPW_Test(int request) {
+  pthread_mutex_lock(&request_lock);
+  std::map<int, Request*>::iterator it = requests.find(request);
+  if (it == requests.end()) {
+    pthread_mutex_unlock(&request_lock);
+    return -EINVAL;
+  }
+  Request *r = it->second;
+  if (!r->finished) {
+    pthread_mutex_unlock(&request_lock);
+    return 0;
+  }
+  requests.erase(it);
+  pthread_mutex_unlock(&request_lock);
+
+  const int ret = r->result < 0 ? r->result : 1;
+  delete r;
+  return ret;
+}
+
+int MPW_Wait(int request) {
+  pthread_mutex_lock(&request_lock);
+  std::map<int, Request*>::iterator it = requests.find(request);
+  if (it == requests.end()) {
+    pthread_mutex_unlock(&request_lock);
+    LOG_WARN("MPW_Wait: request " << request << " does not exist.");
+    return -EINVAL;
+  }
+  Request *r = it->second;
+  while (!r->finished) {
+    pthread_cond_wait(&request_cond, &request_lock);
+  }
+  requests.erase(request);
+  pthread_mutex_unlock(&request_lock);
+
+  const int ret = r->result;
+  delete r;
+  return ret;
+}
+
+int MPW_Waitall(int count, int* reqs) {
+  int ret = 0;
+  for (int i = 0; i < count; i++) {
+    if (reqs[i] == MPW_REQUEST_NULL) {
+      continue;
+    }
+    const int r = MPW_Wait(reqs[i]);
+    if (r < 0) {
+      ret = r;
     }
+    reqs[i] = MPW_REQUEST_NULL;
   }
-  if(element_number < 0) {
-    std::cout << "WARNING: you used a non existent NonBlockingExchange ID number in MPW_Wait." << std::endl;
+  return ret;
+}
+
+int MPW_Waitany(int count, int* reqs, int* index) {
+  *index = -1;
+  pthread_mutex_lock(&request_lock);
+  while (true) {
+    bool active = false;
+    for (int i = 0; i < count; i++) {
+      if (reqs[i] == MPW_REQUEST_NULL) {
+        continue;
+      }
+      std::map<int, Request*>::iterator it = requests.find(reqs[i]);
+      if (it == requests.end()) {
+        pthread_mutex_unlock(&request_lock);
+        LOG_WARN("MPW_Waitany: request " << reqs[i] << " does not exist.");
+        return -EINVAL;
+      }
+      active = true;
+      Request *r = it->second;
+      if (r->finished) {
+        requests.erase(it);
+        pthread_mutex_unlock(&request_lock);
+        reqs[i] = MPW_REQUEST_NULL;
+        *index = i;
+        const int ret = r->result;
+        delete r;
+        return ret;
+      }
+    }
+    if (!active) {
+      pthread_mutex_unlock(&request_lock);
+      return 0;
+    }
+    pthread_cond_wait(&request_cond, &request_lock);
   }
-  return element_number;
 }
 
-/* Check if a particular non-blocking exchange has completed. */
-bool MPW_Has_NBE_Finished(int NBE_id) {
-  int element_number = Find_NBE_By_ID(NBE_id);
-  return(MPW_nonBlockingExchanges[element_number].NBE_args.channel >= 0);
+int MPW_OnComplete(int request, MPW_Callback callback, void* arg) {
+  pthread_mutex_lock(&request_lock);
+  std::map<int, Request*>::iterator it = requests.find(request);
+  if (it == requests.end() || callback == NULL) {
+    pthread_mutex_unlock(&request_lock);
+    return -EINVAL;
+  }
+  Request *r = it->second;
+  if (!r->finished) {
+    r->callback = callback;
+    r->arg = arg;
+    pthread_mutex_unlock(&request_lock);
+    return 0;
+  }
+  requests.erase(it);
+  pthread_mutex_unlock(&request_lock);
+
+  callback(request, r->result, arg);
+  delete r;
+  return 0;
 }
 
-/* Wait until a particular non-blocking exchange has completed. */
-void MPW_Wait(int NBE_id) {
-  int element_number = Find_NBE_By_ID(NBE_id);  
-  pthread_join(MPW_nonBlockingExchanges[element_number].pthr_id, NULL);
-  MPW_nonBlockingExchanges.erase(MPW_nonBlockingExchanges.begin()+element_number);
+/* Check if a particular non-blocking exchange has completed, without releasing it. */
+bool MPW_Has_NBE_Finished(int NBE_id) {
+  pthread_mutex_lock(&request_lock);
+  std::map<int, Request*>::iterator it = requests.find(NBE_id);
+  const bool finished = it == requests.end() || it->second->finished;
+  pthread_mutex_unlock(&request_lock);
+  return finished;
 }
@@ -20,12 +20,17 @@
  * **************************************************************/
 #include <iostream>
 #include <cassert>
+#include <sys/uio.h>
 
 /* Enable/disable software-based packet pacing. */
 #define MPW_PacingMode 1
 
+/* Resolve a host name to an IPv4 address. Thread-safe; results are cached (see below).
+ * Returns NULL on failure, or a string owned by the library that stays valid. */
 char* MPW_DNSResolve(char* host);
 char* MPW_DNSResolve(std::string host);
+/* Seconds resolved host names are cached (default 300, <= 0: no caching). */
+void MPW_setDNSCacheTTL(double seconds);
 
 /* Enable/disable autotuning. Set before initialization. */
 void MPW_setAutoTuning(bool b);
@@ -41,6 +46,23 @@ int MPW_NumChannels();
 int MPW_CreatePathWithoutConnect(std::string host, int server_side_base_port, int streams_in_path); 
 int MPW_ConnectPath(int path_id, bool server_wait);
 int MPW_CreatePath(std::string host, int server_side_base_port, int num_streams); 
+/* Time allowed for connecting the streams of a path, in seconds (default 10, <= 0: no limit).
+ * Refused connects are retried with backoff within it. Call before MPW_ConnectPath. */
+void MPW_setPathConnectTimeout(int path, double seconds);
+/* Mark a path as one half of a forwarder (MPW_RelayPaths). As they connect, the two ends of a
+ * path tell each other their byte order on its first stream; a forwarding path leaves that byte
+ * to the endpoints, so that they learn the order of each other rather than of the forwarder.
+ * Call before MPW_ConnectPath. */
+void MPW_setPathForwarding(int path, bool enable);
+/* Seconds the last MPW_ConnectPath of the path took. */
+double MPW_getPathSetupTime(int path);
+/* Keep the streams of destroyed paths open, so that a later path to the same host and port
+ * can use them without new connections. Both sides must enable this. A client path reuses
+ * the streams of one with at least as many streams. At most max_streams idle streams are kept,
+ * each for at most idle_timeout seconds. max_streams = 0 (the default) disables the pool. */
+void MPW_setPathPool(int max_streams, double idle_timeout);
+/* Number of idle streams currently kept in the pool. */
+int MPW_PooledStreams();
 // Return 0 on success (negative on failure).
 int MPW_DestroyPath(int path);
 
@@ -51,6 +73,82 @@ extern "C" {
   int MPW_SendRecv(char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize, int path);
   // returns the size of the newly received data. 
   int MPW_DSendRecv(char* sendbuf, long long int sendsize, char* recvbuf, long long int maxrecvsize, int path);
+
+  /* Scatter/gather versions: each iovec list is one logical message, no packing needed. */
+  int MPW_SendRecvV(const struct iovec* sendiov, int sendcnt, struct iovec* recviov, int recvcnt, int path);
+  int MPW_SendV(const struct iovec* sendiov, int sendcnt, int path);
+  int MPW_RecvV(struct iovec* recviov, int recvcnt, int path);
+}
+
+/* Typed exchanges: arrays of one of the element types below, counted in elements. The
+ * two ends of a path learn each other's byte order as it connects, also through forwarders
+ * (see MPW_setPathForwarding). Where they differ, the receiving side reverses the bytes of
+ * each element as the data arrives, so neither side converts its arrays itself. Both sides
+ * must use the same type for a message. */
+#define MPW_BYTE   0
+#define MPW_INT16  1
+#define MPW_INT32  2
+#define MPW_INT64  3
+#define MPW_FLOAT  4
+#define MPW_DOUBLE 5
+
+/* Derived types: layouts of elements that are strided or scattered in memory, e.g. the
+ * boundary layer of a grid, like the derived datatypes of MPI. Typed exchanges send them
+ * from and receive them into place, without packing. A derived type may serve wherever a
+ * base type does, including as the old type of another one. Counts, strides, displacements,
+ * sizes and starts are in elements of the old type; displacements and strides may not be
+ * negative. Each call returns the id of the new type, or -EINVAL. */
+extern "C" {
+  /* count blocks of blocklength elements, stride elements apart. */
+  int MPW_TypeVector(long long int count, long long int blocklength, long long int stride, int oldtype);
+  /* count blocks of blocklengths[i] elements at displacements[i]. */
+  int MPW_TypeIndexed(int count, const long long int* blocklengths, const long long int* displacements, int oldtype);
+  /* The block of subsizes elements that starts at starts, within an ndims-dimensional array of
+   * sizes elements (C order). Consecutive elements of the type are whole arrays apart. */
+  int MPW_TypeSubarray(int ndims, const long long int* sizes, const long long int* subsizes, const long long int* starts,
+                       int oldtype);
+  /* Free a derived type. Returns 0, or -EINVAL. */
+  int MPW_TypeFree(int type);
+}
+
+extern "C" {
+  /* Data bytes in an element of a type, and the distance between consecutive elements, or -EINVAL. */
+  long long int MPW_TypeSize(int type);
+  long long int MPW_TypeExtent(int type);
+  /* Whether the other side of a path has a different byte order (1) or the same (0), or -EINVAL. */
+  int MPW_PathSwapsBytes(int path);
+
+  int MPW_SendRecvTyped(int path, int type, const void* sendbuf, long long int sendcount, void* recvbuf, long long int recvcount);
+  int MPW_SendTyped(int path, int type, const void* sendbuf, long long int sendcount);
+  int MPW_RecvTyped(int path, int type, void* recvbuf, long long int recvcount);
+}
+
+/* The element type of C++ arrays. */
+template <class T> struct MPW_TypeOf;
+template <> struct MPW_TypeOf<char> { enum { type = MPW_BYTE }; };
+template <> struct MPW_TypeOf<unsigned char> { enum { type = MPW_BYTE }; };
+template <> struct MPW_TypeOf<short> { enum { type = MPW_INT16 }; };
+template <> struct MPW_TypeOf<unsigned short> { enum { type = MPW_INT16 }; };
+template <> struct MPW_TypeOf<int> { enum { type = MPW_INT32 }; };
+template <> struct MPW_TypeOf<unsigned int> { enum { type = MPW_INT32 }; };
+template <> struct MPW_TypeOf<long> { enum { type = sizeof(long) == 8 ? MPW_INT64 : MPW_INT32 }; };
+template <> struct MPW_TypeOf<unsigned long> { enum { type = sizeof(long) == 8 ? MPW_INT64 : MPW_INT32 }; };
+template <> struct MPW_TypeOf<long long> { enum { type = MPW_INT64 }; };
+template <> struct MPW_TypeOf<unsigned long long> { enum { type = MPW_INT64 }; };
+template <> struct MPW_TypeOf<float> { enum { type = MPW_FLOAT }; };
+template <> struct MPW_TypeOf<double> { enum { type = MPW_DOUBLE }; };
+
+template <class T>
+inline int MPW_SendRecvTyped(int path, const T* sendbuf, long long int sendcount, T* recvbuf, long long int recvcount) {
+  return MPW_SendRecvTyped(path, MPW_TypeOf<T>::type, sendbuf, sendcount, recvbuf, recvcount);
+}
+template <class T>
+inline int MPW_SendTyped(int path, const T* sendbuf, long long int sendcount) {
+  return MPW_SendTyped(path, MPW_TypeOf<T>::type, sendbuf, sendcount);
+}
+template <class T>
+inline int MPW_RecvTyped(int path, T* recvbuf, long long int recvcount) {
+  return MPW_RecvTyped(path, MPW_TypeOf<T>::type, recvbuf, recvcount);
 }
 
 /* Initialize MPWide. */
@@ -71,12 +169,19 @@ int MPW_Finalize();
 /* Perform this using multiple channels. */
 int MPW_PSendRecv(char** sendbuf, long long int* sendsize, char** recvbuf, long long int* recvsize, int* channel, int num_channels);
 int MPW_SendRecv ( char* sendbuf, long long int  sendsize, char*  recvbuf, long long int  recvsize, int* channel, int num_channels);
+int MPW_SendRecvV(const struct iovec* sendiov, int sendcnt, struct iovec* recviov, int recvcnt, int* channel, int num_channels);
 
 /* Dynamically-sized message exchanges. */
 long long int MPW_DSendRecv(char* sendbuf, long long int sendsize, char* recvbuf, long long int maxrecvsize, int* channel, int num_channels);
 
-/* Message relaying/forwarding for communication nodes. */
+/* Message relaying/forwarding for communication nodes: forward everything that arrives on
+ * channels[i] to channels2[i] and vice versa, until both sides of every pair have closed. */
 void MPW_Relay(int* channels, int* channels2, int num_channels);
+/* The same for the streams of paths[i] and paths2[i], which must have equally many streams.
+ * Returns 0, or -EINVAL. Paths that were not marked with MPW_setPathForwarding have told the
+ * endpoints the byte order of this host; they are only relayed if that is the order of the
+ * endpoint at the other side, and -EPROTO is returned otherwise. */
+int MPW_RelayPaths(int* paths, int* paths2, int num_paths);
 
 /* Send data, receive nothing. */
 void MPW_Send(char* buf, long long int size, int* channels, int num_channels);
@@ -84,7 +189,8 @@ void MPW_Send(char* buf, long long int size, int* channels, int num_channels);
 /* Receive data. Will not return until the data is received. */
 void MPW_Recv(char* buf, long long int size, int* channels, int num_channels);
 
-/* Recv from one set of channels. Send out through the other set. */
+/* Recv from one set of channels. Send out through the other set. MPW_DCycle returns the
+ * received size, or a negative errno value if the exchange failed. */
 long long int MPW_DCycle(char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize,
              int* ch_send, int num_ch_send, int* ch_recv, int num_ch_recv);
 void MPW_Cycle(char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize,
@@ -93,25 +199,259 @@ void MPW_Cycle(char* sendbuf, long long int sendsize, char* recvbuf, long long i
 /* Simple buffer splitting function. Handy for PSendRecv calls. */
 void MPW_splitBuf(char* buf, long long int bsize, int num_chunks, char** split_buf, long long int* chunk_sizes);
 
-/* Synchronyze two processes on one stream. 
- * TODO: Implement collective barrier which operates on all streams simultaneously. */
+/* Synchronyze two processes on one stream. */
 void MPW_Barrier(int channel);
 
-/* Adjust the global feeding pace. */
+/* Synchronize the two ends of a path. Each side sends a one-byte token on the first stream of
+ * the path and waits for the one of the other side, so the barrier costs about one round trip
+ * and starts no threads. With flush, it first waits until the other side has acknowledged all
+ * data sent on the other streams of the path, for at most 10 s (-ETIMEDOUT). No exchange may
+ * be in progress on the path. Returns 0, or a negative errno value. */
+int MPW_PathBarrier(int path, bool flush = false);
+
+/* Collective operations across several sites. A communicator is made of the paths from this
+ * site to each of the others: paths[r] leads to the site of rank r (paths[rank] is not used).
+ * All sites create it with the same size and their own rank, and then call the same operations
+ * in the same order. The operations drive all the paths they use at once, and pick a direct,
+ * tree or ring algorithm by message size and number of sites; data that passes through other
+ * sites is forwarded in chunks as it arrives. They use non-blocking requests, so the paths must
+ * not be compressed, and no other exchange may be in progress on them. Send and receive buffers
+ * may not overlap, except that sendbuf of MPW_Allgather may be the block of this site in recvbuf.
+ * MPW_CommCreate returns the id of the communicator, the others 0; all return -EINVAL, or
+ * another negative errno value, on failure. */
+int MPW_CommCreate(int rank, int size, const int* paths);
+int MPW_CommFree(int comm);
+/* Copy size bytes from buf at the root into buf at every site. */
+int MPW_Bcast(char* buf, long long int size, int root, int comm);
+/* Collect the size bytes of sendbuf of every site in recvbuf of the root, in rank order. */
+int MPW_Gather(const char* sendbuf, long long int size, char* recvbuf, int root, int comm);
+/* Collect the size bytes of sendbuf of every site in recvbuf of every site, in rank order. */
+int MPW_Allgather(const char* sendbuf, long long int size, char* recvbuf, int comm);
+/* Send the size bytes at sendbuf + r * size to the site of rank r, which stores them at
+ * recvbuf + rank * size. */
+int MPW_Alltoall(const char* sendbuf, long long int size, char* recvbuf, int comm);
+
+/* Reductions over a communicator: combine count elements of type (MPW_INT32, MPW_INT64,
+ * MPW_FLOAT or MPW_DOUBLE) of every site element by element with op. Chunks are combined with
+ * vectorized loops as they arrive, while the next ones are still on their way. Large vectors
+ * go through a ring reduce-scatter (followed by a ring allgather for MPW_Allreduce), so that
+ * each link carries about twice the vector whatever the number of sites. All sites get the same
+ * result, bit for bit. Integer sums and products wrap around. sendbuf may be recvbuf.
+ * Returns 0, or a negative errno value. */
+#define MPW_SUM  0
+#define MPW_MIN  1
+#define MPW_MAX  2
+#define MPW_PROD 3
+/* Store the result in recvbuf of the root (recvbuf is not used elsewhere). */
+int MPW_Reduce(const void* sendbuf, void* recvbuf, long long int count, int type, int op, int root, int comm);
+/* Store the result in recvbuf of every site. */
+int MPW_Allreduce(const void* sendbuf, void* recvbuf, long long int count, int type, int op, int comm);
+
+/* Adjust the global feeding pace: the largest number of bytes handed to a single send/recv
+ * call (default 4 MB). Streams adapt their chunks to their socket buffers below this limit;
+ * setting it to 8192 gives the fixed 8 kB chunks of older versions. */
 void MPW_setChunkSize(int sending, int receiving);
 
-/* Non-blocking functionalities. */
+/* Send large messages on a path with MSG_ZEROCOPY: the kernel transmits straight from the
+ * user buffer instead of copying it. Sends of at least threshold bytes (<= 0: 32 kB) are
+ * affected. An exchange returns only once the kernel has released the buffer.
+ * Returns the number of streams on which zero-copy is active. */
+int MPW_setPathZeroCopy(int path, bool enable, long long int threshold);
+
+/* Tagged messages. Any number of independent flows can share a path: each message is sent
+ * on a channel (>= 0) with a tag (>= 0), and is received by the MPW_RecvTagged of the same
+ * channel whose tag matches (MPW_ANY_TAG matches any). Within a channel, messages with the same
+ * tag arrive in the order they were sent. Messages that nobody waits for yet are kept until
+ * they are asked for. Large messages are sent in fragments over the streams that are free.
+ * Several threads may send and receive at the same time. Once a path carries tagged messages,
+ * the other exchange functions must no longer be used on it. */
+#define MPW_ANY_TAG -1
+/* Returns 0, or a negative errno value. */
+int MPW_SendTagged(const char* buf, long long int size, int channel, int tag, int path);
+/* Wait for a message and copy it into buf. Returns its size, or a negative errno value
+ * (-EMSGSIZE if it is larger than maxsize; it then stays queued). The tag of the message is
+ * stored in recv_tag, if given. */
+long long int MPW_RecvTagged(char* buf, long long int maxsize, int channel, int tag, int path, int* recv_tag = NULL);
+/* The size of the message MPW_RecvTagged would return now, or -EAGAIN if there is none yet. */
+long long int MPW_ProbeTagged(int channel, int tag, int path, int* recv_tag = NULL);
+
+/* Stripe the messages of a path dynamically instead of in one equal slice per stream:
+ * MPW_SendRecv(V), MPW_Send(V) and MPW_Recv(V) on the path cut them into chunks of
+ * chunk_size bytes (<= 0: 256 kB; at most 1 GB), and each stream takes the next chunk as
+ * soon as it is free. The exchange then takes as long as the streams together need, rather
+ * than the slowest one. Both sides must enable this with the same setting of enable. */
+void MPW_setPathStriping(int path, bool enable, long long int chunk_size);
+
+/* Protect the data of a path against corruption on the way: every 64 kB sent on its streams
+ * are followed by their CRC32C (computed with SSE4.2 or ARMv8 instructions where available),
+ * which the receiver verifies as the data arrives. An exchange that receives a chunk with a
+ * wrong checksum fails with -EBADMSG, after logging the stream and the offset of the chunk;
+ * MPW_GetStreamInfo counts them. Both sides must enable this. This covers MPW_SendRecv(V),
+ * MPW_Send(V), MPW_Recv(V), typed, striped and compressed exchanges and MPW_ISendRecv.
+ * Tagged messages, MPW_DSendRecv and MPW_(D)Cycle carry no checksums: on the streams of such
+ * a path they fail with -ENOTSUP (MPW_Cycle returns nothing). Returns 0, or -EINVAL. */
+int MPW_setPathChecksums(int path, bool enable);
+
+/* Compress the messages of a path: MPW_SendRecv(V), MPW_Send(V) and MPW_Recv(V) on the path
+ * cut each stream's share of a message into blocks, compress them in parallel, send them with
+ * their compressed sizes and decompress them on arrival. Messages below 16 kB are sent as they
+ * are. In MPW_COMPRESS_AUTO the path measures the compression ratio and speed against the
+ * throughput of the link, and sends uncompressed while compressing would make it slower,
+ * trying again every 16th message. Both sides must enable compression, in either mode; the
+ * sender decides per message. A compressing path does not stripe, and its nonblocking calls
+ * fail with -ENOTSUP. Returns 0, or -EINVAL. */
+#define MPW_COMPRESS_OFF  0
+#define MPW_COMPRESS_ON   1
+#define MPW_COMPRESS_AUTO 2
+int MPW_setPathCompression(int path, int mode);
+
+/* What the compression stage of a path has measured (averages over the recent messages;
+ * 0 until measured). Rates are in bytes/s of uncompressed data, the link rate in bytes/s on the wire. */
+typedef struct MPW_CompressionInfo {
+  int mode;
+  int active;                 // the last message was sent compressed.
+  long long int messages;     // messages sent,
+  long long int compressed;   // ... of which compressed.
+  long long int raw_bytes;    // bytes sent before and after compression.
+  long long int wire_bytes;
+  double ratio;               // compressed / uncompressed size.
+  double compress_rate;
+  double decompress_rate;
+  double link_rate;
+} MPW_CompressionInfo;
+int MPW_GetCompressionInfo(int path, MPW_CompressionInfo* info);
+
+/* Use the TCP congestion control algorithm name ("cubic", "bbr", ...) for the streams of a
+ * path, on this side. Takes effect on connection if the path is not connected yet. Returns the
+ * number of connected streams that use it, or a negative errno value if the kernel does not
+ * offer it. MPW_StreamInfo reports the algorithm in effect. */
+int MPW_setPathCongestionControl(int path, std::string name);
+
+/* Congestion state of a stream, sampled with getsockopt(TCP_INFO). Fields the kernel
+ * does not report are 0. */
+typedef struct MPW_TcpInfo {
+  double time;                  // when the sample was taken (seconds since the epoch).
+  int stream;                   // index of the stream within the path.
+  long long int rtt_us;         // smoothed round-trip time in microseconds.
+  long long int rttvar_us;      // ... and its variation.
+  long long int min_rtt_us;     // lowest round-trip time seen.
+  long long int cwnd;           // congestion window, in segments.
+  long long int ssthresh;       // slow start threshold, in segments.
+  long long int mss;            // segment size.
+  long long int retransmits;    // segments retransmitted since the connection was made.
+  long long int lost;           // segments currently considered lost.
+  long long int unacked_bytes;  // bytes sent but not yet acknowledged.
+  long long int notsent_bytes;  // bytes queued but not yet sent.
+  long long int delivery_rate;  // recent delivery rate in bytes/s.
+  long long int pacing_rate;    // rate the kernel paces at in bytes/s.
+} MPW_TcpInfo;
+
+/* Transmission counters of a single stream (stream is the index within the path). */
+typedef struct MPW_StreamInfo {
+  long long int zerocopy_threshold; // 0 if zero-copy is off.
+  long long int zerocopy_sends;     // sends issued with MSG_ZEROCOPY.
+  long long int zerocopy_completed; // ... of which the kernel has released the buffer.
+  long long int zerocopy_copied;    // ... of which the kernel copied the data anyway (e.g. loopback).
+  long long int copy_sends;         // regular, copying sends.
+  long long int send_chunk;         // chunk size currently chosen for sending (0: none yet).
+  long long int recv_chunk;         // ... and for receiving.
+  long long int blocked_sends;      // sends / recvs that found the socket buffer full / empty.
+  long long int blocked_recvs;
+  long long int bytes_sent;         // payload sent / received on the stream.
+  long long int bytes_received;
+  long long int checksum_errors;    // chunks received with a wrong checksum (see MPW_setPathChecksums),
+  long long int checksum_error_offset; // ... and the offset logged for the last one (-1: none).
+  MPW_TcpInfo tcp;                  // sampled when the info is requested.
+  char congestion[16];              // TCP congestion control in effect.
+} MPW_StreamInfo;
+int MPW_GetStreamInfo(int path, int stream, MPW_StreamInfo* info);
+
+/* The streams of a path taken together. */
+typedef struct MPW_PathInfo {
+  int streams;
+  long long int stripe_chunk;   // chunk size of dynamic striping (0: off, see MPW_setPathStriping).
+  long long int bytes_sent;
+  long long int bytes_received;
+  long long int checksum_errors;
+  long long int min_rtt_us;     // lowest / highest / mean smoothed RTT of the streams.
+  long long int max_rtt_us;
+  long long int avg_rtt_us;
+  long long int cwnd;           // the sums over the streams.
+  long long int retransmits;
+  long long int lost;
+  long long int unacked_bytes;
+  long long int delivery_rate;
+  long long int pacing_rate;
+} MPW_PathInfo;
+int MPW_GetPathInfo(int path, MPW_PathInfo* info);
+
+/* Sample the TCP state of all streams of a path every interval seconds into a ring of
+ * the last capacity samples (one per stream per interval). Restarting clears the ring. */
+int MPW_StartTcpRecording(int path, double interval, int capacity);
+int MPW_StopTcpRecording(int path);
+/* Copy up to max recorded samples into samples, oldest first. Returns the number copied. */
+int MPW_GetTcpRecording(int path, MPW_TcpInfo* samples, int max);
+
+/* Transport backends: how the streams of an exchange are driven. */
+#define MPW_BACKEND_EPOLL    0 // non-blocking send/recv calls on ready sockets (poll() outside Linux).
+#define MPW_BACKEND_IO_URING 1 // batched submissions through io_uring (Linux 5.11 and later).
+
+/* Select the transport backend for paths connected from now on (default: MPW_BACKEND_EPOLL).
+ * Returns the backend in effect: io_uring falls back to epoll where the kernel lacks it. */
+int MPW_setTransportBackend(int backend);
+int MPW_getTransportBackend();
+
+/* Set the maximum number of worker threads started for each path (default: one per core, -1).
+ * 0 disables the workers, so that exchanges are driven by the calling thread. Set before connecting. */
+void MPW_setWorkerThreads(int max_workers);
+
+/* Non-blocking functionalities. Each call posts an exchange on a path and returns a request
+ * handle (>= 0), or a negative errno value. The worker threads of the path carry it out in the
+ * background, in the order in which the exchanges of the path were posted. The buffers must
+ * stay untouched until the request has completed. Complete all requests of a path before
+ * destroying it. */
+#define MPW_REQUEST_NULL -1
+int MPW_Isend(char* sendbuf, long long int sendsize, int path);
+int MPW_Irecv(char* recvbuf, long long int recvsize, int path);
 int MPW_ISendRecv( char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize, int path);
+
+/* Returns 0 while the request is in progress. Once it has completed, releases it and
+ * returns 1, or the negative errno value it failed with. */
+int MPW_Test(int request);
+/* Block until the request has completed and release it. Returns 0, or a negative errno value. */
+int MPW_Wait(int request);
+/* MPW_Wait on each request that is not MPW_REQUEST_NULL, and set it to MPW_REQUEST_NULL.
+ * Returns 0, or the last error. */
+int MPW_Waitall(int count, int* requests);
+/* Block until one of the requests has completed, release it, set it to MPW_REQUEST_NULL and
+ * store its position in index (-1 if all are MPW_REQUEST_NULL). Returns as MPW_Wait. */
+int MPW_Waitany(int count, int* requests, int* index);
+
+/* Have callback(request, result, arg) called by a worker thread as soon as the request
+ * completes (by the caller, if it already has). The request is released after the call,
+ * so it must not be tested or waited for any more. */
+typedef void (*MPW_Callback)(int request, int result, void* arg);
+int MPW_OnComplete(int request, MPW_Callback callback, void* arg);
+
+/* Whether a request has completed, without releasing it. */
 bool MPW_Has_NBE_Finished(int NBE_id);
-void MPW_Wait(int NBE_id);
 
 
 #if MPW_PacingMode == 1
-/* Get and set rates for pacing data. */
+/* Get and set rates for pacing data (bytes/s per stream, -1 disables pacing). */
 extern "C" {
   double MPW_getPacingRate();
   void   MPW_setPacingRate(double rate);
 }
+
+/* Pace a path: path_rate limits the sum of its streams and stream_rate each stream
+ * (bytes/s; -1: unlimited, stream_rate 0: the rate of MPW_setPacingRate). */
+void   MPW_setPathPacingRate(int path, double path_rate, double stream_rate);
+double MPW_getPathPacingRate(int path);
+
+/* Let the kernel pace the streams of a path (SO_MAX_PACING_RATE, best with the fq qdisc).
+ * Returns the number of streams the kernel paces; the others are paced by MPWide. */
+int MPW_setPathKernelPacing(int path, bool enable);
 #endif
 
 extern "C" {
@@ -0,0 +1,1227 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "ProgressEngine.h"
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#define MPW_USE_EPOLL 1
+#else
+#include <poll.h>
+#include <fcntl.h>
+#endif
+
+#include "IoUring.h"
+#ifdef MPW_HAVE_IO_URING
+#include <poll.h>
+#include <endian.h>
+#include <linux/swab.h>
+#endif
+
+#include "mpwide-macros.h"
+
+/* Maximum number of events handled per poll round. */
+#define MPW_ENGINE_MAXEVENTS 256
+
+/* Size of the io_uring queues and of its fixed file table. */
+#define MPW_URING_ENTRIES 512
+#define MPW_URING_FILES 256
+
+/* Tags in the low bits of io_uring user_data (the rest is the UringOp pointer). */
+#define URING_TAG_OP     0
+#define URING_TAG_POLL   1
+#define URING_TAG_WAKE   2
+#define URING_TAG_CANCEL 3
+#define URING_TAG_TIMER  4
+#define URING_TAG_MASK   7
+
+struct FdWatch;
+
+/* A send or recv in flight in io_uring. There is at most one per socket and
+ * direction, so that the byte order of the stream is kept. */
+struct UringOp {
+  FdWatch *watch;
+  bool recv;
+  StreamTask *task;  // the task the operation is for; NULL when idle.
+  bool poll_first;   // the socket was not ready last time: wait for readiness first.
+  bool zerocopy;     // sent with IORING_OP_SENDMSG_ZC.
+  long long int bytes; // size of the transfer.
+  bool cancelled;
+  struct msghdr msg;
+  struct iovec iov[MPW_TASK_MAXIOV];
+};
+
+/* A socket in use by one or more tasks, with the events currently registered for it. */
+struct FdWatch {
+  int fd;
+  Socket *sock;
+  int events;
+  std::vector<StreamTask*> readers;
+  std::vector<StreamTask*> writers;
+  int slot; // fixed file slot in the io_uring, or -1.
+  UringOp rop, wop;
+};
+
+IovCursor::IovCursor() :
+  iov(&single), iovcnt(0), index(0), offset(0), left(0)
+{
+  single.iov_base = NULL;
+  single.iov_len = 0;
+}
+
+IovCursor::IovCursor(char *buf, long long int size) :
+  iov(&single), iovcnt(1), index(0), offset(0), left(size)
+{
+  single.iov_base = buf;
+  single.iov_len = size;
+}
+
+IovCursor::IovCursor(const struct iovec *iov, int iovcnt, long long int start, long long int length)
+{
+  single.iov_base = NULL;
+  single.iov_len = 0;
+  reset(iov, iovcnt, start, length);
+}
+
+void IovCursor::reset(const struct iovec *iov, int iovcnt, long long int start, long long int length)
+{
+  this->iov = iov;
+  this->iovcnt = iovcnt;
+  index = 0;
+  left = length;
+  // Find the entry in which the range starts.
+  while(index < iovcnt && start >= (long long int)iov[index].iov_len) {
+    start -= iov[index].iov_len;
+    index++;
+  }
+  offset = start;
+}
+
+void IovCursor::reset(const IovCursor &from, long long int skip, long long int length)
+{
+  if(from.iov == &from.single) {
+    single = from.single;
+    iov = &single;
+  } else {
+    iov = from.iov;
+  }
+  iovcnt = from.iovcnt;
+  index = from.index;
+  offset = from.offset;
+  advance(skip);
+  left = length;
+}
+
+int IovCursor::fill(struct iovec *out, int maxiov) const
+{
+  int n = 0;
+  long long int todo = left;
+  size_t off = offset;
+  for(int i = index; i < iovcnt && n < maxiov && todo > 0; i++) {
+    const long long int len = min(todo, (long long int)(iov[i].iov_len - off));
+    if(len > 0) {
+      out[n].iov_base = (char *)iov[i].iov_base + off;
+      out[n].iov_len = len;
+      todo -= len;
+      n++;
+    }
+    off = 0;
+  }
+  return n;
+}
+
+void IovCursor::advance(long long int n)
+{
+  left -= n;
+  while(n > 0 && index < iovcnt) {
+    const long long int avail = iov[index].iov_len - offset;
+    if(n < avail) {
+      offset += n;
+      return;
+    }
+    n -= avail;
+    index++;
+    offset = 0;
+  }
+}
+
+TaskGroup::TaskGroup(int count) :
+  remaining(count), error(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+TaskGroup::~TaskGroup()
+{
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&cond);
+}
+
+void TaskGroup::done(int task_error)
+{
+  pthread_mutex_lock(&lock);
+  if(task_error < 0) {
+    error = task_error;
+  }
+  if(--remaining == 0) {
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+int TaskGroup::wait()
+{
+  pthread_mutex_lock(&lock);
+  while(remaining > 0) {
+    pthread_cond_wait(&cond, &lock);
+  }
+  int ret = error;
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
+TokenBucket::TokenBucket(double rate) :
+  rate(-1), burst(0), tokens(0), last_ns(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  setRate(rate);
+}
+
+TokenBucket::~TokenBucket()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+void TokenBucket::setRate(double r, long long int b)
+{
+  pthread_mutex_lock(&lock);
+  rate = r > 0 ? r : -1;
+  burst = b > 0 ? b : max(64.0*1024, rate * 0.002);
+  tokens = burst;
+  last_ns = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+long long int TokenBucket::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+bool TokenBucket::take(long long int n, long long int now_ns, long long int *ready_ns)
+{
+  if(rate <= 0) {
+    return true;
+  }
+  pthread_mutex_lock(&lock);
+  if(last_ns > 0 && now_ns > last_ns) {
+    tokens = min(burst, tokens + (now_ns - last_ns) * 1e-9 * rate);
+  }
+  if(now_ns > last_ns) {
+    last_ns = now_ns;
+  }
+  const bool ok = tokens > 0;
+  if(ok) {
+    tokens -= n;
+  } else {
+    // Wait until the overdraft has been paid off.
+    *ready_ns = last_ns + (long long int)(-tokens / rate * 1e9) + 1;
+  }
+  pthread_mutex_unlock(&lock);
+  return ok;
+}
+
+void TokenBucket::refund(long long int n)
+{
+  if(rate <= 0) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  tokens = min(burst, tokens + n);
+  pthread_mutex_unlock(&lock);
+}
+
+StreamTask::StreamTask(Socket *rsock, Socket *wsock) :
+  rsock(rsock), wsock(wsock), error(0), stream(-1), group(NULL), zc_mark(0),
+  paced_until(0), granted(0), rwatch(NULL), wwatch(NULL)
+{
+  pacer[0] = pacer[1] = NULL;
+}
+
+ProgressEngine::ProgressEngine(bool use_io_uring) :
+  send_chunk(8*1024), recv_chunk(8*1024), timer_deadline(0), tfd(-1),
+  ring(NULL), want_ring(use_io_uring), wake_armed(false), timer_armed(false), ring_zerocopy(true),
+  efd(-1), wakefd(-1), num_active(0), last_error(0)
+{
+#ifdef MPW_USE_EPOLL
+  // Paced tasks are woken with an absolute-deadline timer.
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(tfd < 0) {
+    LOG_WARN("ProgressEngine: timerfd_create failed: " << strerror(errno));
+  }
+#endif
+#ifdef MPW_HAVE_IO_URING
+  if(use_io_uring) {
+    ring = new IoUring(MPW_URING_ENTRIES, MPW_URING_FILES);
+    if(ring->valid()) {
+      return;
+    }
+    LOG_WARN("ProgressEngine: io_uring is not available, using epoll instead.");
+    delete ring;
+    ring = NULL;
+  }
+#endif
+#ifdef MPW_USE_EPOLL
+  efd = epoll_create1(EPOLL_CLOEXEC);
+  if(efd < 0) {
+    LOG_ERR("ProgressEngine: epoll_create1 failed: " << strerror(errno));
+  }
+  if(tfd >= 0) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = this; // marks the timer.
+    ev.events = EPOLLIN;
+    epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+  }
+#endif
+}
+
+bool ProgressEngine::ioUringAvailable()
+{
+#ifdef MPW_HAVE_IO_URING
+  return IoUring::available();
+#else
+  return false;
+#endif
+}
+
+ProgressEngine::~ProgressEngine()
+{
+#ifdef MPW_HAVE_IO_URING
+  delete ring; // closing the ring cancels whatever is still in flight.
+#endif
+  for(std::map<int, FdWatch*>::iterator it = watches.begin(); it != watches.end(); ++it) {
+    delete it->second;
+  }
+#ifdef MPW_USE_EPOLL
+  if(efd >= 0) {
+    ::close(efd);
+  }
+  if(tfd >= 0) {
+    ::close(tfd);
+  }
+#endif
+}
+
+void ProgressEngine::setWakeFd(int fd)
+{
+  wakefd = fd;
+  if(ring) {
+    return; // polled through the ring, see pollRing().
+  }
+#ifdef MPW_USE_EPOLL
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.data.ptr = NULL; // the only watch without an FdWatch.
+  ev.events = EPOLLIN;
+  if(epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    LOG_ERR("ProgressEngine: cannot watch wakeup fd: " << strerror(errno));
+  }
+#endif
+}
+
+/* Consume all pending wakeups. */
+static void drainWakeFd(int fd)
+{
+  char buf[64];
+  while(read(fd, buf, sizeof(buf)) > 0) {
+#ifdef MPW_USE_EPOLL
+    break; // an eventfd is reset by a single read.
+#endif
+  }
+}
+
+FdWatch *ProgressEngine::watch(Socket *s)
+{
+  const int fd = s->getSock();
+  std::map<int, FdWatch*>::iterator it = watches.find(fd);
+  if(it != watches.end()) {
+    return it->second;
+  }
+  FdWatch *w = new FdWatch;
+  w->fd = fd;
+  w->sock = s;
+  w->events = 0;
+  w->slot = -1;
+  UringOp *ops[2] = { &w->rop, &w->wop };
+  for(int i = 0; i < 2; i++) {
+    ops[i]->watch = w;
+    ops[i]->recv = i == 0;
+    ops[i]->task = NULL;
+    ops[i]->poll_first = false;
+    ops[i]->zerocopy = false;
+    ops[i]->cancelled = false;
+  }
+#ifdef MPW_HAVE_IO_URING
+  if(ring) {
+    w->slot = ring->registerFile(fd);
+  }
+#endif
+  watches[fd] = w;
+  return w;
+}
+
+/* Tasks sharing a socket take turns in the order in which they were added: the
+ * first one that still wants to receive / send has the socket to itself, so that
+ * their bytes never interleave. */
+StreamTask *ProgressEngine::firstReader(FdWatch *w)
+{
+  for(size_t i = 0; i < w->readers.size(); i++) {
+    if(w->readers[i]->error == 0 && w->readers[i]->wantRecv()) {
+      return w->readers[i];
+    }
+  }
+  return NULL;
+}
+
+StreamTask *ProgressEngine::firstWriter(FdWatch *w)
+{
+  for(size_t i = 0; i < w->writers.size(); i++) {
+    if(w->writers[i]->error == 0 && w->writers[i]->wantSend()) {
+      return w->writers[i];
+    }
+  }
+  return NULL;
+}
+
+/* Recompute the events wanted on a socket and tell the kernel if they changed. */
+void ProgressEngine::update(FdWatch *w)
+{
+  int events = 0;
+  if(firstReader(w)) {
+    events |= MPWIDE_SOCKET_RDMASK;
+  }
+  StreamTask *writer = firstWriter(w);
+  if(writer && writer->paced_until == 0) {
+    events |= MPWIDE_SOCKET_WRMASK;
+  }
+  for(size_t i = 0; i < w->writers.size(); i++) {
+    if(w->writers[i]->zeroCopyPending()) { events |= MPWIDE_SOCKET_ERRMASK; }
+  }
+  if(events == w->events || ring) {
+    w->events = events; // the ring needs no registration.
+    return;
+  }
+
+#ifdef MPW_USE_EPOLL
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.data.ptr = w;
+  ev.events = (FLAG_CHECK(events, MPWIDE_SOCKET_RDMASK) ? EPOLLIN : 0)
+            | (FLAG_CHECK(events, MPWIDE_SOCKET_WRMASK) ? EPOLLOUT : 0);
+  // Error queue notifications (EPOLLERR) are always reported, so they need no flag.
+  // Sockets nobody waits on are removed, otherwise a hang-up on them would wake us forever.
+  int op = events == 0 ? EPOLL_CTL_DEL : (w->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+  if(epoll_ctl(efd, op, w->fd, &ev) < 0) {
+    LOG_ERR("ProgressEngine: epoll_ctl(" << op << ") on fd " << w->fd << " failed: " << strerror(errno));
+  }
+#endif
+  w->events = events;
+}
+
+void ProgressEngine::add(StreamTask *t)
+{
+  num_active++;
+  if(t->finished()) {
+    retire(t);
+    return;
+  }
+  t->rwatch = watch(t->rsock);
+  t->wwatch = watch(t->wsock);
+  t->rwatch->readers.push_back(t);
+  t->wwatch->writers.push_back(t);
+  update(t->rwatch);
+  if(t->wwatch != t->rwatch) {
+    update(t->wwatch);
+  }
+}
+
+/* Detach a finished task from its sockets and signal its completion. */
+void ProgressEngine::retire(StreamTask *t)
+{
+  FdWatch *ws[2] = { t->rwatch, t->wwatch };
+  if(t->rwatch) {
+    std::vector<StreamTask*> &r = t->rwatch->readers;
+    r.erase(std::remove(r.begin(), r.end(), t), r.end());
+  }
+  if(t->wwatch) {
+    std::vector<StreamTask*> &w = t->wwatch->writers;
+    w.erase(std::remove(w.begin(), w.end(), t), w.end());
+  }
+  t->rwatch = t->wwatch = NULL;
+  if(t->paced_until != 0) {
+    paced.erase(std::remove(paced.begin(), paced.end(), t), paced.end());
+    t->paced_until = 0;
+  }
+
+  for(int i = 0; i < 2; i++) {
+    if(ws[i] == NULL || (i == 1 && ws[1] == ws[0])) {
+      continue;
+    }
+    update(ws[i]);
+    if(ws[i]->readers.empty() && ws[i]->writers.empty()) {
+#ifdef MPW_HAVE_IO_URING
+      if(ring) {
+        ring->unregisterFile(ws[i]->slot);
+      }
+#endif
+      watches.erase(ws[i]->fd);
+      delete ws[i];
+    }
+  }
+
+  if(t->error < 0) {
+    last_error = t->error;
+  }
+  num_active--;
+  t->complete();
+}
+
+/* Cut an iovec list down to at most limit bytes. Returns the new iovec count,
+ * or 0 if the list holds no bytes at all. */
+static int trimIov(struct iovec *iov, int cnt, long long int limit)
+{
+  long long int total = 0;
+  for(int i = 0; i < cnt; i++) {
+    if(total + (long long int)iov[i].iov_len >= limit) {
+      iov[i].iov_len = limit - total;
+      return limit > 0 ? i + 1 : 0;
+    }
+    total += iov[i].iov_len;
+  }
+  return total > 0 ? cnt : 0;
+}
+
+/* Fill iov (MPW_TASK_MAXIOV entries) with the next piece t should receive. Returns the iovec count. */
+int ProgressEngine::nextRecv(StreamTask *t, struct iovec *iov, long long int &bytes)
+{
+  const long long int limit = t->rsock->recvChunk(min((long long int) MPW_MIN_CHUNK, recv_chunk), recv_chunk);
+  const int cnt = trimIov(iov, t->nextRecv(iov, MPW_TASK_MAXIOV), limit);
+  bytes = 0;
+  for(int i = 0; i < cnt; i++) {
+    bytes += iov[i].iov_len;
+  }
+  return cnt;
+}
+
+bool ProgressEngine::doRecv(StreamTask *t)
+{
+  struct iovec iov[MPW_TASK_MAXIOV];
+  long long int bytes;
+  const int cnt = nextRecv(t, iov, bytes);
+  if(cnt < 1) {
+    return false;
+  }
+  const long long int n = cnt == 1 ? t->rsock->irecv((char *)iov[0].iov_base, iov[0].iov_len)
+                                   : t->rsock->irecv(iov, cnt);
+  if(n > 0) {
+    t->rsock->recvResult(bytes, n);
+    t->recvDone(n);
+    return true;
+  }
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    t->rsock->recvResult(bytes, -1);
+    return false;
+  }
+  // socket disconnected on other side, choose default -1 errno.
+  t->error = n == 0 ? -1 : -max(1, errno);
+  return false;
+}
+
+/* Fill iov (MPW_TASK_MAXIOV entries) with the next piece t should send. Returns the iovec count. */
+int ProgressEngine::nextSend(StreamTask *t, struct iovec *iov, bool &zerocopy, long long int &bytes)
+{
+  zerocopy = false;
+  bytes = 0;
+  if(t->paced_until != 0) {
+    return 0;
+  }
+  int cnt = t->nextSend(iov, MPW_TASK_MAXIOV);
+  long long int total = 0;
+  for(int i = 0; i < cnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  long long int limit = t->wsock->sendChunk(min((long long int) MPW_MIN_CHUNK, send_chunk), send_chunk);
+  // A paced send should not overdraw its bucket by more than one burst.
+  for(int i = 0; i < 2; i++) {
+    if(t->pacer[i]) {
+      limit = min(limit, max((long long int) MPW_MIN_CHUNK, t->pacer[i]->getBurst()));
+    }
+  }
+
+  /* Large sends go out zero-copy in pieces of at least the threshold, if enabled. */
+  const long long int zc_threshold = t->wsock->zeroCopyThreshold();
+  zerocopy = zc_threshold > 0 && total >= zc_threshold;
+  cnt = trimIov(iov, cnt, zerocopy ? max(limit, zc_threshold) : limit);
+
+  for(int i = 0; i < cnt; i++) {
+    bytes += iov[i].iov_len;
+  }
+  return cnt > 0 && pace(t, bytes) ? cnt : 0;
+}
+
+/* Take bytes from the pacers of t. If one of them is empty, t is parked until it refills. */
+bool ProgressEngine::pace(StreamTask *t, long long int bytes)
+{
+  t->granted = 0;
+  if(t->pacer[0] == NULL && t->pacer[1] == NULL) {
+    return true;
+  }
+  const long long int now = TokenBucket::now();
+  long long int ready = now;
+  if(t->pacer[0] && !t->pacer[0]->take(bytes, now, &ready)) {
+    // stream budget exhausted.
+  } else if(t->pacer[1] && !t->pacer[1]->take(bytes, now, &ready)) {
+    if(t->pacer[0]) {
+      t->pacer[0]->refund(bytes);
+    }
+  } else {
+    t->granted = bytes;
+    return true;
+  }
+  t->paced_until = ready;
+  paced.push_back(t);
+  armTimer();
+  return false;
+}
+
+/* Settle the pacers of t after a send of n bytes (n <= 0 if nothing was sent). */
+void ProgressEngine::sent(StreamTask *t, long long int n)
+{
+  const long long int unused = t->granted - max(n, 0LL);
+  for(int i = 0; i < 2 && unused > 0; i++) {
+    if(t->pacer[i]) {
+      t->pacer[i]->refund(unused);
+    }
+  }
+  t->granted = 0;
+}
+
+/* Set the timer to the earliest time at which a paced task may send again. */
+void ProgressEngine::armTimer()
+{
+  long long int first = 0;
+  for(size_t i = 0; i < paced.size(); i++) {
+    if(first == 0 || paced[i]->paced_until < first) {
+      first = paced[i]->paced_until;
+    }
+  }
+  if(first == timer_deadline) {
+    return;
+  }
+  timer_deadline = first;
+#ifdef MPW_USE_EPOLL
+  if(tfd >= 0) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its)); // a zero time disarms the timer.
+    its.it_value.tv_sec = first / 1000000000LL;
+    its.it_value.tv_nsec = first % 1000000000LL;
+    timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+  }
+#endif
+}
+
+/* Let the paced tasks whose time has come send again. */
+void ProgressEngine::releasePaced()
+{
+#ifdef MPW_USE_EPOLL
+  if(tfd >= 0) {
+    uint64_t expirations;
+    ssize_t ret = read(tfd, &expirations, sizeof(expirations));
+    (void) ret;
+  }
+#endif
+  const long long int now = TokenBucket::now();
+  size_t j = 0;
+  for(size_t i = 0; i < paced.size(); i++) {
+    StreamTask *t = paced[i];
+    if(t->paced_until <= now) {
+      t->paced_until = 0;
+      update(t->wwatch);
+    } else {
+      paced[j++] = t;
+    }
+  }
+  paced.resize(j);
+  timer_deadline = 0; // the timer has expired.
+  armTimer();
+}
+
+bool ProgressEngine::doSend(StreamTask *t)
+{
+  struct iovec iov[MPW_TASK_MAXIOV];
+  bool zerocopy;
+  long long int bytes;
+  const int cnt = nextSend(t, iov, zerocopy, bytes);
+  if(cnt < 1) {
+    return false;
+  }
+
+  long long int n;
+  if(zerocopy) {
+    n = t->wsock->isendZeroCopy(iov, cnt);
+    t->zc_mark = t->wsock->zeroCopyIssued();
+  } else {
+    n = cnt == 1 ? t->wsock->isend((const char *)iov[0].iov_base, iov[0].iov_len)
+                 : t->wsock->isend(iov, cnt);
+  }
+  sent(t, n);
+  if(n > 0) {
+    t->wsock->sendResult(bytes, n);
+    t->sendDone(n);
+    return true;
+  }
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    t->wsock->sendResult(bytes, -1);
+    return false;
+  }
+  t->error = -max(1, errno);
+  return false;
+}
+
+int ProgressEngine::poll(int timeout_ms)
+{
+  if(num_active == 0 && wakefd < 0) {
+    return 0;
+  }
+  // Without a timer descriptor, paced tasks are released by waiting no longer than their deadline.
+  if(tfd < 0 && timer_deadline > 0) {
+    const int wait_ms = (int) max(0LL, (timer_deadline - TokenBucket::now() + 999999) / 1000000);
+    timeout_ms = timeout_ms < 0 ? wait_ms : min(timeout_ms, wait_ms);
+  }
+  if(ring) {
+    return pollRing(timeout_ms);
+  }
+
+  std::vector<FdWatch*> ready;
+  std::vector<int> revents;
+
+#ifdef MPW_USE_EPOLL
+  struct epoll_event evs[MPW_ENGINE_MAXEVENTS];
+  const int n = epoll_wait(efd, evs, MPW_ENGINE_MAXEVENTS, timeout_ms);
+  if(n < 0) {
+    if(errno != EINTR) {
+      LOG_ERR("ProgressEngine: epoll_wait failed: " << strerror(errno));
+    }
+    return 0;
+  }
+  for(int i = 0; i < n; i++) {
+    if(evs[i].data.ptr == NULL) {
+      drainWakeFd(wakefd);
+      continue;
+    }
+    if(evs[i].data.ptr == this) {
+      releasePaced();
+      continue;
+    }
+    FdWatch *w = (FdWatch *)evs[i].data.ptr;
+    ready.push_back(w);
+    if((evs[i].events & EPOLLERR) && w->sock->zeroCopyThreshold() > 0) {
+      // On zero-copy sockets EPOLLERR signals completion notifications.
+      revents.push_back(MPWIDE_SOCKET_ERRMASK
+                      | ((evs[i].events & (EPOLLIN|EPOLLHUP)) ? MPWIDE_SOCKET_RDMASK : 0)
+                      | ((evs[i].events & EPOLLOUT) ? MPWIDE_SOCKET_WRMASK : 0));
+      continue;
+    }
+    // Errors and hang-ups are reported through the next recv/send call.
+    revents.push_back(((evs[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) ? MPWIDE_SOCKET_RDMASK : 0)
+                    | ((evs[i].events & (EPOLLOUT|EPOLLERR)) ? MPWIDE_SOCKET_WRMASK : 0));
+  }
+#else
+  std::vector<struct pollfd> pfds;
+  std::vector<FdWatch*> polled;
+  for(std::map<int, FdWatch*>::iterator it = watches.begin(); it != watches.end(); ++it) {
+    if(it->second->events == 0) {
+      continue;
+    }
+    struct pollfd p;
+    p.fd = it->first;
+    p.events = (FLAG_CHECK(it->second->events, MPWIDE_SOCKET_RDMASK) ? POLLIN : 0)
+             | (FLAG_CHECK(it->second->events, MPWIDE_SOCKET_WRMASK) ? POLLOUT : 0);
+    p.revents = 0;
+    pfds.push_back(p);
+    polled.push_back(it->second);
+  }
+  if(wakefd >= 0) {
+    struct pollfd p;
+    p.fd = wakefd;
+    p.events = POLLIN;
+    p.revents = 0;
+    pfds.push_back(p);
+    polled.push_back(NULL);
+  }
+  const int n = ::poll(pfds.empty() ? NULL : &pfds[0], pfds.size(), timeout_ms);
+  if(n < 0) {
+    if(errno != EINTR) {
+      LOG_ERR("ProgressEngine: poll failed: " << strerror(errno));
+    }
+    return 0;
+  }
+  for(size_t i = 0; i < pfds.size(); i++) {
+    if(pfds[i].revents == 0) {
+      continue;
+    }
+    if(polled[i] == NULL) {
+      drainWakeFd(wakefd);
+      continue;
+    }
+    ready.push_back(polled[i]);
+    revents.push_back(((pfds[i].revents & (POLLIN|POLLERR|POLLHUP)) ? MPWIDE_SOCKET_RDMASK : 0)
+                    | ((pfds[i].revents & (POLLOUT|POLLERR)) ? MPWIDE_SOCKET_WRMASK : 0));
+  }
+#endif
+
+  std::vector<StreamTask*> stepped;
+
+  for(size_t i = 0; i < ready.size(); i++) {
+    FdWatch *w = ready[i];
+    if(FLAG_CHECK(revents[i], MPWIDE_SOCKET_ERRMASK)) {
+      if(w->sock->reapZeroCopy() == 0) {
+        // Not a notification but a real socket error: let recv/send report it.
+        revents[i] |= MPWIDE_SOCKET_RDMASK | MPWIDE_SOCKET_WRMASK;
+      }
+      for(size_t j = 0; j < w->writers.size(); j++) {
+        stepped.push_back(w->writers[j]);
+      }
+    }
+    if(FLAG_CHECK(revents[i], MPWIDE_SOCKET_RDMASK)) {
+      StreamTask *t = firstReader(w);
+      if(t) {
+        doRecv(t);
+        stepped.push_back(t);
+      }
+    }
+    if(FLAG_CHECK(revents[i], MPWIDE_SOCKET_WRMASK)) {
+      StreamTask *t = firstWriter(w);
+      if(t) {
+        doSend(t);
+        stepped.push_back(t);
+      }
+    }
+  }
+
+  int completed = 0;
+  std::sort(stepped.begin(), stepped.end());
+  stepped.erase(std::unique(stepped.begin(), stepped.end()), stepped.end());
+  for(size_t i = 0; i < stepped.size(); i++) {
+    StreamTask *t = stepped[i];
+    if(t->finished()) {
+      retire(t);
+      completed++;
+    } else {
+      // Progress in one direction may change the interest in the other (e.g. relaying).
+      update(t->rwatch);
+      if(t->wwatch != t->rwatch) {
+        update(t->wwatch);
+      }
+    }
+  }
+
+  if(tfd < 0 && timer_deadline > 0 && TokenBucket::now() >= timer_deadline) {
+    releasePaced();
+  }
+  return completed;
+}
+
+int ProgressEngine::run(StreamTask **tasks, int ntasks)
+{
+  last_error = 0;
+  for(int i = 0; i < ntasks; i++) {
+    add(tasks[i]);
+  }
+  while(num_active > 0) {
+    poll(10000);
+  }
+  return last_error;
+}
+
+#ifdef MPW_HAVE_IO_URING
+
+static void setPollMask(struct io_uring_sqe *sqe, unsigned mask)
+{
+#if __BYTE_ORDER == __BIG_ENDIAN
+  mask = __swahw32(mask);
+#endif
+  sqe->poll32_events = mask;
+}
+
+/* Queue the next recv (or send) of t on socket w. */
+void ProgressEngine::startOp(FdWatch *w, StreamTask *t, bool recv)
+{
+  UringOp *op = recv ? &w->rop : &w->wop;
+  bool zerocopy = false;
+  const int cnt = recv ? nextRecv(t, op->iov, op->bytes) : nextSend(t, op->iov, zerocopy, op->bytes);
+  if(cnt < 1) {
+    return;
+  }
+  const int fd = w->slot >= 0 ? w->slot : w->fd;
+  const unsigned char fixed = w->slot >= 0 ? IOSQE_FIXED_FILE : 0;
+
+  if(ring->freeSqes() < 2) {
+    ring->submit(0, 0);
+  }
+  struct io_uring_sqe *sqe;
+  if(op->poll_first) {
+    // Linked: the transfer is only attempted once the socket is ready, instead of failing with EAGAIN again.
+    sqe = ring->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->flags = fixed | IOSQE_IO_LINK;
+    setPollMask(sqe, recv ? POLLIN : POLLOUT);
+    sqe->user_data = (__u64)(unsigned long) op | URING_TAG_POLL;
+  }
+
+  memset(&op->msg, 0, sizeof(op->msg));
+  op->msg.msg_iov = op->iov;
+  op->msg.msg_iovlen = cnt;
+  op->zerocopy = zerocopy && ring_zerocopy;
+  op->cancelled = false;
+  op->task = t;
+
+  sqe = ring->getSqe();
+  sqe->opcode = recv ? IORING_OP_RECVMSG : (op->zerocopy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG);
+  sqe->fd = fd;
+  sqe->flags = fixed;
+  sqe->addr = (__u64)(unsigned long) &op->msg;
+  sqe->len = 1;
+  sqe->msg_flags = recv ? 0 : MSG_NOSIGNAL;
+  if(op->zerocopy) {
+    sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+  }
+  sqe->user_data = (__u64)(unsigned long) op | URING_TAG_OP;
+}
+
+bool ProgressEngine::inFlight(StreamTask *t) const
+{
+  return (t->rwatch && t->rwatch->rop.task == t) || (t->wwatch && t->wwatch->wop.task == t);
+}
+
+/* poll() for the io_uring backend: submit the next transfer of every socket
+ * in one go, then handle whatever completed. */
+int ProgressEngine::pollRing(int timeout_ms)
+{
+  struct io_uring_sqe *sqe;
+  if(wakefd >= 0 && !wake_armed) {
+    if(ring->freeSqes() < 1) {
+      ring->submit(0, 0);
+    }
+    sqe = ring->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wakefd;
+    setPollMask(sqe, POLLIN);
+    sqe->user_data = URING_TAG_WAKE;
+    wake_armed = true;
+  }
+  if(tfd >= 0 && !timer_armed) {
+    if(ring->freeSqes() < 1) {
+      ring->submit(0, 0);
+    }
+    sqe = ring->getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = tfd;
+    setPollMask(sqe, POLLIN);
+    sqe->user_data = URING_TAG_TIMER;
+    timer_armed = true;
+  }
+
+  for(std::map<int, FdWatch*>::iterator it = watches.begin(); it != watches.end(); ++it) {
+    FdWatch *w = it->second;
+    UringOp *ops[2] = { &w->rop, &w->wop };
+    for(int d = 0; d < 2; d++) {
+      UringOp *op = ops[d];
+      if(op->task == NULL) {
+        StreamTask *t = op->recv ? firstReader(w) : firstWriter(w);
+        if(t && (op->recv || t->paced_until == 0)) {
+          startOp(w, t, op->recv);
+        }
+      } else if(op->task->error < 0 && !op->cancelled) {
+        // The task failed in the other direction; stop waiting for this one.
+        for(int tag = URING_TAG_OP; tag <= URING_TAG_POLL; tag++) {
+          if(ring->freeSqes() < 1) {
+            ring->submit(0, 0);
+          }
+          sqe = ring->getSqe();
+          sqe->opcode = IORING_OP_ASYNC_CANCEL;
+          sqe->fd = -1;
+          sqe->addr = (__u64)(unsigned long) op | tag;
+          sqe->user_data = URING_TAG_CANCEL;
+        }
+        op->cancelled = true;
+      }
+    }
+  }
+
+  if(ring->submit(1, timeout_ms) < 0) {
+    return 0;
+  }
+
+  std::vector<StreamTask*> stepped;
+  struct io_uring_cqe cqes[MPW_ENGINE_MAXEVENTS];
+  int n;
+  while((n = ring->reap(cqes, MPW_ENGINE_MAXEVENTS)) > 0) {
+    for(int i = 0; i < n; i++) {
+      const int tag = cqes[i].user_data & URING_TAG_MASK;
+      UringOp *op = (UringOp *)(unsigned long)(cqes[i].user_data & ~(__u64) URING_TAG_MASK);
+      const int res = cqes[i].res;
+      if(tag == URING_TAG_WAKE) {
+        drainWakeFd(wakefd);
+        wake_armed = false;
+        continue;
+      }
+      if(tag == URING_TAG_TIMER) {
+        timer_armed = false;
+        releasePaced();
+        continue;
+      }
+      if(tag != URING_TAG_OP) {
+        continue; // readiness polls and cancellations: the linked / cancelled transfer reports.
+      }
+      if(cqes[i].flags & IORING_CQE_F_NOTIF) {
+        // The kernel has released the pages of a zero-copy send.
+        op->watch->sock->noteZeroCopy(0, 1, (res & IORING_NOTIF_USAGE_ZC_COPIED) ? 1 : 0);
+        stepped.insert(stepped.end(), op->watch->writers.begin(), op->watch->writers.end());
+        continue;
+      }
+
+      StreamTask *t = op->task;
+      op->task = NULL;
+      op->poll_first = res == -EAGAIN;
+      stepped.push_back(t);
+      if(!op->recv) {
+        sent(t, res);
+      }
+      if(res > 0 || res == -EAGAIN) {
+        if(op->recv) {
+          t->rsock->recvResult(op->bytes, res);
+        } else {
+          t->wsock->sendResult(op->bytes, res);
+        }
+      }
+      if(cqes[i].flags & IORING_CQE_F_MORE) {
+        // A zero-copy send: the buffer is in use until its notification arrives.
+        t->wsock->noteZeroCopy(1, 0, 0);
+        t->zc_mark = t->wsock->zeroCopyIssued();
+      }
+
+      if(res > 0) {
+        if(op->recv) {
+          t->recvDone(res);
+        } else {
+          if(!op->zerocopy) {
+            t->wsock->noteCopySend();
+          }
+          t->sendDone(res);
+        }
+        continue;
+      }
+      if(res == -EAGAIN || res == -EINTR || res == -ECANCELED || op->cancelled) {
+        continue; // retried in the next round (a cancelled poll also cancels the transfer).
+      }
+      if(op->zerocopy && (res == -EINVAL || res == -EOPNOTSUPP)) {
+        LOG_WARN("ProgressEngine: io_uring zero-copy sends are not supported, copying instead.");
+        ring_zerocopy = false;
+        continue;
+      }
+      // socket disconnected on other side, choose default -1 errno.
+      t->error = res == 0 ? -1 : res;
+      LOG_ERR("ProgressEngine: " << (op->recv ? "recv" : "send") << " on fd " << op->watch->fd
+              << " failed: " << (res == 0 ? "connection reset by peer" : strerror(-res)));
+      #if EXIT_ON_SENDRECV_ERROR == 1
+        exit(1);
+      #endif
+    }
+  }
+
+  int completed = 0;
+  std::sort(stepped.begin(), stepped.end());
+  stepped.erase(std::unique(stepped.begin(), stepped.end()), stepped.end());
+  for(size_t i = 0; i < stepped.size(); i++) {
+    StreamTask *t = stepped[i];
+    // Even a failed task waits for its zero-copy notifications, which refer to its socket.
+    if(t->finished() && !inFlight(t) && !t->zeroCopyPending()) {
+      retire(t);
+      completed++;
+    }
+  }
+
+  if(tfd < 0 && timer_deadline > 0 && TokenBucket::now() >= timer_deadline) {
+    releasePaced();
+  }
+  return completed;
+}
+
+#else
+
+int ProgressEngine::pollRing(int timeout_ms) { return 0; }
+void ProgressEngine::startOp(FdWatch *w, StreamTask *t, bool recv) {}
+bool ProgressEngine::inFlight(StreamTask *t) const { return false; }
+
+#endif // MPW_HAVE_IO_URING
+
+/* One thread of a WorkerPool with its own engine and submission queue. */
+struct WorkerPool::Worker {
+  Worker(bool use_io_uring) : engine(use_io_uring) {}
+
+  pthread_t thread;
+  ProgressEngine engine;
+  pthread_mutex_t lock;
+  std::vector<StreamTask*> queue;
+  int wake[2]; // read and write end of the wakeup descriptor.
+  bool stop;
+  long long int send_chunk, recv_chunk;
+
+  void wakeup() {
+#ifdef MPW_USE_EPOLL
+    uint64_t one = 1;
+    ssize_t ret = write(wake[1], &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t ret = write(wake[1], &one, 1);
+#endif
+    (void) ret;
+  }
+};
+
+WorkerPool::WorkerPool(int num_workers, bool use_io_uring)
+{
+  for(int i = 0; i < num_workers; i++) {
+    Worker *w = new Worker(use_io_uring);
+    pthread_mutex_init(&w->lock, NULL);
+    w->stop = false;
+    w->send_chunk = w->recv_chunk = 8*1024;
+#ifdef MPW_USE_EPOLL
+    w->wake[0] = w->wake[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+#else
+    if(pipe(w->wake) == 0) {
+      fcntl(w->wake[0], F_SETFL, O_NONBLOCK);
+      fcntl(w->wake[1], F_SETFL, O_NONBLOCK);
+    }
+#endif
+    w->engine.setWakeFd(w->wake[0]);
+    if(pthread_create(&w->thread, NULL, WorkerPool::loop, w) != 0) {
+      LOG_ERR("WorkerPool: failed to start worker thread " << i);
+      ::close(w->wake[0]);
+      if(w->wake[1] != w->wake[0]) ::close(w->wake[1]);
+      pthread_mutex_destroy(&w->lock);
+      delete w;
+      break;
+    }
+    workers.push_back(w);
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  for(size_t i = 0; i < workers.size(); i++) {
+    Worker *w = workers[i];
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_mutex_unlock(&w->lock);
+    w->wakeup();
+    pthread_join(w->thread, NULL);
+    ::close(w->wake[0]);
+    if(w->wake[1] != w->wake[0]) ::close(w->wake[1]);
+    pthread_mutex_destroy(&w->lock);
+    delete w;
+  }
+}
+
+void *WorkerPool::loop(void *args)
+{
+  Worker *w = (Worker *)args;
+  std::vector<StreamTask*> incoming;
+
+  while(true) {
+    pthread_mutex_lock(&w->lock);
+    incoming.swap(w->queue);
+    const bool stop = w->stop;
+    w->engine.send_chunk = w->send_chunk;
+    w->engine.recv_chunk = w->recv_chunk;
+    pthread_mutex_unlock(&w->lock);
+
+    for(size_t i = 0; i < incoming.size(); i++) {
+      w->engine.add(incoming[i]);
+    }
+    incoming.clear();
+
+    if(stop && w->engine.active() == 0) {
+      break;
+    }
+    w->engine.poll(-1);
+  }
+  return NULL;
+}
+
+int WorkerPool::run(StreamTask **tasks, int ntasks, long long int send_chunk, long long int recv_chunk)
+{
+  if(ntasks == 0) {
+    return 0;
+  }
+  TaskGroup group(ntasks);
+  submit(tasks, ntasks, send_chunk, recv_chunk, &group);
+  return group.wait();
+}
+
+void WorkerPool::submit(StreamTask **tasks, int ntasks, long long int send_chunk, long long int recv_chunk, TaskGroup *group)
+{
+  std::vector<bool> touched(workers.size(), false);
+
+  for(size_t i = 0; i < workers.size(); i++) {
+    pthread_mutex_lock(&workers[i]->lock);
+  }
+  for(int i = 0; i < ntasks; i++) {
+    const size_t wi = (tasks[i]->stream >= 0 ? tasks[i]->stream : i) % workers.size();
+    tasks[i]->group = group;
+    workers[wi]->queue.push_back(tasks[i]);
+    touched[wi] = true;
+  }
+  for(size_t i = 0; i < workers.size(); i++) {
+    workers[i]->send_chunk = send_chunk;
+    workers[i]->recv_chunk = recv_chunk;
+    pthread_mutex_unlock(&workers[i]->lock);
+  }
+  for(size_t i = 0; i < workers.size(); i++) {
+    if(touched[i]) {
+      workers[i]->wakeup();
+    }
+  }
+}
@@ -0,0 +1,291 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#ifndef MPW_ProgressEngine_class
+#define MPW_ProgressEngine_class
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+#include <map>
+
+#include "Socket.h"
+
+/* Maximum number of iovec entries a task may hand to the engine per step. */
+#define MPW_TASK_MAXIOV 64
+
+/* Smallest chunk (bytes per send/recv call) the adaptive chunk sizing will pick. */
+#define MPW_MIN_CHUNK (8*1024)
+
+struct FdWatch;
+class IoUring;
+
+/** IovCursor
+ * Walks a byte range of a scatter/gather list, handing out the part that is
+ * still to be transferred as iovecs. A contiguous buffer is a list of one.
+ */
+class IovCursor
+{
+ public:
+  IovCursor();
+  IovCursor(char *buf, long long int size);
+  IovCursor(const struct iovec *iov, int iovcnt, long long int offset, long long int length);
+
+  long long int remaining() const { return left; }
+
+  // Point the cursor at another byte range of a scatter/gather list.
+  void reset(const struct iovec *iov, int iovcnt, long long int offset, long long int length);
+  // Point the cursor at the length bytes that start skip bytes past the position of from.
+  // Takes time in the number of entries skipped, rather than in the offset.
+  void reset(const IovCursor &from, long long int skip, long long int length);
+
+  // Fill out with (at most maxiov entries of) the remaining range. Returns the iovec count.
+  int fill(struct iovec *out, int maxiov) const;
+
+  // Mark n bytes as transferred.
+  void advance(long long int n);
+
+ private:
+  IovCursor(const IovCursor &);
+  IovCursor &operator=(const IovCursor &);
+
+  struct iovec single;
+  const struct iovec *iov;
+  int iovcnt;
+  int index;     // current entry in iov
+  size_t offset; // offset within iov[index]
+  long long int left;
+};
+
+/** TaskGroup
+ * Completion counter for a batch of tasks that are driven by other threads.
+ * Subclasses may override done() to act on completion instead of being waited for.
+ */
+class TaskGroup
+{
+ public:
+  TaskGroup(int count);
+  virtual ~TaskGroup();
+
+  // Called from the driving thread as each task completes.
+  virtual void done(int error);
+
+  // Block until all tasks have completed. Returns 0, or the last task error.
+  int wait();
+
+ private:
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int remaining;
+  int error;
+};
+
+/** TokenBucket
+ * Paces the bytes sent on a stream or a path. Tokens flow in at rate bytes/s
+ * and accumulate up to burst bytes. A send may overdraw the bucket, after which
+ * the next one waits until the balance is positive again. Shared by the workers
+ * that drive the streams of a path, hence the lock.
+ */
+class TokenBucket
+{
+ public:
+  TokenBucket(double rate = -1);
+  ~TokenBucket();
+
+  // rate in bytes/s; <= 0 means unlimited. A burst <= 0 allows 2 ms worth of data (at least 64 kB).
+  void setRate(double rate, long long int burst = 0);
+  double getRate() const { return rate; }
+  long long int getBurst() const { return (long long int) burst; }
+  bool limited() const { return rate > 0; }
+
+  // Take n bytes at time now_ns. If the bucket is empty, return false and set
+  // *ready_ns to the time at which it will have tokens again.
+  bool take(long long int n, long long int now_ns, long long int *ready_ns);
+
+  // Give back tokens that were taken but not used.
+  void refund(long long int n);
+
+  // CLOCK_MONOTONIC in nanoseconds.
+  static long long int now();
+
+ private:
+  TokenBucket(const TokenBucket &);
+  TokenBucket &operator=(const TokenBucket &);
+
+  pthread_mutex_t lock;
+  double rate;
+  double burst;
+  double tokens;
+  long long int last_ns;
+};
+
+/** StreamTask
+ * The state machine of one stream's share of an exchange. A task never touches
+ * its sockets itself: the engine asks where the next bytes should come from or
+ * go to, performs the I/O when the socket is ready, and reports back how many
+ * bytes were moved. A task is finished once it wants neither to send nor to recv.
+ */
+class StreamTask
+{
+ public:
+  StreamTask(Socket *rsock, Socket *wsock);
+  virtual ~StreamTask() {}
+
+  virtual bool wantRecv() const { return false; }
+  virtual bool wantSend() const { return false; }
+
+  // Fill iov with the region to receive into / send from next; return the iovec count.
+  virtual int nextRecv(struct iovec *iov, int maxiov) { return 0; }
+  virtual int nextSend(struct iovec *iov, int maxiov) { return 0; }
+
+  virtual void recvDone(long long int n) {}
+  virtual void sendDone(long long int n) {}
+
+  // Called once by the engine when the task has finished or failed.
+  virtual void complete() { if(group) group->done(error); }
+
+  // A task that sent with MSG_ZEROCOPY is not finished before the kernel released its pages.
+  bool zeroCopyPending() const { return zc_mark > 0 && zc_mark > wsock->zeroCopyCompleted(); }
+  bool finished() const { return error < 0 || (!wantRecv() && !wantSend() && !zeroCopyPending()); }
+
+  Socket *rsock;
+  Socket *wsock;
+  int error;        // 0, or a negative errno value once the task has failed.
+  int stream;       // stream number, used to pick a worker thread (-1 if unknown).
+  TaskGroup *group; // signalled on completion, if set.
+  long long int zc_mark; // zero-copy sends of wsock that must complete before this task does.
+  TokenBucket *pacer[2]; // stream and path rate limits for sending (NULL: unpaced).
+
+  // Engine bookkeeping.
+  long long int paced_until; // the task may not send before this time (0: it may send).
+  long long int granted;     // bytes taken from the pacers for the send in progress.
+  FdWatch *rwatch;
+  FdWatch *wwatch;
+};
+
+/** ProgressEngine
+ * Drives any number of StreamTasks from a single thread using one epoll set
+ * (poll() on platforms without epoll). Several tasks may share a socket, e.g.
+ * a send on one path and a recv on the same path issued from another thread.
+ *
+ * With use_io_uring the engine instead submits the sends and recvs of all its
+ * sockets as one batch through io_uring, and collects their completions with a
+ * single system call per round. It falls back to epoll if io_uring is unavailable.
+ */
+class ProgressEngine
+{
+ public:
+  ProgressEngine(bool use_io_uring = false);
+  ~ProgressEngine();
+
+  bool usingIoUring() const { return ring != NULL; }
+  bool requestedIoUring() const { return want_ring; } // even if it fell back to epoll.
+  static bool ioUringAvailable();
+
+  // Register a task. Tasks that have nothing to do are completed immediately.
+  void add(StreamTask *t);
+
+  // Wait up to timeout_ms for socket events and step the tasks that can progress.
+  // Returns the number of tasks that completed during this round.
+  int poll(int timeout_ms);
+
+  // Number of registered tasks that have not completed yet.
+  int active() const { return num_active; }
+
+  // Add all tasks and drive them to completion. Returns 0, or the last task error.
+  int run(StreamTask **tasks, int ntasks);
+
+  // Let poll() also return when fd becomes readable; the engine drains it.
+  void setWakeFd(int fd);
+
+  /* Upper limits for the chunk sizes (bytes per send/recv call). Within them, each
+   * socket adapts its chunks to its buffers, see Socket::sendChunk(). */
+  long long int send_chunk;
+  long long int recv_chunk;
+
+ private:
+  FdWatch *watch(Socket *s);
+  StreamTask *firstReader(FdWatch *w);
+  StreamTask *firstWriter(FdWatch *w);
+  void update(FdWatch *w);
+  void retire(StreamTask *t);
+  bool doRecv(StreamTask *t);
+  bool doSend(StreamTask *t);
+  int nextRecv(StreamTask *t, struct iovec *iov, long long int &bytes);
+  int nextSend(StreamTask *t, struct iovec *iov, bool &zerocopy, long long int &bytes);
+
+  // Pacing: tasks whose pacers are empty wait for the timer.
+  bool pace(StreamTask *t, long long int bytes);
+  void sent(StreamTask *t, long long int n);
+  void armTimer();
+  void releasePaced();
+  std::vector<StreamTask*> paced;
+  long long int timer_deadline; // time the timer is set to (0: not set).
+  int tfd;                      // timerfd, or -1.
+
+  // io_uring backend.
+  int pollRing(int timeout_ms);
+  void startOp(FdWatch *w, StreamTask *t, bool recv);
+  bool inFlight(StreamTask *t) const;
+  IoUring *ring;
+  bool want_ring;
+  bool wake_armed;
+  bool timer_armed;
+  bool ring_zerocopy; // the kernel supports IORING_OP_SENDMSG_ZC.
+
+  int efd;
+  int wakefd;
+  int num_active;
+  int last_error;
+  std::map<int, FdWatch*> watches;
+};
+
+/** WorkerPool
+ * A fixed set of threads, each with its own ProgressEngine, that lives as long
+ * as the path it serves. Exchanges are handed to the workers through a queue and
+ * a wakeup descriptor; all tasks of one stream always go to the same worker.
+ */
+class WorkerPool
+{
+ public:
+  WorkerPool(int num_workers, bool use_io_uring = false);
+  ~WorkerPool();
+
+  int size() const { return workers.size(); }
+
+  // Hand the tasks to the workers and wait until all of them have completed.
+  // Returns 0, or the last task error.
+  int run(StreamTask **tasks, int ntasks, long long int send_chunk, long long int recv_chunk);
+
+  // Hand the tasks to the workers and return at once; each task signals group as it
+  // completes. Tasks on the same socket are served in the order they were submitted.
+  void submit(StreamTask **tasks, int ntasks, long long int send_chunk, long long int recv_chunk, TaskGroup *group);
+
+ private:
+  struct Worker;
+  static void *loop(void *args);
+
+  std::vector<Worker*> workers;
+};
+
+#endif
@@ -0,0 +1,119 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "MPWide.h"
+#include "Reduction.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MPW_REDUCE_AVX2 1
+#endif
+
+/* acc[i] = acc[i] op in[i], computed in U (the unsigned type for integer sums and products,
+ * which wrap around). The compiler vectorizes each of these loops for the instruction set of
+ * the function they are inlined into. */
+template <class T, class U, int OP>
+static inline __attribute__((always_inline)) void combine(void *acc, const void *in, long long int n)
+{
+  T *__restrict a = (T *) acc;
+  const T *__restrict b = (const T *) in;
+  for (long long int i = 0; i < n; i++) {
+    if (OP == MPW_SUM) {
+      a[i] = (T) ((U) a[i] + (U) b[i]);
+    } else if (OP == MPW_PROD) {
+      a[i] = (T) ((U) a[i] * (U) b[i]);
+    } else if (OP == MPW_MIN) {
+      a[i] = b[i] < a[i] ? b[i] : a[i];
+    } else {
+      a[i] = b[i] > a[i] ? b[i] : a[i];
+    }
+  }
+}
+
+template <int OP>
+static inline __attribute__((always_inline)) void combineType(void *acc, const void *in, long long int n, int type)
+{
+  switch (type) {
+    case MPW_INT32:  combine<int, unsigned int, OP>(acc, in, n); break;
+    case MPW_INT64:  combine<long long int, unsigned long long int, OP>(acc, in, n); break;
+    case MPW_FLOAT:  combine<float, float, OP>(acc, in, n); break;
+    case MPW_DOUBLE: combine<double, double, OP>(acc, in, n); break;
+  }
+}
+
+#define MPW_REDUCE_BODY                                              \
+  switch (op) {                                                      \
+    case MPW_SUM:  combineType<MPW_SUM>(acc, in, n, type); break;    \
+    case MPW_MIN:  combineType<MPW_MIN>(acc, in, n, type); break;    \
+    case MPW_MAX:  combineType<MPW_MAX>(acc, in, n, type); break;    \
+    case MPW_PROD: combineType<MPW_PROD>(acc, in, n, type); break;   \
+  }
+
+static void reducePortable(void *acc, const void *in, long long int n, int type, int op)
+{
+  MPW_REDUCE_BODY
+}
+
+#if defined(MPW_REDUCE_AVX2)
+__attribute__((target("avx2")))
+static void reduceAvx2(void *acc, const void *in, long long int n, int type, int op)
+{
+  MPW_REDUCE_BODY
+}
+#endif
+
+typedef void (*reduce_kernel)(void *, const void *, long long int, int, int);
+static reduce_kernel kernel = reducePortable;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void chooseKernel()
+{
+#if defined(MPW_REDUCE_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernel = reduceAvx2;
+  }
+#endif
+}
+
+bool Reduction::valid(int type, int op)
+{
+  return (type == MPW_INT32 || type == MPW_INT64 || type == MPW_FLOAT || type == MPW_DOUBLE) &&
+         op >= MPW_SUM && op <= MPW_PROD;
+}
+
+void Reduction::apply(void *acc, const void *in, long long int count, int type, int op)
+{
+  pthread_once(&kernel_once, chooseKernel);
+  kernel(acc, in, count, type, op);
+}
+
+void Reduction::applyPortable(void *acc, const void *in, long long int count, int type, int op)
+{
+  reducePortable(acc, in, count, type, op);
+}
+
+bool Reduction::accelerated()
+{
+  pthread_once(&kernel_once, chooseKernel);
+  return kernel != reducePortable;
+}
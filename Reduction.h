@@ -0,0 +1,48 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#ifndef MPW_Reduction_class
+#define MPW_Reduction_class
+
+/** Reduction
+ * Combines arrays of the base types element by element (MPW_SUM, MPW_MIN, MPW_MAX,
+ * MPW_PROD on MPW_INT32, MPW_INT64, MPW_FLOAT and MPW_DOUBLE). The loops are compiled
+ * for AVX2 as well as for the baseline instruction set, and the processor picks one at
+ * run time, so that a chunk is combined far faster than it crosses a wide area link.
+ * Integer sums and products wrap around.
+ */
+class Reduction
+{
+ public:
+  // Whether op can be applied to elements of type.
+  static bool valid(int type, int op);
+
+  // acc[i] = acc[i] op in[i] for count elements of type. acc and in may not overlap.
+  static void apply(void *acc, const void *in, long long int count, int type, int op);
+
+  // The baseline version of apply(), whatever the processor has.
+  static void applyPortable(void *acc, const void *in, long long int count, int type, int op);
+
+  // Whether apply() uses AVX2.
+  static bool accelerated();
+};
+
+#endif
@@ -0,0 +1,337 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "Relay.h"
+
+#include <iostream>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#define MPW_RELAY_SPLICE 1
+#endif
+
+#include "mpwide-macros.h"
+
+bool Relay::available()
+{
+#if defined(MPW_RELAY_SPLICE)
+  return true;
+#else
+  return false;
+#endif
+}
+
+#if defined(MPW_RELAY_SPLICE)
+
+/* Maximum number of events handled per epoll_wait. */
+#define MPW_RELAY_MAXEVENTS 64
+
+/* One direction of a pair: from fd[src] through the pipe to fd[1 - src]. */
+struct RelayFlow {
+  int pipe[2];
+  long long int queued;   // bytes in the pipe.
+  long long int capacity;
+  bool full;              // the pipe took no more (the socket may have more).
+  bool eof;               // the sending side has closed...
+  bool done;              // ... and everything has been forwarded.
+};
+
+struct RelayPair;
+
+/* What epoll reports events for: one socket of a pair. */
+struct RelayEnd {
+  RelayPair *pair;
+  int side;
+};
+
+struct RelayPair {
+  int fd[2];
+  RelayEnd end[2];
+  bool readable[2], writable[2];
+  RelayFlow flow[2];      // flow[i] reads fd[i].
+  bool finished;
+};
+
+struct RelayLoop {
+  std::vector<RelayPair*> pairs;
+  pthread_t thread;
+  int result;
+};
+
+static bool openFlow(RelayFlow &f)
+{
+  f.queued = 0;
+  f.full = f.eof = f.done = false;
+  if (pipe2(f.pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+    return false;
+  }
+  // Beyond the system limit the pipe keeps its default size, which is merely slower.
+  fcntl(f.pipe[1], F_SETPIPE_SZ, MPW_RELAY_PIPE);
+  f.capacity = fcntl(f.pipe[1], F_GETPIPE_SZ);
+  if (f.capacity <= 0) {
+    f.capacity = 65536;
+  }
+  return true;
+}
+
+static void closeFlow(RelayFlow &f)
+{
+  close(f.pipe[0]);
+  close(f.pipe[1]);
+}
+
+/* Move what can be moved in both directions of the pair, until the sockets or the pipes
+ * would block. Returns 0, or a negative errno value if the pair failed. */
+static int pump(RelayPair &p)
+{
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (int src = 0; src < 2; src++) {
+      RelayFlow &f = p.flow[src];
+      const int dst = 1 - src;
+      if (f.done) {
+        continue;
+      }
+      if (!f.eof && !f.full && p.readable[src] && f.queued < f.capacity) {
+        const ssize_t n = splice(p.fd[src], NULL, f.pipe[1], NULL, f.capacity - f.queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+          f.queued += n;
+          progress = true;
+        } else if (n == 0) {
+          f.eof = true;
+          progress = true;
+        } else if (errno == EAGAIN && f.queued > 0) {
+          // The socket may be drained, or the pipe may have run out of slots before bytes:
+          // try again once some of the pipe has been forwarded.
+          f.full = true;
+        } else if (errno == EAGAIN) {
+          p.readable[src] = false;
+        } else if (errno != EINTR) {
+          return -errno;
+        }
+      }
+      if (f.queued > 0 && p.writable[dst]) {
+        const ssize_t n = splice(f.pipe[0], NULL, p.fd[dst], NULL, f.queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+          f.queued -= n;
+          f.full = false;
+          progress = true;
+        } else if (n < 0 && errno == EAGAIN) {
+          p.writable[dst] = false;
+        } else if (n < 0 && errno != EINTR) {
+          return -errno;
+        }
+      }
+      if (f.eof && f.queued == 0) {
+        shutdown(p.fd[dst], SHUT_WR);
+        f.done = true;
+      }
+    }
+  }
+  return 0;
+}
+
+static void *relayLoop(void *args)
+{
+  RelayLoop *l = (RelayLoop *) args;
+  l->result = 0;
+
+  // splice() has no MSG_NOSIGNAL: keep SIGPIPE from a closed peer pending, and drop it afterwards.
+  sigset_t pipe_signal, old_mask;
+  sigemptyset(&pipe_signal);
+  sigaddset(&pipe_signal, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_mask);
+
+  const int efd = epoll_create1(EPOLL_CLOEXEC);
+  if (efd < 0) {
+    l->result = -errno;
+    LOG_ERR("Relay: epoll_create1 failed: " << strerror(errno));
+  }
+  int active = 0;
+  for (size_t i = 0; i < l->pairs.size() && efd >= 0; i++) {
+    RelayPair *p = l->pairs[i];
+    int watched = 0;
+    for (; watched < 2; watched++) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.ptr = &p->end[watched];
+      if (epoll_ctl(efd, EPOLL_CTL_ADD, p->fd[watched], &ev) != 0) {
+        l->result = -errno;
+        LOG_ERR("Relay: cannot watch socket " << p->fd[watched] << ": " << strerror(errno));
+        break;
+      }
+    }
+    if (watched < 2) {
+      // Nothing would ever finish this pair (e.g. a socket that is in another pair as well):
+      // give up on it, so that its peers see the relay close.
+      if (watched == 1) {
+        epoll_ctl(efd, EPOLL_CTL_DEL, p->fd[0], NULL);
+      }
+      shutdown(p->fd[0], SHUT_RDWR);
+      shutdown(p->fd[1], SHUT_RDWR);
+      p->finished = true;
+      continue;
+    }
+    active++;
+  }
+
+  struct epoll_event events[MPW_RELAY_MAXEVENTS];
+  while (active > 0 && efd >= 0) {
+    const int n = epoll_wait(efd, events, MPW_RELAY_MAXEVENTS, -1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      l->result = -errno;
+      LOG_ERR("Relay: epoll_wait failed: " << strerror(errno));
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      RelayEnd *end = (RelayEnd *) events[i].data.ptr;
+      RelayPair *p = end->pair;
+      if (p->finished) {
+        continue;
+      }
+      // On errors and hangups the next splice() reports what happened.
+      const unsigned int e = events[i].events;
+      const int s = end->side;
+      p->readable[s] = p->readable[s] || (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR));
+      p->writable[s] = p->writable[s] || (e & (EPOLLOUT | EPOLLHUP | EPOLLERR));
+      const int ret = pump(*p);
+      if (ret < 0) {
+        LOG_WARN("Relay between sockets " << p->fd[0] << " and " << p->fd[1] << " failed: " << strerror(-ret));
+        l->result = ret;
+        shutdown(p->fd[0], SHUT_RDWR);
+        shutdown(p->fd[1], SHUT_RDWR);
+      }
+      if (ret < 0 || (p->flow[0].done && p->flow[1].done)) {
+        p->finished = true;
+        epoll_ctl(efd, EPOLL_CTL_DEL, p->fd[0], NULL);
+        epoll_ctl(efd, EPOLL_CTL_DEL, p->fd[1], NULL);
+        active--;
+      }
+    }
+  }
+  if (efd >= 0) {
+    close(efd);
+  }
+
+  struct timespec none = { 0, 0 };
+  while (sigtimedwait(&pipe_signal, NULL, &none) == SIGPIPE) {
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  return NULL;
+}
+
+int Relay::run(const std::vector<int> &a, const std::vector<int> &b, int loops)
+{
+  const int npairs = min(a.size(), b.size());
+  if (loops <= 0) {
+    loops = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  loops = max(1, min(loops, npairs));
+
+  std::vector<RelayPair*> pairs;
+  int ret = 0;
+  for (int i = 0; i < npairs; i++) {
+    RelayPair *p = new RelayPair();
+    p->fd[0] = a[i];
+    p->fd[1] = b[i];
+    p->finished = false;
+    for (int s = 0; s < 2; s++) {
+      p->end[s].pair = p;
+      p->end[s].side = s;
+      // Try both sockets once; from then on the edges of epoll tell when to try again.
+      p->readable[s] = p->writable[s] = true;
+    }
+    if (!openFlow(p->flow[0])) {
+      ret = -errno;
+      delete p;
+      break;
+    }
+    if (!openFlow(p->flow[1])) {
+      ret = -errno;
+      closeFlow(p->flow[0]);
+      delete p;
+      break;
+    }
+    pairs.push_back(p);
+  }
+  if (ret < 0) {
+    LOG_ERR("Relay: cannot create pipes: " << strerror(-ret));
+    for (size_t i = 0; i < pairs.size(); i++) {
+      closeFlow(pairs[i]->flow[0]);
+      closeFlow(pairs[i]->flow[1]);
+      delete pairs[i];
+    }
+    return ret;
+  }
+
+  std::vector<RelayLoop> loop(loops);
+  for (size_t i = 0; i < pairs.size(); i++) {
+    loop[i % loops].pairs.push_back(pairs[i]);
+  }
+  // The calling thread runs the first loop.
+  int started = 1;
+  for (; started < loops; started++) {
+    if (pthread_create(&loop[started].thread, NULL, relayLoop, &loop[started]) != 0) {
+      LOG_WARN("Could not start relay thread " << started << "; relaying with " << started << " threads.");
+      for (int j = started; j < loops; j++) {
+        loop[0].pairs.insert(loop[0].pairs.end(), loop[j].pairs.begin(), loop[j].pairs.end());
+      }
+      break;
+    }
+  }
+  relayLoop(&loop[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(loop[i].thread, NULL);
+  }
+
+  for (int i = 0; i < started; i++) {
+    if (loop[i].result < 0) {
+      ret = loop[i].result;
+    }
+  }
+  for (size_t i = 0; i < pairs.size(); i++) {
+    closeFlow(pairs[i]->flow[0]);
+    closeFlow(pairs[i]->flow[1]);
+    delete pairs[i];
+  }
+  return ret;
+}
+
+#else
+
+int Relay::run(const std::vector<int> &a, const std::vector<int> &b, int loops)
+{
+  return -ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#ifndef MPW_Relay_class
+#define MPW_Relay_class
+
+#include <vector>
+
+/* Bytes each direction of a relayed pair buffers in its pipe (at most the system's pipe-max-size). */
+#define MPW_RELAY_PIPE (1024*1024)
+
+/** Relay
+ * Forwards the data between pairs of connected sockets, in both directions, until both
+ * sides of every pair have closed. Each direction runs through a pipe with splice(),
+ * so the data never leaves the kernel. The pairs are spread over one event loop per
+ * core, each with its own edge-triggered epoll set. A direction whose pipe is full stops
+ * reading, so that a slow receiver holds the sender back through TCP flow control
+ * instead of keeping the relay busy. When one side closes, the other is shut down for
+ * writing once the data in flight has been forwarded.
+ */
+class Relay
+{
+ public:
+  // Whether this platform can relay with splice() (Linux).
+  static bool available();
+
+  // Forward between the socket descriptors a[i] and b[i], with at most loops event loops
+  // (<= 0: one per core). Returns 0, or the last error (a negative errno value).
+  static int run(const std::vector<int> &a, const std::vector<int> &b, int loops);
+};
+
+#endif
@@ -0,0 +1,254 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include "Resolver.h"
+#include "ProgressEngine.h"
+
+#include <map>
+#include <vector>
+#include <iostream>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "mpwide-macros.h"
+
+/* Names that do not resolve at once are tried this many times (as gethostbyname was). */
+#define MPW_RESOLVE_ATTEMPTS 4
+/* Most lookups resolveAll runs at the same time. */
+#define MPW_RESOLVE_THREADS 32
+
+struct CachedHost {
+  std::string addr;
+  long long int expires; // CLOCK_MONOTONIC ns.
+  bool busy;             // a thread is looking the name up.
+};
+
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_cond = PTHREAD_COND_INITIALIZER;
+static std::map<std::string, CachedHost> *resolver_cache = NULL;
+static double resolver_ttl = 300.0;
+
+/* Look up the address in the cache. Called with resolver_lock held. */
+static bool cached(const std::string &host, std::string &addr, long long int now)
+{
+  if (!resolver_cache) {
+    return false;
+  }
+  std::map<std::string, CachedHost>::iterator it = resolver_cache->find(host);
+  if (it == resolver_cache->end() || it->second.busy || it->second.expires <= now) {
+    return false;
+  }
+  addr = it->second.addr;
+  return true;
+}
+
+static bool numeric(const std::string &host)
+{
+  struct in_addr a;
+  return inet_pton(AF_INET, host.c_str(), &a) == 1;
+}
+
+int Resolver::lookup(const std::string &host, std::string &addr)
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *res = NULL;
+  int ret = EAI_AGAIN;
+  for (int i = 0; i < MPW_RESOLVE_ATTEMPTS && ret == EAI_AGAIN; i++) {
+    ret = getaddrinfo(host.c_str(), NULL, &hints, &res);
+  }
+  if (ret != 0) {
+    LOG_ERR("Error: Unable to resolve host name " << host << ": " << gai_strerror(ret));
+    switch (ret) {
+      case EAI_SYSTEM: return errno ? -errno : -EIO;
+      case EAI_MEMORY: return -ENOMEM;
+      case EAI_AGAIN:  return -EAGAIN;
+      default:         return -EHOSTUNREACH;
+    }
+  }
+
+  char buf[INET_ADDRSTRLEN];
+  const struct sockaddr_in *sin = (const struct sockaddr_in *) res->ai_addr;
+  inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf));
+  freeaddrinfo(res);
+  addr = buf;
+  LOG_DEBUG(" address found: " << addr);
+  return 0;
+}
+
+int Resolver::resolve(const std::string &host, std::string &addr)
+{
+  if (numeric(host)) {
+    addr = host;
+    return 0;
+  }
+
+  pthread_mutex_lock(&resolver_lock);
+  if (!resolver_cache) {
+    resolver_cache = new std::map<std::string, CachedHost>();
+  }
+  for (;;) {
+    if (cached(host, addr, TokenBucket::now())) {
+      pthread_mutex_unlock(&resolver_lock);
+      return 0;
+    }
+    std::map<std::string, CachedHost>::iterator it = resolver_cache->find(host);
+    if (it == resolver_cache->end() || !it->second.busy) {
+      break;
+    }
+    pthread_cond_wait(&resolver_cond, &resolver_lock);
+  }
+  CachedHost &e = (*resolver_cache)[host];
+  e.busy = true;
+  pthread_mutex_unlock(&resolver_lock);
+
+  const int ret = lookup(host, addr);
+
+  pthread_mutex_lock(&resolver_lock);
+  /* flush() leaves busy entries alone, so e is still there. */
+  if (ret < 0 || resolver_ttl <= 0) {
+    resolver_cache->erase(host);
+  } else {
+    e.addr = addr;
+    e.expires = TokenBucket::now() + (long long int) (resolver_ttl * 1e9);
+    e.busy = false;
+  }
+  pthread_cond_broadcast(&resolver_cond);
+  pthread_mutex_unlock(&resolver_lock);
+
+  if (ret < 0) {
+    addr.clear();
+  }
+  return ret;
+}
+
+struct ResolveJob {
+  const std::string *host;
+  std::string addr;
+  int error;
+  pthread_t thread;
+};
+
+void *Resolver::lookupThread(void *args)
+{
+  ResolveJob *job = (ResolveJob *) args;
+  job->error = resolve(*job->host, job->addr);
+  return NULL;
+}
+
+int Resolver::resolveAll(const std::string *hosts, std::string *addrs, int n)
+{
+  /* Each distinct name is looked up once; cached and numeric ones need no thread. */
+  std::map<std::string, int> index;
+  std::vector<ResolveJob> jobs;
+  std::vector<int> job_of(n, -1);
+
+  pthread_mutex_lock(&resolver_lock);
+  const long long int now = TokenBucket::now();
+  for (int i = 0; i < n; i++) {
+    if (numeric(hosts[i])) {
+      addrs[i] = hosts[i];
+      continue;
+    }
+    if (cached(hosts[i], addrs[i], now)) {
+      continue;
+    }
+    std::map<std::string, int>::iterator it = index.find(hosts[i]);
+    if (it != index.end()) {
+      job_of[i] = it->second;
+      continue;
+    }
+    ResolveJob job;
+    job.host = &hosts[i];
+    job.error = 0;
+    index[hosts[i]] = jobs.size();
+    job_of[i] = jobs.size();
+    jobs.push_back(job);
+  }
+  pthread_mutex_unlock(&resolver_lock);
+
+  if (jobs.size() == 1) {
+    jobs[0].error = resolve(*jobs[0].host, jobs[0].addr);
+  } else {
+    for (size_t first = 0; first < jobs.size(); first += MPW_RESOLVE_THREADS) {
+      const size_t last = min(jobs.size(), first + MPW_RESOLVE_THREADS);
+      std::vector<bool> started(last - first, false);
+      for (size_t j = first; j < last; j++) {
+        started[j - first] = pthread_create(&jobs[j].thread, NULL, lookupThread, &jobs[j]) == 0;
+        if (!started[j - first]) {
+          lookupThread(&jobs[j]);
+        }
+      }
+      for (size_t j = first; j < last; j++) {
+        if (started[j - first]) {
+          pthread_join(jobs[j].thread, NULL);
+        }
+      }
+    }
+  }
+
+  int ret = 0;
+  for (int i = 0; i < n; i++) {
+    if (job_of[i] >= 0) {
+      addrs[i] = jobs[job_of[i]].addr;
+      if (jobs[job_of[i]].error < 0) {
+        ret = jobs[job_of[i]].error;
+      }
+    }
+  }
+  return ret;
+}
+
+void Resolver::setTTL(double seconds)
+{
+  pthread_mutex_lock(&resolver_lock);
+  resolver_ttl = seconds;
+  pthread_mutex_unlock(&resolver_lock);
+  flush();
+}
+
+double Resolver::getTTL()
+{
+  return resolver_ttl;
+}
+
+void Resolver::flush()
+{
+  pthread_mutex_lock(&resolver_lock);
+  if (resolver_cache) {
+    std::map<std::string, CachedHost>::iterator it = resolver_cache->begin();
+    while (it != resolver_cache->end()) {
+      if (it->second.busy) {
+        ++it;
+      } else {
+        resolver_cache->erase(it++);
+      }
+    }
+  }
+  pthread_mutex_unlock(&resolver_lock);
+}
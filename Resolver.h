@@ -0,0 +1,57 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to:
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+
+#ifndef MPW_Resolver_class
+#define MPW_Resolver_class
+
+#include <string>
+
+/** Resolver
+ * Turns host names into IPv4 addresses with getaddrinfo. Results are cached
+ * for ttl seconds, so the streams of a path, and paths to the same host, cost a
+ * single lookup. Threads asking for a name that is being looked up already wait
+ * for that lookup instead of starting their own. Thread-safe.
+ */
+class Resolver
+{
+ public:
+  // Store the address of host in addr ("a.b.c.d"). Numeric addresses are returned as they are.
+  // Returns 0, or a negative errno value (-EHOSTUNREACH if the name does not resolve).
+  static int resolve(const std::string &host, std::string &addr);
+
+  // Resolve n hosts, looking up the distinct uncached names in parallel. Returns 0
+  // if all of them resolved, or the error of the last one that did not (its addr is empty).
+  static int resolveAll(const std::string *hosts, std::string *addrs, int n);
+
+  // Seconds a result is kept (default 300; <= 0 disables the cache). Also drops the cache.
+  static void setTTL(double seconds);
+  static double getTTL();
+
+  // Forget all cached results.
+  static void flush();
+
+ private:
+  static void *lookupThread(void *args);
+  static int lookup(const std::string &host, std::string &addr);
+};
+
+#endif
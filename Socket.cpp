@@ -27,13 +27,20 @@
 #include <cstdlib>
 #include <stdio.h>
 #include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#endif
 
 #include "mpwide-macros.h"
 
 using namespace std;
 
 Socket::Socket() :
-  m_sock ( -1 )
+  m_sock ( -1 ), zc_threshold ( 0 ), zc_issued ( 0 ), zc_completed ( 0 ), zc_copied ( 0 ), copy_sends ( 0 ),
+  snd_chunk ( 0 ), rcv_chunk ( 0 ), snd_eagain ( 0 ), rcv_eagain ( 0 ),
+  snd_bytes ( 0 ), rcv_bytes ( 0 ), crc_errors ( 0 ), crc_error_offset ( -1 ), snd_probe ( 0 )
 {
   memset(&m_addr, 0, sizeof( m_addr ));
   set_non_blocking(false);
@@ -63,6 +70,8 @@ bool Socket::create()
     return false;
   }
 
+  // The constructor runs before the socket exists, so apply this here (accepted sockets inherit it).
+  set_no_delay(true);
   setWin(WINSIZE);
   
   return true;
@@ -107,13 +116,18 @@ bool Socket::bind ( const int port )
 
 
 bool Socket::listen() const
+{
+  return listen(MAXCONNECTIONS);
+}
+
+bool Socket::listen(int backlog) const
 {
   if ( ! is_valid() )
     {
       LOG_ERR("listen: Invalid socket.");
       return false;
     }
-  int listen_return = ::listen ( m_sock, MAXCONNECTIONS );
+  int listen_return = ::listen ( m_sock, backlog );
   if ( listen_return == -1 )
   {
     LOG_ERR("listen failed: " << string(strerror(errno)) << "/" << errno);
@@ -244,11 +258,17 @@ int Socket::recv ( char* s, long long int size ) const
   return size;
 }
 
+/* Nothing to read/write on a non-blocking socket is not an error. */
+static inline bool wouldBlock()
+{
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
 int Socket::irecv ( char* s, long long int size ) const
 {
   int status = ::recv ( m_sock, s, size, 0 );
   #if LOG_LVL >= LVL_ERR || EXIT_ON_SENDRECV_ERROR == 1
-    if ( status <= 0 ) {
+    if ( status == 0 || ( status < 0 && !wouldBlock() ) ) {
       #if LOG_LVL >= LVL_ERR
         if (status == 0) {
           cout << "irecv: connection reset by peer.status = " << status << " errno = " << errno << "/" << strerror(errno) << endl;
@@ -267,8 +287,58 @@ int Socket::irecv ( char* s, long long int size ) const
 int Socket::isend ( const char* s, long long int size ) const
 {
   int status = ::send ( m_sock, s, size, tcp_send_flag );
+  if ( status > 0 ) {
+    copy_sends++;
+  }
+  #if LOG_LVL >= LVL_ERR || EXIT_ON_SENDRECV_ERROR == 1
+    if ( status < 0 && !wouldBlock() ) {
+      LOG_ERR("isend: status = " << status << " errno = " << errno << "/"<< strerror(errno));
+      #if EXIT_ON_SENDRECV_ERROR == 1
+        exit(1);
+      #endif
+    }
+  #endif
+  return status;
+}
+
+long long int Socket::irecv ( struct iovec* iov, int iovcnt ) const
+{
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  long long int status = ::recvmsg ( m_sock, &msg, 0 );
+  #if LOG_LVL >= LVL_ERR || EXIT_ON_SENDRECV_ERROR == 1
+    if ( status == 0 || ( status < 0 && !wouldBlock() ) ) {
+      #if LOG_LVL >= LVL_ERR
+        if (status == 0) {
+          cout << "irecv: connection reset by peer.status = " << status << " errno = " << errno << "/" << strerror(errno) << endl;
+        } else {
+          cout << "irecv: status = " << status << " errno = " << errno << "/" << strerror(errno) << endl;
+        }
+      #endif
+      #if EXIT_ON_SENDRECV_ERROR == 1
+        exit(1);
+      #endif
+    }
+  #endif
+  return status;
+}
+
+long long int Socket::isend ( const struct iovec* iov, int iovcnt ) const
+{
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec *) iov;
+  msg.msg_iovlen = iovcnt;
+
+  long long int status = ::sendmsg ( m_sock, &msg, tcp_send_flag );
+  if ( status > 0 ) {
+    copy_sends++;
+  }
   #if LOG_LVL >= LVL_ERR || EXIT_ON_SENDRECV_ERROR == 1
-    if ( status < 0 ) {
+    if ( status < 0 && !wouldBlock() ) {
       LOG_ERR("isend: status = " << status << " errno = " << errno << "/"<< strerror(errno));
       #if EXIT_ON_SENDRECV_ERROR == 1
         exit(1);
@@ -278,6 +348,88 @@ int Socket::isend ( const char* s, long long int size ) const
   return status;
 }
 
+/* Enable zero-copy sends of at least threshold bytes. Returns false if the kernel does not support it. */
+bool Socket::setZeroCopy ( long long int threshold )
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  int on = threshold > 0 ? 1 : 0;
+  if ( on && setsockopt ( m_sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on) ) == -1 ) {
+    LOG_WARN("SO_ZEROCOPY is not available: " << strerror(errno) << ". Falling back to copying sends.");
+    zc_threshold = 0;
+    return false;
+  }
+  // SO_ZEROCOPY cannot be switched off again; we simply stop passing MSG_ZEROCOPY.
+  zc_threshold = threshold > 0 ? threshold : 0;
+  return true;
+#else
+  zc_threshold = 0;
+  return threshold <= 0;
+#endif
+}
+
+/* Send with MSG_ZEROCOPY. The pages of iov must stay untouched until
+ * zeroCopyCompleted() has caught up with zeroCopyIssued(). */
+long long int Socket::isendZeroCopy ( const struct iovec* iov, int iovcnt )
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec *) iov;
+  msg.msg_iovlen = iovcnt;
+
+  long long int status = ::sendmsg ( m_sock, &msg, tcp_send_flag | MSG_ZEROCOPY );
+  if ( status > 0 ) {
+    // Every zero-copy send that transmits data is completed by one notification.
+    zc_issued++;
+    return status;
+  }
+  if ( status < 0 && errno == ENOBUFS ) {
+    // Out of option memory for pinning pages: copy this one instead.
+    return isend(iov, iovcnt);
+  }
+  return status;
+#else
+  return isend(iov, iovcnt);
+#endif
+}
+
+int Socket::reapZeroCopy()
+{
+  int reaped = 0;
+#if defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+  char control[256];
+  while ( true ) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if ( ::recvmsg ( m_sock, &msg, MSG_ERRQUEUE ) < 0 ) {
+      break; // queue is empty.
+    }
+    for ( struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm) ) {
+      if ( !(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+           !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR) ) {
+        continue;
+      }
+      const struct sock_extended_err *serr = (const struct sock_extended_err *) CMSG_DATA(cm);
+      if ( serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ) {
+        LOG_WARN("Unexpected error queue message: " << strerror(serr->ee_errno));
+        continue;
+      }
+      // Notifications carry an inclusive range of send ids [ee_info, ee_data].
+      const long long int n = (unsigned int)(serr->ee_data - serr->ee_info) + 1;
+      zc_completed += n;
+      reaped++;
+      if ( serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED ) {
+        zc_copied += n;
+      }
+    }
+  }
+#endif
+  return reaped;
+}
+
 /*
  Returns:
  -1 on error
@@ -353,12 +505,334 @@ bool Socket::connect ( const string host, const int port )
   }
 }
 
+int Socket::startConnect ( const string host, const int port )
+{
+  if ( ! is_valid() ) return -EBADF;
+
+  m_addr.sin_family = AF_INET;
+  m_addr.sin_port = htons ( port );
+  if ( inet_pton ( AF_INET, host.c_str(), &m_addr.sin_addr ) < 1 ) {
+    LOG_ERR("Could not convert address '" << host << "'.");
+    return -EINVAL;
+  }
+
+  set_non_blocking(true);
+  if(::connect(m_sock, (struct sockaddr *) &m_addr, sizeof(m_addr)) == 0) {
+    return 0;
+  }
+  return errno == EINPROGRESS || errno == EINTR ? -EINPROGRESS : -errno;
+}
+
+int Socket::finishConnect()
+{
+  int error_buf = 0;
+  socklen_t err_len = sizeof(error_buf);
+  if(getsockopt(m_sock, SOL_SOCKET, SO_ERROR, (char*) &error_buf, &err_len) < 0) {
+    return -errno;
+  }
+  return -error_buf;
+}
+
+int Socket::acceptConnection()
+{
+  sockaddr_in addr;
+  socklen_t addr_length = (socklen_t) sizeof ( addr );
+  int new_m_sock = ::accept ( m_sock, ( sockaddr * ) &addr, &addr_length );
+  if ( new_m_sock < 0 ) {
+    // Connections that were reset before we got to them are not an error of the listener.
+    if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED ) {
+      return -EAGAIN;
+    }
+    LOG_ERR("accept failed: " << string(strerror(errno)) << "/" << errno);
+    return -errno;
+  }
+  return new_m_sock;
+}
+
+int Socket::tryAccept()
+{
+  const int new_m_sock = acceptConnection();
+  if ( new_m_sock < 0 ) {
+    return new_m_sock;
+  }
+  attach(new_m_sock);
+  return 0;
+}
+
+void Socket::attach(int fd)
+{
+  close();
+  m_sock = fd;
+  socklen_t addr_length = (socklen_t) sizeof ( m_addr );
+  getpeername(m_sock, ( sockaddr * ) &m_addr, &addr_length);
+  set_non_blocking(true);
+}
+
+int Socket::detach()
+{
+  const int fd = m_sock;
+  m_sock = -1;
+  return fd;
+}
+
+bool Socket::isIdle(bool allow_data) const
+{
+  if ( ! is_valid() ) {
+    return false;
+  }
+  int error_buf = 0;
+  socklen_t err_len = sizeof(error_buf);
+  if ( getsockopt(m_sock, SOL_SOCKET, SO_ERROR, (char*) &error_buf, &err_len) < 0 || error_buf != 0 ) {
+    return false;
+  }
+  char c;
+  const int status = ::recv(m_sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if ( status < 0 ) {
+    return wouldBlock();
+  }
+  // 0 means the peer has closed the connection.
+  return status > 0 && allow_data;
+}
+
+bool Socket::setReusePort()
+{
+#ifdef SO_REUSEPORT
+  int on = 1;
+  if ( setsockopt ( m_sock, SOL_SOCKET, SO_REUSEPORT, ( const char* ) &on, sizeof ( on ) ) == 0 ) {
+    return true;
+  }
+  LOG_DEBUG("SO_REUSEPORT not available: " << strerror(errno));
+#endif
+  return false;
+}
+
+void Socket::setFastOpenConnect()
+{
+#ifdef TCP_FASTOPEN_CONNECT
+  int on = 1;
+  setsockopt(m_sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+#endif
+}
+
+int Socket::setupSend ( const char* s, int size ) const
+{
+  const int status = ::send ( m_sock, s, size, tcp_send_flag );
+  if ( status < 0 ) {
+    return wouldBlock() || errno == EINPROGRESS ? -EAGAIN : -errno;
+  }
+  return status;
+}
+
+int Socket::setupRecv ( char* s, int size ) const
+{
+  const int status = ::recv ( m_sock, s, size, 0 );
+  if ( status < 0 ) {
+    return wouldBlock() ? -EAGAIN : -errno;
+  }
+  return status == 0 ? -ECONNRESET : status;
+}
+
+void Socket::setFastOpen(int qlen)
+{
+#ifdef TCP_FASTOPEN
+  if(setsockopt(m_sock, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0) {
+    LOG_DEBUG("TCP_FASTOPEN not available: " << strerror(errno));
+  }
+#endif
+}
+
 void Socket::set_no_delay(const bool no_delay)
 {
     int state = no_delay ? 1 : 0;
     setsockopt(m_sock, IPPROTO_TCP, TCP_NODELAY, &state, sizeof(state));
 }
 
+/* Number of sends after which the free space in the send buffer is measured again. */
+static const int chunk_probe_interval = 64;
+
+long long int Socket::sendSpace() const
+{
+#ifdef SIOCOUTQ
+  int sndbuf = 0, queued = 0;
+  socklen_t len = sizeof(sndbuf);
+  if ( getsockopt(m_sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == -1 ||
+       ioctl(m_sock, SIOCOUTQ, &queued) == -1 ) {
+    return -1;
+  }
+  // Linux reports twice the requested SO_SNDBUF, half of which is bookkeeping overhead.
+  return max(0, sndbuf / 2 - queued);
+#else
+  return -1;
+#endif
+}
+
+long long int Socket::sendQueued() const
+{
+#ifdef SIOCOUTQ
+  int queued = 0;
+  if ( ioctl(m_sock, SIOCOUTQ, &queued) == -1 ) {
+    return -1;
+  }
+  return queued;
+#else
+  return -1;
+#endif
+}
+
+long long int Socket::recvQueued() const
+{
+  int queued = 0;
+  if ( ioctl(m_sock, FIONREAD, &queued) == -1 ) {
+    return -1;
+  }
+  return queued;
+}
+
+long long int Socket::sendChunk(long long int lo, long long int hi)
+{
+  if ( snd_chunk == 0 || snd_probe <= 0 ) {
+    const long long int space = sendSpace();
+    snd_chunk = space > 0 ? space : lo;
+    snd_probe = chunk_probe_interval;
+  }
+  snd_chunk = min(max(snd_chunk, lo), hi);
+  return snd_chunk;
+}
+
+void Socket::sendResult(long long int requested, long long int n)
+{
+  snd_probe--;
+  if ( n < 0 ) {
+    // The buffer was full: measure what is free once it drains.
+    snd_eagain++;
+    snd_probe = 0;
+    return;
+  }
+  __sync_fetch_and_add(&snd_bytes, n);
+  if ( n < requested ) {
+    snd_chunk = n; // no more than this fitted.
+  } else {
+    snd_chunk = max(snd_chunk, requested * 2);
+  }
+}
+
+long long int Socket::recvChunk(long long int lo, long long int hi)
+{
+  rcv_chunk = min(max(rcv_chunk, lo), hi);
+  return rcv_chunk;
+}
+
+void Socket::recvResult(long long int requested, long long int n)
+{
+  if ( n < 0 ) {
+    rcv_eagain++;
+    return;
+  }
+  __sync_fetch_and_add(&rcv_bytes, n);
+  if ( n == requested ) {
+    // The chunk was filled: take whatever else is waiting in one go next time.
+    const long long int queued = recvQueued();
+    rcv_chunk = max(rcv_chunk, queued > 0 ? requested + queued : requested * 2);
+  }
+}
+
+#ifdef TCP_INFO
+/* struct tcp_info of glibc stops at tcpi_total_retrans; newer kernels append these. */
+struct tcp_info_ext {
+  struct tcp_info base;
+  uint64_t tcpi_pacing_rate;
+  uint64_t tcpi_max_pacing_rate;
+  uint64_t tcpi_bytes_acked;
+  uint64_t tcpi_bytes_received;
+  uint32_t tcpi_segs_out;
+  uint32_t tcpi_segs_in;
+  uint32_t tcpi_notsent_bytes;
+  uint32_t tcpi_min_rtt;
+  uint32_t tcpi_data_segs_in;
+  uint32_t tcpi_data_segs_out;
+  uint64_t tcpi_delivery_rate;
+};
+#endif
+
+int Socket::tcpStats(TcpStats &stats) const
+{
+  memset(&stats, 0, sizeof(stats));
+#ifdef TCP_INFO
+  struct tcp_info_ext info;
+  memset(&info, 0, sizeof(info));
+  socklen_t len = sizeof(info);
+  if ( getsockopt(m_sock, IPPROTO_TCP, TCP_INFO, &info, &len) == -1 ) {
+    return -errno;
+  }
+  stats.rtt_us      = info.base.tcpi_rtt;
+  stats.rttvar_us   = info.base.tcpi_rttvar;
+  stats.cwnd        = info.base.tcpi_snd_cwnd;
+  stats.ssthresh    = info.base.tcpi_snd_ssthresh;
+  stats.mss         = info.base.tcpi_snd_mss;
+  stats.retransmits = info.base.tcpi_total_retrans;
+  stats.lost        = info.base.tcpi_lost;
+  // Fields the kernel did not fill in (older kernels) stay 0.
+  stats.min_rtt_us     = info.tcpi_min_rtt;
+  stats.notsent_bytes  = info.tcpi_notsent_bytes;
+  stats.delivery_rate  = info.tcpi_delivery_rate;
+  stats.pacing_rate    = info.tcpi_pacing_rate == ~0ULL ? 0 : info.tcpi_pacing_rate;
+  stats.bytes_acked    = info.tcpi_bytes_acked;
+  stats.bytes_received = info.tcpi_bytes_received;
+
+  // SIOCOUTQ counts the unsent bytes too.
+  const long long int queued = sendQueued();
+  stats.unacked_bytes = queued >= 0 ? max(queued - stats.notsent_bytes, 0LL)
+                                    : (long long int) info.base.tcpi_unacked * stats.mss;
+  return 0;
+#else
+  return -ENOSYS;
+#endif
+}
+
+int Socket::setCongestionControl(const string &name)
+{
+#ifdef TCP_CONGESTION
+  if ( setsockopt(m_sock, IPPROTO_TCP, TCP_CONGESTION, name.c_str(), name.length()) == -1 ) {
+    return -errno;
+  }
+  return 0;
+#else
+  return -ENOSYS;
+#endif
+}
+
+string Socket::congestionControl() const
+{
+#ifdef TCP_CONGESTION
+  char name[32];
+  memset(name, 0, sizeof(name));
+  socklen_t len = sizeof(name) - 1;
+  if ( getsockopt(m_sock, IPPROTO_TCP, TCP_CONGESTION, name, &len) == -1 ) {
+    return "";
+  }
+  return name;
+#else
+  return "";
+#endif
+}
+
+/* Let the kernel pace this socket at rate bytes/s (<= 0: unlimited). Works best
+ * with the fq qdisc; otherwise TCP falls back to its internal pacing. */
+bool Socket::setMaxPacingRate(double rate)
+{
+#ifdef SO_MAX_PACING_RATE
+  // The option is an unsigned long since Linux 4.20; older kernels read the low 32 bits.
+  unsigned long val = rate > 0 ? (unsigned long) rate : ~0UL;
+  if ( setsockopt(m_sock, SOL_SOCKET, SO_MAX_PACING_RATE, &val, sizeof(val)) == -1 ) {
+    LOG_WARN("SO_MAX_PACING_RATE is not available: " << strerror(errno));
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
 void Socket::set_non_blocking ( const bool b )
 {
   int opts;
@@ -24,6 +24,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -36,6 +37,18 @@ const int WINSIZE = 1*1024*1024;
 
 #define MPWIDE_SOCKET_RDMASK 1
 #define MPWIDE_SOCKET_WRMASK 2
+#define MPWIDE_SOCKET_ERRMASK 4
+
+/* Congestion state of a TCP connection (TCP_INFO). Fields the kernel does not report are 0. */
+struct TcpStats {
+  long long int rtt_us, rttvar_us, min_rtt_us;
+  long long int cwnd, ssthresh, mss;     // cwnd and ssthresh in segments.
+  long long int retransmits, lost;       // total retransmitted / currently lost segments.
+  long long int unacked_bytes;           // sent but not yet acknowledged.
+  long long int notsent_bytes;           // queued but not yet sent.
+  long long int delivery_rate, pacing_rate; // bytes/s.
+  long long int bytes_acked, bytes_received;
+};
 
 class Socket
 {
@@ -47,10 +60,36 @@ class Socket
   bool create();
   bool bind ( const int port );
   bool listen() const;
+  bool listen(int backlog) const;
   bool accept();
+  // Accept a pending connection on a non-blocking listening socket. Returns 0 once
+  // accepted, -EAGAIN if there was none yet, or another negative errno value.
+  int tryAccept();
+  // Same, but return the new connection's descriptor (or a negative errno value) and keep listening.
+  int acceptConnection();
+  // Let a listening socket accept TCP Fast Open connections (no-op where unsupported).
+  void setFastOpen(int qlen);
+  // Share the port with other listening sockets; the kernel spreads connections over them.
+  bool setReusePort();
+  // Take over an already connected descriptor, or give it up without closing it.
+  void attach(int fd);
+  int detach();
+  // True if the connection is up and has nothing to read (unless allow_data).
+  bool isIdle(bool allow_data) const;
 
   // Client initialization
   bool connect ( const std::string host, const int port );
+  // Non-blocking connect. Returns 0 if connected, -EINPROGRESS while the handshake is
+  // under way (wait until writable, then call finishConnect), or a negative errno value.
+  int startConnect ( const std::string host, const int port );
+  int finishConnect();
+  // Send the first data of the next connect along with the SYN (TCP_FASTOPEN_CONNECT), if supported.
+  void setFastOpenConnect();
+
+  // Connection setup messages. Unlike isend/irecv, failures are not fatal: they return a
+  // negative errno value (-EAGAIN if the call would block, -ECONNRESET at end of stream).
+  int setupSend (const char* s, int size ) const;
+  int setupRecv (char* s, int size ) const;
 
   // Data Transimission
   bool send (const char* s, long long int size ) const;
@@ -60,6 +99,60 @@ class Socket
   int isend (const char* s, long long int size ) const;
   int irecv (char* s, long long int size ) const;
 
+  // Light-weight, non-blocking scatter/gather versions (sendmsg/recvmsg).
+  long long int isend (const struct iovec* iov, int iovcnt ) const;
+  long long int irecv (struct iovec* iov, int iovcnt ) const;
+
+  // Zero-copy transmission (MSG_ZEROCOPY). Sends of at least threshold bytes are
+  // transmitted from user memory; a threshold of 0 disables zero-copy.
+  bool setZeroCopy(long long int threshold);
+  long long int zeroCopyThreshold() const { return zc_threshold; }
+  long long int isendZeroCopy (const struct iovec* iov, int iovcnt );
+  // Consume completion notifications from the error queue. Returns the number consumed.
+  int reapZeroCopy();
+  // Number of zero-copy sends issued / released by the kernel so far.
+  long long int zeroCopyIssued() const { return zc_issued; }
+  long long int zeroCopyCompleted() const { return zc_completed; }
+  // Number of zero-copy sends for which the kernel fell back to copying.
+  long long int zeroCopyCopied() const { return zc_copied; }
+  // Number of regular (copying) sends.
+  long long int copySends() const { return copy_sends; }
+  // Account for sends performed on this socket by someone else (e.g. io_uring).
+  void noteCopySend() const { copy_sends++; }
+  void noteZeroCopy(long long int issued, long long int completed, long long int copied) {
+    zc_issued += issued; zc_completed += completed; zc_copied += copied;
+  }
+
+  // Adaptive chunk sizes: how much to hand to the next send / recv call, within [lo, hi].
+  // They follow the free space in the send buffer (SIOCOUTQ vs. SO_SNDBUF), the bytes
+  // waiting to be read (FIONREAD) and how often calls would have blocked.
+  long long int sendChunk(long long int lo, long long int hi);
+  long long int recvChunk(long long int lo, long long int hi);
+  // Report the outcome of a send / recv of requested bytes (n < 0: it would have blocked).
+  void sendResult(long long int requested, long long int n);
+  void recvResult(long long int requested, long long int n);
+  long long int lastSendChunk() const { return snd_chunk; }
+  long long int lastRecvChunk() const { return rcv_chunk; }
+  long long int blockedSends() const { return snd_eagain; }
+  long long int blockedRecvs() const { return rcv_eagain; }
+  // Bytes moved by the sends / recvs reported above. Safe to read from any thread.
+  long long int bytesSent() const { return __sync_add_and_fetch(&snd_bytes, 0); }
+  long long int bytesReceived() const { return __sync_add_and_fetch(&rcv_bytes, 0); }
+
+  // Chunks that arrived with a wrong checksum, and the offset reported for the last one (-1: none).
+  void noteChecksumError(long long int offset) { __sync_fetch_and_add(&crc_errors, 1); crc_error_offset = offset; }
+  long long int checksumErrors() const { return __sync_add_and_fetch(&crc_errors, 0); }
+  long long int checksumErrorOffset() const { return crc_error_offset; }
+
+  // Sample the congestion state of the connection. Returns 0, or a negative errno value.
+  int tcpStats(TcpStats &stats) const;
+
+  // Free space in the send buffer, bytes not yet acknowledged by the peer, and bytes
+  // waiting in the receive buffer (-1 if unknown).
+  long long int sendSpace() const;
+  long long int sendQueued() const;
+  long long int recvQueued() const;
+
   // Check if the socket is readable / writable. Timeout is 2 minutes.
   int select_me (int mask) const;
   int select_me (int mask, int timeout_val) const;
@@ -68,6 +161,12 @@ class Socket
   void set_non_blocking(bool);
   void set_no_delay(bool);
   void setWin(int size);
+  bool setMaxPacingRate(double rate);
+  // Select the TCP congestion control algorithm ("cubic", "bbr", ...). Returns 0, or a
+  // negative errno value (-ENOENT if the kernel does not offer it).
+  int setCongestionControl(const std::string &name);
+  // The algorithm in effect ("" if unknown).
+  std::string congestionControl() const;
 
   bool is_valid() const { return m_sock != -1; }
 
@@ -78,6 +177,17 @@ class Socket
  private:
   int m_sock;
   sockaddr_in m_addr;
+
+  long long int zc_threshold;
+  long long int zc_issued, zc_completed, zc_copied;
+  mutable long long int copy_sends;
+
+  long long int snd_chunk, rcv_chunk;
+  long long int snd_eagain, rcv_eagain;
+  mutable long long int snd_bytes, rcv_bytes;
+  mutable long long int crc_errors;
+  long long int crc_error_offset;
+  int snd_probe; // sends left before the send buffer is measured again.
   #ifdef MSG_NOSIGNAL
     static const int tcp_send_flag = MSG_NOSIGNAL;
   #else //OSX Case
@@ -103,7 +103,7 @@ void MPW_setChunkSize(int sending, int receiving);
 /* Non-blocking functionalities. */
 int MPW_ISendRecv( char* sendbuf, long long int sendsize, char* recvbuf, long long int recvsize, int path);
 bool MPW_Has_NBE_Finished(int NBE_id);
-void MPW_Wait(int NBE_id);
+int MPW_Wait(int NBE_id);
 
 
 #if PacingMode == 1
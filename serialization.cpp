@@ -0,0 +1,124 @@
+//
+//  serialization.cpp
+//  MPWide
+//
+//  Byte order conversion of whole arrays, for exchanges between hosts of different
+//  endianness. The shuffles reverse 16 or 32 bytes worth of elements at a time.
+//
+
+#include "serialization.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MPW_SWAP_X86 1
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MPW_SWAP_NEON 1
+#endif
+
+template <class T> static inline T swap_one(T v);
+template <> inline unsigned short swap_one(unsigned short v) { return __builtin_bswap16(v); }
+template <> inline unsigned int swap_one(unsigned int v) { return __builtin_bswap32(v); }
+template <> inline unsigned long long swap_one(unsigned long long v) { return __builtin_bswap64(v); }
+
+template <class T>
+static void swap_scalar(unsigned char *p, size_t count)
+{
+    for (size_t i = 0; i < count; i++, p += sizeof(T))
+    {
+        T v;
+        memcpy(&v, p, sizeof(T));
+        v = swap_one(v);
+        memcpy(p, &v, sizeof(T));
+    }
+}
+
+static void swap_portable(unsigned char *p, size_t count, size_t size)
+{
+    if (size == 2)
+        swap_scalar<unsigned short>(p, count);
+    else if (size == 4)
+        swap_scalar<unsigned int>(p, count);
+    else
+        swap_scalar<unsigned long long>(p, count);
+}
+
+#if defined(MPW_SWAP_X86)
+/* pshufb masks that reverse each element of 2, 4 and 8 bytes within 16 bytes. */
+static const unsigned char swap_mask[3][16] = {
+    { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+    { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+    { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 }
+};
+
+static inline int mask_index(size_t size)
+{
+    return size == 2 ? 0 : size == 4 ? 1 : 2;
+}
+
+__attribute__((target("ssse3")))
+static void swap_ssse3(unsigned char *p, size_t count, size_t size)
+{
+    const __m128i mask = _mm_loadu_si128((const __m128i *) swap_mask[mask_index(size)]);
+    size_t bytes = count * size;
+    for (; bytes >= 16; bytes -= 16, p += 16)
+        _mm_storeu_si128((__m128i *) p, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), mask));
+    swap_portable(p, bytes / size, size);
+}
+
+__attribute__((target("avx2")))
+static void swap_avx2(unsigned char *p, size_t count, size_t size)
+{
+    const __m128i half = _mm_loadu_si128((const __m128i *) swap_mask[mask_index(size)]);
+    const __m256i mask = _mm256_broadcastsi128_si256(half);
+    size_t bytes = count * size;
+    for (; bytes >= 64; bytes -= 64, p += 64)
+    {
+        const __m256i a = _mm256_loadu_si256((const __m256i *) p);
+        const __m256i b = _mm256_loadu_si256((const __m256i *) (p + 32));
+        _mm256_storeu_si256((__m256i *) p, _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256((__m256i *) (p + 32), _mm256_shuffle_epi8(b, mask));
+    }
+    for (; bytes >= 16; bytes -= 16, p += 16)
+        _mm_storeu_si128((__m128i *) p, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), half));
+    swap_portable(p, bytes / size, size);
+}
+#elif defined(MPW_SWAP_NEON)
+static void swap_neon(unsigned char *p, size_t count, size_t size)
+{
+    size_t bytes = count * size;
+    for (; bytes >= 16; bytes -= 16, p += 16)
+    {
+        const uint8x16_t v = vld1q_u8(p);
+        vst1q_u8(p, size == 2 ? vrev16q_u8(v) : size == 4 ? vrev32q_u8(v) : vrev64q_u8(v));
+    }
+    swap_portable(p, bytes / size, size);
+}
+#endif
+
+typedef void (*swap_kernel)(unsigned char *, size_t, size_t);
+static swap_kernel kernel = swap_portable;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static void choose_kernel()
+{
+#if defined(MPW_SWAP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernel = swap_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        kernel = swap_ssse3;
+#elif defined(MPW_SWAP_NEON)
+    kernel = swap_neon;
+#endif
+}
+
+void swap_elements(void *buf, size_t count, size_t size)
+{
+    if (size != 2 && size != 4 && size != 8)
+        return;
+    pthread_once(&kernel_once, choose_kernel);
+    kernel((unsigned char *) buf, count, size);
+}
@@ -68,4 +68,48 @@ deserialize_size_t(const unsigned char *net_number)
     }
 }
 
+inline void
+serialize_uint32(unsigned char *net_number, const unsigned int native_number)
+{
+    net_number[0] = (native_number >> 24) & 0xff;
+    net_number[1] = (native_number >> 16) & 0xff;
+    net_number[2] = (native_number >>  8) & 0xff;
+    net_number[3] =  native_number        & 0xff;
+}
+
+inline unsigned int
+deserialize_uint32(const unsigned char *net_number)
+{
+    return ((unsigned int)net_number[0] << 24)
+         | ((unsigned int)net_number[1] << 16)
+         | ((unsigned int)net_number[2] <<  8)
+         |  (unsigned int)net_number[3];
+}
+
+inline void
+serialize_uint64(unsigned char *net_number, const unsigned long long native_number)
+{
+    serialize_uint32(net_number, (unsigned int)(native_number >> 32));
+    serialize_uint32(net_number + 4, (unsigned int)(native_number & 0xffffffffULL));
+}
+
+inline unsigned long long
+deserialize_uint64(const unsigned char *net_number)
+{
+    return ((unsigned long long)deserialize_uint32(net_number) << 32)
+         |  (unsigned long long)deserialize_uint32(net_number + 4);
+}
+
+// Whether this host stores numbers big-endian, i.e. in network byte order.
+inline bool
+host_big_endian()
+{
+    const unsigned int one = 1;
+    return *(const unsigned char *)&one == 0;
+}
+
+// Reverse the bytes of each of count elements of size bytes (2, 4 or 8; others are
+// left alone) at buf, in place. Uses SIMD shuffles where the processor has them.
+void swap_elements(void *buf, size_t count, size_t size);
+
 #endif /* defined(__MPWide__serialization__) */
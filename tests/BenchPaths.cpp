@@ -0,0 +1,171 @@
+/**************************************************************
+ * This file is part of the MPWide communication library
+ *
+ * Written by Derek Groen with thanks going out to Steven Rieder,
+ * Simon Portegies Zwart, Joris Borgdorff, Hans Blom and Tomoaki Ishiyama.
+ * for questions, please send an e-mail to: 
+ *                                     djgroennl@gmail.com
+ * MPWide is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published 
+ * by the Free Software Foundation, either version 3 of the License, 
+ * or (at your option) any later version.
+ *
+ * MPWide is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with MPWide.  If not, see <http://www.gnu.org/licenses/>.
+ * **************************************************************/
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+#include "../MPWide.h"
+
+/*
+  BenchPaths.cpp
+  Measures the throughput of paths over loopback for every combination of stream count and
+  TCP congestion control given, using one process with two threads. Run tests/netem.sh first
+  to emulate a wide area link (delay, loss, rate limit) on the loopback device. Give 1 as the
+  checksums argument to measure the cost of per-chunk checksums. A rate (MB/s per direction)
+  paces each path at a fixed line rate where netem is unavailable; the CPU time per GB then
+  shows what the checksums cost at that rate.
+
+  usage: ./MPWBenchPaths [<streams, e.g. 1,4,16 (default)>] [<algorithms, e.g. cubic,bbr (default)>]
+                         [<message size in MB (default 64)>] [<exchanges (default 5)>]
+                         [<checksums, 0 (default) or 1>] [<rate in MB/s, 0: unlimited (default)>]
+*/
+
+struct bench
+{
+  int path;
+  bool server;
+  long long int size;
+  int exchanges;
+  bool checksums;
+  int result;
+};
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6*tv.tv_usec;
+}
+
+/* CPU seconds this process has used, in user and kernel mode. */
+static double cpu()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + 1.0e-6*(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static vector<string> split(const string &s)
+{
+  vector<string> items;
+  stringstream ss(s);
+  string item;
+  while (getline(ss, item, ',')) {
+    if (!item.empty())
+      items.push_back(item);
+  }
+  return items;
+}
+
+/* Connect one side of the path, then exchange the messages in both directions. */
+static void *run_side(void *data)
+{
+  bench *b = (bench *) data;
+  b->result = MPW_ConnectPath(b->path, b->server);
+  if (b->result < 0)
+    return NULL;
+  if (b->checksums)
+    MPW_setPathChecksums(b->path, true);
+
+  char *sendbuf = new char[b->size];
+  char *recvbuf = new char[b->size];
+  memset(sendbuf, 1, b->size);
+  for (int i = 0; i < b->exchanges && b->result >= 0; i++) {
+    b->result = MPW_SendRecv(sendbuf, b->size, recvbuf, b->size, b->path);
+  }
+  delete [] sendbuf;
+  delete [] recvbuf;
+  return NULL;
+}
+
+int main(int argc, char** argv)
+{
+  vector<string> streams = split(argc > 1 ? argv[1] : "1,4,16");
+  vector<string> algorithms = split(argc > 2 ? argv[2] : "cubic,bbr");
+  const long long int size = (argc > 3 ? atoll(argv[3]) : 64) * 1024 * 1024;
+  const int exchanges = argc > 4 ? atoi(argv[4]) : 5;
+  const bool checksums = argc > 5 && atoi(argv[5]) != 0;
+  const double rate = argc > 6 ? atof(argv[6]) * 1024 * 1024 : 0;
+  int port = 16400;
+  int fails = 0;
+
+  cout << "streams\tcc\tin effect\tsetup [ms]\tMB/s\tretransmits\tmean rtt [us]\tcpu [s/GB]" << endl;
+  for (size_t a = 0; a < algorithms.size(); a++) {
+    for (size_t s = 0; s < streams.size(); s++, port++) {
+      const int n = atoi(streams[s].c_str());
+      bench server = { MPW_CreatePathWithoutConnect("0", port, n), true, size, exchanges, checksums, 0 };
+      bench client = { MPW_CreatePathWithoutConnect("127.0.0.1", port, n), false, size, exchanges, checksums, 0 };
+      if (server.path < 0 || client.path < 0 ||
+          MPW_setPathCongestionControl(server.path, algorithms[a]) < 0 ||
+          MPW_setPathCongestionControl(client.path, algorithms[a]) < 0) {
+        cout << n << "\t" << algorithms[a] << "\tunavailable" << endl;
+        fails++;
+        if (server.path >= 0) MPW_DestroyPath(server.path);
+        if (client.path >= 0) MPW_DestroyPath(client.path);
+        continue;
+      }
+
+      if (rate > 0) {
+        MPW_setPathPacingRate(server.path, rate, -1);
+        MPW_setPathPacingRate(client.path, rate, -1);
+      }
+
+      pthread_t server_t, client_t;
+      const double start = now();
+      const double start_cpu = cpu();
+      pthread_create(&server_t, NULL, &run_side, &server);
+      pthread_create(&client_t, NULL, &run_side, &client);
+      pthread_join(server_t, NULL);
+      pthread_join(client_t, NULL);
+      const double elapsed = now() - start - MPW_getPathSetupTime(client.path);
+      const double used_cpu = cpu() - start_cpu;
+
+      if (server.result < 0 || client.result < 0) {
+        cout << n << "\t" << algorithms[a] << "\tfailed (" << strerror(-min(server.result, client.result)) << ")" << endl;
+        fails++;
+      } else {
+        MPW_StreamInfo stream;
+        MPW_PathInfo info;
+        MPW_GetStreamInfo(client.path, 0, &stream);
+        MPW_GetPathInfo(client.path, &info);
+        cout << n << "\t" << algorithms[a] << "\t" << stream.congestion << "\t\t"
+             << MPW_getPathSetupTime(client.path) * 1000 << "\t\t"
+             << 2.0 * size * exchanges / elapsed / (1024 * 1024) << "\t"
+             << info.retransmits << "\t\t" << info.avg_rtt_us << "\t\t"
+             << used_cpu / (2.0 * size * exchanges / (1024 * 1024 * 1024)) << endl;
+      }
+      MPW_DestroyPath(client.path);
+      MPW_DestroyPath(server.path);
+    }
+  }
+  MPW_Finalize();
+  return fails > 0 ? 1 : 0;
+}
@@ -41,7 +41,6 @@ using namespace std;
 
 
 pthread_mutex_t log_mutex;
-pthread_mutex_t path_mutex;
 
 #define LOG(X) { pthread_mutex_lock(&log_mutex); cout << X << endl; pthread_mutex_unlock(&log_mutex); }
 
@@ -54,17 +53,13 @@ struct vars
 
 int do_connect(string host, int port, int num_channels, bool asServer)
 {
-  pthread_mutex_lock(&path_mutex);
   int path_id = MPW_CreatePathWithoutConnect(host, port, num_channels); ///path version
-  pthread_mutex_unlock(&path_mutex);
 
   if (path_id >= 0) {
     LOG("Connecting to path " << path_id << "; server: " << asServer);
     
     if (MPW_ConnectPath(path_id, asServer) < 0) {
-      pthread_mutex_lock(&path_mutex);
       MPW_DestroyPath(path_id);
-      pthread_mutex_unlock(&path_mutex);
       path_id = -1;
     }
     
@@ -180,7 +175,6 @@ void *communicating_thread(void *data)
 }
 
 int main(int argc, char** argv){
-  pthread_mutex_init(&path_mutex, NULL);
   pthread_mutex_init(&log_mutex, NULL);
 
   //  printf("usage: ./MPWConcurrentTest <channels (default: 1)> [<message size [kB] (default: 8 kB))>]\n");
@@ -239,7 +233,6 @@ int main(int argc, char** argv){
   delete connected_path_id;
   
   pthread_mutex_destroy(&log_mutex);
-  pthread_mutex_destroy(&path_mutex);
   
   MPW_Finalize();
 
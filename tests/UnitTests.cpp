@@ -25,11 +25,22 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
 #include <iostream>
+#include <vector>
 
 using namespace std;
 
 #include "../MPWide.h"
+#include "../Codec.h"
+#include "../Checksum.h"
+#include "../serialization.h"
+#include "../Communicator.h"
+#include "../Reduction.h"
+#include "../Relay.h"
 
 
 #if MPW_PacingMode == 1
@@ -45,6 +56,24 @@ int MPW_Test_PacingRate() {
   return 0;
 }
 
+int MPW_Test_PathPacingRate() {
+  cout << "Test_PathPacingRate()" << endl;
+  int path = MPW_CreatePathWithoutConnect("localhost", 16256, 2);
+  if(path < 0) {
+    return -1;
+  }
+  MPW_setPathPacingRate(path, 10*1024*1024, -1);
+  double rate = MPW_getPathPacingRate(path);
+  MPW_setPathPacingRate(path, -1, 0);
+  double unlimited = MPW_getPathPacingRate(path);
+  MPW_DestroyPath(path);
+
+  if(rate != 10*1024*1024 || unlimited > 0) {
+    return -1;
+  }
+  return 0;
+}
+
 #endif
 
 int Test_DNSResolve(){
@@ -61,6 +90,24 @@ int Test_DNSResolve(){
   }
 }  
 
+int Test_DNSResolveCache(){
+  cout << "Test_DNSResolveCache()" << endl;
+  char localhost[] = "localhost";
+  char localhostIP[] = "127.0.0.1";
+  char *first = MPW_DNSResolve(localhost);
+  char *second = MPW_DNSResolve(localhost);
+  char *numeric = MPW_DNSResolve(localhostIP);
+  MPW_setDNSCacheTTL(0);
+  string uncached(MPW_DNSResolve(string("localhost")));
+  MPW_setDNSCacheTTL(300);
+  if(first == NULL || first != second || string(numeric).compare("127.0.0.1") != 0 ||
+     uncached.compare(first) != 0 || MPW_DNSResolve(string("no-such-host.invalid")) != NULL) {
+    cout << "Unit test Test_DNSResolveCache failed." << endl;
+    return -1;
+  }
+  return 0;
+}
+
 int Test_AutoTuning(){
   cout << "Test_AutoTuning()" << endl;
   MPW_setAutoTuning(false);
@@ -74,6 +121,77 @@ int Test_AutoTuning(){
   return 0;
 }
 
+/* One side of a loopback exchange: a path of streams that swaps 5 MB with the other side,
+ * optionally compressing what it sends. setup prepares the path before the exchange and
+ * then goes on with it afterwards (returning 0, or -1 on failure), if given. */
+struct Endpoint {
+  string host;
+  int port;
+  bool server_wait;
+  char seed, peer_seed;
+  int compression;
+  int streams;
+  void (*setup)(int path);
+  int (*then)(int path, bool server);
+  int ret;
+};
+
+void* runEndpoint(void* args) {
+  Endpoint* e = (Endpoint*) args;
+  const long long int size = 5*1000*1000;
+  e->ret = -1;
+  int p = MPW_CreatePathWithoutConnect(e->host, e->port, e->streams);
+  if(p < 0 || MPW_ConnectPath(p, e->server_wait) < 0) {
+    return NULL;
+  }
+  MPW_setPathCompression(p, e->compression);
+  if(e->setup != NULL) {
+    e->setup(p);
+  }
+  char* buf = new char[size];
+  char* rbuf = new char[size];
+  for(long long int i = 0; i < size; i++) {
+    buf[i] = (char) (i*e->seed);
+  }
+  if(MPW_SendRecv(buf, size, rbuf, size, p) >= 0) {
+    e->ret = 0;
+    for(long long int i = 0; i < size && e->ret == 0; i++) {
+      if(rbuf[i] != (char) (i*e->peer_seed)) {
+        e->ret = -1;
+      }
+    }
+  }
+  MPW_CompressionInfo info;
+  if(e->compression == MPW_COMPRESS_ON &&
+     (MPW_GetCompressionInfo(p, &info) != 0 || info.compressed == 0 || info.wire_bytes >= info.raw_bytes)) {
+    e->ret = -1;
+  }
+  if(e->ret == 0 && e->then != NULL) {
+    e->ret = e->then(p, e->server_wait);
+  }
+  delete [] buf;
+  delete [] rbuf;
+  MPW_DestroyPath(p);
+  return NULL;
+}
+
+/* Barriers after the exchange, and after a one-way message from the server to the client,
+ * with and without flush. */
+int barriers(int path, bool server) {
+  const long long int size = 1000*1000;
+  char* buf = new char[size];
+  memset(buf, server ? 'F' : 0, size);
+  int ret = MPW_PathBarrier(path) == 0 && MPW_PathBarrier(path, true) == 0 ? 0 : -1;
+  if(ret == 0) {
+    ret = (server ? MPW_Send(buf, size, path) : MPW_Recv(buf, size, path)) < 0 || buf[size - 1] != 'F' ? -1 : 0;
+  }
+  if(ret == 0) {
+    ret = MPW_PathBarrier(path, true) == 0 && MPW_PathBarrier(path) == 0 ? 0 : -1;
+  }
+  delete [] buf;
+  return ret;
+}
+
 int Test_Paths(){
   cout << "Test_Paths()" << endl;  
   int i = MPW_CreatePathWithoutConnect("localhost", 16256, 4);
@@ -82,13 +200,850 @@ int Test_Paths(){
   }
   MPW_setWin(0, 262144);
   MPW_setPathWin(i, 262144);
+  if(MPW_PathBarrier(i + 1) != -EINVAL) {
+    return -1;
+  }
   int j = MPW_DestroyPath(i);
   if(j<0) {
     return -1;
   }
+
+  // Barriers between the two ends of a connected path.
+  Endpoint a = { "127.0.0.1", 16272, false, 7, 13, MPW_COMPRESS_OFF, 4, NULL, barriers, -1 };
+  Endpoint b = { "0", 16272, true, 13, 7, MPW_COMPRESS_OFF, 4, NULL, barriers, -1 };
+  pthread_t ta, tb;
+  pthread_create(&tb, NULL, runEndpoint, &b);
+  pthread_create(&ta, NULL, runEndpoint, &a);
+  pthread_join(ta, NULL);
+  pthread_join(tb, NULL);
+  if(a.ret < 0 || b.ret < 0) {
+    cout << "Unit test Test_Paths failed." << endl;
+    return -1;
+  }
+  return 0;
+}
+
+void* connectServerPath(void* path) {
+  *(int*) path = MPW_ConnectPath(*(int*) path, true) < 0 ? -1 : *(int*) path;
+  return NULL;
+}
+
+/* A typed exchange between endpoints that learned each other's byte order through a forwarder. */
+int typedThroughForwarder(int path, bool server) {
+  const double mine[3] = { server ? 1.5 : -2.25, 1e300, 3 };
+  double theirs[3] = { 0, 0, 0 };
+  if(MPW_PathSwapsBytes(path) != 0 || MPW_SendRecvTyped(path, mine, 3, theirs, 3) < 0) {
+    return -1;
+  }
+  return theirs[0] == (server ? -2.25 : 1.5) && theirs[1] == 1e300 && theirs[2] == 3 ? 0 : -1;
+}
+
+/* An endpoint of the other byte order, played by hand: it connects as a forwarding path, so that
+ * the library leaves the order byte to it, announces the order it pretends to have, and sends
+ * {1.5, -2.25} in that order. It receives what the other end sends as it is. */
+const double forwarded_mine[2] = { 0.5, 4.0 }, forwarded_theirs[2] = { 1.5, -2.25 };
+
+void* otherOrderEndpoint(void* result) {
+  int path = MPW_CreatePathWithoutConnect("0", 16278, 2);
+  MPW_setPathForwarding(path, true);
+  char order = host_big_endian() ? 'l' : 'B', peer = 0;
+  unsigned char send[16], recv[16];
+  memcpy(send, forwarded_theirs, 16);
+  swap_elements(send, 2, 8);
+  int ret = path >= 0 && MPW_ConnectPath(path, true) >= 0 ? 0 : -1;
+  if(ret == 0 && MPW_Send(&order, 1, path) >= 0 && MPW_Recv(&peer, 1, path) >= 0 &&
+     MPW_SendRecv((char*) send, 16, (char*) recv, 16, path) >= 0) {
+    ret = peer == (host_big_endian() ? 'B' : 'l') && memcmp(recv, forwarded_mine, 16) == 0 ? 0 : -1;
+  } else {
+    ret = -1;
+  }
+  MPW_DestroyPath(path);
+  *(int*) result = ret;
+  return NULL;
+}
+
+void* sameOrderEndpoint(void* result) {
+  int path = MPW_CreatePathWithoutConnect("127.0.0.1", 16277, 2);
+  double theirs[2] = { 0, 0 };
+  int ret = path >= 0 && MPW_ConnectPath(path, false) >= 0 ? 0 : -1;
+  if(ret == 0 && MPW_PathSwapsBytes(path) == 1 && MPW_SendRecvTyped(path, forwarded_mine, 2, theirs, 2) >= 0) {
+    ret = theirs[0] == forwarded_theirs[0] && theirs[1] == forwarded_theirs[1] ? 0 : -1;
+  } else {
+    ret = -1;
+  }
+  MPW_DestroyPath(path);
+  *(int*) result = ret;
+  return NULL;
+}
+
+int Test_Forwarding(){
+  cout << "Test_Forwarding()" << endl;
+  // As MPWForwarder does it: serve one endpoint, connect to the other, and relay the two paths.
+  // The byte orders of the endpoints pass through the relay as the first bytes of their data.
+  Endpoint a = { "127.0.0.1", 16263, false, 7, 13, MPW_COMPRESS_OFF, 2, NULL, typedThroughForwarder, -1 };
+  Endpoint b = { "0", 16264, true, 13, 7, MPW_COMPRESS_OFF, 2, NULL, typedThroughForwarder, -1 };
+  int in = MPW_CreatePathWithoutConnect("0", 16263, 2);
+  int out = MPW_CreatePathWithoutConnect("127.0.0.1", 16264, 2);
+  if(in < 0 || out < 0) {
+    return -1;
+  }
+  // Half a forwarding pair would pass one endpoint's byte to an endpoint that has had ours.
+  MPW_setPathForwarding(in, true);
+  if(MPW_RelayPaths(&in, &out, 1) != -EPROTO) {
+    cout << "Unit test Test_Forwarding failed on half a forwarding pair." << endl;
+    return -1;
+  }
+  MPW_setPathForwarding(out, true);
+  const int server = in;
+  pthread_t ta, tb, tin;
+  pthread_create(&tb, NULL, runEndpoint, &b);
+  pthread_create(&ta, NULL, runEndpoint, &a);
+  pthread_create(&tin, NULL, connectServerPath, &in);
+  const int connected = MPW_ConnectPath(out, false);
+  pthread_join(tin, NULL);
+  int ret = 0;
+  if(connected < 0 || in < 0 || MPW_RelayPaths(&in, &out, 1) != 0) {
+    ret = -1;
+  }
+  pthread_join(ta, NULL);
+  pthread_join(tb, NULL);
+  if(ret < 0 || a.ret < 0 || b.ret < 0) {
+    cout << "Unit test Test_Forwarding failed." << endl;
+    ret = -1;
+  }
+  MPW_DestroyPath(server);
+  MPW_DestroyPath(out);
+
+  // Endpoints of different byte orders learn each other's order through the forwarder, not its own.
+  in = MPW_CreatePathWithoutConnect("0", 16277, 2);
+  out = MPW_CreatePathWithoutConnect("127.0.0.1", 16278, 2);
+  if(in < 0 || out < 0) {
+    return -1;
+  }
+  MPW_setPathForwarding(in, true);
+  MPW_setPathForwarding(out, true);
+  const int forwarder = in;
+  int same_ret = -1, other_ret = -1;
+  pthread_t tsame, tother;
+  pthread_create(&tother, NULL, otherOrderEndpoint, &other_ret);
+  pthread_create(&tsame, NULL, sameOrderEndpoint, &same_ret);
+  pthread_create(&tin, NULL, connectServerPath, &in);
+  const int out_connected = MPW_ConnectPath(out, false);
+  pthread_join(tin, NULL);
+  if(out_connected < 0 || in < 0 || MPW_RelayPaths(&in, &out, 1) != 0) {
+    ret = -1;
+  }
+  pthread_join(tsame, NULL);
+  pthread_join(tother, NULL);
+  if(same_ret < 0 || other_ret < 0) {
+    cout << "Unit test Test_Forwarding failed between endpoints of different byte orders." << endl;
+    ret = -1;
+  }
+  MPW_DestroyPath(forwarder);
+  MPW_DestroyPath(out);
+
+  // A socket in two pairs cannot be watched twice: the relay gives up on the second pair
+  // (which closes the first) instead of waiting for it forever.
+  int s[2], t[2];
+  if(Relay::available() && socketpair(AF_UNIX, SOCK_STREAM, 0, s) == 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, t) == 0) {
+    vector<int> from(2, s[0]), to(t, t + 2);
+    if(Relay::run(from, to, 1) != -EEXIST) {
+      cout << "Unit test Test_Forwarding failed on a socket in two pairs." << endl;
+      ret = -1;
+    }
+    for(int i = 0; i < 2; i++) {
+      close(s[i]);
+      close(t[i]);
+    }
+  }
+  return ret;
+}
+
+/* Striping in chunks that do not divide the 5 MB exchange, with and without checksums. */
+void stripe(int path) {
+  MPW_setPathStriping(path, true, 300007);
+}
+
+void stripeWithChecksums(int path) {
+  MPW_setPathStriping(path, true, 100003);
+  MPW_setPathChecksums(path, true);
+}
+
+int checkStriped(int path, bool server) {
+  MPW_PathInfo info;
+  return MPW_GetPathInfo(path, &info) == 0 && info.stripe_chunk > 0 && info.checksum_errors == 0 ? 0 : -1;
+}
+
+int Test_Striping(){
+  cout << "Test_Striping()" << endl;
+  int p = MPW_CreatePathWithoutConnect("localhost", 16273, 4);
+  if(p < 0) {
+    return -1;
+  }
+  // The chunk size defaults to 256 kB and is clamped to the 1 GB the chunk headers carry.
+  MPW_PathInfo info[3];
+  MPW_setPathStriping(p, true, 1LL << 40);
+  MPW_GetPathInfo(p, &info[0]);
+  MPW_setPathStriping(p, true, 0);
+  MPW_GetPathInfo(p, &info[1]);
+  MPW_setPathStriping(p, false, 300007);
+  MPW_GetPathInfo(p, &info[2]);
+  MPW_DestroyPath(p);
+  int ret = 0;
+  if(info[0].stripe_chunk != 1024*1024*1024 || info[1].stripe_chunk != 256*1024 || info[2].stripe_chunk != 0) {
+    ret = -1;
+  }
+
+  Endpoint a = { "127.0.0.1", 16274, false, 7, 13, MPW_COMPRESS_OFF, 4, stripe, checkStriped, -1 };
+  Endpoint b = { "0", 16274, true, 13, 7, MPW_COMPRESS_OFF, 4, stripe, checkStriped, -1 };
+  Endpoint c = { "127.0.0.1", 16275, false, 5, 11, MPW_COMPRESS_OFF, 3, stripeWithChecksums, checkStriped, -1 };
+  Endpoint d = { "0", 16275, true, 11, 5, MPW_COMPRESS_OFF, 3, stripeWithChecksums, checkStriped, -1 };
+  pthread_t ta, tb, tc, td;
+  pthread_create(&tb, NULL, runEndpoint, &b);
+  pthread_create(&ta, NULL, runEndpoint, &a);
+  pthread_create(&td, NULL, runEndpoint, &d);
+  pthread_create(&tc, NULL, runEndpoint, &c);
+  pthread_join(ta, NULL);
+  pthread_join(tb, NULL);
+  pthread_join(tc, NULL);
+  pthread_join(td, NULL);
+  if(ret < 0 || a.ret < 0 || b.ret < 0 || c.ret < 0 || d.ret < 0) {
+    cout << "Unit test Test_Striping failed." << endl;
+    ret = -1;
+  }
+  return ret;
+}
+
+char tagPattern(int channel, int tag, long long int i) {
+  return (char) (i*(tag + 3) + channel);
+}
+
+int sendTagged(int path, int channel, int tag, long long int size) {
+  char* buf = new char[size];
+  for(long long int i = 0; i < size; i++) {
+    buf[i] = tagPattern(channel, tag, i);
+  }
+  const int ret = MPW_SendTagged(buf, size, channel, tag, path);
+  delete [] buf;
+  return ret;
+}
+
+/* Receive a message of channel that matches tag, and check that it is the one sent with want_tag. */
+int recvTagged(int path, int channel, int tag, long long int size, int want_tag) {
+  char* buf = new char[size + 1];
+  int recv_tag = -1;
+  int ret = MPW_RecvTagged(buf, size + 1, channel, tag, path, &recv_tag) == size && recv_tag == want_tag ? 0 : -1;
+  for(long long int i = 0; i < size && ret == 0; i++) {
+    ret = buf[i] != tagPattern(channel, want_tag, i) ? -1 : 0;
+  }
+  delete [] buf;
+  return ret;
+}
+
+/* Tagged messages in both directions, on two channels, taken in another order than they were
+ * sent. One of them takes five fragments of the default stripe chunk over the streams. */
+int tagged(int path, bool server) {
+  const long long int big = 4*256*1024 + 12345;
+  if(sendTagged(path, 0, 1, 1000) < 0 || sendTagged(path, 0, 2, 2000) < 0 || sendTagged(path, 0, 3, 3000) < 0 ||
+     sendTagged(path, 1, 1, 500) < 0 || sendTagged(path, 1, 7, big) < 0) {
+    return -1;
+  }
+  int recv_tag = -1;
+  long long int size = -EAGAIN;
+  for(int i = 0; i < 10000 && size == -EAGAIN; i++) {
+    size = MPW_ProbeTagged(1, 7, path, &recv_tag);
+    if(size == -EAGAIN) {
+      usleep(1000);
+    }
+  }
+  if(size != big || recv_tag != 7) {
+    return -1;
+  }
+  // A message that does not fit stays queued.
+  char small[16];
+  if(MPW_RecvTagged(small, 16, 1, 7, path) != -EMSGSIZE || MPW_ProbeTagged(1, 7, path) != big ||
+     MPW_ProbeTagged(1, MPW_ANY_TAG, path, &recv_tag) != 500 || recv_tag != 1) {
+    return -1;
+  }
+  if(recvTagged(path, 1, 7, big, 7) < 0 || recvTagged(path, 1, MPW_ANY_TAG, 500, 1) < 0 ||
+     recvTagged(path, 0, 3, 3000, 3) < 0 || recvTagged(path, 0, 1, 1000, 1) < 0 ||
+     recvTagged(path, 0, MPW_ANY_TAG, 2000, 2) < 0) {
+    return -1;
+  }
+  // Nothing is left (-EAGAIN, or -ECONNRESET once the other side has closed the path).
+  return MPW_ProbeTagged(0, MPW_ANY_TAG, path) < 0 && MPW_ProbeTagged(1, MPW_ANY_TAG, path) < 0 ? 0 : -1;
+}
+
+int Test_Tagged(){
+  cout << "Test_Tagged()" << endl;
+  Endpoint a = { "127.0.0.1", 16276, false, 7, 13, MPW_COMPRESS_OFF, 4, NULL, tagged, -1 };
+  Endpoint b = { "0", 16276, true, 13, 7, MPW_COMPRESS_OFF, 4, NULL, tagged, -1 };
+  pthread_t ta, tb;
+  pthread_create(&tb, NULL, runEndpoint, &b);
+  pthread_create(&ta, NULL, runEndpoint, &a);
+  pthread_join(ta, NULL);
+  pthread_join(tb, NULL);
+  if(a.ret < 0 || b.ret < 0) {
+    cout << "Unit test Test_Tagged failed." << endl;
+    return -1;
+  }
+  return 0;
+}
+
+int Test_PathInfo(){
+  cout << "Test_PathInfo()" << endl;
+  int p = MPW_CreatePathWithoutConnect("localhost", 16257, 4);
+  if(p<0) {
+    return -1;
+  }
+  MPW_PathInfo info;
+  MPW_TcpInfo samples[8];
+  int ret = 0;
+  // The streams are not connected, so there is nothing to sample yet.
+  if(MPW_GetPathInfo(p, &info) != 0 || info.streams != 4 || info.bytes_sent != 0 ||
+     MPW_StartTcpRecording(p, 0.001, 8) != 0 || MPW_GetTcpRecording(p, samples, 8) != 0 ||
+     MPW_GetPathInfo(p + 1, &info) >= 0) {
+    cout << "Unit test Test_PathInfo failed." << endl;
+    ret = -1;
+  }
+  MPW_DestroyPath(p);
+  return ret;
+}
+
+int Test_Requests(){
+  cout << "Test_Requests()" << endl;
+  int reqs[3] = { MPW_REQUEST_NULL, MPW_REQUEST_NULL, MPW_REQUEST_NULL };
+  int index = 0;
+  char buf[8];
+  // Nothing is posted on a path that does not exist, and unknown handles are rejected.
+  if(MPW_Isend(buf, 8, 12345) != -EINVAL || MPW_Irecv(buf, 8, -1) != -EINVAL ||
+     MPW_Test(12345) != -EINVAL || MPW_Wait(12345) != -EINVAL ||
+     MPW_Waitall(3, reqs) != 0 || MPW_Waitany(3, reqs, &index) != 0 || index != -1) {
+    cout << "Unit test Test_Requests failed." << endl;
+    return -1;
+  }
   return 0;
 }
 
+int Test_Compression(){
+  cout << "Test_Compression()" << endl;
+  int p = MPW_CreatePathWithoutConnect("localhost", 16258, 2);
+  if(p<0) {
+    return -1;
+  }
+  MPW_CompressionInfo info;
+  char buf[8];
+  int ret = 0;
+  // Invalid modes are rejected, and a compressing path does not take nonblocking calls.
+  if(MPW_setPathCompression(p, 3) != -EINVAL || MPW_setPathCompression(p, MPW_COMPRESS_AUTO) != 0 ||
+     MPW_GetCompressionInfo(p, &info) != 0 || info.mode != MPW_COMPRESS_AUTO || info.messages != 0 ||
+     MPW_Isend(buf, 8, p) != -ENOTSUP || MPW_GetCompressionInfo(p + 1, &info) != -EINVAL) {
+    cout << "Unit test Test_Compression failed." << endl;
+    ret = -1;
+  }
+  MPW_DestroyPath(p);
+  if(ret < 0) {
+    return ret;
+  }
+
+  // Blocks of text-like and of random bytes come back as they were, and damaged ones are refused.
+  const char words[] = "MPWide sends data over wide area networks. ";
+  const int n = 100000;
+  const int cap = n + n/255 + 16;
+  char* text = new char[n];
+  char* noise = new char[n];
+  char* block = new char[cap];
+  char* out = new char[n];
+  srand(1);
+  for(int k = 0; k < n; k++) {
+    text[k] = words[k % (sizeof(words) - 1)] + (k / 4096) % 3;
+    noise[k] = (char) rand();
+  }
+  const int ctext = Codec::compress(text, n, block, cap);
+  if(ctext <= 0 || ctext > n/4 || Codec::decompress(block, ctext, out, n) != n || memcmp(out, text, n) != 0 ||
+     Codec::decompress(block, ctext - 1, out, n) != -1 || Codec::decompress(block, ctext, out, n + 1) != -1) {
+    ret = -1;
+  }
+  const int cnoise = Codec::compress(noise, n, block, cap);
+  if(cnoise < n || Codec::decompress(block, cnoise, out, n) != n || memcmp(out, noise, n) != 0 ||
+     Codec::compress(noise, n, block, n) != 0) {
+    ret = -1;
+  }
+  // A run of zeros is a literal and then a match one byte back; a match offset of 0 is invalid.
+  memset(text, 0, n);
+  const int czero = Codec::compress(text, n, block, cap);
+  block[2] = block[3] = 0;
+  if(czero < 4 || Codec::decompress(block, czero, out, n) != -1) {
+    ret = -1;
+  }
+  delete [] text;
+  delete [] noise;
+  delete [] block;
+  delete [] out;
+
+  // A compressing path over loopback.
+  Endpoint a = { "127.0.0.1", 16265, false, 7, 13, MPW_COMPRESS_ON, 2, NULL, NULL, -1 };
+  Endpoint b = { "0", 16265, true, 13, 7, MPW_COMPRESS_ON, 2, NULL, NULL, -1 };
+  pthread_t ta, tb;
+  pthread_create(&tb, NULL, runEndpoint, &b);
+  pthread_create(&ta, NULL, runEndpoint, &a);
+  pthread_join(ta, NULL);
+  pthread_join(tb, NULL);
+  if(ret < 0 || a.ret < 0 || b.ret < 0) {
+    cout << "Unit test Test_Compression failed." << endl;
+    ret = -1;
+  }
+  return ret;
+}
+
+/* Move everything c has to transfer between its buffers and wire. Returns the bytes on the wire. */
+long long int transfer(ChecksumCursor &c, char* wire, bool sending) {
+  long long int pos = 0;
+  struct iovec v[16];
+  while(c.remaining() > 0) {
+    const int n = c.fill(v, 16);
+    long long int bytes = 0;
+    for(int k = 0; k < n; k++) {
+      if(sending) {
+        memcpy(wire + pos + bytes, v[k].iov_base, v[k].iov_len);
+      } else {
+        memcpy(v[k].iov_base, wire + pos + bytes, v[k].iov_len);
+      }
+      bytes += v[k].iov_len;
+    }
+    c.advance(bytes);
+    pos += bytes;
+  }
+  return pos;
+}
+
+int Test_Checksums(){
+  cout << "Test_Checksums()" << endl;
+  int p = MPW_CreatePathWithoutConnect("localhost", 16259, 2);
+  if(p<0) {
+    return -1;
+  }
+  MPW_StreamInfo info;
+  int ret = 0;
+  // A path that has not exchanged anything has seen no checksum errors. The calls that carry
+  // no checksums refuse to run on it.
+  char c = 0;
+  if(MPW_setPathChecksums(p, true) != 0 || MPW_setPathChecksums(p + 1, true) != -EINVAL ||
+     MPW_GetStreamInfo(p, 1, &info) != 0 || info.checksum_errors != 0 || info.checksum_error_offset != -1 ||
+     MPW_DSendRecv(&c, 1, &c, 1, p) != -ENOTSUP || MPW_SendTagged(&c, 1, 0, 0, p) != -ENOTSUP ||
+     MPW_RecvTagged(&c, 1, 0, 0, p) != -ENOTSUP || MPW_ProbeTagged(0, MPW_ANY_TAG, p) != -ENOTSUP) {
+    ret = -1;
+  }
+  MPW_DestroyPath(p);
+
+  // The check value of CRC32C, and the same checksums with and without the crc32 instruction at any
+  // alignment, over lengths that the interleaved blocks of 256 and 8192 bytes do not divide.
+  char* data = new char[60000];
+  for(int k = 0; k < 60000; k++) {
+    data[k] = (char) (k*k + 3);
+  }
+  if(Checksum::crc32c(0, "123456789", 9) != 0xE3069283 || Checksum::crc32cPortable(0, "123456789", 9) != 0xE3069283) {
+    ret = -1;
+  }
+  for(int k = 0; k < 8; k++) {
+    if(Checksum::crc32c(0, data + k, 4093 - k) != Checksum::crc32cPortable(0, data + k, 4093 - k) ||
+       Checksum::crc32c(0, data + k, 57000 - k) != Checksum::crc32cPortable(0, data + k, 57000 - k) ||
+       Checksum::crc32c(Checksum::crc32c(0, data, 30000 + k), data + 30000 + k, 29000) !=
+       Checksum::crc32cPortable(0, data, 59000 + k)) {
+      ret = -1;
+    }
+  }
+
+  // 5 chunks of 1000 bytes, each followed by its checksum; one damaged byte in the third.
+  char wire[5020];
+  char received[5000];
+  struct iovec siov = { data, 5000 };
+  struct iovec riov = { received, 5000 };
+  ChecksumCursor sender, receiver;
+  sender.reset(&siov, 1, 0, 5000, 1000, true);
+  receiver.reset(&riov, 1, 0, 5000, 1000, false);
+  if(transfer(sender, wire, true) != 5020 || transfer(receiver, wire, false) != 5020 ||
+     receiver.mismatch() != -1 || memcmp(received, data, 5000) != 0) {
+    ret = -1;
+  }
+  wire[2*1004 + 500] ^= 1;
+  receiver.reset(&riov, 1, 0, 5000, 1000, false);
+  if(transfer(receiver, wire, false) != 5020 || receiver.mismatch() != 2000) {
+    ret = -1;
+  }
+  delete [] data;
+  if(ret < 0) {
+    cout << "Unit test Test_Checksums failed." << endl;
+  }
+  return ret;
+}
+
+int Test_TypedExchange(){
+  cout << "Test_TypedExchange()" << endl;
+  int p = MPW_CreatePathWithoutConnect("localhost", 16260, 2);
+  if(p<0) {
+    return -1;
+  }
+  double d[2];
+  int ret = 0;
+  // Until the path has connected, the other side is taken to have our byte order.
+  if(MPW_TypeSize(MPW_DOUBLE) != 8 || MPW_TypeSize(MPW_INT16) != 2 || MPW_TypeSize(42) != -EINVAL ||
+     MPW_PathSwapsBytes(p) != 0 || MPW_PathSwapsBytes(p + 1) != -EINVAL ||
+     MPW_SendRecvTyped(p, 42, d, 2, d, 2) != -EINVAL || MPW_SendTyped(p + 1, d, 2) != -EINVAL) {
+    ret = -1;
+  }
+  MPW_DestroyPath(p);
+
+  // Every element count up to 150, so that the vector loops end on every possible tail,
+  // also at an odd address. Bytes past the elements stay as they are.
+  unsigned char buf[1216], want[1216];
+  for(size_t size = 2; size <= 8; size *= 2) {
+    for(size_t count = 0; count <= 150; count++) {
+      for(int k = 0; k < 1216; k++) {
+        buf[k] = want[k] = (unsigned char) (k*31 + count);
+      }
+      unsigned char* elements = want + 1;
+      for(size_t e = 0; e < count; e++, elements += size) {
+        if(size == 2) {
+          unsigned short v;
+          memcpy(&v, elements, 2);
+          v = __builtin_bswap16(v);
+          memcpy(elements, &v, 2);
+        } else if(size == 4) {
+          unsigned int v;
+          memcpy(&v, elements, 4);
+          v = __builtin_bswap32(v);
+          memcpy(elements, &v, 4);
+        } else {
+          unsigned long long v;
+          memcpy(&v, elements, 8);
+          v = __builtin_bswap64(v);
+          memcpy(elements, &v, 8);
+        }
+      }
+      swap_elements(buf + 1, count, size);
+      if(memcmp(buf, want, sizeof(buf)) != 0) {
+        ret = -1;
+      }
+    }
+  }
+  if(ret < 0) {
+    cout << "Unit test Test_TypedExchange failed." << endl;
+  }
+  return ret;
+}
+
+int Test_Datatypes(){
+  cout << "Test_Datatypes()" << endl;
+  // Every other double of 4 pairs, and the 2x2 block at (1,1) of a 4x4 array of ints.
+  int v = MPW_TypeVector(4, 1, 2, MPW_DOUBLE);
+  long long int sizes[2] = {4, 4}, subsizes[2] = {2, 2}, starts[2] = {1, 1}, bad[2] = {3, 1};
+  int s = MPW_TypeSubarray(2, sizes, subsizes, starts, MPW_INT32);
+  int ret = 0;
+  if(v < 0 || s < 0 || MPW_TypeSize(v) != 32 || MPW_TypeExtent(v) != 56 ||
+     MPW_TypeSize(s) != 16 || MPW_TypeExtent(s) != 64 ||
+     MPW_TypeSubarray(2, sizes, subsizes, bad, MPW_INT32) != -EINVAL ||
+     MPW_TypeFree(MPW_DOUBLE) != -EINVAL) {
+    cout << "Unit test Test_Datatypes failed." << endl;
+    ret = -1;
+  }
+  // Types built from one with a gap after its data span whole elements of it, as in MPI:
+  // doubles 1 and 2 of 4, two of those in a row, one at displacement 0, and a double at 2.
+  long long int all = 4, two = 2, one = 1, at = 1, zero = 0, second = 2;
+  int sub = MPW_TypeSubarray(1, &all, &two, &at, MPW_DOUBLE);
+  int row = MPW_TypeVector(2, 1, 1, sub);
+  int first = MPW_TypeIndexed(1, &one, &zero, sub);
+  int shifted = MPW_TypeIndexed(1, &one, &second, MPW_DOUBLE);
+  if(MPW_TypeExtent(sub) != 32 || MPW_TypeExtent(row) != 64 || MPW_TypeSize(row) != 32 ||
+     MPW_TypeExtent(first) != 32 || MPW_TypeExtent(shifted) != 8) {
+    cout << "Unit test Test_Datatypes failed on the extents of derived types." << endl;
+    ret = -1;
+  }
+  if(MPW_TypeFree(v) != 0 || MPW_TypeFree(s) != 0 || MPW_TypeSize(v) != -EINVAL ||
+     MPW_TypeFree(sub) != 0 || MPW_TypeFree(row) != 0 || MPW_TypeFree(first) != 0 || MPW_TypeFree(shifted) != 0) {
+    cout << "Unit test Test_Datatypes failed to free its types." << endl;
+    ret = -1;
+  }
+  return ret;
+}
+
+/* A site of a communicator of 3 over loopback paths, run in a thread of its own. */
+struct Site {
+  int rank;
+  int paths[3];
+  int (*run)(int rank, int comm);
+  int ret;
+};
+
+void* runSite(void* args) {
+  Site* s = (Site*) args;
+  s->ret = -1;
+  // The lower rank of a pair serves its path; all sites connect their pairs in the same order.
+  for(int r = 0; r < 3; r++) {
+    if(r != s->rank && MPW_ConnectPath(s->paths[r], s->rank < r) < 0) {
+      return NULL;
+    }
+  }
+  const int comm = MPW_CommCreate(s->rank, 3, s->paths);
+  if(comm >= 0) {
+    s->ret = s->run(s->rank, comm);
+    MPW_CommFree(comm);
+  }
+  return NULL;
+}
+
+/* Run run(rank, comm) on 3 sites connected by paths on base_port .. base_port + 2. */
+int runSites(int base_port, int (*run)(int rank, int comm)) {
+  Site sites[3];
+  for(int i = 0; i < 3; i++) {
+    sites[i].rank = i;
+    sites[i].paths[i] = -1;
+    sites[i].run = run;
+  }
+  for(int i = 0; i < 3; i++) {
+    for(int j = i + 1; j < 3; j++) {
+      sites[i].paths[j] = MPW_CreatePathWithoutConnect("0", base_port + i + j - 1, 2);
+      sites[j].paths[i] = MPW_CreatePathWithoutConnect("127.0.0.1", base_port + i + j - 1, 2);
+    }
+  }
+  pthread_t threads[3];
+  for(int i = 0; i < 3; i++) {
+    pthread_create(&threads[i], NULL, runSite, &sites[i]);
+  }
+  int ret = 0;
+  for(int i = 0; i < 3; i++) {
+    pthread_join(threads[i], NULL);
+    ret = sites[i].ret < 0 ? -1 : ret;
+  }
+  for(int i = 0; i < 3; i++) {
+    for(int j = 0; j < 3; j++) {
+      if(i != j) {
+        MPW_DestroyPath(sites[i].paths[j]);
+      }
+    }
+  }
+  return ret;
+}
+
+/* Byte i of what the site of rank from has for the one of rank to. */
+char pattern(int from, int to, long long int i) {
+  return (char) (from*31 + to*7 + i*13 + (i >> 10));
+}
+
+/* Broadcasts from every root, straight, along a tree and along a chain, and gathers,
+ * allgathers and alltoalls with and without the ring. */
+int checkCollectives(int rank, int comm) {
+  const long long int bcast_sizes[3] = { 1000, MPW_COLL_DIRECT_MAX + 1, MPW_COLL_CHAIN_MIN + 3 };
+  const long long int sizes[2] = { 1000, MPW_COLL_RING_MIN + 5 };
+  int ret = 0;
+  char* buf = new char[MPW_COLL_CHAIN_MIN + 3];
+  for(int k = 0; k < 3; k++) {
+    const long long int size = bcast_sizes[k];
+    for(int root = 0; root < 3; root++) {
+      for(long long int i = 0; i < size; i++) {
+        buf[i] = rank == root ? pattern(root, 0, i) : 0;
+      }
+      if(MPW_Bcast(buf, size, root, comm) != 0) {
+        ret = -1;
+      }
+      for(long long int i = 0; i < size && ret == 0; i++) {
+        if(buf[i] != pattern(root, 0, i)) {
+          ret = -1;
+        }
+      }
+    }
+  }
+  delete [] buf;
+
+  for(int k = 0; k < 2 && ret == 0; k++) {
+    const long long int size = sizes[k];
+    char* mine = new char[size];
+    char* all = new char[3*size];
+    char* out = new char[3*size];
+    for(long long int i = 0; i < size; i++) {
+      mine[i] = pattern(rank, 1, i);
+    }
+    for(int r = 0; r < 3; r++) {
+      for(long long int i = 0; i < size; i++) {
+        out[r*size + i] = pattern(rank, r, i);
+      }
+    }
+    // Gather at rank 2, then allgather: every site ends up with the blocks of all, in rank order.
+    memset(all, 0, 3*size);
+    if(MPW_Gather(mine, size, all, 2, comm) != 0) {
+      ret = -1;
+    }
+    for(int r = 0; r < 3 && rank == 2; r++) {
+      for(long long int i = 0; i < size; i++) {
+        ret = all[r*size + i] != pattern(r, 1, i) ? -1 : ret;
+      }
+    }
+    memset(all, 0, 3*size);
+    if(MPW_Allgather(mine, size, all, comm) != 0) {
+      ret = -1;
+    }
+    for(int r = 0; r < 3; r++) {
+      for(long long int i = 0; i < size; i++) {
+        ret = all[r*size + i] != pattern(r, 1, i) ? -1 : ret;
+      }
+    }
+    // Alltoall: block r of every site ends up at rank r.
+    memset(all, 0, 3*size);
+    if(MPW_Alltoall(out, size, all, comm) != 0) {
+      ret = -1;
+    }
+    for(int r = 0; r < 3; r++) {
+      for(long long int i = 0; i < size; i++) {
+        ret = all[r*size + i] != pattern(r, rank, i) ? -1 : ret;
+      }
+    }
+    delete [] mine;
+    delete [] all;
+    delete [] out;
+  }
+  return ret;
+}
+
+int Test_Communicators(){
+  cout << "Test_Communicators()" << endl;
+  int paths[3];
+  paths[0] = MPW_CreatePathWithoutConnect("localhost", 16261, 1);
+  paths[2] = MPW_CreatePathWithoutConnect("localhost", 16262, 1);
+  paths[1] = paths[2] + 1;
+  if(paths[0]<0 || paths[2]<0) {
+    return -1;
+  }
+  // Rank 1 is this site, so its entry is not used.
+  int c = MPW_CommCreate(1, 3, paths);
+  char buf[4];
+  int ret = 0;
+  if(c < 0 || MPW_Bcast(buf, 4, 3, c) != -EINVAL || MPW_Gather(buf, -1, buf, 0, c) != -EINVAL ||
+     MPW_CommCreate(0, 3, paths) != -EINVAL || MPW_CommCreate(3, 3, paths) != -EINVAL ||
+     MPW_CommFree(c) != 0 || MPW_CommFree(c) != -EINVAL || MPW_Alltoall(buf, 1, buf, c) != -EINVAL) {
+    ret = -1;
+  }
+  MPW_DestroyPath(paths[0]);
+  MPW_DestroyPath(paths[2]);
+
+  if(ret < 0 || runSites(16266, checkCollectives) < 0) {
+    cout << "Unit test Test_Communicators failed." << endl;
+    ret = -1;
+  }
+  return ret;
+}
+
+/* a op b, with integer sums and products computed in U so that they wrap around. */
+template <class T, class U>
+T reference(int op, T a, T b) {
+  if(op == MPW_SUM) {
+    return (T) ((U) a + (U) b);
+  } else if(op == MPW_PROD) {
+    return (T) ((U) a * (U) b);
+  } else if(op == MPW_MIN) {
+    return b < a ? b : a;
+  }
+  return b > a ? b : a;
+}
+
+/* Both reduction kernels on every op and on lengths around the vector widths, against reference(). */
+template <class T, class U>
+int checkKernels(int type) {
+  const long long int lengths[9] = { 0, 1, 3, 7, 8, 9, 31, 33, 1005 };
+  T a[1005], b[1005], fast[1005], portable[1005];
+  for(int i = 0; i < 1005; i++) {
+    a[i] = (T) (long long int) ((i*2654435761U) >> 3) - (T) (i % 5);
+    b[i] = (T) (long long int) ((i + 7)*40503U) - (T) (i % 9);
+  }
+  int ret = 0;
+  for(int op = MPW_SUM; op <= MPW_PROD; op++) {
+    for(int k = 0; k < 9; k++) {
+      const long long int n = lengths[k];
+      memcpy(fast, a, sizeof(a));
+      memcpy(portable, a, sizeof(a));
+      Reduction::apply(fast, b, n, type, op);
+      Reduction::applyPortable(portable, b, n, type, op);
+      for(int i = 0; i < 1005; i++) {
+        const T want = i < n ? reference<T, U>(op, a[i], b[i]) : a[i];
+        if(memcmp(&fast[i], &want, sizeof(T)) != 0 || memcmp(&portable[i], &want, sizeof(T)) != 0) {
+          ret = -1;
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+/* Allreduces that go around the ring and that do not, and a reduce to rank 1. */
+int checkReductions(int rank, int comm) {
+  const long long int n = MPW_COLL_RING_MIN / sizeof(double) + 3;
+  double* d = new double[n];
+  double* dsum = new double[n];
+  long long int* l = new long long int[n];
+  long long int* lsum = new long long int[n];
+  int x[1000], xmax[1000];
+  for(long long int i = 0; i < n; i++) {
+    d[i] = rank + i*0.5;
+    l[i] = (long long int) rank << 62;
+  }
+  for(int i = 0; i < 1000; i++) {
+    x[i] = (i + rank) % 3 - i;
+  }
+  int ret = 0;
+  if(MPW_Allreduce(d, dsum, n, MPW_DOUBLE, MPW_SUM, comm) != 0 ||
+     MPW_Allreduce(x, xmax, 1000, MPW_INT32, MPW_MAX, comm) != 0 ||
+     MPW_Reduce(l, lsum, n, MPW_INT64, MPW_SUM, 1, comm) != 0) {
+    ret = -1;
+  }
+  for(long long int i = 0; i < n && ret == 0; i++) {
+    // 0 + 2^62 + 2^63 wraps around to -2^62.
+    if(dsum[i] != 3 + i*1.5 || (rank == 1 && lsum[i] != -(1LL << 62))) {
+      ret = -1;
+    }
+  }
+  for(int i = 0; i < 1000 && ret == 0; i++) {
+    ret = xmax[i] != 2 - i ? -1 : 0;
+  }
+  delete [] d;
+  delete [] dsum;
+  delete [] l;
+  delete [] lsum;
+  return ret;
+}
+
+int Test_Reductions(){
+  cout << "Test_Reductions()" << endl;
+  // A communicator of this site alone needs no paths.
+  int self = -1;
+  int c = MPW_CommCreate(0, 1, &self);
+  double d[3] = {1.5, -2.0, 4.0}, r[3] = {0, 0, 0};
+  long long int l = 7;
+  int ret = 0;
+  if(c < 0 || MPW_Allreduce(d, r, 3, MPW_DOUBLE, MPW_MIN, c) != 0 || r[1] != -2.0 ||
+     MPW_Reduce(&l, &l, 1, MPW_INT64, MPW_PROD, 0, c) != 0 || l != 7 ||
+     MPW_Allreduce(d, r, 3, MPW_INT16, MPW_SUM, c) != -EINVAL ||
+     MPW_Allreduce(d, r, 3, MPW_DOUBLE, 4, c) != -EINVAL || MPW_Reduce(d, r, 3, MPW_DOUBLE, MPW_SUM, 1, c) != -EINVAL) {
+    ret = -1;
+  }
+  MPW_CommFree(c);
+
+  // Integer sums and products wrap around.
+  int i32[2] = { INT_MAX, -3 }, one32[2] = { 1, INT_MAX };
+  long long int i64 = LLONG_MAX, two64 = 2;
+  Reduction::apply(i32, one32, 2, MPW_INT32, MPW_SUM);
+  Reduction::apply(&i64, &two64, 1, MPW_INT64, MPW_PROD);
+  if(i32[0] != INT_MIN || i32[1] != INT_MAX - 3 || i64 != -2 ||
+     checkKernels<int, unsigned int>(MPW_INT32) < 0 ||
+     checkKernels<long long int, unsigned long long int>(MPW_INT64) < 0 ||
+     checkKernels<float, float>(MPW_FLOAT) < 0 || checkKernels<double, double>(MPW_DOUBLE) < 0) {
+    ret = -1;
+  }
+  if(ret < 0 || runSites(16269, checkReductions) < 0) {
+    cout << "Unit test Test_Reductions failed." << endl;
+    ret = -1;
+  }
+  return ret;
+}
+
 int Test_MPW_splitBuf() {
   cout << "Test_MPW_splitBuf()" << endl;
   char* buf = "aaabbbcccdddeeefff";
@@ -124,22 +1079,48 @@ int main(int argc, char** argv){
   int i = 0;
   #if MPW_PacingMode == 1
   i = MPW_Test_PacingRate();
-  checkOutput(i, fails);
+  fails = checkOutput(i, fails);
+  i = MPW_Test_PathPacingRate();
+  fails = checkOutput(i, fails);
   #endif
   i = Test_DNSResolve();
-  checkOutput(i, fails);
+  fails = checkOutput(i, fails);
+  i = Test_DNSResolveCache();
+  fails = checkOutput(i, fails);
 
   i = Test_AutoTuning();
-  checkOutput(i, fails);
+  fails = checkOutput(i, fails);
 
   i = Test_Paths();
-  checkOutput(i, fails);
+  fails = checkOutput(i, fails);
+  i = Test_Forwarding();
+  fails = checkOutput(i, fails);
+  i = Test_Striping();
+  fails = checkOutput(i, fails);
+  i = Test_Tagged();
+  fails = checkOutput(i, fails);
+  i = Test_PathInfo();
+  fails = checkOutput(i, fails);
+  i = Test_Requests();
+  fails = checkOutput(i, fails);
+  i = Test_Compression();
+  fails = checkOutput(i, fails);
+  i = Test_Checksums();
+  fails = checkOutput(i, fails);
+  i = Test_TypedExchange();
+  fails = checkOutput(i, fails);
+  i = Test_Datatypes();
+  fails = checkOutput(i, fails);
+  i = Test_Communicators();
+  fails = checkOutput(i, fails);
+  i = Test_Reductions();
+  fails = checkOutput(i, fails);
 
   i = Test_MPW_splitBuf();
-  checkOutput(i, fails);
+  fails = checkOutput(i, fails);
 
   i = Test_MPW_setChunkSize();
-  checkOutput(i, fails);
+  fails = checkOutput(i, fails);
 
   cout << "Unit tests completed. Number of failed tests: " << fails << endl;
   cout << "Number of successful tests: " << MPW_test_count - fails << endl;
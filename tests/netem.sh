@@ -0,0 +1,22 @@
+#!/bin/sh
+# Emulate a wide area link on the loopback device for tests/BenchPaths.cpp (needs root).
+#
+# usage: tests/netem.sh <delay, e.g. 50ms> [<loss, e.g. 0.01%>] [<rate, e.g. 1gbit>]
+#        tests/netem.sh off
+#
+# Loopback traffic crosses the device in both directions, so the round-trip time is
+# twice the delay given.
+
+DEV=${DEV:-lo}
+
+if [ "$1" = "off" ] || [ -z "$1" ]; then
+  tc qdisc del dev $DEV root 2>/dev/null
+  exit 0
+fi
+
+ARGS="delay $1"
+[ -n "$2" ] && ARGS="$ARGS loss $2"
+[ -n "$3" ] && ARGS="$ARGS rate $3"
+# Leave enough queue for a long fat pipe at loopback speed.
+tc qdisc replace dev $DEV root netem $ARGS limit 1000000
+tc qdisc show dev $DEV